@@ -33,11 +33,19 @@ extern "C"
 
 /**
  * define HOMA_BPAGE_SIZE - Number of bytes in pages used for receive
- * buffers. Must be power of two.
+ * buffers, unless a different size is specified with SO_HOMA_SET_BUF.
+ * This is also the smallest bpage size permitted. Must be power of two.
  */
 #define HOMA_BPAGE_SHIFT 16
 #define HOMA_BPAGE_SIZE (1 << HOMA_BPAGE_SHIFT)
 
+/**
+ * define HOMA_MAX_BPAGE_SIZE - Largest bpage size that may be specified
+ * with SO_HOMA_SET_BUF (one x86 huge page).
+ */
+#define HOMA_MAX_BPAGE_SHIFT 21
+#define HOMA_MAX_BPAGE_SIZE (1 << HOMA_MAX_BPAGE_SHIFT)
+
 /**
  * define HOMA_MAX_BPAGES: The largest number of bpages that will be required
  * to store an incoming message.
@@ -82,11 +90,25 @@ struct homa_sendmsg_args {
 	 * locate app-specific info about the RPC.
 	 */
 	uint64_t completion_cookie;
+
+	/**
+	 * @response_length: (in) Used only for request messages: the
+	 * expected length of the response, in bytes, or 0 if unknown. If
+	 * the response is longer than Homa's unscheduled limit, Homa may
+	 * let the server transmit more of it without waiting for grants,
+	 * which saves a round trip. Responses of any length will still be
+	 * received correctly; this is only a hint. Ignored unless the
+	 * socket has enabled SO_HOMA_RESPONSE_LENGTH.
+	 */
+	uint32_t response_length;
+
+	/** @_pad1: Reserved for future use; should be zero. */
+	uint32_t _pad1;
 };
 #if !defined(__cplusplus)
-_Static_assert(sizeof(struct homa_sendmsg_args) >= 16,
+_Static_assert(sizeof(struct homa_sendmsg_args) >= 24,
 		"homa_sendmsg_args shrunk");
-_Static_assert(sizeof(struct homa_sendmsg_args) <= 16,
+_Static_assert(sizeof(struct homa_sendmsg_args) <= 24,
 		"homa_sendmsg_args grew");
 #endif
 
@@ -137,8 +159,9 @@ struct homa_recvmsg_args {
 	 * @bpage_offsets: (in/out) Each entry is an offset into the buffer
 	 * region for the socket pool. When returned from recvmsg, the
 	 * offsets indicate where fragments of the new message are stored. All
-	 * entries but the last refer to full buffer pages (HOMA_BPAGE_SIZE bytes)
-	 * and are bpage-aligned. The last entry may refer to a bpage fragment and
+	 * entries but the last refer to full buffer pages (HOMA_BPAGE_SIZE bytes,
+	 * or the bpage_size specified with SO_HOMA_SET_BUF) and are
+	 * bpage-aligned. The last entry may refer to a bpage fragment and
 	 * is not necessarily aligned. The application now owns these bpages and
 	 * must eventually return them to Homa, using bpage_offsets in a future
 	 * recvmsg invocation.
@@ -184,6 +207,21 @@ _Static_assert(sizeof(struct homa_abort_args) <= 32, "homa_abort_args grew");
 /** define SO_HOMA_SET_BUF: setsockopt option for specifying buffer region. */
 #define SO_HOMA_SET_BUF 10
 
+/**
+ * define SO_HOMA_SHARE_BUF: setsockopt option that causes a socket to use
+ * the buffer region of another Homa socket in the same process; the
+ * argument is an int containing the file descriptor of the other socket.
+ */
+#define SO_HOMA_SHARE_BUF 11
+
+/**
+ * define SO_HOMA_RESPONSE_LENGTH: setsockopt option that controls whether
+ * sendmsg reads the @response_length field of struct homa_sendmsg_args
+ * (applications compiled before that field existed pass a smaller struct).
+ * The argument is an int; nonzero enables the field.
+ */
+#define SO_HOMA_RESPONSE_LENGTH 12
+
 /** struct homa_set_buf - setsockopt argument for SO_HOMA_SET_BUF. */
 struct homa_set_buf_args {
 	/** @start: First byte of buffer region. */
@@ -191,8 +229,80 @@ struct homa_set_buf_args {
 
 	/** @length: Total number of bytes available at @start. */
 	size_t length;
+
+	/**
+	 * @bpage_size: Size of the buffer pages into which the region is
+	 * divided: a power of two between HOMA_BPAGE_SIZE and
+	 * HOMA_MAX_BPAGE_SIZE, or 0 for HOMA_BPAGE_SIZE. Larger bpages allow
+	 * large messages to be stored contiguously; if @start is aligned
+	 * to @bpage_size and the region is backed by huge pages, each bpage
+	 * will require only a single TLB entry. This field may be omitted
+	 * (i.e. optlen may end just before it) for compatibility with older
+	 * applications.
+	 */
+	uint32_t bpage_size;
+
+	uint32_t _pad[1];
 };
 
+/**
+ * struct homa_metrics_raw_header - Describes the layout of
+ * /proc/net/homa_metrics_raw (per-core counters) and
+ * /proc/net/homa_metrics_sum (counters summed over all cores). These files
+ * contain the same information as /proc/net/homa_metrics, but in binary
+ * form, which is much cheaper to generate and parse. Each file consists
+ * of this header, followed by @schema_length bytes of schema, followed
+ * by @num_cores blocks of @num_counters 64-bit counters each. The schema
+ * is a NULL-terminated string with one line per metric of the form
+ * "name offset count", where offset gives the index of the metric's first
+ * counter within each block and count gives the number of consecutive
+ * counters for the metric (> 1 for histograms).
+ */
+struct homa_metrics_raw_header {
+	/** @magic: Always HOMA_METRICS_MAGIC. */
+	uint32_t magic;
+
+	/** @version: Format of the file (HOMA_METRICS_VERSION). */
+	uint32_t version;
+
+	/**
+	 * @num_cores: Number of blocks of counters (1 for
+	 * /proc/net/homa_metrics_sum).
+	 */
+	uint32_t num_cores;
+
+	/** @num_counters: Number of 64-bit counters in each block. */
+	uint32_t num_counters;
+
+	/**
+	 * @schema_length: Number of bytes of schema following the header
+	 * (always a multiple of 8).
+	 */
+	uint32_t schema_length;
+
+	/** @flags: OR-ed combination of HOMA_METRICS_* flag bits. */
+	uint32_t flags;
+
+	/** @rdtsc_cycles: RDTSC counter when metrics were gathered. */
+	uint64_t rdtsc_cycles;
+
+	/** @cpu_khz: Clock rate for RDTSC counter, in khz. */
+	uint64_t cpu_khz;
+};
+#if !defined(__cplusplus)
+_Static_assert(sizeof(struct homa_metrics_raw_header) >= 40,
+		"homa_metrics_raw_header shrunk");
+_Static_assert(sizeof(struct homa_metrics_raw_header) <= 40,
+		"homa_metrics_raw_header grew");
+#endif
+
+#define HOMA_METRICS_MAGIC       0x616d6f68
+#define HOMA_METRICS_VERSION     1
+
+/* Flag bits for homa_metrics_raw_header: */
+/* The counters have been summed over all cores. */
+#define HOMA_METRICS_SUMMED      1
+
 /**
  * Meanings of the bits in Homa's flag word, which can be set using
  * "sysctl /net/homa/flags".
@@ -46,6 +46,8 @@ ssize_t homa_reply(int sockfd, const void *message_buf, size_t length,
 
 	args.id = id;
 	args.completion_cookie = 0;
+	args.response_length = 0;
+	args._pad1 = 0;
 
 	vec.iov_base = (void *) message_buf;
 	vec.iov_len = length;
@@ -88,6 +90,8 @@ ssize_t homa_replyv(int sockfd, const struct iovec *iov, int iovcnt,
 
 	args.id = id;
 	args.completion_cookie = 0;
+	args.response_length = 0;
+	args._pad1 = 0;
 
 	hdr.msg_name = (void *) dest_addr;
 	hdr.msg_namelen = sizeof(*dest_addr);
@@ -125,6 +129,8 @@ int homa_send(int sockfd, const void *message_buf, size_t length,
 
 	args.id = 0;
 	args.completion_cookie = completion_cookie;
+	args.response_length = 0;
+	args._pad1 = 0;
 
 	vec.iov_base = (void *) message_buf;
 	vec.iov_len = length;
@@ -173,6 +179,8 @@ int homa_sendv(int sockfd, const struct iovec *iov, int iovcnt,
 
 	args.id = 0;
 	args.completion_cookie = completion_cookie;
+	args.response_length = 0;
+	args._pad1 = 0;
 
 	hdr.msg_name = (void *) dest_addr;
 	hdr.msg_namelen = sizeof(*dest_addr);
@@ -0,0 +1,144 @@
+/* Copyright (c) 2024 Homa Developers
+ * SPDX-License-Identifier: BSD-1-Clause
+ */
+
+/* This file implements Homa's optional "engine" mode, in which a kernel
+ * thread pinned to a dedicated core busy-polls the NIC for incoming Homa
+ * packets and also runs the pacer. Packets received by the engine are
+ * processed by SoftIRQ on the engine's core, so no interprocessor
+ * interrupts or SoftIRQ scheduling delays occur, and there are no pacer
+ * wakeups. The mode is enabled by setting the engine_core sysctl value.
+ */
+
+#include "homa_impl.h"
+
+/**
+ * homa_engine_main() - Top-level function for the engine thread.
+ * @transportInfo:  Pointer to struct homa.
+ *
+ * Return:         Always 0.
+ */
+int homa_engine_main(void *transportInfo)
+{
+	struct homa *homa = (struct homa *) transportInfo;
+	__u64 start, end;
+	int work;
+
+	tt_record1("homa_engine starting on core %d", raw_smp_processor_id());
+	while (!kthread_should_stop()) {
+		start = get_cycles();
+		work = homa_engine_run_once(homa);
+		end = get_cycles();
+		INC_METRIC(engine_iterations, 1);
+		INC_METRIC(engine_cycles, end - start);
+		if (work) {
+			INC_METRIC(engine_busy_cycles, end - start);
+			INC_METRIC(engine_work, work);
+		}
+
+		/* This thread owns its core, but it must still let the
+		 * scheduler run other threads (such as kworkers) when
+		 * they need the core.
+		 */
+		if (need_resched())
+			schedule();
+	}
+	tt_record("homa_engine exiting");
+	return 0;
+}
+
+/**
+ * homa_engine_run_once() - Make one pass through all of the work done by
+ * the engine thread: poll the NIC (which also runs SoftIRQ processing for
+ * any packets received, including the generation of grants) and transmit
+ * from the throttled list.
+ * @homa:    Overall data about the Homa protocol implementation.
+ *
+ * Return:   A count of the units of work performed (batches of packets
+ *           processed by SoftIRQ, plus one if the pacer was invoked);
+ *           0 means the pass found nothing to do.
+ */
+int homa_engine_run_once(struct homa *homa)
+{
+	struct homa_core *core = homa_cores[raw_smp_processor_id()];
+	__u64 softirq_calls = core->metrics.softirq_calls;
+	unsigned int napi_id;
+	int work;
+
+	napi_id = READ_ONCE(homa->engine_napi_id);
+#ifdef CONFIG_NET_RX_BUSY_POLL
+	if (napi_id >= MIN_NAPI_ID) {
+		core->busy_poller = current;
+		napi_busy_loop(napi_id, NULL, NULL, false, BUSY_POLL_BUDGET);
+		core->busy_poller = NULL;
+	}
+#endif
+	work = core->metrics.softirq_calls - softirq_calls;
+
+	if (!list_empty(&homa->throttled_rpcs)) {
+		homa_pacer_xmit(homa);
+		work++;
+	}
+	return work;
+}
+
+/**
+ * homa_engine_sysctl_changed() - Invoked whenever a sysctl value is changed;
+ * starts, stops, or moves the engine thread so that it matches the
+ * engine_core configuration value.
+ * @homa:    Overall data about the Homa protocol implementation.
+ */
+void homa_engine_sysctl_changed(struct homa *homa)
+{
+	struct task_struct *thread;
+	int core = homa->engine_core;
+
+	if ((core >= nr_cpu_ids) || ((core >= 0) && !cpu_online(core))) {
+		printk(KERN_ERR "Homa can't run engine on core %d: "
+				"no such core\n", core);
+		homa->engine_core = core = -1;
+	}
+	if (homa->engine_kthread && (homa->engine_thread_core == core))
+		return;
+	homa_engine_stop(homa);
+	if (core < 0)
+		return;
+
+	thread = kthread_create(homa_engine_main, homa, "homa_engine");
+	if (IS_ERR(thread)) {
+		printk(KERN_ERR "couldn't create homa engine thread: "
+				"error %ld\n", PTR_ERR(thread));
+		homa->engine_core = -1;
+		return;
+	}
+	kthread_bind(thread, core);
+	homa->engine_kthread = thread;
+	homa->engine_thread_core = core;
+	wake_up_process(thread);
+}
+
+/**
+ * homa_engine_stop() - Stop the engine thread, if it is running; doesn't
+ * return until the thread has exited.
+ * @homa:    Overall data about the Homa protocol implementation.
+ */
+void homa_engine_stop(struct homa *homa)
+{
+	struct task_struct *thread = homa->engine_kthread;
+
+	if (!thread)
+		return;
+
+	/* Clear engine_kthread first, so that homa_add_to_throttled will
+	 * go back to waking the pacer thread.
+	 */
+	homa->engine_kthread = NULL;
+	homa->engine_thread_core = -1;
+	kthread_stop(thread);
+
+	/* The throttled list may be nonempty; the pacer thread must now
+	 * take over.
+	 */
+	if (homa->pacer_kthread)
+		wake_up_process(homa->pacer_kthread);
+}
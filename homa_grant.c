@@ -202,15 +202,17 @@ void homa_grant_remove_rpc(struct homa_rpc *rpc)
 }
 
 /**
- * homa_grant_send() - See if it is appropriate to send a grant to an RPC;
- * if so, create the grant and send it.
+ * homa_grant_update_granted() - Compute how many additional bytes (if any)
+ * may now be granted for an RPC's incoming message, and update
+ * @rpc->msgin.granted to reflect the new grant. This function doesn't
+ * transmit anything.
  * @rpc:   The RPC to check for possible grant. Must be locked by the caller.
- * Return: Nonzero if a grant was sent, 0 if not.
+ * @homa:  Overall information about the Homa transport.
+ * Return: The number of additional bytes granted (0 means no new grant).
  */
-int homa_grant_send(struct homa_rpc *rpc, struct homa *homa)
+int homa_grant_update_granted(struct homa_rpc *rpc, struct homa *homa)
 {
 	int incoming, increment, available;
-	struct grant_header grant;
 
 	/* Compute how many additional bytes to grant. */
 	incoming = rpc->msgin.granted - (rpc->msgin.length
@@ -220,7 +222,7 @@ int homa_grant_send(struct homa_rpc *rpc, struct homa *homa)
 				- rpc->msgin.bytes_remaining;
 		incoming = 0;
 	}
-	increment = homa->grant_window - incoming;
+	increment = homa_peer_grant_window(homa, rpc->peer) - incoming;
 	if (increment > (rpc->msgin.length - rpc->msgin.granted))
 		increment = rpc->msgin.length - rpc->msgin.granted;
 	available = homa->max_incoming - atomic_read(&homa->total_incoming)
@@ -238,23 +240,112 @@ int homa_grant_send(struct homa_rpc *rpc, struct homa *homa)
 	 */
 	rpc->silent_ticks = 0;
 
+	/* Use this grant to measure the round-trip time to the peer,
+	 * unless a measurement is already in progress. Skip messages with
+	 * nothing granted so far (e.g. they were waiting for buffer space):
+	 * stale packets could make the sample too small.
+	 */
+	if ((rpc->msgin.rtt_probe_offset == 0) && (rpc->msgin.granted > 0)) {
+		rpc->msgin.rtt_probe_offset = rpc->msgin.granted;
+		rpc->msgin.rtt_probe_cycles = get_cycles();
+	}
+
 	rpc->msgin.granted += increment;
+	tt_record4("granting id %llu, offset %d, priority %d, increment %d",
+			rpc->id, rpc->msgin.granted, rpc->msgin.priority,
+			increment);
+	return increment;
+}
+
+/**
+ * homa_grant_send() - See if it is appropriate to send a grant to an RPC;
+ * if so, create the grant and send it.
+ * @rpc:   The RPC to check for possible grant. Must be locked by the caller.
+ * @homa:  Overall information about the Homa transport.
+ * Return: Nonzero if a grant was sent, 0 if not.
+ */
+int homa_grant_send(struct homa_rpc *rpc, struct homa *homa)
+{
+	struct grant_header grant;
+	int increment;
+
+	increment = homa_grant_update_granted(rpc, homa);
+	if (increment == 0)
+		return 0;
 
 	/* Send the grant. */
+	memset(&grant, 0, sizeof(grant));
 	grant.offset = htonl(rpc->msgin.granted);
 	grant.priority = rpc->msgin.priority;
 	grant.resend_all = rpc->msgin.resend_all;
 	rpc->msgin.resend_all = 0;
-	tt_record4("sending grant for id %llu, offset %d, priority %d, "
-			"increment %d", rpc->id, rpc->msgin.granted,
-			rpc->msgin.priority, increment);
+	grant.num_acks = homa_peer_get_acks(rpc->peer, HOMA_MAX_CTRL_ACKS,
+			grant.acks);
+	INC_METRIC(piggybacked_acks, grant.num_acks);
 	printk("sending grant for id %llu, offset %d, priority %d, "
 			"increment %d", rpc->id, rpc->msgin.granted,
 			rpc->msgin.priority, increment);
-	homa_xmit_control(GRANT, &grant, sizeof(grant),rpc);
+	homa_xmit_control(GRANT, &grant, homa_grant_length(&grant), rpc);
 	return 1;
 }
 
+/**
+ * homa_grant_xmit_batch() - Transmit a collection of grants computed by
+ * homa_grant_recalc. Grants for RPCs with the same peer and the same
+ * ports are combined into a single GRANT packet, which reduces the number
+ * of control packets when many RPCs from the same peer are active.
+ * @rpcs:      RPCs that may need grants. They need not be locked, but
+ *             each must have a nonzero @grants_in_progress so that it
+ *             can't be reaped.
+ * @grants:    Element i describes the grant for @rpcs[i]; valid only
+ *             if @pending[i] is nonzero.
+ * @pending:   Nonzero elements indicate grants that must be sent. All
+ *             elements will be zero when this function returns.
+ * @count:     Number of elements in each of the above arrays.
+ */
+void homa_grant_xmit_batch(struct homa_rpc **rpcs,
+		struct homa_extra_grant *grants, char *pending, int count)
+{
+	struct homa_extra_grant *extra;
+	struct grant_header grant;
+	int i, j;
+
+	for (i = 0; i < count; i++) {
+		struct homa_rpc *rpc = rpcs[i];
+
+		if (!pending[i])
+			continue;
+		pending[i] = 0;
+		memset(&grant, 0, sizeof(grant));
+		grant.offset = grants[i].offset;
+		grant.priority = grants[i].priority;
+
+		/* The acks must be collected first: the extra grants are
+		 * stored after them.
+		 */
+		grant.num_acks = homa_peer_get_acks(rpc->peer,
+				HOMA_MAX_CTRL_ACKS, grant.acks);
+		INC_METRIC(piggybacked_acks, grant.num_acks);
+		extra = homa_grant_extra(&grant);
+		for (j = i+1; j < count; j++) {
+			struct homa_rpc *other = rpcs[j];
+
+			if (grant.num_extra >= HOMA_MAX_EXTRA_GRANTS)
+				break;
+			if (!pending[j] || (other->peer != rpc->peer)
+					|| (other->hsk != rpc->hsk)
+					|| (other->dport != rpc->dport))
+				continue;
+			extra[grant.num_extra] = grants[j];
+			grant.num_extra++;
+			pending[j] = 0;
+		}
+		INC_METRIC(coalesced_grants, grant.num_extra);
+		homa_xmit_control(GRANT, &grant, homa_grant_length(&grant),
+				rpc);
+	}
+}
+
 /**
  * homa_grant_check_rpc() - This function is invoked when the state of an
  * RPC has changed (such as packets arriving). It checks the state of the
@@ -300,7 +391,7 @@ void homa_grant_check_rpc(struct homa_rpc *rpc)
 	 */
 	if (list_empty(&rpc->grantable_links)) {
 		homa_grant_update_incoming(rpc,homa);
-		homa_grantable_lock(homa, 0);
+		homa_grantable_lock(homa, 0, "homa_grant_check_rpc");
 		homa_grant_add_rpc(rpc);
 		recalc = ((homa->num_grantable_rpcs <= homa->max_overcommit)
 				|| (rpc->msgin.bytes_remaining < atomic_read(
@@ -346,7 +437,7 @@ void homa_grant_check_rpc(struct homa_rpc *rpc)
 	/* Is the message now fully granted? */
 	if (rpc->msgin.granted >= rpc->msgin.length) {
 		homa_rpc_unlock(rpc);
-		homa_grantable_lock(homa, 0);
+		homa_grantable_lock(homa, 0, "homa_grant_check_rpc #2");
 		homa_grant_remove_rpc(rpc);
 		homa_grant_recalc(homa, 1);
 		return;
@@ -383,10 +474,16 @@ void homa_grant_recalc(struct homa *homa, int locked)
 	 */
 	struct homa_rpc *active_rpcs[HOMA_MAX_GRANTS];
 
+	/* Grants computed while holding RPC locks, which will be sent by
+	 * homa_grant_xmit_batch once all of the locks have been released.
+	 */
+	struct homa_extra_grant grants[HOMA_MAX_GRANTS];
+	char pending[HOMA_MAX_GRANTS];
+
 	tt_record("homa_grant_recalc starting");
 	INC_METRIC(grant_recalc_calls, 1);
 	if (!locked) {
-		if (!homa_grantable_lock(homa, 1)) {
+		if (!homa_grantable_lock(homa, 1, "homa_grant_recalc")) {
 			INC_METRIC(grant_recalc_skips, 1);
 			return;
 		}
@@ -457,22 +554,34 @@ void homa_grant_recalc(struct homa *homa, int locked)
 
 
 			homa_rpc_lock(rpc, "homa_grant_recalc");
-			homa_grant_send(rpc, homa);
+			pending[i] = 0;
+			if (rpc->msgin.resend_all) {
+				/* Rare case: send this grant by itself. */
+				homa_grant_send(rpc, homa);
+			} else if (homa_grant_update_granted(rpc, homa)) {
+				grants[i].id = cpu_to_be64(rpc->id);
+				grants[i].offset = htonl(rpc->msgin.granted);
+				grants[i].priority = rpc->msgin.priority;
+				pending[i] = 1;
+			}
 			try_again += homa_grant_update_incoming(rpc, homa);
 			if (rpc->msgin.granted >= rpc->msgin.length) {
-				homa_grantable_lock(homa, 0);
+				homa_grantable_lock(homa, 0,
+						"homa_grant_recalc #2");
 				try_again += 1;
 				homa_grant_remove_rpc(rpc);
 				homa_grantable_unlock(homa);
 			}
 			homa_rpc_unlock(rpc);
-			atomic_dec(&rpc->grants_in_progress);
 		}
+		homa_grant_xmit_batch(active_rpcs, grants, pending, active);
+		for (i = 0; i < active; i++)
+			atomic_dec(&active_rpcs[i]->grants_in_progress);
 
 		if (try_again == 0)
 			break;
 		INC_METRIC(grant_recalc_loops, 1);
-		if (!homa_grantable_lock(homa, 1)) {
+		if (!homa_grantable_lock(homa, 1, "homa_grant_recalc #3")) {
 			INC_METRIC(grant_recalc_skips, 1);
 			break;
 		}
@@ -588,6 +697,58 @@ void homa_grant_find_oldest(struct homa *homa)
 	}
 	homa->oldest_rpc = oldest;
 }
+
+/**
+ * homa_grant_pregrant() - Invoked when a client sends a request for which
+ * the application has supplied the expected length of the response. If
+ * the response will need grants, this function decides how much of it the
+ * server may transmit without waiting for them, and reserves incoming
+ * capacity for those bytes. This saves a round trip for large responses.
+ * @rpc:     Client RPC whose request is about to be sent. Must be locked
+ *           by the caller, and its response must not yet have arrived.
+ *           @rpc->resp_incoming is set by this function.
+ * @length:  Expected length of the response, in bytes (0 means unknown).
+ */
+void homa_grant_pregrant(struct homa_rpc *rpc, int length)
+{
+	struct homa *homa = rpc->hsk->homa;
+	int pregrant, available, unsched;
+
+	rpc->resp_incoming = 0;
+	unsched = homa_peer_unsched_bytes(homa, rpc->peer);
+	if (length <= unsched)
+		return;
+
+	/* Grant only as much as the response would have received from
+	 * normal grants, and only if it would rank among the messages
+	 * currently being granted (SRPT).
+	 */
+	pregrant = homa_peer_grant_window(homa, rpc->peer);
+	if (pregrant > length)
+		pregrant = length;
+	if ((homa->num_grantable_rpcs >= homa->max_overcommit)
+			&& (length >= atomic_read(&homa->active_remaining[
+			homa->max_overcommit-1])))
+		return;
+	available = homa->max_incoming - atomic_read(&homa->total_incoming);
+	if (pregrant > available)
+		pregrant = available;
+	if (pregrant <= unsched)
+		return;
+
+	/* The reservation is recorded in rec_incoming; once the response
+	 * arrives, homa_grant_update_incoming will adjust it to match the
+	 * actual incoming bytes.
+	 */
+	atomic_add(pregrant, &homa->total_incoming);
+	rpc->msgin.rec_incoming = pregrant;
+	rpc->resp_incoming = pregrant;
+	rpc->pregrant_timer_ticks = homa->timer_ticks;
+	INC_METRIC(resp_pregrants, 1);
+	INC_METRIC(resp_pregrant_bytes, pregrant - unsched);
+	tt_record3("pregranted %d bytes of response for id %d, expected "
+			"length %d", pregrant, rpc->id, length);
+}
 /**
  * homa_grant_free_rpc() - This function is invoked when an RPC is freed;
  * it cleans up any state related to grants for that RPC's incoming message.
@@ -598,7 +759,7 @@ void homa_grant_free_rpc(struct homa_rpc *rpc)
 	struct homa *homa = rpc->hsk->homa;
 
 	if (!list_empty(&rpc->grantable_links)) {
-		homa_grantable_lock(homa, 0);
+		homa_grantable_lock(homa, 0, "homa_grant_free_rpc");
 		homa_grant_remove_rpc(rpc);
 		if (atomic_read(&rpc->msgin.rank) >= 0) {
 			/* Very tricky code below. We have to unlock the RPC before
@@ -628,12 +789,13 @@ void homa_grant_free_rpc(struct homa_rpc *rpc)
  * @homa:    Overall data about the Homa protocol implementation.
  * @recalc:  Nonzero means the caller is homa_grant_recalc; if another thread
  *           is already recalculating, can return without waiting for the lock.
+ * @locker:  Static string identifying the locking code.
  * Return:   Nonzero means this thread now owns the grantable lock. Zero
  *           means the lock was not acquired and there is no need for this
  *           thread to do the work of homa_grant_recalc because some other
  *           thread started a fresh calculation after this method was invoked.
  */
-int homa_grantable_lock_slow(struct homa *homa, int recalc)
+int homa_grantable_lock_slow(struct homa *homa, int recalc, char *locker)
 {
 	int result = 0;
 	__u64 start = get_cycles();
@@ -655,5 +817,6 @@ int homa_grantable_lock_slow(struct homa *homa, int recalc)
 	}
 	INC_METRIC(grantable_lock_misses, 1);
 	INC_METRIC(grantable_lock_miss_cycles, get_cycles() - start);
+	homa_lock_miss(HOMA_LOCK_GRANTABLE, locker, get_cycles() - start);
 	return result;
 }
\ No newline at end of file
@@ -35,11 +35,13 @@
 #include <linux/kernel.h>
 #include <linux/kthread.h>
 #include <linux/completion.h>
+#include <linux/cpuhotplug.h>
 #include <linux/proc_fs.h>
 #include <linux/sched/signal.h>
 #include <linux/skbuff.h>
 #include <linux/version.h>
 #include <linux/socket.h>
+#include <net/busy_poll.h>
 #include <net/icmp.h>
 #include <net/ip.h>
 #include <net/protocol.h>
@@ -97,11 +99,14 @@ struct homa;
 struct homa_peer;
 
 /* Declarations used in this file, so they can't be made at the end. */
-extern void     homa_bucket_lock_slow(struct homa_rpc_bucket *bucket, __u64 id);
-extern int      homa_grantable_lock_slow(struct homa *homa, int recalc);
-extern void     homa_peer_lock_slow(struct homa_peer *peer);
-extern void     homa_sock_lock_slow(struct homa_sock *hsk);
-extern void     homa_throttle_lock_slow(struct homa *homa);
+extern void     homa_bucket_lock_slow(struct homa_rpc_bucket *bucket, __u64 id,
+		    char *locker);
+extern int      homa_grantable_lock_slow(struct homa *homa, int recalc,
+		    char *locker);
+extern void     homa_lock_miss(int lock_class, char *locker, __u64 cycles);
+extern void     homa_peer_lock_slow(struct homa_peer *peer, char *locker);
+extern void     homa_sock_lock_slow(struct homa_sock *hsk, char *locker);
+extern void     homa_throttle_lock_slow(struct homa *homa, char *locker);
 
 extern struct homa_core *homa_cores[];
 
@@ -157,7 +162,9 @@ enum homa_packet_type {
 #define HOMA_MIN_PKT_LENGTH 26
 
 /**
- * define HOMA_MAX_HEADER - Number of bytes in the largest Homa header.
+ * define HOMA_MAX_HEADER - Number of bytes in the largest Homa header,
+ * not counting the variable-length batch of acks at the end of ACK, GRANT,
+ * and RESEND packets.
  */
 #define HOMA_MAX_HEADER 90
 
@@ -182,9 +189,16 @@ enum homa_packet_type {
 
 /**
  * define NUM_PEER_UNACKED_IDS - The number of ids for unacked RPCs that
- * can be stored in a struct homa_peer.
+ * can be stored in a struct homa_peer; this is also the largest number of
+ * acks that can be carried in a single ACK packet.
  */
-#define NUM_PEER_UNACKED_IDS 5
+#define NUM_PEER_UNACKED_IDS 32
+
+/**
+ * define HOMA_MAX_CTRL_ACKS - The largest number of acks that can be
+ * piggybacked on a GRANT or RESEND packet.
+ */
+#define HOMA_MAX_CTRL_ACKS 8
 
 /**
  * define HOMA_MAX_GRANTS - Used to size various data structures for grant
@@ -193,6 +207,12 @@ enum homa_packet_type {
  */
 #define HOMA_MAX_GRANTS 10
 
+/**
+ * define HOMA_MAX_EXTRA_GRANTS - The maximum number of additional grants
+ * (for other RPCs) that can be carried in a single GRANT packet.
+ */
+#define HOMA_MAX_EXTRA_GRANTS 4
+
 /**
  * struct homa_cache_line - An object whose size equals that of a cache line.
  */
@@ -222,7 +242,8 @@ struct common_header {
 	/**
 	 * @unused1: corresponds to the sequence number field in TCP headers;
 	 * must not be used by Homa, in case it gets incremented during TCP
-	 * offload.
+	 * offload. On the receive side, this field and @unused2 hold the
+	 * time recorded by homa_set_rcv_cycles.
 	 */
 	__be32 unused1;
 
@@ -341,6 +362,15 @@ struct data_header {
 
 	__u8 pad;
 
+	/**
+	 * @resp_incoming: Used only in request messages: the number of
+	 * initial bytes of the response that the server may transmit without
+	 * waiting for grants (the client has already reserved incoming
+	 * capacity for them). 0 means the server should use its normal
+	 * unscheduled limit.
+	 */
+	__be32 resp_incoming;
+
 	/** @seg: First of possibly many segments */
 	struct data_segment seg;
 } __attribute__((packed));
@@ -355,6 +385,23 @@ _Static_assert(((sizeof(struct data_header) - sizeof(struct data_segment))
 		" data_header length not a multiple of 4 bytes (required "
 		"for TCP/TSO compatibility");
 
+/**
+ * struct homa_extra_grant - Describes a grant for an RPC other than the
+ * one identified in the common header of a GRANT packet. This allows
+ * grants for several RPCs between the same pair of sockets to be sent
+ * in a single packet.
+ */
+struct homa_extra_grant {
+	/** @id: The sender's identifier for the RPC. */
+	__be64 id;
+
+	/** @offset: Same as the @offset field in struct grant_header. */
+	__be32 offset;
+
+	/** @priority: Same as the @priority field in struct grant_header. */
+	__u8 priority;
+} __attribute__((packed));
+
 /**
  * struct grant_header - Wire format for GRANT packets, which are sent by
  * the receiver back to the sender to indicate that the sender may transmit
@@ -385,8 +432,37 @@ struct grant_header {
 	 * that no packets have been successfully received).
 	 */
 	__u8 resend_all;
+
+	/**
+	 * @num_extra: Number of extra grants (for other RPCs whose sockets
+	 * are the same as this one) that follow the valid elements of
+	 * @acks; see homa_grant_extra. Never used for grants with
+	 * @resend_all.
+	 */
+	__u8 num_extra;
+
+	/**
+	 * @num_acks: Number of elements in @acks that are valid. Only these
+	 * elements (and the @num_extra extra grants after them) are
+	 * transmitted, so the length of the packet varies.
+	 */
+	__u8 num_acks;
+
+	/**
+	 * @acks: Acks for RPCs on the recipient (which is a server for
+	 * these RPCs) that are no longer active on the sender.
+	 */
+	struct homa_ack acks[HOMA_MAX_CTRL_ACKS];
+
+	/**
+	 * @extra_space: Ensures that there is room for the largest number
+	 * of extra grants after @acks; the extra grants start immediately
+	 * after the last valid ack, so this field shouldn't be accessed
+	 * directly.
+	 */
+	struct homa_extra_grant extra_space[HOMA_MAX_EXTRA_GRANTS];
 } __attribute__((packed));
-_Static_assert(sizeof(struct grant_header) <= HOMA_MAX_HEADER,
+_Static_assert(offsetof(struct grant_header, acks) <= HOMA_MAX_HEADER,
 		"grant_header too large for HOMA_MAX_HEADER; must "
 		"adjust HOMA_MAX_HEADER");
 
@@ -424,8 +500,17 @@ struct resend_header {
 	 * priority.
 	 */
 	__u8 priority;
+
+	/**
+	 * @num_acks: Number of elements in @acks that are valid. Only these
+	 * elements are transmitted, so the length of the packet varies.
+	 */
+	__u8 num_acks;
+
+	/** @acks: Same as the @acks field in struct grant_header. */
+	struct homa_ack acks[HOMA_MAX_CTRL_ACKS];
 } __attribute__((packed));
-_Static_assert(sizeof(struct resend_header) <= HOMA_MAX_HEADER,
+_Static_assert(offsetof(struct resend_header, acks) <= HOMA_MAX_HEADER,
 		"resend_header too large for HOMA_MAX_HEADER; must "
 		"adjust HOMA_MAX_HEADER");
 
@@ -527,12 +612,17 @@ struct ack_header {
 	/** @common: Fields common to all packet types. */
 	struct common_header common;
 
-	/** @num_acks: number of (leading) elements in @acks that are valid. */
+	/**
+	 * @num_acks: number of (leading) elements in @acks that are valid.
+	 * Only these elements are transmitted, so the length of the packet
+	 * varies.
+	 */
 	__be16 num_acks;
 
+	/** @acks: RPCs that are no longer active on the sender. */
 	struct homa_ack acks[NUM_PEER_UNACKED_IDS];
 } __attribute__((packed));
-_Static_assert(sizeof(struct ack_header) <= HOMA_MAX_HEADER,
+_Static_assert(offsetof(struct ack_header, acks) <= HOMA_MAX_HEADER,
 		"ack_header too large for HOMA_MAX_HEADER; must "
 		"adjust HOMA_MAX_HEADER");
 
@@ -614,6 +704,14 @@ struct homa_message_out {
 	 * initialized.  Used to find the oldest outgoing message.
 	 */
 	__u64 init_cycles;
+
+	/**
+	 * @rtt_probe_cycles: Time in get_cycles units when the first packet
+	 * of the message was transmitted. Used to measure the round-trip
+	 * time to the peer when the first grant arrives (see
+	 * homa_apply_grant).
+	 */
+	__u64 rtt_probe_cycles;
 };
 
 /**
@@ -699,15 +797,42 @@ struct homa_message_in {
 	 */
 	__u64 birth;
 
+	/**
+	 * @rtt_probe_offset: If nonzero, a grant was sent at time
+	 * @rtt_probe_cycles that allowed the sender to transmit the byte
+	 * at this offset; the arrival of that byte provides a sample of
+	 * the round-trip time to the peer. Zero means no probe is in
+	 * progress.
+	 */
+	int rtt_probe_offset;
+
+	/** @rtt_probe_cycles: See @rtt_probe_offset. */
+	__u64 rtt_probe_cycles;
+
 	/**
 	 * @num_bpages: The number of entries in @bpage_offsets used for this
 	 * message (0 means buffers not allocated yet).
 	 */
 	__u32 num_bpages;
 
+	/**
+	 * @charged_bpages: The number of bpages for this message that are
+	 * currently charged to its peer in hsk->buffer_pool (nonzero only
+	 * for messages that need more than one bpage and haven't been fully
+	 * received).
+	 */
+	__u32 charged_bpages;
+
+	/**
+	 * @charged_links: Used to link this RPC into the charged_rpcs list
+	 * of hsk->buffer_pool while @charged_bpages is nonzero.
+	 */
+	struct list_head charged_links;
+
 	/** @bpage_offsets: Describes buffer space allocated for this message.
 	 * Each entry is an offset from the start of the buffer region.
-	 * All but the last pointer refer to areas of size HOMA_BPAGE_SIZE.
+	 * All but the last pointer refer to full bpages (hsk->buffer_pool
+	 * .bpage_size bytes).
 	 */
 	__u32 bpage_offsets[HOMA_MAX_BPAGES];
 };
@@ -750,6 +875,14 @@ struct homa_interest {
 	 */
 	struct homa_rpc *reg_rpc;
 
+	/**
+	 * @peer: the peer for @reg_rpc (NULL if no specific RPC was
+	 * requested). Used to find the NIC queue to busy-poll while
+	 * waiting. Unlike @reg_rpc, this remains valid after the RPC is
+	 * freed, since peers live until Homa is unloaded.
+	 */
+	struct homa_peer *peer;
+
 	/**
 	 * @request_links: For linking this object into
 	 * &homa_sock.request_interests. The interest must not be linked
@@ -776,6 +909,7 @@ static void inline homa_interest_init(struct homa_interest *interest)
 	interest->locked = 0;
 	interest->core = raw_smp_processor_id();
 	interest->reg_rpc = NULL;
+	interest->peer = NULL;
 	interest->request_links.next = LIST_POISON1;
 	interest->response_links.next = LIST_POISON1;
 }
@@ -891,6 +1025,15 @@ struct homa_rpc {
 	 */
 	__u64 completion_cookie;
 
+	/**
+	 * @resp_incoming: On clients, the number of bytes of the response
+	 * that the server may send without waiting for grants, based on the
+	 * response length supplied by the application (0 means the server
+	 * should use its normal unscheduled limit); sent to the server in
+	 * request packets. On servers, the value received from the client.
+	 */
+	int resp_incoming;
+
 	/**
 	 * @error: Only used on clients. If nonzero, then the RPC has
 	 * failed and the value is a negative errno that describes the
@@ -926,9 +1069,9 @@ struct homa_rpc {
 	struct list_head ready_links;
 
 	/**
-	 * @buf_links: Used to link this RPC into @hsk->waiting_for_bufs.
-	 * If the RPC isn't on @hsk->waiting_for_bufs, this is an empty
-	 * list pointing to itself.
+	 * @buf_links: Used to link this RPC into the waiting_for_bufs
+	 * list of @hsk->buffer_pool. If the RPC isn't on that list, this
+	 * is an empty list pointing to itself.
 	 */
 	struct list_head buf_links;
 
@@ -983,6 +1126,14 @@ struct homa_rpc {
 	 */
 	__u32 done_timer_ticks;
 
+	/**
+	 * @pregrant_timer_ticks: Only used on clients. The value of
+	 * homa->timer_ticks when incoming capacity was reserved for the
+	 * response (see homa_grant_pregrant); used to release the
+	 * reservation if the response is slow to arrive.
+	 */
+	__u32 pregrant_timer_ticks;
+
 	/**
 	 * @magic: when the RPC is alive, this holds a distinct value that
 	 * is unlikely to occur naturally. The value is cleared when the
@@ -997,6 +1148,28 @@ struct homa_rpc {
 	 * Used (sometimes) for testing.
 	 */
 	uint64_t start_cycles;
+
+	/**
+	 * @dispatch_cycles: time when homa_softirq began processing the
+	 * packet that most recently made incoming data ready for the
+	 * application; 0 means no such packet since the last handoff.
+	 * Used for the softirq_handoff_latency metric.
+	 */
+	__u64 dispatch_cycles;
+
+	/**
+	 * @handoff_cycles: time when homa_rpc_handoff last made this RPC
+	 * available to the application; 0 means not handed off since the
+	 * last wakeup. Used for the handoff_wakeup_latency metric.
+	 */
+	__u64 handoff_cycles;
+
+	/**
+	 * @wakeup_cycles: time when homa_wait_for_message last received this
+	 * RPC from homa_rpc_handoff; 0 means not received since the last
+	 * return from recvmsg. Used for the wakeup_recvmsg_latency metric.
+	 */
+	__u64 wakeup_cycles;
 };
 
 /**
@@ -1136,6 +1309,12 @@ struct homa_bpage {
 			 */
 			int owner;
 
+			/**
+			 * @node: index in pool->nodes of the NUMA node whose
+			 * slice of the region contains this page.
+			 */
+			int node;
+
 			/**
 			 * @expiration: time (in get_cycles units) after
 			 * which it's OK to steal this page from its current
@@ -1149,17 +1328,70 @@ _Static_assert(sizeof(struct homa_bpage) == sizeof(struct homa_cache_line),
 		"homa_bpage overflowed a cache line");
 
 /**
- * struct homa_pool_core - Holds core-specific data for a homa_pool (a bpage
- * out of which that core is allocating small chunks).
+ * define HOMA_POOL_CACHE_SIZE - Maximum number of free bpage indexes that
+ * can be cached by each core in a homa_pool.
+ */
+#define HOMA_POOL_CACHE_SIZE 24
+
+/**
+ * define HOMA_POOL_BATCH - Number of bpage indexes moved at once between
+ * a core's cache and the free stack for its NUMA node.
+ */
+#define HOMA_POOL_BATCH 8
+
+/**
+ * define HOMA_POOL_MAX_NODES - Maximum number of NUMA nodes across which
+ * a homa_pool's region can be divided. Cores on higher-numbered nodes
+ * share slices with lower-numbered nodes.
+ */
+#define HOMA_POOL_MAX_NODES 8
+
+/**
+ * struct homa_pool_node - Holds information about the slice of a homa_pool's
+ * region that is associated with one NUMA node.
+ */
+struct homa_pool_node {
+	/**
+	 * @lock: Used to synchronize access to @free_stack and @free_top.
+	 */
+	struct spinlock lock;
+
+	/** @first_bpage: Index of the first bpage in this node's slice. */
+	int first_bpage;
+
+	/** @num_bpages: Number of bpages in this node's slice. */
+	int num_bpages;
+
+	/**
+	 * @free_stack: Refers to @num_bpages entries in pool->free_space;
+	 * the first @free_top entries hold indexes of free bpages from this
+	 * slice that aren't in any core's cache.
+	 */
+	__u32 *free_stack;
+
+	/** @free_top: Number of valid entries in @free_stack. */
+	int free_top;
+};
+
+/**
+ * struct homa_pool_core - Holds core-specific data for a homa_pool: a bpage
+ * out of which that core is allocating small chunks, plus a cache of free
+ * bpages that the core can allocate without touching shared state.
  */
 struct homa_pool_core {
 	union {
 		/**
-		 * @cache_line: Ensures that each object is exactly one
-		 * cache line long.
+		 * @cache_lines: Ensures that each object is exactly two
+		 * cache lines long.
 		 */
-		struct homa_cache_line cache_line;
+		struct homa_cache_line cache_lines[2];
 		struct {
+			/**
+			 * @lock: Used to synchronize access to @num_free and
+			 * @free (other cores access them when stealing).
+			 */
+			struct spinlock lock;
+
 			/**
 			 * @page_hint: Index of bpage in pool->descriptors,
 			 * which may be owned by this core. If so, we'll use it
@@ -1176,36 +1408,70 @@ struct homa_pool_core {
 			int allocated;
 
 			/**
-			 * @next_candidate: when searching for free bpages,
-			 * check this index next.
+			 * @node: Index in pool->nodes of the slice from which
+			 * this core allocates (that of its NUMA node).
+			 */
+			int node;
+
+			/** @num_free: Number of valid entries in @free. */
+			int num_free;
+
+			/**
+			 * @free: Indexes of bpages that are free (reference
+			 * count zero) and may be allocated by this core; they
+			 * all come from the slice for @node. Used
+			 * as a stack: the most recently freed bpage (which is
+			 * the most likely to be in cache) is allocated first.
 			 */
-			int next_candidate;
+			__u32 free[HOMA_POOL_CACHE_SIZE];
 		};
 	};
 };
-_Static_assert(sizeof(struct homa_pool_core) == sizeof(struct homa_cache_line),
-		"homa_pool_core overflowed a cache line");
+_Static_assert(sizeof(struct homa_pool_core)
+		== 2*sizeof(struct homa_cache_line),
+		"homa_pool_core overflowed two cache lines");
 
 /**
  * struct homa_pool - Describes a pool of buffer space for incoming
- * messages for a particular socket; managed by homa_pool.c. The pool is
- * divided up into "bpages", which are a multiple of the hardware page size.
- * A bpage may be owned by a particular core so that it can more efficiently
- * allocate space for small messages.
+ * messages; managed by homa_pool.c. A pool is created for a socket with
+ * SO_HOMA_SET_BUF, and other sockets in the same process can then share
+ * it with SO_HOMA_SHARE_BUF. The pool is divided up into "bpages", which
+ * are a multiple of the hardware page size. A bpage may be owned by a
+ * particular core so that it can more efficiently allocate space for
+ * small messages.
  */
 struct homa_pool {
+	/** @homa: Overall information about the Homa protocol. */
+	struct homa *homa;
+
 	/**
-	 * @hsk: the socket that this pool belongs to.
+	 * @refs: Number of sockets whose @buffer_pool refers to this pool.
+	 * The pool is freed when this becomes zero.
 	 */
-	struct homa_sock *hsk;
+	atomic_t refs;
 
 	/**
 	 * @region: beginning of the pool's region (in the app's virtual
-	 * memory). Divided into bpages. 0 means the pool hasn't yet been
-	 * initialized.
+	 * memory). Divided into bpages.
 	 */
 	char *region;
 
+	/**
+	 * @mm: address space of the process that created the pool; @region
+	 * is only meaningful in this address space, so only sockets opened
+	 * by that process may share the pool (see homa_pool_share).
+	 */
+	struct mm_struct *mm;
+
+	/**
+	 * @bpage_size: number of bytes in each bpage (a power of two,
+	 * specified by the application with SO_HOMA_SET_BUF).
+	 */
+	int bpage_size;
+
+	/** @bpage_shift: log2(@bpage_size). */
+	int bpage_shift;
+
 	/** @num_bpages: total number of bpages in the pool. */
 	int num_bpages;
 
@@ -1220,13 +1486,63 @@ struct homa_pool {
 	 */
 	atomic_t free_bpages;
 
+	/**
+	 * @free_space: kmalloced array with room for @num_bpages entries;
+	 * divided among the free stacks in @nodes. Every free bpage is
+	 * either on the free stack for its node or in the @free array of
+	 * exactly one core.
+	 */
+	__u32 *free_space;
+
+	/**
+	 * @nodes: Information about the slices of the region, one per NUMA
+	 * node. Slice i consists of a contiguous range of bpages, and slices
+	 * appear in the region in node order, so the application can bind
+	 * each slice to its node (e.g. with mbind).
+	 */
+	struct homa_pool_node nodes[HOMA_POOL_MAX_NODES];
+
+	/** @num_nodes: Number of valid entries in @nodes. */
+	int num_nodes;
+
+	/**
+	 * @lock: Used to synchronize access to @waiting_for_bufs,
+	 * @charged_rpcs, and @bpages_needed. If an RPC lock is also needed,
+	 * it must be acquired before this lock.
+	 */
+	struct spinlock lock;
+
+	/**
+	 * @waiting_for_bufs: Contains RPCs (from any of the sockets sharing
+	 * the pool) that are blocked because there wasn't enough space in
+	 * the pool for their incoming messages. Sorted in increasing order
+	 * of message length.
+	 */
+	struct list_head waiting_for_bufs;
+
+	/**
+	 * @charged_rpcs: Contains RPCs (from any of the sockets sharing the
+	 * pool) whose incoming messages need more than one bpage and haven't
+	 * yet been completely received; their bpages count against their
+	 * peers' limits in this pool (see homa_pool_admit). Linked through
+	 * msgin.charged_links.
+	 */
+	struct list_head charged_rpcs;
+
 	/**
 	 * The number of free bpages required to satisfy the needs of the
-	 * first RPC on @hsk->waiting_for_bufs, or INT_MAX if that queue
-	 * is empty.
+	 * first RPC on @waiting_for_bufs that isn't held back by its peer's
+	 * limit, or INT_MAX if there is no such RPC.
 	 */
 	int bpages_needed;
 
+	/**
+	 * @next_reclaim: get_cycles() time before which homa_pool_get_pages
+	 * won't invoke homa_pool_reclaim again (scanning the whole pool is
+	 * expensive, so it happens at most once per bpage lease).
+	 */
+	atomic64_t next_reclaim;
+
 	/** @cores: core-specific info; dynamically allocated. */
 	struct homa_pool_core *cores;
 
@@ -1289,6 +1605,14 @@ struct homa_sock {
 	/** @shutdown: True means the socket is no longer usable. */
 	bool shutdown;
 
+	/**
+	 * @use_response_length: True means sendmsg reads the
+	 * @response_length field of struct homa_sendmsg_args (set with
+	 * SO_HOMA_RESPONSE_LENGTH); otherwise only the fields in the
+	 * original, smaller struct are read.
+	 */
+	bool use_response_length;
+
 	/**
 	 * @port: Port number: identifies this socket uniquely among all
 	 * those on this node.
@@ -1301,6 +1625,16 @@ struct homa_sock {
 	 */
 	int ip_header_length;
 
+	/**
+	 * @avg_wait_cycles: Exponentially weighted average of how long
+	 * (in get_cycles units) threads have recently had to wait in
+	 * homa_wait_for_message for a message to arrive on this socket;
+	 * used to size the polling window. 0 means no information is
+	 * available yet. Updated without synchronization, so it is only
+	 * approximate.
+	 */
+	__u64 avg_wait_cycles;
+
 	/**
 	 * @client_socktab_links: Links this socket into the homa_socktab
 	 * based on @port.
@@ -1327,13 +1661,6 @@ struct homa_sock {
 	/** @dead_skbs: Total number of socket buffers in RPCs on dead_rpcs. */
 	int dead_skbs;
 
-	/**
-	 * @waiting_for_bufs: Contains RPCs that are blocked because there
-	 * wasn't enough space in the buffer pool region for their incoming
-	 * messages. Sorted in increasing order of message length.
-	 */
-	struct list_head waiting_for_bufs;
-
 	/**
 	 * @ready_requests: Contains server RPCs whose request message is
 	 * in a state requiring attention from  a user process. The head is
@@ -1376,8 +1703,18 @@ struct homa_sock {
 
 	/**
 	 * @buffer_pool: used to allocate buffer space for incoming messages.
+	 * NULL means the application hasn't yet specified a region with
+	 * SO_HOMA_SET_BUF. The pool may be shared with other sockets.
+	 * Changes require the socket lock.
 	 */
-	struct homa_pool buffer_pool;
+	struct homa_pool *buffer_pool;
+
+	/**
+	 * @copy_core: The core on which data was most recently copied out
+	 * to user space for this socket, or -1 if none yet. Buffer space
+	 * for incoming messages is allocated from this core's NUMA node.
+	 */
+	int copy_core;
 };
 
 /**
@@ -1441,6 +1778,14 @@ struct homa_peertab {
 	struct hlist_head *buckets;
 };
 
+/**
+ * define HOMA_RTT_RANGE - When per-peer RTT estimates are used to compute
+ * unscheduled bytes or grant windows, the results are kept within a factor
+ * of HOMA_RTT_RANGE of the corresponding global values (unsched_bytes and
+ * window). This limits the damage from bad estimates.
+ */
+#define HOMA_RTT_RANGE 8
+
 /**
  * struct homa_peer - One of these objects exists for each machine that we
  * have communicated with (either as client or server).
@@ -1561,6 +1906,29 @@ struct homa_peer {
 	 * @ack_lock: used to synchronize access to @num_acks and @acks.
 	 */
 	struct spinlock ack_lock;
+
+	/**
+	 * @napi_id: identifies the NIC queue (NAPI instance) on which
+	 * packets from this peer most recently arrived; used for busy
+	 * polling. 0 means unknown.
+	 */
+	unsigned int napi_id;
+
+	/**
+	 * @srtt_cycles: Smoothed estimate of the round-trip time to this
+	 * peer, in get_cycles units, or 0 if no samples have been collected
+	 * yet. Updated by homa_peer_add_rtt without synchronization: an
+	 * occasional lost sample is harmless.
+	 */
+	int srtt_cycles;
+
+	/**
+	 * @rtt_bytes: The number of bytes that can be transmitted at
+	 * @homa->link_mbps during @srtt_cycles (0 if @srtt_cycles is 0).
+	 * Used to compute per-peer unscheduled bytes and grant windows;
+	 * see homa_peer_unsched_bytes and homa_peer_grant_window.
+	 */
+	int rtt_bytes;
 };
 
 /**
@@ -1813,6 +2181,16 @@ struct homa {
 	 */
 	int link_mbps;
 
+	/**
+	 * @rtt_adaptive: Nonzero means that the number of unscheduled bytes
+	 * for outgoing messages and the grant window (if @window_param is
+	 * nonzero) are computed separately for each peer, based on the
+	 * measured round-trip time to that peer; zero means @unsched_bytes
+	 * and @window_param are used for all peers. Set externally via
+	 * sysctl.
+	 */
+	int rtt_adaptive;
+
 	/**
 	 * @poll_usecs: Amount of time (in microseconds) that a thread
 	 * will spend busy-waiting for an incoming messages before
@@ -1826,6 +2204,16 @@ struct homa {
 	 */
 	int poll_cycles;
 
+	/**
+	 * @poll_adaptive: Nonzero means homa_wait_for_message adjusts the
+	 * polling time for each socket based on how long threads have
+	 * recently waited for messages on that socket: it polls only when
+	 * a message is likely to arrive within @poll_usecs, and it polls
+	 * no longer than needed. Zero means always poll for @poll_usecs.
+	 * Set externally via sysctl.
+	 */
+	int poll_adaptive;
+
 	/**
 	 * @num_priorities: The total number of priority levels available for
 	 * Homa's use. Internally, Homa will use priorities from 0 to
@@ -1869,6 +2257,44 @@ struct homa {
 	 */
 	int cutoff_version;
 
+	/**
+	 * @prio_autotune: nonzero means that Homa recomputes @unsched_cutoffs
+	 * periodically, based on the sizes of recently received messages
+	 * (see homa_prio.c); any values set externally will be overwritten.
+	 * Set externally via sysctl.
+	 */
+	int prio_autotune;
+
+	/**
+	 * @prio_autotune_interval: how often to recompute @unsched_cutoffs
+	 * when @prio_autotune is set, in units of timer ticks (ms). Message
+	 * sizes are also decayed by half at this interval. Set externally
+	 * via sysctl.
+	 */
+	int prio_autotune_interval;
+
+	/**
+	 * @prio_autotune_min_msgs: @unsched_cutoffs will not be recomputed
+	 * unless the (decayed) message count is at least this large.
+	 * Set externally via sysctl.
+	 */
+	int prio_autotune_min_msgs;
+
+	/**
+	 * @prio_autotune_min_drift: @unsched_cutoffs will not be recomputed
+	 * unless the deciles of the message size distribution have drifted
+	 * by at least this much (sum of the fractional changes of the 9
+	 * deciles, in thousandths) since the last recomputation. Prevents
+	 * churn in the cutoffs. Set externally via sysctl.
+	 */
+	int prio_autotune_min_drift;
+
+	/**
+	 * @prio_tuner: information about recent message sizes, used when
+	 * @prio_autotune is set.
+	 */
+	struct homa_prio_tuner *prio_tuner;
+
 	/**
 	 * @fifo_grant_increment: how many additional bytes to grant in
 	 * a "pity" grant sent to the oldest outstanding message. Set
@@ -1971,6 +2397,33 @@ struct homa {
 	 */
 	bool pacer_exit;
 
+	/**
+	 * @engine_core: if nonnegative, Homa runs an engine thread pinned
+	 * to this core, which busy-polls the NIC and runs the pacer (see
+	 * homa_engine.c). -1 means the engine is disabled. Set externally
+	 * via sysctl.
+	 */
+	int engine_core;
+
+	/**
+	 * @engine_kthread: the engine thread, or NULL if it isn't running.
+	 * When this is non-NULL, the pacer thread isn't woken up.
+	 */
+	struct task_struct *engine_kthread;
+
+	/**
+	 * @engine_thread_core: the core to which @engine_kthread is bound;
+	 * -1 if there is no engine thread.
+	 */
+	int engine_thread_core;
+
+	/**
+	 * @engine_napi_id: NAPI id of the NIC queue most recently seen
+	 * delivering Homa packets (from skb->napi_id); the engine thread
+	 * busy-polls this queue. 0 means no queue is known yet.
+	 */
+	unsigned int engine_napi_id;
+
 	/**
 	 * @max_nic_queue_ns: Limits the NIC queue length: we won't queue
 	 * up a packet for transmission if link_idle_time is this many
@@ -2046,6 +2499,18 @@ struct homa {
 	 *                            core isn't overloaded).
 	 * HOMA_GRO_GEN3              Use the "Gen3" mechanisms for load
 	 *                            balancing.
+	 * HOMA_GRO_COALESCE          Merge contiguous DATA packets from the
+	 *                            same RPC into a single skb during GRO
+	 *                            (see homa_gro_coalesce).
+	 * HOMA_GRO_GEN3_ADAPTIVE     When used with HOMA_GRO_GEN3, vary the
+	 *                            number of SoftIRQ cores used by each GRO
+	 *                            core according to load (see
+	 *                            homa_gro_gen3_adapt).
+	 * HOMA_GRO_RFS               When a thread is waiting for a particular
+	 *                            client RPC, send that RPC's packets to
+	 *                            a SoftIRQ core that shares cache with
+	 *                            the waiting thread's core (see
+	 *                            homa_gro_rfs); overrides other policies.
 	 */
 	#define HOMA_GRO_SAME_CORE       2
 	#define HOMA_GRO_IDLE            4
@@ -2054,6 +2519,9 @@ struct homa {
 	#define HOMA_GRO_FAST_GRANTS    32
 	#define HOMA_GRO_SHORT_BYPASS   64
 	#define HOMA_GRO_GEN3          128
+	#define HOMA_GRO_COALESCE      256
+	#define HOMA_GRO_GEN3_ADAPTIVE 512
+	#define HOMA_GRO_RFS          1024
 	#define HOMA_GRO_NORMAL      (HOMA_GRO_SAME_CORE|HOMA_GRO_GEN2 \
 			|HOMA_GRO_SHORT_BYPASS|HOMA_GRO_FAST_GRANTS)
 
@@ -2081,6 +2549,56 @@ struct homa {
 	/** @gro_busy_cycles: Same as busy_usecs except in get_cycles() units. */
 	int gro_busy_cycles;
 
+	/**
+	 * @gen3_adapt_usecs: when HOMA_GRO_GEN3_ADAPTIVE is set, each GRO
+	 * core reconsiders the number of cores it uses for SoftIRQ once
+	 * in this many microseconds. Set externally via sysctl.
+	 */
+	int gen3_adapt_usecs;
+
+	/**
+	 * @gen3_adapt_cycles: Same as gen3_adapt_usecs except in get_cycles()
+	 * units.
+	 */
+	int gen3_adapt_cycles;
+
+	/**
+	 * @gen3_expand_pct: when HOMA_GRO_GEN3_ADAPTIVE is set, a GRO core
+	 * will start using an additional SoftIRQ core if any of the cores
+	 * it is currently using spent more than this percentage of its time
+	 * in SoftIRQ processing (or had more than one batch waiting). Set
+	 * externally via sysctl.
+	 */
+	int gen3_expand_pct;
+
+	/**
+	 * @gen3_shrink_pct: when HOMA_GRO_GEN3_ADAPTIVE is set, a GRO core
+	 * will stop using one of its SoftIRQ cores if the total SoftIRQ load
+	 * on those cores would keep one fewer core busy less than this
+	 * percentage of the time. Must be well below @gen3_expand_pct to
+	 * avoid oscillation. Set externally via sysctl.
+	 */
+	int gen3_shrink_pct;
+
+	/**
+	 * @gen3_auto_cores: nonzero means the gen3_softirq_cores for each
+	 * core were computed by homa_gen3_default_cores from the CPU topology,
+	 * so they will be recomputed when CPUs come online or go offline.
+	 * Zero means they were set explicitly via sysctl.
+	 */
+	int gen3_auto_cores;
+
+	/**
+	 * @rfs_table: used when HOMA_GRO_RFS is set to find the core where
+	 * a thread is waiting for a particular client RPC. Indexed by
+	 * homa_rfs_index(id); each nonzero entry contains the low-order 48
+	 * bits of an RPC id in its high-order bits and the waiting thread's
+	 * core in its low-order 16 bits. Entries are written without locks
+	 * (see homa_rfs_record), so they are only hints.
+	 */
+#define HOMA_RFS_ENTRIES 1024
+	__u64 rfs_table[HOMA_RFS_ENTRIES];
+
 	/**
 	 * @timer_ticks: number of times that homa_timer has been invoked
 	 * (may wraparound, which is safe).
@@ -2140,6 +2658,26 @@ struct homa {
 	 */
 	int bpage_lease_cycles;
 
+	/**
+	 * @bpage_reserve_pct: Percentage of each socket's buffer pool that
+	 * is reserved for messages that fit in a single bpage; larger
+	 * messages won't be allocated space if it would reduce the free
+	 * bpages in the pool below this level. Ensures that short messages
+	 * can make progress even when large messages have consumed most of
+	 * the buffer space. Set externally via sysctl.
+	 */
+	int bpage_reserve_pct;
+
+	/**
+	 * @bpage_peer_max_pct: Messages that need more than one bpage won't
+	 * be allocated buffer space if that would cause the total space for
+	 * incompletely received messages from the sender to exceed this
+	 * percentage of the receiving socket's pool (unless the sender
+	 * currently has no such messages). 0 means no limit. Set externally
+	 * via sysctl.
+	 */
+	int bpage_peer_max_pct;
+
 	/**
 	 * @next_id: Set via sysctl; causes next_outgoing_id to be set to
 	 * this value; always reads as zero. Typically used while debugging to
@@ -2169,6 +2707,87 @@ struct homa {
  */
 #define HOMA_NUM_SMALL_COUNTS 64
 #define HOMA_NUM_MEDIUM_COUNTS 128
+
+/* Latency histograms (such as client_rpc_latency) are log-linear: each
+ * power of 2 (starting at 2^HOMA_LATENCY_MIN_SHIFT cycles) is divided into
+ * 2^HOMA_LATENCY_SUB_SHIFT buckets of equal width. See homa_latency_bucket.
+ */
+#define HOMA_LATENCY_MIN_SHIFT 10
+#define HOMA_LATENCY_SUB_SHIFT 2
+#define HOMA_NUM_LATENCY_BUCKETS (24 << HOMA_LATENCY_SUB_SHIFT)
+
+/* RPC latencies are recorded separately for different request sizes;
+ * size class i holds requests with fewer than HOMA_LATENCY_SIZE_BASE*10^i
+ * bytes (the last class holds all larger requests). See
+ * homa_latency_size_class.
+ */
+#define HOMA_LATENCY_SIZE_BASE 1000
+#define HOMA_NUM_SIZE_CLASSES 4
+
+/**
+ * define HOMA_PRIO_BUCKETS - Number of message size ranges tracked in a
+ * struct homa_prio_tuner: the first HOMA_NUM_SMALL_COUNTS correspond to
+ * the small_msg_bytes metrics, the next HOMA_NUM_MEDIUM_COUNTS to the
+ * medium_msg_bytes metrics, and the last holds all larger messages.
+ */
+#define HOMA_PRIO_BUCKETS (HOMA_NUM_SMALL_COUNTS + HOMA_NUM_MEDIUM_COUNTS + 1)
+
+/**
+ * struct homa_prio_tuner - Holds a decayed histogram of the sizes of
+ * recently received messages; used by homa_prio_check to compute
+ * unsched_cutoffs. Accessed only by the timer thread.
+ */
+struct homa_prio_tuner {
+	/**
+	 * @active: nonzero means the fields below contain valid information;
+	 * zero means they must be reinitialized from the current metrics.
+	 */
+	int active;
+
+	/**
+	 * @next_tick: value of homa->timer_ticks at which the histogram
+	 * should next be updated.
+	 */
+	__u32 next_tick;
+
+	/**
+	 * @prev_bytes: entry i holds the total bytes (summed over all cores)
+	 * in the message size metrics for bucket i as of the last update.
+	 */
+	__u64 prev_bytes[HOMA_PRIO_BUCKETS];
+
+	/**
+	 * @prev_large_count: the total of the large_msg_count metrics as of
+	 * the last update.
+	 */
+	__u64 prev_large_count;
+
+	/**
+	 * @bytes: entry i holds the number of bytes received in messages
+	 * in bucket i; halved every update, so older traffic decays.
+	 */
+	__u64 bytes[HOMA_PRIO_BUCKETS];
+
+	/**
+	 * @msgs: estimated number of messages in bucket i (exact counts
+	 * aren't kept for most buckets); decayed just like @bytes.
+	 */
+	__u64 msgs[HOMA_PRIO_BUCKETS];
+
+	/**
+	 * @deciles: entry i is the smallest bucket size limit such that
+	 * (i+1)*10% of messages are no larger, as of the last time the
+	 * cutoffs were computed. Used to detect drift.
+	 */
+	int deciles[9];
+
+	/**
+	 * @num_priorities: value of homa->num_priorities the last time
+	 * the cutoffs were computed.
+	 */
+	int num_priorities;
+};
+
 struct homa_metrics {
 	/**
 	 * @small_msg_bytes: entry i holds the total number of bytes
@@ -2296,6 +2915,26 @@ struct homa_metrics {
 	 */
 	__u64 poll_cycles;
 
+	/**
+	 * @busy_polls: total number of times that homa_wait_for_message
+	 * invoked napi_busy_loop to poll the NIC while waiting for a message.
+	 */
+	__u64 busy_polls;
+
+	/**
+	 * @poll_skips: total number of times that homa_wait_for_message
+	 * went to sleep without polling, because recent messages on the
+	 * socket took much longer than the polling time to arrive.
+	 */
+	__u64 poll_skips;
+
+	/**
+	 * @poll_shortened: total number of times that homa_wait_for_message
+	 * polled for less than the poll_usecs time, because recent messages
+	 * on the socket arrived quickly.
+	 */
+	__u64 poll_shortened;
+
 	/**
 	 * @softirq_calls: total number of calls to homa_softirq (i.e.,
 	 * total number of GRO packets processed, each of which could contain
@@ -2447,6 +3086,32 @@ struct homa_metrics {
 	 */
 	__u64 pacer_needed_help;
 
+	/**
+	 * @engine_iterations: total number of passes through the main loop
+	 * of the engine thread.
+	 */
+	__u64 engine_iterations;
+
+	/**
+	 * @engine_cycles: total time spent in the main loop of the engine
+	 * thread, as measured with get_cycles().
+	 */
+	__u64 engine_cycles;
+
+	/**
+	 * @engine_busy_cycles: the portion of @engine_cycles spent in
+	 * passes that found work to do; engine_busy_cycles/engine_cycles
+	 * gives the utilization of the engine's core.
+	 */
+	__u64 engine_busy_cycles;
+
+	/**
+	 * @engine_work: total units of work performed by the engine thread
+	 * (batches of incoming packets processed plus invocations of the
+	 * pacer); engine_work/engine_iterations gives the work per pass.
+	 */
+	__u64 engine_work;
+
 	/**
 	 * @throttled_cycles: total amount of time that @homa->throttled_rpcs
 	 * is nonempty, as measured with get_cycles().
@@ -2631,6 +3296,12 @@ struct homa_metrics {
 	 */
 	__u64 grantable_lock_misses;
 
+	/**
+	 * @lock_site_overflows: total number of lock misses that couldn't
+	 * be recorded in homa_core.lock_sites because it was full.
+	 */
+	__u64 lock_site_overflows;
+
 	/**
 	 * @grantable_rpcs_integral: cumulative sum of time_delta*grantable,
 	 * where time_delta is a get_cycles time and grantable is the
@@ -2663,6 +3334,33 @@ struct homa_metrics {
 	 */
 	__u64 grant_priority_bumps;
 
+	/**
+	 * @resp_pregrants: total number of requests for which part of the
+	 * response was granted in advance, based on the expected response
+	 * length supplied by the application.
+	 */
+	__u64 resp_pregrants;
+
+	/**
+	 * @resp_pregrant_bytes: total number of bytes (beyond the normal
+	 * unscheduled limit) granted in advance for responses.
+	 */
+	__u64 resp_pregrant_bytes;
+
+	/**
+	 * @resp_pregrant_expirations: total number of pregrants whose
+	 * reserved incoming capacity was released because the response
+	 * didn't start arriving within resend_ticks timer ticks.
+	 */
+	__u64 resp_pregrant_expirations;
+
+	/**
+	 * @coalesced_grants: total number of grants that were sent as
+	 * extras in a GRANT packet for a different RPC, rather than in
+	 * their own packets.
+	 */
+	__u64 coalesced_grants;
+
 	/**
 	 * @fifo_grants: total number of times that grants were sent to
 	 * the oldest message.
@@ -2724,6 +3422,40 @@ struct homa_metrics {
 	 */
 	__u64 ack_overflows;
 
+	/**
+	 * @piggybacked_acks: total number of acks that were carried in
+	 * GRANT or RESEND packets rather than in ACK packets.
+	 */
+	__u64 piggybacked_acks;
+
+	/**
+	 * @prio_autotune_updates: total number of times that homa_prio_check
+	 * installed new values for unsched_cutoffs.
+	 */
+	__u64 prio_autotune_updates;
+
+	/**
+	 * @peer_rtt_clamped: total number of round-trip time samples that
+	 * were more than twice a peer's smoothed estimate or outside
+	 * HOMA_RTT_RANGE of the configured RTT, so they were adjusted
+	 * before incorporating them (see homa_peer_add_rtt).
+	 */
+	__u64 peer_rtt_clamped;
+
+	/**
+	 * @rtt_unsched_msgs: total number of outgoing messages whose
+	 * unscheduled bytes were computed from the RTT estimate for their
+	 * peer (see homa_peer_unsched_bytes).
+	 */
+	__u64 rtt_unsched_msgs;
+
+	/**
+	 * @rtt_unsched_bytes: total of the unscheduled byte limits computed
+	 * for the messages in @rtt_unsched_msgs; dividing by @rtt_unsched_msgs
+	 * gives the average.
+	 */
+	__u64 rtt_unsched_bytes;
+
 	/**
 	 * @ignored_need_acks: total number of times that a NEED_ACK packet
 	 * was ignored because the RPC's result hadn't been fully received.
@@ -2737,6 +3469,32 @@ struct homa_metrics {
 	 */
 	__u64 bpage_reuses;
 
+	/**
+	 * @bpage_refills: total number of times that a core's cache of free
+	 * bpages was empty, so it was refilled from its node's free stack.
+	 */
+	__u64 bpage_refills;
+
+	/**
+	 * @bpage_steals: total number of times that a free bpage was taken
+	 * from another core's cache because the local cache and the
+	 * relevant node's free stack were both empty.
+	 */
+	__u64 bpage_steals;
+
+	/**
+	 * @bpage_node_allocs: entry i holds the total number of bpages
+	 * allocated from the slice of a buffer pool for NUMA node i.
+	 */
+	__u64 bpage_node_allocs[HOMA_POOL_MAX_NODES];
+
+	/**
+	 * @bpage_remote_allocs: total number of bpages allocated from a
+	 * different NUMA node's slice than the one requested, because the
+	 * requested node's slice had no free bpages.
+	 */
+	__u64 bpage_remote_allocs;
+
 	/**
 	 * @buffer_alloc_failures: total number of times that
 	 * homa_pool_allocate was unable to allocate buffer space for
@@ -2744,6 +3502,20 @@ struct homa_metrics {
 	 */
 	__u64 buffer_alloc_failures;
 
+	/**
+	 * @buffer_reserve_waits: total number of times that a message
+	 * couldn't be allocated buffer space because it would have used
+	 * bpages reserved for short messages.
+	 */
+	__u64 buffer_reserve_waits;
+
+	/**
+	 * @buffer_peer_waits: total number of times that a message couldn't
+	 * be allocated buffer space because its sender already had too much
+	 * space allocated to incomplete messages.
+	 */
+	__u64 buffer_peer_waits;
+
 	/**
 	 * @linux_pkt_alloc_bytes: total bytes allocated in new packet buffers
 	 * by the NIC driver because of packet cache underflows.
@@ -2769,6 +3541,24 @@ struct homa_metrics {
 	 */
 	__u64 gen3_alt_handoffs;
 
+	/**
+	 * @gen3_expansions: total number of times that homa_gro_gen3_adapt
+	 * added a SoftIRQ core for a GRO core.
+	 */
+	__u64 gen3_expansions;
+
+	/**
+	 * @gen3_contractions: total number of times that homa_gro_gen3_adapt
+	 * removed a SoftIRQ core for a GRO core.
+	 */
+	__u64 gen3_contractions;
+
+	/**
+	 * @rfs_handoffs: total number of batches of packets that
+	 * homa_gro_rfs steered toward a thread waiting for their RPC.
+	 */
+	__u64 rfs_handoffs;
+
 	/**
 	 * @gro_grant_bypasses: total number of GRANT packets passed directly
 	 * to homa_softirq by homa_gro_receive, bypassing the normal SoftIRQ
@@ -2783,11 +3573,155 @@ struct homa_metrics {
 	 */
 	__u64 gro_data_bypasses;
 
+	/**
+	 * @gro_data_coalesced: total number of DATA packets whose data was
+	 * merged into an earlier packet from the same RPC by
+	 * homa_gro_coalesce (triggered by HOMA_GRO_COALESCE).
+	 */
+	__u64 gro_data_coalesced;
+
+	/**
+	 * @client_rpc_latency: entry [i][j] holds the number of client RPCs
+	 * whose request falls in size class i (see HOMA_NUM_SIZE_CLASSES)
+	 * and whose latency, measured from the sendmsg call that created the
+	 * RPC to the recvmsg call that returned its response, falls in
+	 * bucket j (see homa_latency_bucket).
+	 */
+	__u64 client_rpc_latency[HOMA_NUM_SIZE_CLASSES]
+			[HOMA_NUM_LATENCY_BUCKETS];
+
+	/**
+	 * @server_rpc_latency: same as client_rpc_latency, except for
+	 * server RPCs, and latency is measured from the arrival of the
+	 * first request packet to the recvmsg call that returned the
+	 * request.
+	 */
+	__u64 server_rpc_latency[HOMA_NUM_SIZE_CLASSES]
+			[HOMA_NUM_LATENCY_BUCKETS];
+
+	/**
+	 * @gro_softirq_latency: entry i holds the number of incoming packets
+	 * whose delay between homa_gro_receive and the start of homa_softirq
+	 * falls in bucket i (see homa_latency_bucket). Large values indicate
+	 * overloaded SoftIRQ cores (see balance.txt).
+	 */
+	__u64 gro_softirq_latency[HOMA_NUM_LATENCY_BUCKETS];
+
+	/**
+	 * @softirq_handoff_latency: entry i holds the number of handoffs
+	 * (calls to homa_rpc_handoff for incoming data) whose delay since
+	 * homa_softirq began processing the triggering packet falls in
+	 * bucket i.
+	 */
+	__u64 softirq_handoff_latency[HOMA_NUM_LATENCY_BUCKETS];
+
+	/**
+	 * @handoff_wakeup_latency: entry i holds the number of handoffs
+	 * for which the delay until homa_wait_for_message received the RPC
+	 * falls in bucket i. Includes the time the RPC spent queued, if no
+	 * thread was waiting for it.
+	 */
+	__u64 handoff_wakeup_latency[HOMA_NUM_LATENCY_BUCKETS];
+
+	/**
+	 * @wakeup_recvmsg_latency: entry i holds the number of recvmsg calls
+	 * whose delay between the final wakeup in homa_wait_for_message and
+	 * the return from recvmsg (including copying data to user space)
+	 * falls in bucket i.
+	 */
+	__u64 wakeup_recvmsg_latency[HOMA_NUM_LATENCY_BUCKETS];
+
+	/**
+	 * @peer_rtt_latency: entry i holds the number of round-trip time
+	 * samples (see homa_peer_add_rtt) that fell in bucket i.
+	 */
+	__u64 peer_rtt_latency[HOMA_NUM_LATENCY_BUCKETS];
+
 	/** @temp: For temporary use during testing. */
 #define NUM_TEMP_METRICS 10
 	__u64 temp[NUM_TEMP_METRICS];
 };
 
+/**
+ * struct homa_metric_desc - Describes one field of struct homa_metrics;
+ * used to generate the schema for binary metrics snapshots (see
+ * homa_metrics_raw).
+ */
+struct homa_metric_desc {
+	/** @name: Name of the field in struct homa_metrics. */
+	const char *name;
+
+	/**
+	 * @offset: Index of the field's first __u64 within struct
+	 * homa_metrics.
+	 */
+	int offset;
+
+	/** @count: Number of __u64 values in the field. */
+	int count;
+};
+
+extern const struct homa_metric_desc homa_metric_descs[];
+extern const int homa_num_metric_descs;
+
+/**
+ * enum homa_lock_class - Identifies the kinds of locks whose contention
+ * is tracked by call site in homa_core.lock_sites.
+ */
+enum homa_lock_class {
+	HOMA_LOCK_SOCKET           = 0,
+	HOMA_LOCK_BUCKET           = 1,
+	HOMA_LOCK_GRANTABLE        = 2,
+	HOMA_LOCK_THROTTLE         = 3,
+	HOMA_LOCK_PEER_ACK         = 4,
+	HOMA_LOCK_BPAGE            = 5,
+	HOMA_NUM_LOCK_CLASSES      = 6
+};
+
+/* Lock wait histograms are logarithmic: bucket 0 holds waits shorter than
+ * 2^(HOMA_LOCK_MIN_SHIFT+1) cycles, bucket i (for i > 0) holds waits from
+ * 2^(HOMA_LOCK_MIN_SHIFT+i) up to twice that, and the last bucket also
+ * holds all longer waits. See homa_lock_bucket.
+ */
+#define HOMA_LOCK_MIN_SHIFT 8
+#define HOMA_NUM_LOCK_BUCKETS 16
+
+/* Maximum number of distinct (lock class, call site) pairs whose
+ * contention can be recorded on each core.
+ */
+#define HOMA_MAX_LOCK_SITES 64
+
+/**
+ * struct homa_lock_site - Contention statistics for one kind of lock
+ * when acquired from one call site (as identified by the locker string
+ * passed to functions such as homa_sock_lock).
+ */
+struct homa_lock_site {
+	/**
+	 * @locker: static string identifying the call site; NULL means
+	 * this entry is unused.
+	 */
+	char *locker;
+
+	/** @lock_class: kind of lock (a value of enum homa_lock_class). */
+	int lock_class;
+
+	/**
+	 * @misses: total number of times the lock was not immediately
+	 * available at this call site.
+	 */
+	__u64 misses;
+
+	/** @miss_cycles: total time spent waiting for those misses. */
+	__u64 miss_cycles;
+
+	/**
+	 * @histogram: entry i holds the number of misses whose wait
+	 * time falls in bucket i (see homa_lock_bucket).
+	 */
+	__u64 histogram[HOMA_NUM_LOCK_BUCKETS];
+};
+
 /**
  * struct homa_core - Homa allocates one of these structures for each
  * core, to hold information that needs to be kept on a per-core basis.
@@ -2810,8 +3744,9 @@ struct homa_core {
 
 	/**
 	 * @softirq_backlog: the number of batches of packets that have
-	 * been queued for SoftIRQ processing on this core but haven't
-	 * yet been processed.
+	 * been steered to this core by homa_set_softirq_cpu but haven't
+	 * yet been processed by homa_softirq. Batches that reach SoftIRQ
+	 * without Homa steering aren't counted.
 	 */
 	atomic_t softirq_backlog;
 
@@ -2831,6 +3766,42 @@ struct homa_core {
 #define NUM_GEN3_SOFTIRQ_CORES 3
 	int gen3_softirq_cores[NUM_GEN3_SOFTIRQ_CORES];
 
+	/**
+	 * @gen3_num_cores: when HOMA_GRO_GEN3_ADAPTIVE is set, only this
+	 * many of the entries at the beginning of @gen3_softirq_cores are
+	 * currently used for SoftIRQ; 0 means SoftIRQ processing happens
+	 * on this (the GRO) core.
+	 */
+	int gen3_num_cores;
+
+	/**
+	 * @gen3_last_adapt: time (in get_cycles() units) of the most recent
+	 * call to homa_gro_gen3_adapt for this core.
+	 */
+	__u64 gen3_last_adapt;
+
+	/**
+	 * @gen3_prev_softirq: the values of metrics.softirq_cycles for this
+	 * core (element 0) and for each of the cores in @gen3_softirq_cores
+	 * (elements 1 and up) as of @gen3_last_adapt.
+	 */
+	__u64 gen3_prev_softirq[NUM_GEN3_SOFTIRQ_CORES + 1];
+
+	/**
+	 * @rfs_core: when HOMA_GRO_RFS is set, SoftIRQ processing for packets
+	 * destined to a thread waiting on this core will be performed on
+	 * this core, which shares cache with this one (see
+	 * homa_rfs_default_cores).
+	 */
+	int rfs_core;
+
+	/**
+	 * @busy_poller: if non-NULL, the thread that is currently busy-polling
+	 * the NIC on this core (via napi_busy_loop). Packets received by that
+	 * thread are processed by SoftIRQ on the same core.
+	 */
+	struct task_struct *busy_poller;
+
 	/**
 	 * @last_app_active: the most recent time (get_cycles() units)
 	 * when an application was actively using Homa on this core (e.g.,
@@ -2872,6 +3843,13 @@ struct homa_core {
 	 */
 	int rpcs_locked;
 
+	/**
+	 * @lock_sites: lock contention statistics for this core, broken
+	 * down by lock class and call site. Kept as an open hash table
+	 * (see homa_lock_miss); reported by homa_print_metrics.
+	 */
+	struct homa_lock_site lock_sites[HOMA_MAX_LOCK_SITES];
+
 	/** @metrics: performance statistics for this core. */
 	struct homa_metrics metrics;
 };
@@ -2902,9 +3880,120 @@ struct homa_skb_info {
 	int data_bytes;
 };
 
+/**
+ * define HOMA_SOFTIRQ_GROUPS - Maximum number of distinct RPCs that
+ * homa_softirq can group in a single pass over a batch of packets; if
+ * a batch contains more RPCs than this, additional passes are made.
+ */
+#define HOMA_SOFTIRQ_GROUPS 16
+
+/**
+ * define HOMA_SOFTIRQ_HASH_BITS - log2 of the number of buckets in the
+ * hash table homa_softirq uses to find the group for a packet.
+ */
+#define HOMA_SOFTIRQ_HASH_BITS 5
+
+/**
+ * struct homa_softirq_group - Used by homa_softirq to collect all of the
+ * packets in a batch that belong to the same RPC. These structures are
+ * allocated on the stack.
+ */
+struct homa_softirq_group {
+	/** @saddr: Source address of the packets in the group. */
+	struct in6_addr saddr;
+
+	/** @sender_id: sender_id field from the packets in the group. */
+	__be64 sender_id;
+
+	/**
+	 * @head: First packet in the group; packets are linked through
+	 * skb->next, in order of arrival.
+	 */
+	struct sk_buff *head;
+
+	/** @tail: Points to the next field of the last packet in the group. */
+	struct sk_buff **tail;
+
+	/**
+	 * @next: Index of the next group in the same hash bucket, or -1
+	 * for end of list.
+	 */
+	int next;
+};
+
 #define INC_METRIC(metric, count) \
 		(homa_cores[raw_smp_processor_id()]->metrics.metric) += (count)
 
+/**
+ * homa_latency_bucket() - Return the index of the bucket in a latency
+ * histogram (such as homa_metrics.client_rpc_latency) that holds a given
+ * elapsed time.
+ * @cycles:   The elapsed time, in get_cycles() units.
+ */
+static inline int homa_latency_bucket(__u64 cycles)
+{
+	int exp, bucket;
+
+	if (cycles < (1ULL << HOMA_LATENCY_MIN_SHIFT))
+		return 0;
+	exp = fls64(cycles) - 1;
+	bucket = ((exp - HOMA_LATENCY_MIN_SHIFT) << HOMA_LATENCY_SUB_SHIFT)
+			+ ((cycles >> (exp - HOMA_LATENCY_SUB_SHIFT))
+			& ((1 << HOMA_LATENCY_SUB_SHIFT) - 1));
+	if (bucket >= HOMA_NUM_LATENCY_BUCKETS)
+		bucket = HOMA_NUM_LATENCY_BUCKETS - 1;
+	return bucket;
+}
+
+/**
+ * homa_latency_bucket_min() - Return the smallest elapsed time (in
+ * get_cycles() units) that falls in a given latency histogram bucket.
+ * @bucket:   Index of a bucket in a latency histogram.
+ */
+static inline __u64 homa_latency_bucket_min(int bucket)
+{
+	int exp = HOMA_LATENCY_MIN_SHIFT + (bucket >> HOMA_LATENCY_SUB_SHIFT);
+
+	if (bucket == 0)
+		return 0;
+	return (1ULL << exp) + (((__u64) (bucket
+			& ((1 << HOMA_LATENCY_SUB_SHIFT) - 1)))
+			<< (exp - HOMA_LATENCY_SUB_SHIFT));
+}
+
+/**
+ * homa_latency_size_class() - Return the size class to use for an RPC's
+ * latency in histograms such as homa_metrics.client_rpc_latency.
+ * @length:   Number of bytes in the RPC's request message.
+ */
+static inline int homa_latency_size_class(int length)
+{
+	int class, limit = HOMA_LATENCY_SIZE_BASE;
+
+	for (class = 0; class < HOMA_NUM_SIZE_CLASSES - 1; class++) {
+		if (length < limit)
+			break;
+		limit *= 10;
+	}
+	return class;
+}
+
+/**
+ * homa_lock_bucket() - Return the index of the bucket in a lock wait
+ * histogram (homa_lock_site.histogram) that holds a given wait time.
+ * @cycles:   The time spent waiting for a lock, in get_cycles() units.
+ */
+static inline int homa_lock_bucket(__u64 cycles)
+{
+	int bucket = fls64(cycles >> HOMA_LOCK_MIN_SHIFT) - 1;
+
+	if (bucket < 0)
+		return 0;
+	if (bucket >= HOMA_NUM_LOCK_BUCKETS)
+		return HOMA_NUM_LOCK_BUCKETS - 1;
+	return bucket;
+}
+
 /**
  * homa_get_skb_info() - Return the address of Homa's private information
  * for an sk_buff.
@@ -2916,6 +4005,62 @@ static inline struct homa_skb_info *homa_get_skb_info(struct sk_buff *skb)
 			- sizeof(struct homa_skb_info));
 }
 
+/**
+ * homa_set_rcv_cycles() - Record in an incoming packet the time when it
+ * reached a particular stage of Homa's receive pipeline. The time is kept
+ * in the unused1 and unused2 fields of the packet's Homa header: skb->cb
+ * belongs to GRO until the packet reaches homa_softirq, and skb->tstamp
+ * belongs to the rest of the stack.
+ * @skb:      Incoming packet; its Homa header must be in the linear part
+ *            of the packet.
+ * @cycles:   Time to record, in get_cycles() units.
+ */
+static inline void homa_set_rcv_cycles(struct sk_buff *skb, __u64 cycles)
+{
+	struct common_header *h = (struct common_header *)
+			skb_transport_header(skb);
+
+	memcpy(&h->unused1, &cycles, sizeof(cycles));
+}
+
+/**
+ * homa_get_rcv_cycles() - Return the time most recently recorded in an
+ * incoming packet by homa_set_rcv_cycles. Packets that didn't pass through
+ * homa_gro_receive contain whatever the sender left in these fields.
+ * @skb:      Incoming packet.
+ */
+static inline __u64 homa_get_rcv_cycles(struct sk_buff *skb)
+{
+	struct common_header *h = (struct common_header *)
+			skb_transport_header(skb);
+	__u64 cycles;
+
+	memcpy(&cycles, &h->unused1, sizeof(cycles));
+	return cycles;
+}
+
+/**
+ * homa_grant_extra() - Returns the location of the extra grants in a GRANT
+ * packet (they follow the valid acks, so @h->num_acks must already be set).
+ * @h:      Header of the GRANT packet.
+ */
+static inline struct homa_extra_grant *homa_grant_extra(struct grant_header *h)
+{
+	return (struct homa_extra_grant *) &h->acks[h->num_acks];
+}
+
+/**
+ * homa_grant_length() - Returns the number of bytes to transmit for a
+ * GRANT packet, which includes only its valid acks and extra grants.
+ * @h:      Header of the GRANT packet.
+ */
+static inline int homa_grant_length(struct grant_header *h)
+{
+	return offsetof(struct grant_header, acks)
+			+ h->num_acks * sizeof32(struct homa_ack)
+			+ h->num_extra * sizeof32(struct homa_extra_grant);
+}
+
 /**
  * homa_is_client(): returns true if we are the client for a particular RPC,
  * false if we are the server.
@@ -2940,20 +4085,63 @@ static inline __u64 homa_local_id(__be64 sender_id)
 	return be64_to_cpu(sender_id) ^ 1;
 }
 
+/**
+ * homa_peer_set_napi_id() - Record the NIC queue on which a packet from
+ * a peer arrived, for use in busy polling.
+ * @peer:   Peer that sent @skb.
+ * @skb:    Incoming packet.
+ */
+static inline void homa_peer_set_napi_id(struct homa_peer *peer,
+		struct sk_buff *skb)
+{
+#ifdef CONFIG_NET_RX_BUSY_POLL
+	if (unlikely(peer->napi_id != skb->napi_id)
+			&& (skb->napi_id >= MIN_NAPI_ID))
+		WRITE_ONCE(peer->napi_id, skb->napi_id);
+#endif
+}
+
+/**
+ * homa_rfs_index() - Return the index in homa->rfs_table to use for a
+ * given RPC.
+ * @id:   Local identifier for a client RPC.
+ */
+static inline int homa_rfs_index(__u64 id)
+{
+	/* Client ids are always even, so the low-order bit is useless. */
+	return (id >> 1) & (HOMA_RFS_ENTRIES - 1);
+}
+
+/**
+ * homa_rfs_record() - Record the core on which a thread is waiting for
+ * a given client RPC, so that homa_gro_rfs can steer packets for the
+ * RPC toward that core.
+ * @homa:   Overall data about the Homa protocol implementation.
+ * @id:     Local identifier for the RPC.
+ * @core:   Core on which the waiting thread is running.
+ */
+static inline void homa_rfs_record(struct homa *homa, __u64 id, int core)
+{
+	__u64 entry = (id << 16) | (core & 0xffff);
+
+	if (READ_ONCE(homa->rfs_table[homa_rfs_index(id)]) != entry)
+		WRITE_ONCE(homa->rfs_table[homa_rfs_index(id)], entry);
+}
+
 /**
  * homa_bucket_lock() - Acquire the lock for an RPC hash table bucket.
  * @bucket:    Bucket to lock
  * @id:        ID of the RPC that is requesting the lock. Normally ignored,
  *             but used occasionally for diagnostics and debugging.
- * @locker:    Static string identifying the locking code. Normally ignored,
- *             but used occasionally for diagnostics and debugging.
+ * @locker:    Static string identifying the locking code. Used to attribute
+ *             contention (see homa_lock_miss).
  */
 inline static void homa_bucket_lock(struct homa_rpc_bucket *bucket,
 		__u64 id, char *locker)
 {
 	int core = raw_smp_processor_id();
 	if (!spin_trylock_bh(&bucket->lock))
-		homa_bucket_lock_slow(bucket, id);
+		homa_bucket_lock_slow(bucket, id, locker);
 	homa_cores[core]->rpcs_locked ++;
 	BUG_ON(homa_cores[core]->rpcs_locked > 1);
 }
@@ -3103,13 +4291,13 @@ static inline struct homa_sock *homa_sk(const struct sock *sk)
  * isn't immediately available, record stats on the waiting time.
  * @hsk:     Socket to lock.
  * @locker:  Static string identifying where the socket was locked;
- *           used to track down deadlocks.
+ *           used to track down deadlocks and to attribute contention.
  */
 static inline void homa_sock_lock(struct homa_sock *hsk, char *locker) {
 	if (!spin_trylock_bh(&hsk->lock)) {
 //		printk(KERN_NOTICE "Slow path for socket %d, last locker %s",
 //				hsk->client_port, hsk->last_locker);
-		homa_sock_lock_slow(hsk);
+		homa_sock_lock_slow(hsk, locker);
 	}
 //	hsk->last_locker = locker;
 }
@@ -3126,11 +4314,13 @@ static inline void homa_sock_unlock(struct homa_sock *hsk) {
  * homa_peer_lock() - Acquire the lock for a peer's @unacked_lock. If the lock
  * isn't immediately available, record stats on the waiting time.
  * @peer:    Peer to lock.
+ * @locker:  Static string identifying the locking code; used to attribute
+ *           contention.
  */
-static inline void homa_peer_lock(struct homa_peer *peer)
+static inline void homa_peer_lock(struct homa_peer *peer, char *locker)
 {
 	if (!spin_trylock_bh(&peer->ack_lock)) {
-		homa_peer_lock_slow(peer);
+		homa_peer_lock_slow(peer, locker);
 	}
 }
 
@@ -3182,19 +4372,22 @@ static inline void homa_unprotect_rpcs(struct homa_sock *hsk)
  * @homa:    Overall data about the Homa protocol implementation.
  * @recalc:  Nonzero means the caller is homa_grant_recalc; if another thread
  *           is already recalculating, can return without waiting for the lock.
+ * @locker:  Static string identifying the locking code; used to attribute
+ *           contention.
  * Return:   Nonzero means this thread now owns the grantable lock. Zero
  *           means the lock was not acquired and there is no need for this
  *           thread to do the work of homa_grant_recalc because some other
  *           thread started a fresh calculation after this method was invoked.
  */
-static inline int homa_grantable_lock(struct homa *homa, int recalc)
+static inline int homa_grantable_lock(struct homa *homa, int recalc,
+		char *locker)
 {
 	int result;
 
 	if (spin_trylock_bh(&homa->grantable_lock))
 		result = 1;
 	else
-		result = homa_grantable_lock_slow(homa, recalc);
+		result = homa_grantable_lock_slow(homa, recalc, locker);
 	homa->grantable_lock_time = get_cycles();
 	return result;
 }
@@ -3214,11 +4407,13 @@ static inline void homa_grantable_unlock(struct homa *homa)
  * homa_throttle_lock() - Acquire the throttle lock. If the lock
  * isn't immediately available, record stats on the waiting time.
  * @homa:    Overall data about the Homa protocol implementation.
+ * @locker:  Static string identifying the locking code; used to attribute
+ *           contention.
  */
-static inline void homa_throttle_lock(struct homa *homa)
+static inline void homa_throttle_lock(struct homa *homa, char *locker)
 {
 	if (!spin_trylock_bh(&homa->throttle_lock)) {
-		homa_throttle_lock_slow(homa);
+		homa_throttle_lock_slow(homa, locker);
 	}
 }
 
@@ -3336,10 +4531,14 @@ extern void     homa_ack_pkt(struct sk_buff *skb, struct homa_sock *hsk,
 extern void     homa_add_packet(struct homa_rpc *rpc, struct sk_buff *skb);
 extern void     homa_add_to_throttled(struct homa_rpc *rpc);
 extern void     homa_append_metric(struct homa *homa, const char* format, ...);
+extern void     homa_apply_grant(struct homa_rpc *rpc, int offset,
+		    int priority, int resend_all);
 extern int      homa_backlog_rcv(struct sock *sk, struct sk_buff *skb);
 extern int      homa_bind(struct socket *sk, struct sockaddr *addr,
                     int addr_len);
 extern void     homa_bucket_unlock(struct homa_rpc_bucket *bucket, __u64 id);
+extern int      homa_busy_poll(struct homa_sock *hsk,
+		    struct homa_interest *interest);
 extern void     homa_check_rpc(struct homa_rpc *rpc);
 extern int      homa_check_nic_queue(struct homa *homa, struct sk_buff *skb,
                     bool force);
@@ -3350,6 +4549,7 @@ extern struct homa_interest
 	            int offset);
 extern void     homa_close(struct sock *sock, long timeout);
 extern int      homa_copy_to_user(struct homa_rpc *rpc);
+extern int      homa_cpu_topology(int cpu, int *phys, int *llc, int *node);
 extern void     homa_cutoffs_pkt(struct sk_buff *skb, struct homa_sock *hsk);
 extern void     homa_data_from_server(struct sk_buff *skb,
                     struct homa_rpc *crpc);
@@ -3362,9 +4562,17 @@ extern int      homa_dointvec(struct ctl_table *table, int write,
                     void __user *buffer, size_t *lenp, loff_t *ppos);
 extern void     homa_dst_refresh(struct homa_peertab *peertab,
                     struct homa_peer *peer, struct homa_sock *hsk);
+extern int      homa_engine_main(void *transportInfo);
+extern int      homa_engine_run_once(struct homa *homa);
+extern void     homa_engine_stop(struct homa *homa);
+extern void     homa_engine_sysctl_changed(struct homa *homa);
 extern int      homa_err_handler_v4(struct sk_buff *skb, u32 info);
 extern int      homa_err_handler_v6(struct sk_buff *skb, struct inet6_skb_parm *
                     , u8,  u8,  int,  __be32);
+extern int      homa_extract_acks(struct sk_buff *skb, struct homa_ack *dst,
+		    int max);
+extern int      homa_extract_extra_grants(struct sk_buff *skb,
+		    struct homa_extra_grant *dst);
 extern struct homa_rpc
                *homa_find_client_rpc(struct homa_sock *hsk, __u64 id);
 extern struct homa_rpc
@@ -3375,6 +4583,8 @@ extern void     homa_freeze(struct homa_rpc *rpc, enum homa_freeze_type type,
 		    char *format);
 extern void     homa_freeze_peers(struct homa *homa);
 extern void     homa_gap_new(struct list_head *next, int start, int end);
+extern void     homa_gen3_choose_cores(int cpu, int exclude, int *cores);
+extern void     homa_gen3_default_cores(int exclude);
 extern int      homa_get_port(struct sock *sk, unsigned short snum);
 extern void     homa_get_resend_range(struct homa_message_in *msgin,
                     struct resend_header *resend);
@@ -3383,20 +4593,32 @@ extern int      homa_getsockopt(struct sock *sk, int level, int optname,
 extern void     homa_grant_add_rpc(struct homa_rpc *rpc);
 extern void     homa_grant_check_rpc(struct homa_rpc *rpc);
 extern void     homa_grant_find_oldest(struct homa *homa);
+extern void     homa_grant_extras(struct homa_sock *hsk,
+		    const struct in6_addr *saddr, __u16 sport,
+		    struct homa_extra_grant *grants, int count);
 extern void     homa_grant_free_rpc(struct homa_rpc *rpc);
 extern int      homa_grant_outranks(struct homa_rpc *rpc1,
 		    struct homa_rpc *rpc2);
 extern int      homa_grant_pick_rpcs(struct homa *homa, struct homa_rpc **rpcs,
 		    int max_rpcs);
 extern void     homa_grant_pkt(struct sk_buff *skb, struct homa_rpc *rpc);
+extern void     homa_grant_pregrant(struct homa_rpc *rpc, int length);
 extern void     homa_grant_recalc(struct homa *homa, int locked);
 extern void     homa_grant_remove_rpc(struct homa_rpc *rpc);
 extern int      homa_grant_send(struct homa_rpc *rpc, struct homa *homa);
+extern int      homa_grant_update_granted(struct homa_rpc *rpc,
+		    struct homa *homa);
 extern int      homa_grant_update_incoming(struct homa_rpc *rpc,
 		    struct homa *homa);
+extern void     homa_grant_xmit_batch(struct homa_rpc **rpcs,
+		    struct homa_extra_grant *grants, char *pending, int count);
+extern int      homa_gro_coalesce(struct sk_buff *held_skb,
+		    struct sk_buff *skb);
 extern int      homa_gro_complete(struct sk_buff *skb, int thoff);
 extern void     homa_gro_gen2(struct sk_buff *skb);
 extern void     homa_gro_gen3(struct sk_buff *skb);
+extern void     homa_gro_gen3_adapt(int core_id, __u64 now);
+extern int      homa_gro_rfs(struct sk_buff *skb);
 extern struct sk_buff
                *homa_gro_receive(struct list_head *gro_list,
                     struct sk_buff *skb);
@@ -3418,11 +4640,22 @@ extern int      homa_message_out_init(struct homa_rpc *rpc,
 extern loff_t   homa_metrics_lseek(struct file *file, loff_t offset,
 		    int whence);
 extern int      homa_metrics_open(struct inode *inode, struct file *file);
+extern int      homa_metrics_raw_open(struct inode *inode,
+		    struct file *file);
+extern ssize_t  homa_metrics_raw_read(struct file *file,
+		    char __user *buffer, size_t length, loff_t *offset);
+extern int      homa_metrics_raw_release(struct inode *inode,
+		    struct file *file);
 extern ssize_t  homa_metrics_read(struct file *file, char __user *buffer,
                     size_t length, loff_t *offset);
 extern int      homa_metrics_release(struct inode *inode, struct file *file);
+extern char    *homa_metrics_snapshot(int sum);
+extern int      homa_metrics_sum_open(struct inode *inode,
+		    struct file *file);
 extern void     homa_need_ack_pkt(struct sk_buff *skb, struct homa_sock *hsk,
 		    struct homa_rpc *rpc);
+extern int      homa_offload_cpu_offline(unsigned int cpu);
+extern int      homa_offload_cpu_online(unsigned int cpu);
 extern int      homa_offload_end(void);
 extern int      homa_offload_init(void);
 extern void     homa_outgoing_sysctl_changed(struct homa *homa);
@@ -3435,6 +4668,8 @@ extern struct homa_peer **
 		    int *num_peers);
 extern int      homa_peertab_init(struct homa_peertab *peertab);
 extern void     homa_peer_add_ack(struct homa_rpc *rpc);
+extern void     homa_peer_add_rtt(struct homa *homa, struct homa_peer *peer,
+		    __u64 sample);
 extern struct homa_peer
                *homa_peer_find(struct homa_peertab *peertab,
 		    const struct in6_addr *addr, struct inet_sock *inet);
@@ -3448,23 +4683,53 @@ extern void     homa_peer_set_cutoffs(struct homa_peer *peer, int c0, int c1,
 extern void     homa_peertab_gc_dsts(struct homa_peertab *peertab, __u64 now);
 extern __poll_t homa_poll(struct file *file, struct socket *sock,
                     struct poll_table_struct *wait);
+extern void     homa_poll_record_wait(struct homa_sock *hsk, __u64 wait);
+extern __u64    homa_poll_window(struct homa_sock *hsk);
+extern int      homa_pool_admit(struct homa_pool *pool,
+		    struct homa_rpc *rpc, int num_bpages);
 extern int      homa_pool_allocate(struct homa_rpc *rpc);
 extern void     homa_pool_check_waiting(struct homa_pool *pool);
 extern void     homa_pool_destroy(struct homa_pool *pool);
+extern void     homa_pool_detach(struct homa_sock *hsk);
 extern void    *homa_pool_get_buffer(struct homa_rpc *rpc, int offset,
 		    int *available);
 extern int      homa_pool_get_pages(struct homa_pool *pool, int num_pages,
-		    __u32 *pages, int leave_locked);
+		    __u32 *pages, int set_owner, int node);
 extern int      homa_pool_init(struct homa_sock *hsk, void *buf_region,
-		    __u64 region_size);
+		    __u64 region_size, __u32 bpage_size);
+extern int      homa_pool_peer_bpages(struct homa_pool *pool,
+		    struct homa_peer *peer);
+extern int      homa_pool_pop(struct homa_pool *pool, int core_num);
+extern void     homa_pool_push(struct homa_pool *pool, __u32 index);
+extern int      homa_pool_reclaim(struct homa_pool *pool, __u64 now);
 extern void     homa_pool_release_buffers(struct homa_pool *pool,
 		    int num_buffers, __u32 *buffers);
+extern int      homa_pool_share(struct homa_sock *hsk,
+		    struct homa_sock *other);
+extern int      homa_pool_steal(struct homa_pool *pool, int core_num,
+		    int node);
+extern void     homa_pool_uncharge(struct homa_rpc *rpc);
+extern int      homa_print_acks(struct homa_ack *acks, int count, int max,
+		    char *buffer, int buf_len, int used);
 extern char    *homa_print_ipv4_addr(__be32 addr);
 extern char    *homa_print_ipv6_addr(const struct in6_addr *addr);
+extern void     homa_print_lock_sites(struct homa *homa,
+		    struct homa_core *core);
+extern void     homa_print_latency(struct homa *homa, const char *kind,
+		    __u64 histogram[HOMA_NUM_SIZE_CLASSES]
+		    [HOMA_NUM_LATENCY_BUCKETS]);
 extern char    *homa_print_metrics(struct homa *homa);
 extern char    *homa_print_packet(struct sk_buff *skb, char *buffer, int buf_len);
 extern char    *homa_print_packet_short(struct sk_buff *skb, char *buffer,
                     int buf_len);
+extern void     homa_print_stage_latency(struct homa *homa,
+		    const char *name, const char *desc,
+		    __u64 histogram[HOMA_NUM_LATENCY_BUCKETS]);
+extern void     homa_prio_check(struct homa *homa);
+extern void     homa_prio_compute(struct homa *homa, int *cutoffs);
+extern void     homa_prio_deciles(struct homa_prio_tuner *tuner, int *deciles);
+extern int      homa_prio_drift(int *d1, int *d2);
+extern void     homa_prio_sysctl_changed(struct homa *homa);
 extern void     homa_prios_changed(struct homa *homa);
 extern int      homa_proc_read_metrics(char *buffer, char **start, off_t offset,
                     int count, int *eof, void *data);
@@ -3473,6 +4738,8 @@ extern int      homa_recvmsg(struct sock *sk, struct msghdr *msg, size_t len,
 extern int      homa_register_interests(struct homa_interest *interest,
                     struct homa_sock *hsk, int flags, __u64 id);
 extern void     homa_rehash(struct sock *sk);
+extern int      homa_rfs_choose_core(int cpu, int exclude);
+extern void     homa_rfs_default_cores(int exclude);
 extern void     homa_remove_from_throttled(struct homa_rpc *rpc);
 extern void     homa_resend_data(struct homa_rpc *rpc, int start, int end,
                     int priority);
@@ -3595,5 +4862,52 @@ static inline struct dst_entry *homa_get_dst(struct homa_peer *peer,
 	return peer->dst;
 }
 
+/**
+ * homa_peer_unsched_bytes() - Returns the number of bytes of a new message
+ * that may be sent to a peer without waiting for grants.
+ * @homa:   Overall data about the Homa protocol implementation.
+ * @peer:   Peer to which the message will be sent.
+ * Return:  If @homa->rtt_adaptive is set and we have an RTT estimate for
+ *          @peer, the RTT in bytes (limited by HOMA_RTT_RANGE); otherwise
+ *          @homa->unsched_bytes.
+ */
+static inline int homa_peer_unsched_bytes(struct homa *homa,
+		struct homa_peer *peer)
+{
+	int bytes = peer->rtt_bytes;
+
+	if (!homa->rtt_adaptive || (bytes == 0))
+		return homa->unsched_bytes;
+	if (bytes < homa->unsched_bytes/HOMA_RTT_RANGE)
+		bytes = homa->unsched_bytes/HOMA_RTT_RANGE;
+	if (bytes > homa->unsched_bytes*HOMA_RTT_RANGE)
+		bytes = homa->unsched_bytes*HOMA_RTT_RANGE;
+	return bytes;
+}
+
+/**
+ * homa_peer_grant_window() - Returns the maximum number of granted but
+ * not yet received bytes for a message from a peer.
+ * @homa:   Overall data about the Homa protocol implementation.
+ * @peer:   Peer that is sending the message.
+ * Return:  If @homa->rtt_adaptive is set, the window is static (nonzero
+ *          @homa->window_param), and we have an RTT estimate for @peer,
+ *          the RTT in bytes (limited by HOMA_RTT_RANGE); otherwise
+ *          @homa->grant_window.
+ */
+static inline int homa_peer_grant_window(struct homa *homa,
+		struct homa_peer *peer)
+{
+	int bytes = peer->rtt_bytes;
+
+	if (!homa->rtt_adaptive || (homa->window_param == 0) || (bytes == 0))
+		return homa->grant_window;
+	if (bytes < homa->window_param/HOMA_RTT_RANGE)
+		bytes = homa->window_param/HOMA_RTT_RANGE;
+	if (bytes > homa->window_param*HOMA_RTT_RANGE)
+		bytes = homa->window_param*HOMA_RTT_RANGE;
+	return bytes;
+}
+
 extern struct completion homa_pacer_kthread_done;
 #endif /* _HOMA_IMPL_H */
@@ -26,11 +26,19 @@ int homa_message_in_init(struct homa_rpc *rpc, int length, int unsched)
 	INIT_LIST_HEAD(&rpc->msgin.gaps);
 	rpc->msgin.bytes_remaining = length;
 	rpc->msgin.granted = (unsched > length) ? length : unsched;
-	rpc->msgin.rec_incoming = 0;
+
+	/* Note: rec_incoming isn't reset here: a client may already have
+	 * reserved incoming capacity for this message (see
+	 * homa_grant_pregrant).
+	 */
 	atomic_set(&rpc->msgin.rank, -1);
 	rpc->msgin.priority = 0;
 	rpc->msgin.resend_all = 0;
+	rpc->msgin.rtt_probe_offset = 0;
+	rpc->msgin.rtt_probe_cycles = 0;
 	rpc->msgin.num_bpages = 0;
+	rpc->msgin.charged_bpages = 0;
+	INIT_LIST_HEAD(&rpc->msgin.charged_links);
 	err = homa_pool_allocate(rpc);
 	if (err != 0)
 		return err;
@@ -187,8 +195,15 @@ int homa_copy_to_user(struct homa_rpc *rpc)
 	int error = 0;
 	int start_offset = 0;
 	int end_offset = 0;
+	int core = raw_smp_processor_id();
 	int i;
 
+	/* Remember where copying happens, so that future buffer space
+	 * for this socket can be allocated on the same NUMA node.
+	 */
+	if (READ_ONCE(rpc->hsk->copy_core) != core)
+		WRITE_ONCE(rpc->hsk->copy_core, core);
+
 	/* Tricky note: we can't hold the RPC lock while we're actually
 	 * copying to user space, because (a) it's illegal to hold a spinlock
 	 * while copying to user space and (b) we'd like for homa_softirq
@@ -344,19 +359,32 @@ void homa_dispatch_pkts(struct sk_buff *skb, struct homa *homa)
 	struct sk_buff *next;
 
 #ifdef __UNIT_TEST__
-#define MAX_ACKS 2
+#define MAX_ACKS (HOMA_MAX_CTRL_ACKS + 1)
 #else
-#define MAX_ACKS 10
+#define MAX_ACKS (4*(HOMA_MAX_CTRL_ACKS + 1))
 #endif
-	/* Used to collect acks from data packets so we can process them
+	/* Used to collect acks from data packets (and acks piggybacked on
+	 * GRANT and RESEND packets) so we can process them
 	 * all at the end (can't process them inline because that may
-	 * require locking conflicting RPCs). If we run out of space just
-	 * ignore the extra acks; they'll be regenerated later through the
-	 * explicit mechanism.
+	 * require locking conflicting RPCs). If there might not be room
+	 * for the acks in the next packet, the ones collected so far are
+	 * processed early, with the RPC lock released.
 	 */
 	struct homa_ack acks[MAX_ACKS];
 	int num_acks = 0;
 
+	/* Extra grants for other RPCs, carried in GRANT packets; they are
+	 * processed at the end for the same reason as acks (or earlier,
+	 * with the RPC lock released, if this array fills).
+	 */
+	struct homa_extra_grant grants[HOMA_MAX_EXTRA_GRANTS];
+	int num_grants = 0;
+	__u16 grant_sport = 0;
+
+	/* Extra grants from the current packet. */
+	struct homa_extra_grant extra[HOMA_MAX_EXTRA_GRANTS];
+	int num_extra;
+
 	/* Find the appropriate socket.*/
 	hsk = homa_sock_find(&homa->port_map, dport);
 	if (!hsk) {
@@ -379,12 +407,54 @@ void homa_dispatch_pkts(struct sk_buff *skb, struct homa *homa)
 		return;
 	}
 
+	/* Remember the NIC queue for busy polling (see homa_busy_poll). */
+	sk_mark_napi_id(&hsk->sock, skb);
+
 	/* Each iteration through through the following loop processes one
 	 * packet.
 	 */
 	for (; skb != NULL; skb = next) {
-		h = (struct data_header *) skb->data;
 		next = skb->next;
+		if ((num_acks > 0) && ((MAX_ACKS - num_acks)
+				< (HOMA_MAX_CTRL_ACKS + 1))) {
+			if (rpc != NULL) {
+				homa_rpc_unlock(rpc);
+				rpc = NULL;
+			}
+			while (num_acks > 0) {
+				num_acks--;
+				homa_rpc_acked(hsk, &saddr, &acks[num_acks]);
+			}
+		}
+		num_acks += homa_extract_acks(skb, &acks[num_acks],
+				MAX_ACKS - num_acks);
+		num_extra = homa_extract_extra_grants(skb, extra);
+		h = (struct data_header *) skb->data;
+
+		if (num_extra > 0) {
+			int i;
+
+			grant_sport = ntohs(h->common.sport);
+			for (i = 0; i < num_extra; i++) {
+				if (num_grants >= HOMA_MAX_EXTRA_GRANTS) {
+					/* No room for more grants; process
+					 * the ones we have now (the RPC lock
+					 * must be released to do this; it
+					 * will be reacquired below).
+					 */
+					if (rpc != NULL) {
+						homa_rpc_unlock(rpc);
+						rpc = NULL;
+					}
+					homa_grant_extras(hsk, &saddr,
+							grant_sport, grants,
+							num_grants);
+					num_grants = 0;
+				}
+				grants[num_grants] = extra[i];
+				num_grants++;
+			}
+		}
 
 		/* Relinquish the RPC lock temporarily if it's needed
 		 * elsewhere.
@@ -446,6 +516,7 @@ void homa_dispatch_pkts(struct sk_buff *skb, struct homa *homa)
 					|| (h->common.type == BUSY))
 				rpc->silent_ticks = 0;
 			rpc->peer->outstanding_resends = 0;
+			homa_peer_set_napi_id(rpc->peer, skb);
 		}
 
 		switch (h->common.type) {
@@ -517,6 +588,15 @@ void homa_dispatch_pkts(struct sk_buff *skb, struct homa *homa)
 		homa_rpc_acked(hsk, &saddr, &acks[num_acks]);
 	}
 
+	if (num_grants > 0)
+		homa_grant_extras(hsk, &saddr, grant_sport, grants,
+				num_grants);
+
+	/* Messages that completed (or RPCs freed by acks) may have released
+	 * their peers' holds on buffer space (see homa_pool_uncharge).
+	 */
+	homa_pool_check_waiting(hsk->buffer_pool);
+
 	if (hsk->dead_skbs >= 2*hsk->homa->dead_buffs_limit) {
 		/* We get here if neither homa_wait_for_message
 		 * nor homa_timer can keep up with reaping dead
@@ -531,6 +611,81 @@ void homa_dispatch_pkts(struct sk_buff *skb, struct homa *homa)
 	}
 }
 
+/**
+ * homa_extract_acks() - Copy out any acks piggybacked on a GRANT or
+ * RESEND packet.
+ * @skb:     Incoming packet; its fixed header has already been pulled.
+ *           Note: skb->data may change during this function.
+ * @dst:     The acks are copied here.
+ * @max:     Maximum number of acks to store at @dst; any additional acks
+ *           are discarded (the server will eventually ask for them again
+ *           with NEED_ACK).
+ *
+ * Return:   The number of acks stored at @dst.
+ */
+int homa_extract_acks(struct sk_buff *skb, struct homa_ack *dst, int max)
+{
+	struct common_header *h = (struct common_header *) skb->data;
+	int offset, count;
+
+	if (h->type == GRANT) {
+		offset = offsetof(struct grant_header, acks);
+		count = ((struct grant_header *) h)->num_acks;
+	} else if (h->type == RESEND) {
+		offset = offsetof(struct resend_header, acks);
+		count = ((struct resend_header *) h)->num_acks;
+	} else
+		return 0;
+	if (count > HOMA_MAX_CTRL_ACKS)
+		count = HOMA_MAX_CTRL_ACKS;
+	if (count > (int) (skb->len - offset) / sizeof32(struct homa_ack))
+		count = (skb->len - offset) / sizeof32(struct homa_ack);
+	if (count > max)
+		count = max;
+	if (count <= 0)
+		return 0;
+	if (!pskb_may_pull(skb, offset + count * sizeof32(struct homa_ack)))
+		return 0;
+	memcpy(dst, skb->data + offset, count * sizeof(struct homa_ack));
+	return count;
+}
+
+/**
+ * homa_extract_extra_grants() - Copy out any grants for other RPCs that
+ * are carried in a GRANT packet (they follow the packet's acks).
+ * @skb:     Incoming packet; its fixed header has already been pulled.
+ *           Note: skb->data may change during this function.
+ * @dst:     The grants are copied here; must have space for
+ *           HOMA_MAX_EXTRA_GRANTS entries.
+ *
+ * Return:   The number of grants stored at @dst.
+ */
+int homa_extract_extra_grants(struct sk_buff *skb,
+		struct homa_extra_grant *dst)
+{
+	struct grant_header *h = (struct grant_header *) skb->data;
+	int offset, count;
+
+	if (h->common.type != GRANT)
+		return 0;
+	offset = offsetof(struct grant_header, acks)
+			+ h->num_acks * sizeof32(struct homa_ack);
+	count = h->num_extra;
+	if (count > HOMA_MAX_EXTRA_GRANTS)
+		count = HOMA_MAX_EXTRA_GRANTS;
+	if (count > (int) (skb->len - offset)
+			/ sizeof32(struct homa_extra_grant))
+		count = (skb->len - offset) / sizeof32(struct homa_extra_grant);
+	if (count <= 0)
+		return 0;
+	if (!pskb_may_pull(skb, offset
+			+ count * sizeof32(struct homa_extra_grant)))
+		return 0;
+	memcpy(dst, skb->data + offset,
+			count * sizeof(struct homa_extra_grant));
+	return count;
+}
+
 /**
  * homa_data_pkt() - Handler for incoming DATA packets
  * @skb:     Incoming packet; size known to be large enough for the header.
@@ -542,6 +697,7 @@ void homa_data_pkt(struct sk_buff *skb, struct homa_rpc *rpc)
 {
 	struct homa *homa = rpc->hsk->homa;
 	struct data_header *h = (struct data_header *) skb->data;
+	__u64 dispatch_cycles = homa_get_rcv_cycles(skb);
 
 	tt_record4("incoming data packet, id %d, peer 0x%x, offset %d/%d",
 			homa_local_id(h->common.sender_id),
@@ -581,11 +737,24 @@ void homa_data_pkt(struct sk_buff *skb, struct homa_rpc *rpc)
 		goto discard;
 	}
 
+	if ((rpc->msgin.rtt_probe_offset != 0)
+			&& (ntohl(h->seg.offset) >= rpc->msgin.rtt_probe_offset)) {
+		/* This data could only be sent after the sender received
+		 * our grant, so it provides a round-trip time sample.
+		 */
+		homa_peer_add_rtt(homa, rpc->peer,
+				get_cycles() - rpc->msgin.rtt_probe_cycles);
+		rpc->msgin.rtt_probe_offset = 0;
+	}
+
 	homa_add_packet(rpc, skb);
+	if (rpc->msgin.bytes_remaining == 0)
+		homa_pool_uncharge(rpc);
 
 	if ((skb_queue_len(&rpc->msgin.packets) != 0)
 			&& !(atomic_read(&rpc->flags) & RPC_PKTS_READY)) {
 		atomic_or(RPC_PKTS_READY, &rpc->flags);
+		rpc->dispatch_cycles = dispatch_cycles;
 		homa_sock_lock(rpc->hsk, "homa_data_pkt");
 		homa_rpc_handoff(rpc);
 		homa_sock_unlock(rpc->hsk);
@@ -620,11 +789,54 @@ void homa_data_pkt(struct sk_buff *skb, struct homa_rpc *rpc)
 	UNIT_LOG("; ", "homa_data_pkt discarded packet");
 }
 
+/**
+ * homa_apply_grant() - Update an outgoing message to reflect a grant
+ * received from its destination, and transmit any newly granted data.
+ * @rpc:         RPC whose outgoing message was granted. Must be locked
+ *               by the caller.
+ * @offset:      All bytes of the message up to (but not including) this
+ *               offset may now be transmitted.
+ * @priority:    Priority to use for future scheduled packets.
+ * @resend_all:  Nonzero means all previously transmitted data must be
+ *               retransmitted.
+ */
+void homa_apply_grant(struct homa_rpc *rpc, int offset, int priority,
+		int resend_all)
+{
+	if (rpc->state != RPC_OUTGOING)
+		return;
+	if (resend_all)
+		homa_resend_data(rpc, 0, rpc->msgout.next_xmit_offset,
+				priority);
+
+	if ((rpc->msgout.granted == rpc->msgout.unscheduled)
+			&& (offset > rpc->msgout.granted)
+			&& (rpc->msgout.next_xmit_offset > 0)) {
+		/* First grant for this message: the time since its first
+		 * packet was transmitted is a round-trip time sample.
+		 */
+		homa_peer_add_rtt(rpc->hsk->homa, rpc->peer, get_cycles()
+				- rpc->msgout.rtt_probe_cycles);
+	}
+	if (offset > rpc->msgout.granted) {
+		rpc->msgout.granted = offset;
+		if (offset > rpc->msgout.length)
+			rpc->msgout.granted = rpc->msgout.length;
+	}
+	rpc->msgout.sched_priority = priority;
+	homa_xmit_data(rpc, false);
+}
+
 /**
  * homa_grant_pkt() - Handler for incoming GRANT packets
  * @skb:     Incoming packet; size already verified large enough for header.
  *           This function now owns the packet.
  * @rpc:     Information about the RPC corresponding to this packet.
+ *
+ * Only the grant for @rpc is processed here; the caller must extract any
+ * extra grants for other RPCs (see homa_extract_extra_grants) before
+ * invoking this function and pass them to homa_grant_extras once @rpc
+ * has been unlocked.
  */
 void homa_grant_pkt(struct sk_buff *skb, struct homa_rpc *rpc)
 {
@@ -634,22 +846,48 @@ void homa_grant_pkt(struct sk_buff *skb, struct homa_rpc *rpc)
 			"resend_all %d",
 			homa_local_id(h->common.sender_id), ntohl(h->offset),
 			h->priority, h->resend_all);
-	if (rpc->state == RPC_OUTGOING) {
-		int new_offset = ntohl(h->offset);
+	homa_apply_grant(rpc, ntohl(h->offset), h->priority, h->resend_all);
+	homa_skb_free(skb);
+}
 
-		if (h->resend_all)
-			homa_resend_data(rpc, 0, rpc->msgout.next_xmit_offset,
-					h->priority);
+/**
+ * homa_grant_extras() - Process grants for additional RPCs that arrived
+ * in GRANT packets (see homa_extract_extra_grants).
+ * @hsk:     Socket on which the GRANT packets arrived.
+ * @saddr:   Address of the host that sent the packets.
+ * @sport:   Port on @saddr from which the packets were sent.
+ * @grants:  The extra grants.
+ * @count:   Number of entries in @grants.
+ *
+ * No RPC locks may be held by the caller: the lock for each RPC is
+ * acquired here.
+ */
+void homa_grant_extras(struct homa_sock *hsk, const struct in6_addr *saddr,
+		__u16 sport, struct homa_extra_grant *grants, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		__u64 id = homa_local_id(grants[i].id);
+		struct homa_rpc *rpc;
 
-		if (new_offset > rpc->msgout.granted) {
-			rpc->msgout.granted = new_offset;
-			if (new_offset > rpc->msgout.length)
-				rpc->msgout.granted = rpc->msgout.length;
+		if (homa_is_client(id))
+			rpc = homa_find_client_rpc(hsk, id);
+		else
+			rpc = homa_find_server_rpc(hsk, saddr, sport, id);
+		if (rpc == NULL) {
+			tt_record2("Discarding extra grant for unknown RPC, "
+					"id %u, peer 0x%x", id, tt_addr(*saddr));
+			continue;
 		}
-		rpc->msgout.sched_priority = h->priority;
-		homa_xmit_data(rpc, false);
+		tt_record3("processing extra grant for id %llu, offset %d, "
+				"priority %d", id, ntohl(grants[i].offset),
+				grants[i].priority);
+		rpc->silent_ticks = 0;
+		homa_apply_grant(rpc, ntohl(grants[i].offset),
+				grants[i].priority, 0);
+		homa_rpc_unlock(rpc);
 	}
-	homa_skb_free(skb);
 }
 
 /**
@@ -666,6 +904,7 @@ void homa_resend_pkt(struct sk_buff *skb, struct homa_rpc *rpc,
 {
 	struct resend_header *h = (struct resend_header *) skb->data;
 	const struct in6_addr saddr = skb_canonical_ipv6_saddr(skb);
+	struct resend_header resend;
 	struct busy_header busy;
 
 	if (rpc == NULL) {
@@ -686,14 +925,21 @@ void homa_resend_pkt(struct sk_buff *skb, struct homa_rpc *rpc,
 		 * all of the bytes we've granted then request a resend
 		 * of the missing bytes; otherwise just send a BUSY.
 		 */
-		homa_get_resend_range(&rpc->msgin, h);
-		if (ntohl(h->length) > 0) {
+		memcpy(&resend, h, offsetof(struct resend_header, acks));
+		homa_get_resend_range(&rpc->msgin, &resend);
+		if (ntohl(resend.length) > 0) {
 			tt_record4("sending RESEND from resend RPC id %llu, "
 					"client 0x%x:%d offset %d",
 					rpc->id, tt_addr(rpc->peer->addr),
-					rpc->dport, ntohl(h->offset));
-			h->priority = rpc->hsk->homa->num_priorities -1;
-			homa_xmit_control(RESEND, h, sizeof(*h), rpc);
+					rpc->dport, ntohl(resend.offset));
+			resend.priority = rpc->hsk->homa->num_priorities -1;
+			resend.num_acks = homa_peer_get_acks(rpc->peer,
+					HOMA_MAX_CTRL_ACKS, resend.acks);
+			INC_METRIC(piggybacked_acks, resend.num_acks);
+			homa_xmit_control(RESEND, &resend,
+					offsetof(struct resend_header, acks)
+					+ resend.num_acks
+					* sizeof(struct homa_ack), rpc);
 		} else {
 			tt_record2("sending BUSY from resend, id %d, state %d",
 					rpc->id, rpc->state);
@@ -847,7 +1093,9 @@ void homa_need_ack_pkt(struct sk_buff *skb, struct homa_sock *hsk,
 	ack.common.sender_id = cpu_to_be64(id);
 	ack.num_acks = htons(homa_peer_get_acks(peer,
 			NUM_PEER_UNACKED_IDS, ack.acks));
-	__homa_xmit_control(&ack, sizeof(ack), peer, hsk);
+	__homa_xmit_control(&ack, offsetof(struct ack_header, acks)
+			+ ntohs(ack.num_acks) * sizeof(struct homa_ack),
+			peer, hsk);
 	tt_record3("Responded to NEED_ACK for id %d, peer %0x%x with %d "
 			"other acks", id, tt_addr(saddr), ntohs(ack.num_acks));
 
@@ -877,7 +1125,20 @@ void homa_ack_pkt(struct sk_buff *skb, struct homa_sock *hsk,
 		homa_rpc_unlock(rpc);
 	}
 
+	/* Only the valid acks are transmitted, so make sure they're all
+	 * present before using them.
+	 */
 	count = ntohs(h->num_acks);
+	if (count > NUM_PEER_UNACKED_IDS)
+		count = NUM_PEER_UNACKED_IDS;
+	if (count > (int) (skb->len - offsetof(struct ack_header, acks))
+			/ sizeof32(struct homa_ack))
+		count = (skb->len - offsetof(struct ack_header, acks))
+				/ sizeof32(struct homa_ack);
+	if ((count > 0) && !pskb_may_pull(skb, offsetof(struct ack_header,
+			acks) + count * sizeof32(struct homa_ack)))
+		count = 0;
+	h = (struct ack_header *) skb->data;
 	for (i = 0; i < count; i++)
 		homa_rpc_acked(hsk, &saddr, &h->acks[i]);
 	tt_record3("ACK received for id %d, peer 0x%x, with %d other acks",
@@ -1129,6 +1390,9 @@ int homa_register_interests(struct homa_interest *interest,
 			goto claim_rpc;
 		rpc->interest = interest;
 		interest->reg_rpc = rpc;
+		interest->peer = rpc->peer;
+		if (hsk->homa->gro_policy & HOMA_GRO_RFS)
+			homa_rfs_record(hsk->homa, id, interest->core);
 		homa_rpc_unlock(rpc);
 	}
 
@@ -1189,6 +1453,110 @@ int homa_register_interests(struct homa_interest *interest,
 	return 0;
 }
 
+/**
+ * homa_busy_poll() - Invoked by homa_wait_for_message while it polls for an
+ * incoming message. If busy polling is enabled for the socket, runs one
+ * pass of NAPI polling for the NIC queue where the awaited message is
+ * likely to arrive, so that packets don't have to wait for an interrupt
+ * and SoftIRQ handoff; the packets are processed on the current core.
+ * @hsk:       Socket on which the thread is waiting.
+ * @interest:  Describes what the thread is waiting for. If it is waiting
+ *             for a specific RPC, the queue used by that RPC's peer is
+ *             polled; otherwise the queue where the socket most recently
+ *             received packets is polled.
+ *
+ * Return:     Nonzero means the NIC was polled; zero means busy polling
+ *             isn't enabled or no NIC queue is known.
+ */
+int homa_busy_poll(struct homa_sock *hsk, struct homa_interest *interest)
+{
+#ifdef CONFIG_NET_RX_BUSY_POLL
+	struct sock *sk = &hsk->sock;
+	struct homa_core *core;
+	unsigned int napi_id = 0;
+
+	if (!READ_ONCE(sk->sk_ll_usec))
+		return 0;
+	if (interest->peer)
+		napi_id = READ_ONCE(interest->peer->napi_id);
+	if (napi_id < MIN_NAPI_ID)
+		napi_id = READ_ONCE(sk->sk_napi_id);
+	if (napi_id < MIN_NAPI_ID)
+		return 0;
+
+	/* The busy_poller field tells homa_gro_complete to keep SoftIRQ
+	 * processing on this core. If this thread migrates before polling,
+	 * the field won't match and packets are steered normally.
+	 */
+	core = homa_cores[raw_smp_processor_id()];
+	core->busy_poller = current;
+	napi_busy_loop(napi_id, NULL, NULL, READ_ONCE(sk->sk_prefer_busy_poll),
+			READ_ONCE(sk->sk_busy_poll_budget) ?: BUSY_POLL_BUDGET);
+	core->busy_poller = NULL;
+	INC_METRIC(busy_polls, 1);
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+/**
+ * homa_poll_window() - Compute how long homa_wait_for_message should poll
+ * before going to sleep, based on how long threads have recently waited
+ * for messages on a socket. If messages usually take much longer than
+ * poll_usecs to arrive, polling just wastes a core, so don't poll at all;
+ * if messages usually arrive quickly, there's no need to poll for the
+ * full poll_usecs.
+ * @hsk:     Socket on which a thread is about to wait.
+ *
+ * Return:   Number of get_cycles units to poll (may be 0).
+ */
+__u64 homa_poll_window(struct homa_sock *hsk)
+{
+	struct homa *homa = hsk->homa;
+	__u64 max = homa->poll_cycles;
+	__u64 avg = READ_ONCE(hsk->avg_wait_cycles);
+
+	if (!homa->poll_adaptive || (avg == 0))
+		return max;
+	if (avg > 2*max) {
+		INC_METRIC(poll_skips, 1);
+		return 0;
+	}
+	if (2*avg < max) {
+		INC_METRIC(poll_shortened, 1);
+		return 2*avg;
+	}
+	return max;
+}
+
+/**
+ * homa_poll_record_wait() - Update a socket's statistics about how long
+ * threads must wait for incoming messages (see homa_poll_window).
+ * @hsk:     Socket on which a thread waited.
+ * @wait:    How long (in get_cycles units) the thread waited before a
+ *           message became available.
+ */
+void homa_poll_record_wait(struct homa_sock *hsk, __u64 wait)
+{
+	__u64 avg = READ_ONCE(hsk->avg_wait_cycles);
+	__u64 limit = 4 * (__u64) hsk->homa->poll_cycles;
+
+	/* Cap the sample: otherwise an idle period would keep polling
+	 * disabled for a long time after traffic resumes. Zero is reserved
+	 * to mean "no information".
+	 */
+	if (wait > limit)
+		wait = limit;
+	if (wait == 0)
+		wait = 1;
+	if (avg == 0)
+		avg = wait;
+	else
+		avg = avg - (avg >> 3) + (wait >> 3);
+	WRITE_ONCE(hsk->avg_wait_cycles, avg);
+}
+
 /**
  * @homa_wait_for_message() - Wait for receipt of an incoming message
  * that matches the parameters. Various other activities can occur while
@@ -1208,7 +1576,10 @@ struct homa_rpc *homa_wait_for_message(struct homa_sock *hsk, int flags,
 	struct homa_rpc *result = NULL;
 	struct homa_interest interest;
 	struct homa_rpc *rpc = NULL;
-	uint64_t poll_start, now;
+	uint64_t poll_start, poll_cycles, now;
+#ifdef CONFIG_NET_RX_BUSY_POLL
+	uint64_t busy_poll_cycles;
+#endif
 	int error, blocked = 0, polled = 0;
 
 	/* Each iteration of this loop finds an RPC, but it might not be
@@ -1258,9 +1629,18 @@ struct homa_rpc *homa_wait_for_message(struct homa_sock *hsk, int flags,
 		}
 
 		/* Busy-wait for a while before going to sleep; this avoids
-		 * context-switching overhead to wake up.
+		 * context-switching overhead to wake up. If the socket has
+		 * busy polling enabled (SO_BUSY_POLL or net.core.busy_read),
+		 * poll the NIC directly while waiting.
 		 */
 		poll_start = now = get_cycles();
+		poll_cycles = homa_poll_window(hsk);
+#ifdef CONFIG_NET_RX_BUSY_POLL
+		busy_poll_cycles = READ_ONCE(hsk->sock.sk_ll_usec);
+		busy_poll_cycles = (busy_poll_cycles * cpu_khz)/1000;
+		if (busy_poll_cycles > poll_cycles)
+			poll_cycles = busy_poll_cycles;
+#endif
 		while (1) {
 			__u64 blocked;
 			rpc = (struct homa_rpc *) atomic_long_read(
@@ -1271,10 +1651,16 @@ struct homa_rpc *homa_wait_for_message(struct homa_sock *hsk, int flags,
 						current->pid);
 				polled = 1;
 				INC_METRIC(poll_cycles, now - poll_start);
+				homa_poll_record_wait(hsk, now - poll_start);
 				goto found_rpc;
 			}
-			if (now >= (poll_start + hsk->homa->poll_cycles))
+			if (now >= (poll_start + poll_cycles))
 				break;
+			if (homa_busy_poll(hsk, &interest)) {
+				now = get_cycles();
+				if (!need_resched())
+					continue;
+			}
 			blocked = get_cycles();
 			schedule();
 			now = get_cycles();
@@ -1304,6 +1690,8 @@ struct homa_rpc *homa_wait_for_message(struct homa_sock *hsk, int flags,
 			end = get_cycles();
 			blocked = 1;
 			INC_METRIC(blocked_cycles, end - start);
+			if (atomic_long_read(&interest.ready_rpc))
+				homa_poll_record_wait(hsk, end - poll_start);
 		}
 		__set_current_state(TASK_RUNNING);
 
@@ -1340,6 +1728,8 @@ found_rpc:
 		 */
 		rpc = (struct homa_rpc *) atomic_long_read(&interest.ready_rpc);
 		if (rpc) {
+			__u64 wakeup = get_cycles();
+
 			tt_record2("homa_wait_for_message found rpc id %d, pid %d",
 					rpc->id, current->pid);
 			if (!interest.locked) {
@@ -1353,6 +1743,13 @@ found_rpc:
 				homa_rpc_unlock(rpc);
 				continue;
 			}
+			if (rpc->handoff_cycles != 0) {
+				INC_METRIC(handoff_wakeup_latency[
+						homa_latency_bucket(wakeup
+						- rpc->handoff_cycles)], 1);
+				rpc->handoff_cycles = 0;
+			}
+			rpc->wakeup_cycles = wakeup;
 			if (!rpc->error)
 				rpc->error = homa_copy_to_user(rpc);
 			if (rpc->error)
@@ -1434,6 +1831,13 @@ void homa_rpc_handoff(struct homa_rpc *rpc)
 			|| !list_empty(&rpc->ready_links))
 		return;
 
+	rpc->handoff_cycles = get_cycles();
+	if (rpc->dispatch_cycles != 0) {
+		INC_METRIC(softirq_handoff_latency[homa_latency_bucket(
+				rpc->handoff_cycles - rpc->dispatch_cycles)], 1);
+		rpc->dispatch_cycles = 0;
+	}
+
 	/* First, see if someone is interested in this RPC specifically.
 	 */
 	if (rpc->interest) {
@@ -1540,6 +1944,10 @@ void homa_incoming_sysctl_changed(struct homa *homa)
 	tmp = (tmp*cpu_khz)/1000;
 	homa->gro_busy_cycles = tmp;
 
+	tmp = homa->gen3_adapt_usecs;
+	tmp = (tmp*cpu_khz)/1000;
+	homa->gen3_adapt_cycles = tmp;
+
 	tmp = homa->bpage_lease_usecs;
 	tmp = (tmp*cpu_khz)/1000;
 	homa->bpage_lease_cycles = tmp;
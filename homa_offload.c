@@ -8,6 +8,10 @@
 
 #include "homa_impl.h"
 
+#ifdef __UNIT_TEST__
+#include "mock.h"
+#endif
+
 #define CORES_TO_CHECK 4
 
 static const struct net_offload homa_offload = {
@@ -48,7 +52,9 @@ int homa_offload_end(void)
 /**
  * homa_set_softirq_cpu() - Arrange for SoftIRQ processing of a packet to
  * occur on a specific core (creates a socket flow table entry for the core,
- * and sets the packet's hash to map to the given entry).
+ * and sets the packet's hash to map to the given entry). Also charges the
+ * packet to the core's softirq_backlog; if the packet had already been
+ * steered elsewhere, the charge is moved from the old core.
  * @skb:  Incoming packet
  * @cpu:  Index of core to which the packet should be directed for
  *        SoftIRQ processing.
@@ -56,11 +62,15 @@ int homa_offload_end(void)
 static inline void homa_set_softirq_cpu(struct sk_buff *skb, int cpu)
 {
 	struct rps_sock_flow_table *sock_flow_table;
-	int hash;
+	int hash, old_core;
 
 	sock_flow_table = rcu_dereference(rps_sock_flow_table);
 	if (sock_flow_table == NULL)
 		return;
+	old_core = homa_softirq_core(skb);
+	if (old_core >= 0)
+		atomic_dec_if_positive(&homa_cores[old_core]->softirq_backlog);
+	atomic_inc(&homa_cores[cpu]->softirq_backlog);
 	hash = cpu + rps_cpu_mask + 1;
 	if (sock_flow_table->ents[hash] != hash) {
 		rcu_read_lock();
@@ -140,6 +150,121 @@ struct sk_buff *homa_gso_segment(struct sk_buff *skb,
 	return segs;
 }
 
+/**
+ * homa_gro_ip_payload() - Return the number of bytes following the IP
+ * header in a packet, according to its IP header.
+ * @skb:    Packet of interest.
+ */
+static inline int homa_gro_ip_payload(struct sk_buff *skb)
+{
+	if (skb_is_ipv6(skb))
+		return ntohs(ipv6_hdr(skb)->payload_len);
+	return ntohs(ip_hdr(skb)->tot_len) - ip_hdrlen(skb);
+}
+
+/**
+ * homa_gro_exact_length() - Returns nonzero if a DATA packet contains
+ * exactly its header and segment, consistent with its IP header (e.g.
+ * no Ethernet padding), and its header is in the linear part of the skb
+ * so it can be pulled off.
+ * @skb:    Packet of interest.
+ * @h:      Homa header for @skb.
+ */
+static int homa_gro_exact_length(struct sk_buff *skb, struct data_header *h)
+{
+	int length = skb->len - skb_transport_offset(skb);
+
+	return (length == (sizeof(struct data_header)
+			+ ntohl(h->seg.segment_length)))
+			&& (skb_headlen(skb) >= (skb_transport_offset(skb)
+			+ sizeof(struct data_header)))
+			&& (homa_gro_ip_payload(skb) == length);
+}
+
+/**
+ * homa_gro_coalesce() - Try to merge the data from a new DATA packet into
+ * the most recent packet in a GRO batch, so that the rest of Homa
+ * (homa_add_packet, homa_copy_to_user, reaping, etc.) has fewer skbs to
+ * manage. This is only possible if the packets belong to the same RPC and
+ * the new packet's data immediately follows the data in the earlier one.
+ * @held_skb:  The skb that holds the current GRO batch; the packet that
+ *             was most recently added to its frag_list is the candidate
+ *             for merging. The merge target must be on the frag_list
+ *             (not @held_skb itself), since @held_skb's length will be
+ *             checked against its IP header.
+ * @skb:       The newly arrived packet.
+ *
+ * Return:     Nonzero means the data from @skb was merged and @skb has been
+ *             freed; zero means no merge was possible and @skb is unchanged.
+ */
+int homa_gro_coalesce(struct sk_buff *held_skb, struct sk_buff *skb)
+{
+	struct sk_buff *last = NAPI_GRO_CB(held_skb)->last;
+	struct data_header *h_new = (struct data_header *)
+			skb_transport_header(skb);
+	struct data_header *h_last;
+	struct in6_addr saddr, last_saddr;
+	int hdr_length, seg_length, delta_truesize;
+	bool fragstolen;
+
+	if ((last == held_skb) || (h_new->common.type != DATA)
+			|| h_new->retransmit || h_new->seg.ack.client_id)
+		return 0;
+	h_last = (struct data_header *) skb_transport_header(last);
+	if ((h_last->common.type != DATA)
+			|| (h_last->common.sender_id != h_new->common.sender_id)
+			|| (h_last->common.dport != h_new->common.dport)
+			|| (h_last->message_length != h_new->message_length)
+			|| (h_last->cutoff_version != h_new->cutoff_version)
+			|| h_last->retransmit
+			|| ((ntohl(h_last->seg.offset)
+			+ ntohl(h_last->seg.segment_length))
+			!= ntohl(h_new->seg.offset)))
+		return 0;
+	saddr = skb_canonical_ipv6_saddr(skb);
+	last_saddr = skb_canonical_ipv6_saddr(last);
+	if (!ipv6_addr_equal(&saddr, &last_saddr))
+		return 0;
+
+	/* Both packets must contain exactly their segments, so that the
+	 * offsets checked above describe the data actually present, and
+	 * the merged packet must still be describable by its IP header.
+	 */
+	if (!homa_gro_exact_length(skb, h_new)
+			|| !homa_gro_exact_length(last, h_last))
+		return 0;
+	hdr_length = skb_transport_offset(skb) + sizeof(struct data_header);
+	seg_length = ntohl(h_new->seg.segment_length);
+	if ((homa_gro_ip_payload(last) + seg_length) > 0xffff)
+		return 0;
+
+	__skb_pull(skb, hdr_length);
+	if (!skb_try_coalesce(last, skb, &fragstolen, &delta_truesize)) {
+		__skb_push(skb, hdr_length);
+		return 0;
+	}
+	h_last->seg.segment_length = htonl(ntohl(h_last->seg.segment_length)
+			+ seg_length);
+	h_last->incoming = h_new->incoming;
+	if (skb_is_ipv6(last)) {
+		ipv6_hdr(last)->payload_len = htons(
+				ntohs(ipv6_hdr(last)->payload_len) + seg_length);
+	} else {
+		struct iphdr *iph = ip_hdr(last);
+		__be16 old_len = iph->tot_len;
+
+		iph->tot_len = htons(ntohs(old_len) + seg_length);
+		csum_replace2(&iph->check, old_len, iph->tot_len);
+	}
+	tt_record3("homa_gro_coalesce merged offset %d into packet at "
+			"offset %d, id %d", ntohl(h_new->seg.offset),
+			ntohl(h_last->seg.offset),
+			homa_local_id(h_new->common.sender_id));
+	kfree_skb_partial(skb, fragstolen);
+	INC_METRIC(gro_data_coalesced, 1);
+	return 1;
+}
+
 /**
  * homa_gro_receive() - Invoked for each input packet at a very low
  * level in the stack to perform GRO. However, this code does GRO in an
@@ -182,6 +307,13 @@ struct sk_buff *homa_gro_receive(struct list_head *held_list,
 	__u32 saddr;
 
 	core->last_active = now;
+	homa_set_rcv_cycles(skb, now);
+#ifdef CONFIG_NET_RX_BUSY_POLL
+	if (unlikely(homa->engine_core >= 0)
+			&& (skb->napi_id >= MIN_NAPI_ID)
+			&& (skb->napi_id != READ_ONCE(homa->engine_napi_id)))
+		WRITE_ONCE(homa->engine_napi_id, skb->napi_id);
+#endif
 	if (skb_is_ipv6(skb)) {
 		priority = ipv6_hdr(skb)->priority;
 		saddr = ntohl(ipv6_hdr(skb)->saddr.in6_u.u6_addr32[3]);
@@ -249,17 +381,24 @@ struct sk_buff *homa_gro_receive(struct list_head *held_list,
 			if (held_skb != core->held_skb)
 				continue;
 
-			/* Aggregate skb into held_skb. We don't update the
+			/* Aggregate skb into held_skb, either by merging its
+			 * data into the previous packet or by appending it
+			 * to held_skb's frag_list. We don't update the
 			 * length of held_skb because we'll eventually split
 			 * it up and process each skb independently.
 			 */
-			if (NAPI_GRO_CB(held_skb)->last == held_skb)
-				skb_shinfo(held_skb)->frag_list = skb;
-			else
-				NAPI_GRO_CB(held_skb)->last->next = skb;
-			NAPI_GRO_CB(held_skb)->last = skb;
-			skb->next = NULL;
-			NAPI_GRO_CB(skb)->same_flow = 1;
+			if ((homa->gro_policy & HOMA_GRO_COALESCE)
+					&& homa_gro_coalesce(held_skb, skb)) {
+				result = ERR_PTR(-EINPROGRESS);
+			} else {
+				if (NAPI_GRO_CB(held_skb)->last == held_skb)
+					skb_shinfo(held_skb)->frag_list = skb;
+				else
+					NAPI_GRO_CB(held_skb)->last->next = skb;
+				NAPI_GRO_CB(held_skb)->last = skb;
+				skb->next = NULL;
+				NAPI_GRO_CB(skb)->same_flow = 1;
+			}
 			NAPI_GRO_CB(held_skb)->count++;
 			if (NAPI_GRO_CB(held_skb)->count >= homa->max_gro_skbs) {
 				/* Push this batch up through the SoftIRQ
@@ -374,7 +513,6 @@ void homa_gro_gen2(struct sk_buff *skb)
 				candidate, homa_local_id(h->common.sender_id),
 				ntohl(h->seg.offset));
 	}
-	atomic_inc(&homa_cores[candidate]->softirq_backlog);
 	homa_set_softirq_cpu(skb, candidate);
 }
 
@@ -394,13 +532,22 @@ void homa_gro_gen3(struct sk_buff *skb)
 	struct data_header *h = (struct data_header *) skb_transport_header(skb);
 	int i, core;
 	__u64 now, busy_time;
-	int *candidates = homa_cores[raw_smp_processor_id()]->gen3_softirq_cores;
+	int this_core = raw_smp_processor_id();
+	struct homa_core *gro_core = homa_cores[this_core];
+	int *candidates = gro_core->gen3_softirq_cores;
+	int num_candidates = NUM_GEN3_SOFTIRQ_CORES;
 
 	now = get_cycles();
 	busy_time = now - homa->busy_cycles;
 
-	core = candidates[0];
-	for (i = 0; i <  NUM_GEN3_SOFTIRQ_CORES; i++) {
+	if (homa->gro_policy & HOMA_GRO_GEN3_ADAPTIVE) {
+		if ((now - gro_core->gen3_last_adapt) >= homa->gen3_adapt_cycles)
+			homa_gro_gen3_adapt(this_core, now);
+		num_candidates = gro_core->gen3_num_cores;
+	}
+
+	core = (num_candidates > 0) ? candidates[0] : this_core;
+	for (i = 0; i < num_candidates; i++) {
 		int candidate = candidates[i];
 		if (candidate < 0) {
 			break;
@@ -417,10 +564,315 @@ void homa_gro_gen3(struct sk_buff *skb)
 			ntohl(h->seg.offset),
 			now - homa_cores[core]->last_app_active);
 	INC_METRIC(gen3_handoffs, 1);
-	if (core != candidates[0])
+	if ((num_candidates > 0) && (core != candidates[0]))
 		INC_METRIC(gen3_alt_handoffs, 1);
 }
 
+/**
+ * homa_gro_gen3_adapt() - Invoked periodically by homa_gro_gen3 when
+ * HOMA_GRO_GEN3_ADAPTIVE is set; measures how busy the SoftIRQ cores
+ * for a GRO core have been since the last call and grows or shrinks
+ * the number of SoftIRQ cores in use accordingly. Under light load all
+ * SoftIRQ processing collapses onto the GRO core (which avoids the
+ * cost of inter-core handoffs); as load increases, additional cores
+ * from gen3_softirq_cores are brought into use one at a time.
+ * @core_id:  The GRO core whose SoftIRQ cores should be reconsidered.
+ * @now:      Current time, in get_cycles() units.
+ */
+void homa_gro_gen3_adapt(int core_id, __u64 now)
+{
+	struct homa_core *gro_core = homa_cores[core_id];
+	int *candidates = gro_core->gen3_softirq_cores;
+	int num_cores = gro_core->gen3_num_cores;
+	__u64 elapsed = now - gro_core->gen3_last_adapt;
+	int max_cores, max_pct, total_pct, expand_pct, i;
+	bool backlogged = false;
+
+	for (max_cores = 0; max_cores < NUM_GEN3_SOFTIRQ_CORES; max_cores++) {
+		if (candidates[max_cores] < 0)
+			break;
+	}
+	if (num_cores > max_cores)
+		num_cores = max_cores;
+
+	/* Element 0 of gen3_prev_softirq refers to the GRO core itself;
+	 * it's only relevant when that core is doing SoftIRQ work.
+	 */
+	max_pct = 0;
+	total_pct = 0;
+	for (i = 0; i <= max_cores; i++) {
+		struct homa_core *core = (i == 0) ? gro_core
+				: homa_cores[candidates[i-1]];
+		__u64 cycles = core->metrics.softirq_cycles;
+		__u64 delta = cycles - gro_core->gen3_prev_softirq[i];
+		int pct;
+
+		gro_core->gen3_prev_softirq[i] = cycles;
+		if ((i == 0) ? (num_cores != 0) : (i > num_cores))
+			continue;
+		pct = (elapsed == 0) ? 0 : (int) ((100*delta)/elapsed);
+		if (pct > max_pct)
+			max_pct = pct;
+		total_pct += pct;
+		if (atomic_read(&core->softirq_backlog) > 1)
+			backlogged = true;
+	}
+	gro_core->gen3_last_adapt = now;
+
+	/* When SoftIRQ runs on the GRO core, that core is also busy with
+	 * GRO (which isn't included in softirq_cycles), so expand sooner.
+	 */
+	expand_pct = homa->gen3_expand_pct;
+	if (num_cores == 0)
+		expand_pct /= 2;
+	if ((max_pct > expand_pct || backlogged) && (num_cores < max_cores)) {
+		num_cores++;
+		INC_METRIC(gen3_expansions, 1);
+		tt_record3("homa_gro_gen3_adapt expanded core %d to %d SoftIRQ "
+				"cores, max_pct %d", core_id, num_cores,
+				max_pct);
+	} else if ((num_cores > 0) && (total_pct < homa->gen3_shrink_pct
+			* ((num_cores > 1) ? (num_cores - 1) : 1))) {
+		num_cores--;
+		INC_METRIC(gen3_contractions, 1);
+		tt_record3("homa_gro_gen3_adapt shrank core %d to %d SoftIRQ "
+				"cores, total_pct %d", core_id, num_cores,
+				total_pct);
+	}
+	gro_core->gen3_num_cores = num_cores;
+}
+
+/**
+ * homa_cpu_topology() - Return information about where a core sits in
+ * the machine's CPU topology.
+ * @cpu:    Core of interest.
+ * @phys:   Stored here: identifier for the physical core containing @cpu
+ *          (hyperthreads of the same physical core have the same value).
+ * @llc:    Stored here: identifier for the last-level cache used by @cpu.
+ * @node:   Stored here: NUMA node containing @cpu.
+ *
+ * Return:  Nonzero if @cpu is online (in which case the values above have
+ *          been filled in), zero otherwise.
+ */
+int homa_cpu_topology(int cpu, int *phys, int *llc, int *node)
+{
+#ifndef __UNIT_TEST__
+	if (!cpu_online(cpu))
+		return 0;
+	*phys = (topology_physical_package_id(cpu) << 16)
+			| topology_core_id(cpu);
+	*node = cpu_to_node(cpu);
+#ifdef CONFIG_X86
+	*llc = cpumask_first(cpu_llc_shared_mask(cpu));
+#else
+	*llc = *node;
+#endif
+	return 1;
+#else
+	return mock_cpu_topology(cpu, phys, llc, node);
+#endif
+}
+
+/**
+ * homa_gen3_choose_cores() - Use the CPU topology to pick the cores that
+ * a given GRO core should use for SoftIRQ processing under the Gen3 load
+ * balancer. Cores that share a last-level cache with the GRO core are
+ * preferred, followed by other cores on the same NUMA node (which is
+ * also the NIC's node, since the NIC interrupts the GRO core). Cores on
+ * the same physical core as the GRO core (SMT siblings) are never chosen,
+ * nor are two SMT siblings of each other.
+ * @cpu:      The GRO core.
+ * @exclude:  A core that must not be chosen (e.g. because it is going
+ *            offline), or -1.
+ * @cores:    Results are stored here (NUM_GEN3_SOFTIRQ_CORES entries, with
+ *            -1 for unused entries). If no suitable cores can be found,
+ *            @cpu itself is used, so SoftIRQ will run on the GRO core.
+ */
+void homa_gen3_choose_cores(int cpu, int exclude, int *cores)
+{
+	int my_phys, my_llc, my_node, phys, llc, node;
+	int chosen_phys[NUM_GEN3_SOFTIRQ_CORES];
+	int num_chosen = 0;
+	int pass, offset, i;
+
+	if (!homa_cpu_topology(cpu, &my_phys, &my_llc, &my_node))
+		goto done;
+
+	/* Pass 0 considers only cores in the same LLC; pass 1 considers
+	 * other cores on the same NUMA node. Within a pass, scan upward
+	 * from @cpu so that GRO cores spaced evenly across the machine
+	 * will end up with disjoint sets of SoftIRQ cores.
+	 */
+	for (pass = 0; pass < 2; pass++) {
+		for (offset = 1; offset < nr_cpu_ids; offset++) {
+			int candidate = (cpu + offset) % nr_cpu_ids;
+
+			if (num_chosen >= NUM_GEN3_SOFTIRQ_CORES)
+				goto done;
+			if (candidate == exclude)
+				continue;
+			if (!homa_cpu_topology(candidate, &phys, &llc, &node))
+				continue;
+			if ((pass == 0) ? (llc != my_llc)
+					: ((llc == my_llc) || (node != my_node)))
+				continue;
+			if (phys == my_phys)
+				continue;
+			for (i = 0; i < num_chosen; i++) {
+				if (chosen_phys[i] == phys)
+					break;
+			}
+			if (i < num_chosen)
+				continue;
+			chosen_phys[num_chosen] = phys;
+			cores[num_chosen] = candidate;
+			num_chosen++;
+		}
+	}
+
+done:
+	if (num_chosen == 0) {
+		cores[0] = cpu;
+		num_chosen = 1;
+	}
+	for (i = num_chosen; i < NUM_GEN3_SOFTIRQ_CORES; i++)
+		cores[i] = -1;
+}
+
+/**
+ * homa_gen3_default_cores() - Recompute gen3_softirq_cores for every core
+ * from the CPU topology (see homa_gen3_choose_cores).
+ * @exclude:  A core that should not be used for SoftIRQ (e.g. because it
+ *            is about to go offline), or -1.
+ */
+void homa_gen3_default_cores(int exclude)
+{
+	int cores[NUM_GEN3_SOFTIRQ_CORES];
+	int cpu, i;
+
+	for (cpu = 0; cpu < nr_cpu_ids; cpu++) {
+		homa_gen3_choose_cores(cpu, exclude, cores);
+		for (i = 0; i < NUM_GEN3_SOFTIRQ_CORES; i++)
+			homa_cores[cpu]->gen3_softirq_cores[i] = cores[i];
+	}
+}
+
+/**
+ * homa_rfs_choose_core() - Use the CPU topology to pick the core that
+ * should perform SoftIRQ processing for packets destined to a thread
+ * waiting on a given core (with HOMA_GRO_RFS). The goal is to share cache
+ * with the waiting thread without running on its core: the first choice
+ * is an SMT sibling, the second choice is another core in the same LLC.
+ * @cpu:      Core where the thread is waiting.
+ * @exclude:  A core that must not be chosen (e.g. because it is going
+ *            offline), or -1.
+ *
+ * Return:    The chosen core; @cpu itself if there are no better options.
+ */
+int homa_rfs_choose_core(int cpu, int exclude)
+{
+	int my_phys, my_llc, my_node, phys, llc, node;
+	int offset, same_llc = -1;
+
+	if (!homa_cpu_topology(cpu, &my_phys, &my_llc, &my_node))
+		return cpu;
+	for (offset = 1; offset < nr_cpu_ids; offset++) {
+		int candidate = (cpu + offset) % nr_cpu_ids;
+
+		if (candidate == exclude)
+			continue;
+		if (!homa_cpu_topology(candidate, &phys, &llc, &node))
+			continue;
+		if (phys == my_phys)
+			return candidate;
+		if ((llc == my_llc) && (same_llc < 0))
+			same_llc = candidate;
+	}
+	return (same_llc >= 0) ? same_llc : cpu;
+}
+
+/**
+ * homa_rfs_default_cores() - Recompute rfs_core for every core from the
+ * CPU topology (see homa_rfs_choose_core).
+ * @exclude:  A core that should not be used for SoftIRQ (e.g. because it
+ *            is about to go offline), or -1.
+ */
+void homa_rfs_default_cores(int exclude)
+{
+	int cpu;
+
+	for (cpu = 0; cpu < nr_cpu_ids; cpu++)
+		homa_cores[cpu]->rfs_core = homa_rfs_choose_core(cpu, exclude);
+}
+
+/**
+ * homa_offload_cpu_online() - Invoked by the CPU hotplug mechanism after a
+ * core has come online.
+ * @cpu:    The core that came online.
+ *
+ * Return:  Always 0.
+ */
+int homa_offload_cpu_online(unsigned int cpu)
+{
+	if (homa->gen3_auto_cores)
+		homa_gen3_default_cores(-1);
+	homa_rfs_default_cores(-1);
+	return 0;
+}
+
+/**
+ * homa_offload_cpu_offline() - Invoked by the CPU hotplug mechanism when a
+ * core is about to go offline.
+ * @cpu:    The core that is going offline.
+ *
+ * Return:  Always 0.
+ */
+int homa_offload_cpu_offline(unsigned int cpu)
+{
+	if (homa->gen3_auto_cores)
+		homa_gen3_default_cores(cpu);
+	homa_rfs_default_cores(cpu);
+	return 0;
+}
+
+/**
+ * homa_gro_rfs() - Invoked by homa_gro_complete when HOMA_GRO_RFS is set.
+ * If a thread is waiting for the RPC that a batch of packets belongs to,
+ * direct SoftIRQ processing for the batch to a core that shares cache
+ * with the thread's core, so that the handoff and wakeup will find
+ * warm caches.
+ * @skb:     First in a group of packets that are ready to be passed to SoftIRQ.
+ *           Information will be updated in the packet so that Linux will
+ *           direct it to the chosen core.
+ *
+ * Return:   Nonzero means the batch was steered; zero means no thread is
+ *           known to be waiting for the RPC, so the caller should pick a
+ *           core some other way.
+ */
+int homa_gro_rfs(struct sk_buff *skb)
+{
+	struct data_header *h = (struct data_header *) skb_transport_header(skb);
+	__u64 id = homa_local_id(h->common.sender_id);
+	__u64 entry;
+	int core;
+
+	if (!homa_is_client(id))
+		return 0;
+	entry = READ_ONCE(homa->rfs_table[homa_rfs_index(id)]);
+	if ((entry == 0) || ((entry >> 16) != ((id << 16) >> 16)))
+		return 0;
+	core = entry & 0xffff;
+	if (unlikely(core >= nr_cpu_ids))
+		return 0;
+	core = homa_cores[core]->rfs_core;
+	homa_set_softirq_cpu(skb, core);
+	homa_cores[core]->last_active = get_cycles();
+	tt_record3("homa_gro_rfs chose core %d for id %d, offset %d",
+			core, id, ntohl(h->seg.offset));
+	INC_METRIC(rfs_handoffs, 1);
+	return 1;
+}
+
 /**
  * homa_gro_complete() - This function is invoked just before a packet that
  * was held for GRO processing is passed up the network stack, in case the
@@ -438,7 +890,18 @@ int homa_gro_complete(struct sk_buff *skb, int hoffset)
 //			h->type, homa_local_id(h->sender_id), ntohl(d->seg.offset),
 //			NAPI_GRO_CB(skb)->count);
 
-	if (homa->gro_policy & HOMA_GRO_GEN3) {
+	if ((homa->engine_kthread && (raw_smp_processor_id()
+			== homa->engine_thread_core))
+			|| (homa_cores[raw_smp_processor_id()]->busy_poller
+			== current)) {
+		/* This batch was received by busy polling (either in the
+		 * engine thread or in a thread waiting for a message);
+		 * process it on the same core, so there is no handoff.
+		 */
+		homa_set_softirq_cpu(skb, raw_smp_processor_id());
+	} else if ((homa->gro_policy & HOMA_GRO_RFS) && homa_gro_rfs(skb)) {
+		/* Nothing more to do. */
+	} else if (homa->gro_policy & HOMA_GRO_GEN3) {
 		homa_gro_gen3(skb);
 	} else if (homa->gro_policy & HOMA_GRO_GEN2) {
 		homa_gro_gen2(skb);
@@ -74,11 +74,32 @@ int homa_message_out_init(struct homa_rpc *rpc, struct iov_iter *iter, int xmit)
 	rpc->msgout.next_xmit = &rpc->msgout.packets;
 	rpc->msgout.next_xmit_offset = 0;
 	atomic_set(&rpc->msgout.active_xmits, 0);
-	rpc->msgout.unscheduled = rpc->hsk->homa->unsched_bytes;
+	rpc->msgout.unscheduled = homa_peer_unsched_bytes(rpc->hsk->homa,
+			rpc->peer);
+	if (rpc->hsk->homa->rtt_adaptive && (rpc->peer->rtt_bytes != 0)) {
+		INC_METRIC(rtt_unsched_msgs, 1);
+		INC_METRIC(rtt_unsched_bytes, rpc->msgout.unscheduled);
+	}
+	if (!homa_is_client(rpc->id)
+			&& (rpc->resp_incoming > rpc->msgout.unscheduled)) {
+		/* The client granted part of the response in advance. The
+		 * value came from the network, so limit it to what we would
+		 * grant this peer ourselves.
+		 */
+		struct homa *homa = rpc->hsk->homa;
+		int limit = homa_peer_grant_window(homa, rpc->peer);
+
+		if (limit > homa->max_incoming)
+			limit = homa->max_incoming;
+		if (limit > rpc->msgout.unscheduled)
+			rpc->msgout.unscheduled = (rpc->resp_incoming > limit)
+					? limit : rpc->resp_incoming;
+	}
 	if (rpc->msgout.unscheduled > rpc->msgout.length)
 		rpc->msgout.unscheduled = rpc->msgout.length;
 	rpc->msgout.sched_priority = 0;
 	rpc->msgout.init_cycles = get_cycles();
+	rpc->msgout.rtt_probe_cycles = 0;
 
 	if (unlikely((rpc->msgout.length > HOMA_MAX_MESSAGE_LENGTH)
 			|| (rpc->msgout.length == 0))) {
@@ -182,6 +203,9 @@ int homa_message_out_init(struct homa_rpc *rpc, struct iov_iter *iter, int xmit)
 		h->incoming = htonl(rpc->msgout.unscheduled);
 		h->cutoff_version = rpc->peer->cutoff_version;
 		h->retransmit = 0;
+		h->pad = 0;
+		h->resp_incoming = homa_is_client(rpc->id)
+				? htonl(rpc->resp_incoming) : 0;
 		homa_info->wire_bytes = 0;
 		homa_info->data_bytes = 0;
 
@@ -294,10 +318,12 @@ int __homa_xmit_control(void *contents, size_t length, struct homa_peer *peer,
 	struct sk_buff *skb;
 
 	/* Allocate the same size sk_buffs as for the smallest data
-         * packets (better reuse of sk_buffs?).
+         * packets (better reuse of sk_buffs?), unless the packet carries
+	 * a large batch of acks.
 	 */
 	dst = homa_get_dst(peer, hsk);
-	skb = homa_skb_new(HOMA_MAX_HEADER + HOMA_SKB_EXTRA + sizeof32(void*));
+	skb = homa_skb_new(((length > HOMA_MAX_HEADER) ? length : HOMA_MAX_HEADER)
+			+ HOMA_SKB_EXTRA + sizeof32(void*));
 	if (unlikely(!skb))
 		return -ENOBUFS;
 	dst_hold(dst);
@@ -439,6 +465,14 @@ void homa_xmit_data(struct homa_rpc *rpc, bool force)
 		} else {
 			priority = rpc->msgout.sched_priority;
 		}
+		if ((rpc->msgout.next_xmit_offset == 0)
+				&& (rpc->msgout.unscheduled
+				< rpc->msgout.length)) {
+			/* The first grant for this message will provide an
+			 * RTT sample (see homa_apply_grant).
+			 */
+			rpc->msgout.rtt_probe_cycles = get_cycles();
+		}
 		rpc->msgout.next_xmit = &(homa_get_skb_info(skb)->next_skb);
 		next_skb = *rpc->msgout.next_xmit;
 		if (next_skb == NULL) {
@@ -805,7 +839,7 @@ void homa_pacer_xmit(struct homa *homa)
 		 * throttle lock while locking the RPC is important because
 		 * it keeps the RPC from being deleted before it can be locked.
 		 */
-		homa_throttle_lock(homa);
+		homa_throttle_lock(homa, "homa_pacer_xmit");
 		homa->pacer_fifo_count -= homa->pacer_fifo_fraction;
 		if (homa->pacer_fifo_count <= 0) {
 			__u64 oldest = ~0;
@@ -846,7 +880,7 @@ void homa_pacer_xmit(struct homa *homa)
 			/* Nothing more to transmit from this message (right now),
 			 * so remove it from the throttled list.
 			 */
-			homa_throttle_lock(homa);
+			homa_throttle_lock(homa, "homa_pacer_xmit #2");
 			if (!list_empty(&rpc->throttled_links)) {
 				tt_record2("pacer removing id %d from "
 						"throttled list, offset %d",
@@ -910,7 +944,7 @@ void homa_add_to_throttled(struct homa_rpc *rpc)
 		INC_METRIC(throttled_cycles, now - homa->throttle_add);
 	homa->throttle_add = now;
 	bytes_left = rpc->msgout.length - rpc->msgout.next_xmit_offset;
-	homa_throttle_lock(homa);
+	homa_throttle_lock(homa, "homa_add_to_throttled");
 	list_for_each_entry_rcu(candidate, &homa->throttled_rpcs,
 			throttled_links) {
 		int bytes_left_cand;
@@ -930,7 +964,12 @@ void homa_add_to_throttled(struct homa_rpc *rpc)
 	list_add_tail_rcu(&rpc->throttled_links, &homa->throttled_rpcs);
 done:
 	homa_throttle_unlock(homa);
-	wake_up_process(homa->pacer_kthread);
+
+	/* If the engine thread is running, it invokes the pacer on every
+	 * pass, so there's no need to wake the pacer thread.
+	 */
+	if (!homa->engine_kthread)
+		wake_up_process(homa->pacer_kthread);
 	INC_METRIC(throttle_list_adds, 1);
 	INC_METRIC(throttle_list_checks, checks);
 //	tt_record("woke up pacer thread");
@@ -945,7 +984,8 @@ void homa_remove_from_throttled(struct homa_rpc *rpc)
 {
 	if (unlikely(!list_empty(&rpc->throttled_links))) {
 		UNIT_LOG("; ", "removing id %llu from throttled list", rpc->id);
-		homa_throttle_lock(rpc->hsk->homa);
+		homa_throttle_lock(rpc->hsk->homa,
+				"homa_remove_from_throttled");
 		list_del(&rpc->throttled_links);
 		if (list_empty(&rpc->hsk->homa->throttled_rpcs))
 			INC_METRIC(throttled_cycles, get_cycles()
@@ -967,7 +1007,7 @@ void homa_log_throttled(struct homa *homa)
 	int64_t bytes = 0;
 
 	printk(KERN_NOTICE "Printing throttled list\n");
-	homa_throttle_lock(homa);
+	homa_throttle_lock(homa, "homa_log_throttled");
 	list_for_each_entry_rcu(rpc, &homa->throttled_rpcs, throttled_links) {
 		rpcs++;
 		if (!homa_bucket_try_lock(rpc->bucket, rpc->id,
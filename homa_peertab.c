@@ -204,6 +204,9 @@ struct homa_peer *homa_peer_find(struct homa_peertab *peertab,
 	peer->resend_rpc = NULL;
 	peer->num_acks = 0;
 	spin_lock_init(&peer->ack_lock);
+	peer->napi_id = 0;
+	peer->srtt_cycles = 0;
+	peer->rtt_bytes = 0;
 	INC_METRIC(peer_new_entries, 1);
 
     done:
@@ -353,8 +356,9 @@ void homa_peer_set_cutoffs(struct homa_peer *peer, int c0, int c1, int c2,
  * immediately available. It waits for the lock, but also records statistics
  * about the waiting time.
  * @peer:    Peer to  lock.
+ * @locker:  Static string identifying the locking code.
  */
-void homa_peer_lock_slow(struct homa_peer *peer)
+void homa_peer_lock_slow(struct homa_peer *peer, char *locker)
 {
 	__u64 start = get_cycles();
 	tt_record("beginning wait for peer lock");
@@ -362,6 +366,7 @@ void homa_peer_lock_slow(struct homa_peer *peer)
 	tt_record("ending wait for peer lock");
 	INC_METRIC(peer_ack_lock_misses, 1);
 	INC_METRIC(peer_ack_lock_miss_cycles, get_cycles() - start);
+	homa_lock_miss(HOMA_LOCK_PEER_ACK, locker, get_cycles() - start);
 }
 
 /**
@@ -374,8 +379,9 @@ void homa_peer_add_ack(struct homa_rpc *rpc)
 {
 	struct homa_peer *peer = rpc->peer;
 	struct ack_header ack;
+	int num_acks;
 
-	homa_peer_lock(peer);
+	homa_peer_lock(peer, "homa_peer_add_ack");
 	if (peer->num_acks < NUM_PEER_UNACKED_IDS) {
 		peer->acks[peer->num_acks].client_id = cpu_to_be64(rpc->id);
 		peer->acks[peer->num_acks].client_port = htons(rpc->hsk->port);
@@ -389,11 +395,70 @@ void homa_peer_add_ack(struct homa_rpc *rpc)
 	 * RPC in the message header will also be considered ACKed.
 	 */
 	INC_METRIC(ack_overflows, 1);
-	memcpy(ack.acks, peer->acks, sizeof(peer->acks));
-	ack.num_acks = htons(peer->num_acks);
+	num_acks = peer->num_acks;
+	memcpy(ack.acks, peer->acks, num_acks * sizeof(peer->acks[0]));
+	ack.num_acks = htons(num_acks);
 	peer->num_acks = 0;
 	homa_peer_unlock(peer);
-	homa_xmit_control(ACK, &ack, sizeof(ack), rpc);
+	homa_xmit_control(ACK, &ack, offsetof(struct ack_header, acks)
+			+ num_acks * sizeof(struct homa_ack), rpc);
+}
+
+/**
+ * homa_peer_add_rtt() - Incorporate a new round-trip time sample into
+ * a peer's smoothed RTT estimate, and recompute the values derived from it.
+ * @homa:    Overall data about the Homa protocol implementation.
+ * @peer:    Peer to which the sample applies.
+ * @sample:  Measured round-trip time, in get_cycles units. Samples
+ *           include queueing delays at both ends, so unusually large
+ *           ones are clamped to limit their impact.
+ */
+void homa_peer_add_rtt(struct homa *homa, struct homa_peer *peer,
+		__u64 sample)
+{
+	int srtt = peer->srtt_cycles;
+	__u64 config_rtt, min_rtt, max_rtt;
+
+	INC_METRIC(peer_rtt_latency[homa_latency_bucket(sample)], 1);
+
+	/* Keep every sample (including the first one, which is used
+	 * without smoothing) within a factor of HOMA_RTT_RANGE of the
+	 * time to transmit homa->unsched_bytes, the RTT that is
+	 * configured for peers without an estimate.
+	 */
+	min_rtt = 1;
+	max_rtt = INT_MAX/2;
+	if ((homa->cycles_per_kbyte != 0) && (homa->unsched_bytes > 0)) {
+		config_rtt = ((__u64) homa->unsched_bytes
+				* homa->cycles_per_kbyte)/1000;
+		if (config_rtt/HOMA_RTT_RANGE > min_rtt)
+			min_rtt = config_rtt/HOMA_RTT_RANGE;
+		if (config_rtt*HOMA_RTT_RANGE < max_rtt)
+			max_rtt = config_rtt*HOMA_RTT_RANGE;
+	}
+	if ((srtt != 0) && (2*(__u64) srtt < max_rtt))
+		max_rtt = 2*(__u64) srtt;
+	if (sample > max_rtt) {
+		sample = max_rtt;
+		INC_METRIC(peer_rtt_clamped, 1);
+	} else if (sample < min_rtt) {
+		sample = min_rtt;
+		INC_METRIC(peer_rtt_clamped, 1);
+	}
+
+	/* Same gain as TCP's smoothed RTT (RFC 6298). */
+	if (srtt == 0)
+		srtt = sample;
+	else
+		srtt += ((int) sample - srtt)/8;
+	peer->srtt_cycles = srtt;
+	if (homa->cycles_per_kbyte != 0) {
+		__u64 bytes = (1000*(__u64) srtt)/homa->cycles_per_kbyte;
+
+		peer->rtt_bytes = (bytes > INT_MAX) ? INT_MAX : bytes;
+	}
+	tt_record3("homa_peer_add_rtt peer 0x%x, srtt %d cycles, %d bytes",
+			tt_addr(peer->addr), srtt, peer->rtt_bytes);
 }
 
 /**
@@ -411,7 +476,7 @@ int homa_peer_get_acks(struct homa_peer *peer, int count, struct homa_ack *dst)
 	if (peer->num_acks == 0)
 		return 0;
 
-	homa_peer_lock(peer);
+	homa_peer_lock(peer, "homa_peer_get_acks");
 
 	if (count > peer->num_acks)
 		count = peer->num_acks;
@@ -34,6 +34,11 @@ static bool exiting = false;
 /* Thread that runs timer code to detect lost packets and crashed peers. */
 static struct task_struct *timer_kthread;
 
+/* Dynamic CPU hotplug state used to recompute gen3_softirq_cores when
+ * cores come and go; negative means not registered.
+ */
+static int homa_cpuhp_state = -1;
+
 /* Set via sysctl to request that a particular action be taken. The value
  * written determines the action.
  */
@@ -189,8 +194,26 @@ static const struct proc_ops homa_metrics_pops = {
 	.proc_release      = homa_metrics_release,
 };
 
-/* Used to remove /proc/net/homa_metrics when the module is unloaded. */
+/* Describes file operations implemented for /proc/net/homa_metrics_raw. */
+static const struct proc_ops homa_metrics_raw_pops = {
+	.proc_open         = homa_metrics_raw_open,
+	.proc_read         = homa_metrics_raw_read,
+	.proc_lseek        = homa_metrics_lseek,
+	.proc_release      = homa_metrics_raw_release,
+};
+
+/* Describes file operations implemented for /proc/net/homa_metrics_sum. */
+static const struct proc_ops homa_metrics_sum_pops = {
+	.proc_open         = homa_metrics_sum_open,
+	.proc_read         = homa_metrics_raw_read,
+	.proc_lseek        = homa_metrics_lseek,
+	.proc_release      = homa_metrics_raw_release,
+};
+
+/* Used to remove /proc/net/homa_metrics* when the module is unloaded. */
 static struct proc_dir_entry *metrics_dir_entry = NULL;
+static struct proc_dir_entry *metrics_raw_dir_entry = NULL;
+static struct proc_dir_entry *metrics_sum_dir_entry = NULL;
 
 /* Used to configure sysctl access to Homa configuration parameters.*/
 static struct ctl_table homa_ctl_table[] = {
@@ -208,6 +231,20 @@ static struct ctl_table homa_ctl_table[] = {
 		.mode		= 0644,
 		.proc_handler	= homa_dointvec
 	},
+	{
+		.procname	= "bpage_peer_max_pct",
+		.data		= &homa_data.bpage_peer_max_pct,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= homa_dointvec
+	},
+	{
+		.procname	= "bpage_reserve_pct",
+		.data		= &homa_data.bpage_reserve_pct,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= homa_dointvec
+	},
 	{
 		.procname	= "busy_usecs",
 		.data		= &homa_data.busy_usecs,
@@ -229,6 +266,13 @@ static struct ctl_table homa_ctl_table[] = {
 		.mode		= 0644,
 		.proc_handler	= proc_dointvec
 	},
+	{
+		.procname	= "engine_core",
+		.data		= &homa_data.engine_core,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= homa_dointvec
+	},
 	{
 		.procname	= "fifo_grant_increment",
 		.data		= &homa_data.fifo_grant_increment,
@@ -250,6 +294,27 @@ static struct ctl_table homa_ctl_table[] = {
 		.mode		= 0644,
 		.proc_handler	= proc_dointvec
 	},
+	{
+		.procname	= "gen3_adapt_usecs",
+		.data		= &homa_data.gen3_adapt_usecs,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= homa_dointvec
+	},
+	{
+		.procname	= "gen3_expand_pct",
+		.data		= &homa_data.gen3_expand_pct,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= homa_dointvec
+	},
+	{
+		.procname	= "gen3_shrink_pct",
+		.data		= &homa_data.gen3_shrink_pct,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= homa_dointvec
+	},
 	{
 		.procname	= "gen3_softirq_cores",
 		.data		= NULL,
@@ -376,6 +441,13 @@ static struct ctl_table homa_ctl_table[] = {
 		.mode		= 0644,
 		.proc_handler	= homa_dointvec
 	},
+	{
+		.procname	= "poll_adaptive",
+		.data		= &homa_data.poll_adaptive,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= homa_dointvec
+	},
 	{
 		.procname	= "poll_usecs",
 		.data		= &homa_data.poll_usecs,
@@ -383,6 +455,34 @@ static struct ctl_table homa_ctl_table[] = {
 		.mode		= 0644,
 		.proc_handler	= homa_dointvec
 	},
+	{
+		.procname	= "prio_autotune",
+		.data		= &homa_data.prio_autotune,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= homa_dointvec
+	},
+	{
+		.procname	= "prio_autotune_interval",
+		.data		= &homa_data.prio_autotune_interval,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= homa_dointvec
+	},
+	{
+		.procname	= "prio_autotune_min_drift",
+		.data		= &homa_data.prio_autotune_min_drift,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= homa_dointvec
+	},
+	{
+		.procname	= "prio_autotune_min_msgs",
+		.data		= &homa_data.prio_autotune_min_msgs,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= homa_dointvec
+	},
 	{
 		.procname	= "priority_map",
 		.data		= &homa_data.priority_map,
@@ -418,6 +518,13 @@ static struct ctl_table homa_ctl_table[] = {
 		.mode		= 0644,
 		.proc_handler	= proc_dointvec
 	},
+	{
+		.procname	= "rtt_adaptive",
+		.data		= &homa_data.rtt_adaptive,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= homa_dointvec
+	},
 	{
 		.procname	= "temp",
 		.data		= homa_data.temp,
@@ -477,17 +584,20 @@ static struct ctl_table homa_ctl_table[] = {
 	{}
 };
 
-/* Sizes of the headers for each Homa packet type, in bytes. */
+/* Sizes of the headers for each Homa packet type, in bytes. For packets
+ * that end with a variable-length batch of acks, this is the size of the
+ * fixed portion only.
+ */
 static __u16 header_lengths[] = {
 	sizeof32(struct data_header),
-	sizeof32(struct grant_header),
-	sizeof32(struct resend_header),
+	offsetof(struct grant_header, acks),
+	offsetof(struct resend_header, acks),
 	sizeof32(struct unknown_header),
 	sizeof32(struct busy_header),
 	sizeof32(struct cutoffs_header),
 	sizeof32(struct freeze_header),
 	sizeof32(struct need_ack_header),
-	sizeof32(struct ack_header)
+	offsetof(struct ack_header, acks)
 };
 
 /* Used to remove sysctl values when the module is unloaded. */
@@ -565,6 +675,20 @@ static int __init homa_load(void) {
 		status = -ENOMEM;
 		goto out_cleanup;
 	}
+	metrics_raw_dir_entry = proc_create("homa_metrics_raw", S_IRUGO,
+			init_net.proc_net, &homa_metrics_raw_pops);
+	if (!metrics_raw_dir_entry) {
+		printk(KERN_ERR "couldn't create /proc/net/homa_metrics_raw\n");
+		status = -ENOMEM;
+		goto out_cleanup;
+	}
+	metrics_sum_dir_entry = proc_create("homa_metrics_sum", S_IRUGO,
+			init_net.proc_net, &homa_metrics_sum_pops);
+	if (!metrics_sum_dir_entry) {
+		printk(KERN_ERR "couldn't create /proc/net/homa_metrics_sum\n");
+		status = -ENOMEM;
+		goto out_cleanup;
+	}
 
 	homa_ctl_header = register_net_sysctl(&init_net, "net/homa",
 			homa_ctl_table);
@@ -580,6 +704,16 @@ static int __init homa_load(void) {
 		goto out_cleanup;
 	}
 
+	status = cpuhp_setup_state_nocalls(CPUHP_AP_ONLINE_DYN,
+			"net/homa:online", homa_offload_cpu_online,
+			homa_offload_cpu_offline);
+	if (status < 0) {
+		printk(KERN_ERR "Homa couldn't register for CPU hotplug "
+				"notifications: error %d\n", status);
+		goto out_cleanup;
+	}
+	homa_cpuhp_state = status;
+
 	timer_kthread = kthread_run(homa_timer_main, homa, "homa_timer");
 	if (IS_ERR(timer_kthread)) {
 		status = PTR_ERR(timer_kthread);
@@ -594,9 +728,15 @@ static int __init homa_load(void) {
 	return 0;
 
 out_cleanup:
+	if (homa_cpuhp_state >= 0) {
+		cpuhp_remove_state_nocalls(homa_cpuhp_state);
+		homa_cpuhp_state = -1;
+	}
 	homa_offload_end();
 	unregister_net_sysctl_table(homa_ctl_header);
 	proc_remove(metrics_dir_entry);
+	proc_remove(metrics_raw_dir_entry);
+	proc_remove(metrics_sum_dir_entry);
 	homa_destroy(homa);
 	inet_del_protocol(&homa_protocol, IPPROTO_HOMA);
 	inet_unregister_protosw(&homa_protosw);
@@ -619,11 +759,17 @@ static void __exit homa_unload(void) {
 
 	if (timer_kthread)
 		wake_up_process(timer_kthread);
+	if (homa_cpuhp_state >= 0) {
+		cpuhp_remove_state_nocalls(homa_cpuhp_state);
+		homa_cpuhp_state = -1;
+	}
 	if (homa_offload_end() != 0)
 		printk(KERN_ERR "Homa couldn't stop offloads\n");
 	wait_for_completion(&timer_thread_done);
 	unregister_net_sysctl_table(homa_ctl_header);
 	proc_remove(metrics_dir_entry);
+	proc_remove(metrics_raw_dir_entry);
+	proc_remove(metrics_sum_dir_entry);
 	homa_destroy(homa);
 	inet_del_protocol(&homa_protocol, IPPROTO_HOMA);
 	inet_unregister_protosw(&homa_protosw);
@@ -813,10 +959,48 @@ int homa_setsockopt(struct sock *sk, int level, int optname, sockptr_t optval,
 	__u64 start = get_cycles();
 	int ret;
 
+	if ((level == IPPROTO_HOMA) && (optname == SO_HOMA_SHARE_BUF)) {
+		struct socket *other;
+		int fd;
+
+		if (optlen != sizeof(fd))
+			return -EINVAL;
+		if (copy_from_sockptr(&fd, optval, sizeof(fd)))
+			return -EFAULT;
+		other = sockfd_lookup(fd, &ret);
+		if (!other)
+			return ret;
+		if (((other->sk->sk_family != AF_INET)
+				&& (other->sk->sk_family != AF_INET6))
+				|| (other->sk->sk_protocol != IPPROTO_HOMA))
+			ret = -EINVAL;
+		else
+			ret = homa_pool_share(hsk, homa_sk(other->sk));
+		sockfd_put(other);
+		INC_METRIC(so_set_buf_calls, 1);
+		INC_METRIC(so_set_buf_cycles, get_cycles() - start);
+		return ret;
+	}
+
+	if ((level == IPPROTO_HOMA) && (optname == SO_HOMA_RESPONSE_LENGTH)) {
+		int enable;
+
+		if (optlen != sizeof(enable))
+			return -EINVAL;
+		if (copy_from_sockptr(&enable, optval, sizeof(enable)))
+			return -EFAULT;
+		hsk->use_response_length = (enable != 0);
+		return 0;
+	}
+
+	/* Older applications don't provide the bpage_size field. */
 	if ((level != IPPROTO_HOMA) || (optname != SO_HOMA_SET_BUF)
-			|| (optlen != sizeof(struct homa_set_buf_args)))
+			|| ((optlen != sizeof(struct homa_set_buf_args))
+			&& (optlen != offsetof(struct homa_set_buf_args,
+			bpage_size))))
 		return -EINVAL;
 
+	memset(&args, 0, sizeof(args));
 	if (copy_from_sockptr(&args, optval, optlen))
 		return -EFAULT;
 
@@ -827,7 +1011,7 @@ int homa_setsockopt(struct sock *sk, int level, int optname, sockptr_t optval,
 		return -EFAULT;
 
 	homa_sock_lock(hsk, "homa_setsockopt SO_HOMA_SET_BUF");
-	ret = homa_pool_init(hsk, args.start, args.length);
+	ret = homa_pool_init(hsk, args.start, args.length, args.bpage_size);
 	homa_sock_unlock(hsk);
 	INC_METRIC(so_set_buf_calls, 1);
 	INC_METRIC(so_set_buf_cycles, get_cycles() - start);
@@ -875,11 +1059,23 @@ int homa_sendmsg(struct sock *sk, struct msghdr *msg, size_t length) {
 		result = -EINVAL;
 		goto error;
 	}
+
+	/* Applications compiled before @response_length was added pass a
+	 * smaller struct, and the kernel's conventions for user-space
+	 * control data (msg_controllen must be 0) mean we can't tell its
+	 * size; whatever follows their struct in memory must not be
+	 * mistaken for a response length. So, the full struct is read only
+	 * if the application has opted in with SO_HOMA_RESPONSE_LENGTH.
+	 */
+	memset(&args, 0, sizeof(args));
 	if (unlikely(copy_from_user(&args, msg->msg_control,
-			sizeof(args)))) {
+			hsk->use_response_length ? sizeof(args)
+			: offsetof(struct homa_sendmsg_args, response_length)))) {
 		result = -EFAULT;
 		goto error;
 	}
+	if (args.response_length > HOMA_MAX_MESSAGE_LENGTH)
+		args.response_length = HOMA_MAX_MESSAGE_LENGTH;
 	if (addr->in6.sin6_family != sk->sk_family) {
 		result = -EAFNOSUPPORT;
 		goto error;
@@ -908,6 +1104,7 @@ int homa_sendmsg(struct sock *sk, struct msghdr *msg, size_t length) {
 				ntohs(addr->in6.sin6_port), rpc->id,
 				length);
 		rpc->completion_cookie = args.completion_cookie;
+		homa_grant_pregrant(rpc, args.response_length);
 		result = homa_message_out_init(rpc, &msg->msg_iter, 1);
 		if (result)
 			goto error;
@@ -915,8 +1112,12 @@ int homa_sendmsg(struct sock *sk, struct msghdr *msg, size_t length) {
 		homa_rpc_unlock(rpc);
 		rpc = NULL;
 
-		if (unlikely(copy_to_user(msg->msg_control, &args,
-				sizeof(args)))) {
+		/* Only @id is returned, so that applications compiled with
+		 * the smaller (pre-@response_length) homa_sendmsg_args
+		 * aren't corrupted.
+		 */
+		if (unlikely(copy_to_user(msg->msg_control, &args.id,
+				sizeof(args.id)))) {
 			rpc = homa_find_client_rpc(hsk, args.id);
 			result = -EFAULT;
 			goto error;
@@ -1034,8 +1235,11 @@ int homa_recvmsg(struct sock *sk, struct msghdr *msg, size_t len, int flags,
 		result = -EINVAL;
 		goto done;
 	}
-	homa_pool_release_buffers(&hsk->buffer_pool, control.num_bpages,
-			control.bpage_offsets);
+	if (control.num_bpages > 0) {
+		homa_pool_release_buffers(hsk->buffer_pool,
+				control.num_bpages, control.bpage_offsets);
+		homa_pool_check_waiting(hsk->buffer_pool);
+	}
 	control.num_bpages = 0;
 
 	rpc = homa_wait_for_message(hsk, control.flags, control.id);
@@ -1049,6 +1253,25 @@ int homa_recvmsg(struct sock *sk, struct msghdr *msg, size_t len, int flags,
 	}
 	result = rpc->error ? rpc->error : rpc->msgin.length;
 
+	/* Record the RPC's latency (only for RPCs that completed normally). */
+	if (result >= 0) {
+		int bucket = homa_latency_bucket(get_cycles()
+				- rpc->start_cycles);
+
+		if (homa_is_client(rpc->id))
+			INC_METRIC(client_rpc_latency[homa_latency_size_class(
+					rpc->msgout.length)][bucket], 1);
+		else
+			INC_METRIC(server_rpc_latency[homa_latency_size_class(
+					rpc->msgin.length)][bucket], 1);
+	}
+
+	if (rpc->wakeup_cycles != 0) {
+		INC_METRIC(wakeup_recvmsg_latency[homa_latency_bucket(
+				get_cycles() - rpc->wakeup_cycles)], 1);
+		rpc->wakeup_cycles = 0;
+	}
+
 	/* Generate time traces on both ends for long elapsed times (used
 	 * for performance debugging).
 	 */
@@ -1129,7 +1352,8 @@ done:
 	finish = get_cycles();
 	tt_record3("homa_recvmsg returning id %d, length %d, bpage0 %d",
 			control.id, result,
-			control.bpage_offsets[0] >> HOMA_BPAGE_SHIFT);
+			hsk->buffer_pool ? control.bpage_offsets[0]
+			>> hsk->buffer_pool->bpage_shift : 0);
 	INC_METRIC(recv_cycles, finish - start);
 	return result;
 }
@@ -1233,10 +1457,11 @@ int homa_softirq(struct sk_buff *skb) {
 	struct sk_buff *packets, *other_pkts, *next;
 	struct sk_buff **prev_link, **other_link;
 	static __u64 last = 0;
-	__u64 start;
+	__u64 start, gro_cycles;
 	int header_offset;
 	int first_packet = 1;
 	int pull_length;
+	int steered_core = homa_softirq_core(skb);
 
 	start = get_cycles();
 	INC_METRIC(softirq_calls, 1);
@@ -1314,6 +1539,18 @@ int homa_softirq(struct sk_buff *skb) {
 			first_packet = 0;
 		}
 
+		/* Record how long the packet waited between GRO and SoftIRQ.
+		 * Packets that didn't pass through homa_gro_receive (e.g.
+		 * because GRO is disabled) contain whatever the sender put
+		 * where the time is kept; ignore values that are obviously
+		 * bogus.
+		 */
+		gro_cycles = homa_get_rcv_cycles(skb);
+		if ((gro_cycles != 0) && (gro_cycles <= start))
+			INC_METRIC(gro_softirq_latency[homa_latency_bucket(
+					start - gro_cycles)], 1);
+		homa_set_rcv_cycles(skb, start);
+
 		/* Check for FREEZE here, rather than in homa_incoming.c, so
 		 * it will work even if the RPC and/or socket are unknown.
 		 */
@@ -1344,50 +1581,85 @@ int homa_softirq(struct sk_buff *skb) {
 		homa_skb_free(skb);
 	}
 
-	/* Now process the longer packets. Each iteration of this loop
-	 * collects all of the packets for a particular RPC and dispatches
-	 * them.
+	/* Now process the longer packets. Each iteration of this loop makes
+	 * a single pass over the remaining packets, collecting the packets
+	 * for each RPC into a group (using a small hash table to find the
+	 * group for each packet), then dispatches the groups in the order
+	 * their RPCs first appeared. Packets for RPCs that don't fit in the
+	 * table are left for the next iteration.
 	 */
 	while (packets != NULL) {
-		struct in6_addr saddr, saddr2;
-		struct common_header *h2;
-		struct sk_buff *skb2;
-
-		skb = packets;
-		prev_link = &skb->next;
-		saddr = skb_canonical_ipv6_saddr(skb);
+		struct homa_softirq_group groups[HOMA_SOFTIRQ_GROUPS];
+		int buckets[1 << HOMA_SOFTIRQ_HASH_BITS];
+		struct homa_softirq_group *group = NULL;
+		struct in6_addr saddr;
+		int num_groups = 0;
+		int i, bucket;
+
+		for (i = 0; i < (1 << HOMA_SOFTIRQ_HASH_BITS); i++)
+			buckets[i] = -1;
 		other_pkts = NULL;
 		other_link = &other_pkts;
-		h = (struct common_header *) skb->data;
-		for (skb2 = skb->next; skb2 != NULL; skb2 = next) {
-			next = skb2->next;
-			h2 = (struct common_header *) skb2->data;
-			if (h2->sender_id == h->sender_id) {
-				saddr2 = skb_canonical_ipv6_saddr(skb2);
-				if (ipv6_addr_equal(&saddr, &saddr2)) {
-					*prev_link = skb2;
-					prev_link = &skb2->next;
-					continue;
-				}
+		for (skb = packets; skb != NULL; skb = next) {
+			next = skb->next;
+			skb->next = NULL;
+			h = (struct common_header *) skb->data;
+			saddr = skb_canonical_ipv6_saddr(skb);
+			bucket = hash_32(((__force __u32) h->sender_id)
+					^ ((__force __u32) saddr.s6_addr32[3]),
+					HOMA_SOFTIRQ_HASH_BITS);
+			for (i = buckets[bucket]; i >= 0; i = groups[i].next) {
+				group = &groups[i];
+				if ((group->sender_id == h->sender_id)
+						&& ipv6_addr_equal(&group->saddr,
+						&saddr))
+					break;
 			}
-			*other_link = skb2;
-			other_link = &skb2->next;
+			if (i >= 0) {
+				*group->tail = skb;
+				group->tail = &skb->next;
+				continue;
+			}
+			if (num_groups >= HOMA_SOFTIRQ_GROUPS) {
+				*other_link = skb;
+				other_link = &skb->next;
+				continue;
+			}
+			group = &groups[num_groups];
+			group->saddr = saddr;
+			group->sender_id = h->sender_id;
+			group->head = skb;
+			group->tail = &skb->next;
+			group->next = buckets[bucket];
+			buckets[bucket] = num_groups;
+			num_groups++;
 		}
-		*prev_link = NULL;
-		*other_link = NULL;
+		for (i = 0; i < num_groups; i++) {
 #ifdef __UNIT_TEST__
-		UNIT_LOG("; ", "id %lld, offsets", homa_local_id(h->sender_id));
-		for (skb2 = packets; skb2 != NULL; skb2 = skb2->next) {
-			struct data_header *h3 = (struct data_header *)
-					skb2->data;
-			UNIT_LOG("", " %d", ntohl(h3->seg.offset));
-		}
+			struct sk_buff *skb2;
+
+			h = (struct common_header *) groups[i].head->data;
+			UNIT_LOG("; ", "id %lld, offsets",
+					homa_local_id(h->sender_id));
+			for (skb2 = groups[i].head; skb2 != NULL;
+					skb2 = skb2->next) {
+				struct data_header *h3 = (struct data_header *)
+						skb2->data;
+				UNIT_LOG("", " %d", ntohl(h3->seg.offset));
+			}
 #endif
-		homa_dispatch_pkts(packets, homa);
+			homa_dispatch_pkts(groups[i].head, homa);
+		}
 		packets = other_pkts;
 	}
 
-	atomic_dec(&homa_cores[raw_smp_processor_id()]->softirq_backlog);
+	/* Only batches steered by homa_set_softirq_cpu were counted in
+	 * softirq_backlog, and they were counted against the chosen core
+	 * (which isn't necessarily this one, e.g. if RPS was bypassed).
+	 */
+	if (steered_core >= 0)
+		atomic_dec_if_positive(
+				&homa_cores[steered_core]->softirq_backlog);
 	INC_METRIC(softirq_cycles, get_cycles() - start);
 	return 0;
 }
@@ -1599,6 +1871,88 @@ int homa_metrics_release(struct inode *inode, struct file *file)
 	return 0;
 }
 
+/**
+ * homa_metrics_raw_open() - This function is invoked when
+ * /proc/net/homa_metrics_raw is opened.
+ * @inode:    The inode corresponding to the file.
+ * @file:     Information about the open file.
+ *
+ * Return: 0 for success, otherwise a negative errno.
+ */
+int homa_metrics_raw_open(struct inode *inode, struct file *file)
+{
+	/* Each open gets its own snapshot, so (unlike homa_metrics_open)
+	 * there's no need to synchronize with other opens.
+	 */
+	file->private_data = homa_metrics_snapshot(0);
+	if (!file->private_data)
+		return -ENOMEM;
+	return 0;
+}
+
+/**
+ * homa_metrics_sum_open() - This function is invoked when
+ * /proc/net/homa_metrics_sum is opened.
+ * @inode:    The inode corresponding to the file.
+ * @file:     Information about the open file.
+ *
+ * Return: 0 for success, otherwise a negative errno.
+ */
+int homa_metrics_sum_open(struct inode *inode, struct file *file)
+{
+	file->private_data = homa_metrics_snapshot(1);
+	if (!file->private_data)
+		return -ENOMEM;
+	return 0;
+}
+
+/**
+ * homa_metrics_raw_read() - This function is invoked to handle read kernel
+ * calls on /proc/net/homa_metrics_raw and /proc/net/homa_metrics_sum.
+ * @file:    Information about the file being read.
+ * @buffer:  Address in user space of the buffer in which data from the file
+ *           should be returned.
+ * @length:  Number of bytes available at @buffer.
+ * @offset:  Current read offset within the file.
+ *
+ * Return: the number of bytes returned at @buffer. 0 means the end of the
+ * file was reached, and a negative number indicates an error (-errno).
+ */
+ssize_t homa_metrics_raw_read(struct file *file, char __user *buffer,
+		size_t length, loff_t *offset)
+{
+	struct homa_metrics_raw_header *header = file->private_data;
+	size_t total, copied;
+
+	total = sizeof(*header) + header->schema_length + header->num_cores
+			* header->num_counters * sizeof(__u64);
+	if (*offset >= total)
+		return 0;
+	copied = total - *offset;
+	if (copied > length)
+		copied = length;
+	if (copy_to_user(buffer, ((char *) header) + *offset, copied))
+		return -EFAULT;
+	*offset += copied;
+	return copied;
+}
+
+/**
+ * homa_metrics_raw_release() - This function is invoked when the last
+ * reference to an open /proc/net/homa_metrics_raw or
+ * /proc/net/homa_metrics_sum is closed.
+ * @inode:    The inode corresponding to the file.
+ * @file:     Information about the open file.
+ *
+ * Return: always 0.
+ */
+int homa_metrics_raw_release(struct inode *inode, struct file *file)
+{
+	vfree(file->private_data);
+	file->private_data = NULL;
+	return 0;
+}
+
 /**
  * homa_dointvec() - This function is a wrapper around proc_dointvec. It is
  * invoked to read and write sysctl values and also update other values
@@ -1622,6 +1976,8 @@ int homa_dointvec(struct ctl_table *table, int write,
 		 */
 		homa_incoming_sysctl_changed(homa);
 		homa_outgoing_sysctl_changed(homa);
+		homa_engine_sysctl_changed(homa);
+		homa_prio_sysctl_changed(homa);
 
 		/* For this value, only call the method when this
 		 * particular value was written (don't want to increment
@@ -1712,6 +2068,16 @@ int homa_sysctl_softirq_cores(struct ctl_table *table, int write,
 		result = proc_dointvec(&table_copy, write, buffer, lenp, ppos);
 		if (result != 0)
 			goto done;
+
+		/* A negative first value means "compute the SoftIRQ cores
+		 * automatically from the CPU topology".
+		 */
+		if (values[0] < 0) {
+			homa->gen3_auto_cores = 1;
+			homa_gen3_default_cores(-1);
+			goto done;
+		}
+		homa->gen3_auto_cores = 0;
 		for (i = 0; i < max_values;
 				i += NUM_GEN3_SOFTIRQ_CORES + 1) {
 			int j;
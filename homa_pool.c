@@ -9,11 +9,8 @@
  */
 #define MIN_POOL_SIZE 2
 
-/* Used when determining how many bpages to consider for allocation. */
-#define MIN_EXTRA 4
-
 /* When running unit tests, allow HOMA_BPAGE_SIZE and HOMA_BPAGE_SHIFT
- * to be overriden.
+ * (the default bpage size) to be overriden.
  */
 #ifdef __UNIT_TEST__
 #include "mock.h"
@@ -23,39 +20,121 @@
 #define HOMA_BPAGE_SHIFT mock_bpage_shift
 #endif
 
+/**
+ * homa_pool_reserve() - Return the number of bpages in @pool that must
+ * remain free after allocating space for a message that needs more than
+ * one bpage (the reserve is for messages that fit in a single bpage).
+ * @pool:        Pool of interest.
+ * @num_bpages:  Number of bpages needed by the message.
+ */
+static inline int homa_pool_reserve(struct homa_pool *pool, int num_bpages)
+{
+	int reserve = (pool->num_bpages * pool->homa->bpage_reserve_pct) / 100;
+
+	/* A message too large to fit alongside the full reserve could
+	 * never be admitted, so it gets to use part of the reserve.
+	 */
+	if (reserve > (pool->num_bpages - num_bpages))
+		reserve = pool->num_bpages - num_bpages;
+	return (reserve > 0) ? reserve : 0;
+}
+
+/**
+ * homa_pool_peer_limited() - Returns nonzero if allocating space for a
+ * message would cause its peer to tie up more than its share of @pool.
+ * The caller must own @pool->lock.
+ * @pool:        Pool from which space would be allocated.
+ * @rpc:         RPC whose incoming message needs space.
+ * @num_bpages:  Number of bpages the message will require.
+ */
+static inline int homa_pool_peer_limited(struct homa_pool *pool,
+		struct homa_rpc *rpc, int num_bpages)
+{
+	int limit = (pool->num_bpages * pool->homa->bpage_peer_max_pct) / 100;
+	int peer_bpages;
+
+	if (limit <= 0)
+		return 0;
+	peer_bpages = homa_pool_peer_bpages(pool, rpc->peer);
+
+	/* A peer with nothing charged can always get space, so that even
+	 * a message larger than the limit makes progress eventually.
+	 */
+	return (peer_bpages > 0) && ((peer_bpages + num_bpages) > limit);
+}
+
 /**
  * set_bpages_needed() - Set the bpages_needed field of @pool based
- * on the length of the first RPC that's waiting for buffer space.
- * The caller must own the lock for @pool->hsk.
+ * on the length of the first RPC that's waiting for buffer space and
+ * isn't held back by its peer's limit (such RPCs are reconsidered when
+ * their peer's messages complete; see homa_pool_uncharge). The caller
+ * must own @pool->lock.
+ * Return:  The RPC that bpages_needed is based on, or NULL if there is
+ *          none (bpages_needed is then INT_MAX).
  */
-static void inline set_bpages_needed(struct homa_pool *pool) {
-	struct homa_rpc *rpc = list_first_entry(&pool->hsk->waiting_for_bufs,
-			struct homa_rpc, buf_links);
-	pool->bpages_needed = (rpc->msgin.length + HOMA_BPAGE_SIZE - 1)
-			>> HOMA_BPAGE_SHIFT;
+static struct homa_rpc *set_bpages_needed(struct homa_pool *pool)
+{
+	struct homa_rpc *rpc;
+	int needed;
+
+	list_for_each_entry(rpc, &pool->waiting_for_bufs, buf_links) {
+		needed = (rpc->msgin.length + pool->bpage_size - 1)
+				>> pool->bpage_shift;
+		if (rpc->msgin.length >= pool->bpage_size) {
+			if (homa_pool_peer_limited(pool, rpc, needed))
+				continue;
+			needed += homa_pool_reserve(pool, needed);
+		}
+		pool->bpages_needed = needed;
+		return rpc;
+	}
+	pool->bpages_needed = INT_MAX;
+	return NULL;
 }
 
 /**
- * homa_pool_init() - Initialize a homa_pool; any previous contents of the
- * objects are overwritten.
- * @hsk:          Socket containing the pool to initialize.
+ * homa_pool_init() - Create a new homa_pool and make it the buffer pool
+ * for a socket.
+ * @hsk:          Socket that will use the new pool; must not already have
+ *                a pool (RPCs may hold buffers from it, so it can't be
+ *                replaced). Must be locked by caller (unless it isn't yet
+ *                visible to other threads).
  * @region:       First byte of the memory region for the pool, allocated
  *                by the application; must be page-aligned.
  * @region_size   Total number of bytes available at @buf_region.
+ * @bpage_size:   Number of bytes in each bpage: must be a power of two
+ *                between HOMA_BPAGE_SIZE and HOMA_MAX_BPAGE_SIZE, or 0
+ *                to use HOMA_BPAGE_SIZE.
  * Return: Either zero (for success) or a negative errno for failure.
  */
-int homa_pool_init(struct homa_sock *hsk, void *region, __u64 region_size)
+int homa_pool_init(struct homa_sock *hsk, void *region, __u64 region_size,
+		__u32 bpage_size)
 {
-	int i, result;
-	struct homa_pool *pool = &hsk->buffer_pool;
+	int i, n, result;
+	struct homa_pool *pool;
 
+	if (hsk->buffer_pool)
+		return -EINVAL;
 	if (((__u64) region) & ~PAGE_MASK)
 		return -EINVAL;
-	pool->hsk = hsk;
+	if (bpage_size == 0)
+		bpage_size = HOMA_BPAGE_SIZE;
+	if ((bpage_size < HOMA_BPAGE_SIZE) || (bpage_size > HOMA_MAX_BPAGE_SIZE)
+			|| (bpage_size & (bpage_size - 1)))
+		return -EINVAL;
+	pool = (struct homa_pool *) kmalloc(sizeof(*pool), GFP_ATOMIC);
+	if (!pool)
+		return -ENOMEM;
+	pool->homa = hsk->homa;
+	atomic_set(&pool->refs, 1);
 	pool->region = (char *) region;
-	pool->num_bpages = region_size >> HOMA_BPAGE_SHIFT;
+	pool->mm = current->mm;
+	pool->bpage_size = bpage_size;
+	pool->bpage_shift = ilog2(bpage_size);
+	pool->num_bpages = region_size >> pool->bpage_shift;
 	pool->descriptors = NULL;
 	pool->cores = NULL;
+	pool->free_space = NULL;
 	if (pool->num_bpages < MIN_POOL_SIZE) {
 		result = -EINVAL;
 		goto error;
@@ -75,7 +154,11 @@ int homa_pool_init(struct homa_sock *hsk, void *region, __u64 region_size)
 		bp->expiration = 0;
 	}
 	atomic_set(&pool->free_bpages, pool->num_bpages);
+	spin_lock_init(&pool->lock);
+	INIT_LIST_HEAD(&pool->waiting_for_bufs);
+	INIT_LIST_HEAD(&pool->charged_rpcs);
 	pool->bpages_needed = INT_MAX;
+	atomic64_set(&pool->next_reclaim, 0);
 
 	/* Allocate and initialize core-specific data. */
 	pool->cores = (struct homa_pool_core *) kmalloc(nr_cpu_ids *
@@ -85,13 +168,50 @@ int homa_pool_init(struct homa_sock *hsk, void *region, __u64 region_size)
 		goto error;
 	}
 	pool->num_cores = nr_cpu_ids;
+	pool->num_nodes = 1;
 	for (i = 0; i < pool->num_cores; i++) {
-		pool->cores[i].page_hint = 0;
-		pool->cores[i].allocated = 0;
-		pool->cores[i].next_candidate = 0;
+		struct homa_pool_core *core = &pool->cores[i];
+		int phys, llc, node;
+
+		spin_lock_init(&core->lock);
+		core->page_hint = 0;
+		core->allocated = 0;
+		core->num_free = 0;
+		if (!homa_cpu_topology(i, &phys, &llc, &node) || (node < 0))
+			node = 0;
+		core->node = node % HOMA_POOL_MAX_NODES;
+		if (core->node >= pool->num_nodes)
+			pool->num_nodes = core->node + 1;
+	}
+
+	/* Divide the region into equal slices, one per node, in node order.
+	 * Initially all bpages are on the free stacks for their nodes,
+	 * arranged so that those with the lowest indexes are allocated first.
+	 */
+	pool->free_space = (__u32 *) kmalloc(pool->num_bpages * sizeof(__u32),
+			GFP_ATOMIC);
+	if (!pool->free_space) {
+		result = -ENOMEM;
+		goto error;
+	}
+	for (n = 0; n < pool->num_nodes; n++) {
+		struct homa_pool_node *node = &pool->nodes[n];
+
+		spin_lock_init(&node->lock);
+		node->first_bpage = (n * pool->num_bpages) / pool->num_nodes;
+		node->num_bpages = (((n + 1) * pool->num_bpages)
+				/ pool->num_nodes) - node->first_bpage;
+		node->free_stack = &pool->free_space[node->first_bpage];
+		for (i = 0; i < node->num_bpages; i++) {
+			node->free_stack[i] = node->first_bpage
+					+ node->num_bpages - 1 - i;
+			pool->descriptors[node->first_bpage + i].node = n;
+		}
+		node->free_top = node->num_bpages;
 	}
 	pool->check_waiting_invoked = 0;
 
+	hsk->buffer_pool = pool;
 	return 0;
 
 	error:
@@ -99,22 +219,315 @@ int homa_pool_init(struct homa_sock *hsk, void *region, __u64 region_size)
 		kfree(pool->descriptors);
 	if (pool->cores)
 		kfree(pool->cores);
-	pool->region = NULL;
+	if (pool->free_space)
+		kfree(pool->free_space);
+	kfree(pool);
 	return result;
 }
 
 /**
- * homa_pool_destroy() - Destructor for homa_pool. After this method
- * returns, the object should not be used unless it has been reinitialized.
+ * homa_pool_destroy() - Destructor for homa_pool; frees the pool and
+ * all of its resources. Normally invoked by homa_pool_detach when the
+ * last socket stops using the pool.
  * @pool: Pool to destroy.
  */
 void homa_pool_destroy(struct homa_pool *pool)
 {
-	if (!pool->region)
-		return;
 	kfree(pool->descriptors);
 	kfree(pool->cores);
-	pool->region = NULL;
+	kfree(pool->free_space);
+	kfree(pool);
+}
+
+/**
+ * homa_pool_detach() - Disconnect a socket from its buffer pool (if any);
+ * the pool is destroyed if no other socket is using it.
+ * @hsk:   Socket whose pool is no longer needed. Must be locked by caller
+ *         (unless it isn't visible to other threads) and must not have
+ *         any RPCs waiting for buffer space.
+ */
+void homa_pool_detach(struct homa_sock *hsk)
+{
+	struct homa_pool *pool = hsk->buffer_pool;
+
+	if (!pool)
+		return;
+	hsk->buffer_pool = NULL;
+	if (atomic_dec_and_test(&pool->refs))
+		homa_pool_destroy(pool);
+}
+
+/**
+ * homa_pool_share() - Arrange for a socket to use the same buffer pool
+ * as another socket, so that buffer space can be sized for the aggregate
+ * load of a group of sockets rather than the peak load of each one.
+ * @hsk:    Socket that will use the pool; must not already have a pool.
+ *          Must not be locked by caller.
+ * @other:  Socket whose pool @hsk should share. The pool must have been
+ *          created by the current process, since its region is an address
+ *          in that process's address space (@other may have been passed
+ *          in from another process). Must not be locked by caller.
+ * Return:  Either zero (for success) or a negative errno for failure.
+ */
+int homa_pool_share(struct homa_sock *hsk, struct homa_sock *other)
+{
+	struct homa_pool *pool;
+
+	/* Take a reference while holding other's lock, so the pool can't
+	 * be destroyed out from under us.
+	 */
+	homa_sock_lock(other, "homa_pool_share");
+	pool = other->buffer_pool;
+	if (pool && (pool->mm != current->mm))
+		pool = NULL;
+	if (pool)
+		atomic_inc(&pool->refs);
+	homa_sock_unlock(other);
+	if (!pool)
+		return -EINVAL;
+
+	homa_sock_lock(hsk, "homa_pool_share #2");
+	if (hsk->buffer_pool) {
+		homa_sock_unlock(hsk);
+		if (atomic_dec_and_test(&pool->refs))
+			homa_pool_destroy(pool);
+		return -EINVAL;
+	}
+	hsk->buffer_pool = pool;
+	homa_sock_unlock(hsk);
+	return 0;
+}
+
+/**
+ * homa_pool_pop_node() - Remove a free bpage from the free stack for a
+ * node (without going through any core's cache).
+ * @pool:      Pool from which to allocate.
+ * @node:      Index in @pool->nodes of the desired slice.
+ *
+ * Return:     The index of a bpage that is now owned by the caller, or -1
+ *             if the node's free stack is empty.
+ */
+static int homa_pool_pop_node(struct homa_pool *pool, int node)
+{
+	struct homa_pool_node *pn = &pool->nodes[node];
+	int result = -1;
+
+	if (READ_ONCE(pn->free_top) == 0)
+		return -1;
+	spin_lock_bh(&pn->lock);
+	if (pn->free_top > 0) {
+		pn->free_top--;
+		result = pn->free_stack[pn->free_top];
+	}
+	spin_unlock_bh(&pn->lock);
+	return result;
+}
+
+/**
+ * homa_pool_pop() - Remove a free bpage from the cache for a core,
+ * refilling the cache from the free stack for the core's node if it
+ * is empty.
+ * @pool:      Pool from which to allocate.
+ * @core_num:  Index of the core whose cache should be used.
+ *
+ * Return:     The index of a bpage that is now owned by the caller, or -1
+ *             if both the core's cache and its node's stack are empty.
+ */
+int homa_pool_pop(struct homa_pool *pool, int core_num)
+{
+	struct homa_pool_core *core = &pool->cores[core_num];
+	int result = -1;
+
+	spin_lock_bh(&core->lock);
+	if (core->num_free == 0) {
+		struct homa_pool_node *node = &pool->nodes[core->node];
+		int i, count;
+
+		/* Refill in reverse order so that bpages come out of the
+		 * cache in the same order they would have come out of the
+		 * node's stack.
+		 */
+		spin_lock_bh(&node->lock);
+		count = node->free_top;
+		if (count > HOMA_POOL_BATCH)
+			count = HOMA_POOL_BATCH;
+		for (i = count - 1; i >= 0; i--) {
+			node->free_top--;
+			core->free[i] = node->free_stack[node->free_top];
+		}
+		spin_unlock_bh(&node->lock);
+		core->num_free = count;
+		if (count > 0)
+			INC_METRIC(bpage_refills, 1);
+	}
+	if (core->num_free > 0) {
+		core->num_free--;
+		result = core->free[core->num_free];
+	}
+	spin_unlock_bh(&core->lock);
+	return result;
+}
+
+/**
+ * homa_pool_push() - Make a free bpage available for allocation by
+ * adding it to the cache for the current core. If the cache is full,
+ * its oldest entries are moved to the free stack for the core's node.
+ * If the bpage belongs to a different node than the current core, it
+ * is returned directly to that node's stack, so that core caches only
+ * hold local bpages.
+ * @pool:      Pool containing the bpage.
+ * @index:     Index of a bpage whose reference count just became zero.
+ */
+void homa_pool_push(struct homa_pool *pool, __u32 index)
+{
+	struct homa_pool_core *core = &pool->cores[raw_smp_processor_id()];
+	struct homa_pool_node *node;
+
+	if (pool->descriptors[index].node != core->node) {
+		node = &pool->nodes[pool->descriptors[index].node];
+		spin_lock_bh(&node->lock);
+		node->free_stack[node->free_top] = index;
+		node->free_top++;
+		spin_unlock_bh(&node->lock);
+		return;
+	}
+
+	spin_lock_bh(&core->lock);
+	if (core->num_free >= HOMA_POOL_CACHE_SIZE) {
+		int i;
+
+		node = &pool->nodes[core->node];
+		spin_lock_bh(&node->lock);
+		for (i = 0; i < HOMA_POOL_BATCH; i++) {
+			node->free_stack[node->free_top] = core->free[i];
+			node->free_top++;
+		}
+		spin_unlock_bh(&node->lock);
+		core->num_free -= HOMA_POOL_BATCH;
+		memmove(core->free, &core->free[HOMA_POOL_BATCH],
+				core->num_free * sizeof(core->free[0]));
+	}
+	core->free[core->num_free] = index;
+	core->num_free++;
+	spin_unlock_bh(&core->lock);
+}
+
+/**
+ * homa_pool_steal() - Take a free bpage from the cache of some other core.
+ * Invoked when the local cache and the relevant free stack are both empty.
+ * @pool:      Pool from which to allocate.
+ * @core_num:  Index of the core that needs a bpage.
+ * @node:      Only consider cores whose caches hold bpages from this
+ *             node's slice; -1 means any core.
+ *
+ * Return:     The index of a bpage that is now owned by the caller, or -1
+ *             if no suitable core had a free bpage cached.
+ */
+int homa_pool_steal(struct homa_pool *pool, int core_num, int node)
+{
+	int i, result = -1;
+
+	for (i = 1; i < pool->num_cores; i++) {
+		struct homa_pool_core *other;
+
+		other = &pool->cores[(core_num + i) % pool->num_cores];
+		if ((node >= 0) && (other->node != node))
+			continue;
+		if (READ_ONCE(other->num_free) == 0)
+			continue;
+		spin_lock_bh(&other->lock);
+		if (other->num_free > 0) {
+			other->num_free--;
+			result = other->free[other->num_free];
+		}
+		spin_unlock_bh(&other->lock);
+		if (result >= 0) {
+			INC_METRIC(bpage_steals, 1);
+			break;
+		}
+	}
+	return result;
+}
+
+/**
+ * homa_pool_get_free() - Find a free bpage, preferring one from a given
+ * node's slice of the region.
+ * @pool:      Pool from which to allocate.
+ * @core_num:  Index of the core that needs a bpage.
+ * @node:      Index in @pool->nodes of the preferred slice.
+ *
+ * Return:     The index of a bpage that is now owned by the caller, or -1
+ *             if no free bpage could be found (a free page may be in
+ *             transit between stacks, so the caller may want to retry).
+ */
+static int homa_pool_get_free(struct homa_pool *pool, int core_num, int node)
+{
+	int i, result;
+
+	if (node == pool->cores[core_num].node)
+		result = homa_pool_pop(pool, core_num);
+	else
+		result = homa_pool_pop_node(pool, node);
+	if (result < 0)
+		result = homa_pool_steal(pool, core_num, node);
+	if ((result >= 0) || (pool->num_nodes == 1))
+		return result;
+
+	/* The preferred slice is exhausted; fall back to other nodes. */
+	for (i = 1; i < pool->num_nodes; i++) {
+		result = homa_pool_pop_node(pool, (node + i) % pool->num_nodes);
+		if (result >= 0)
+			break;
+	}
+	if (result < 0)
+		result = homa_pool_steal(pool, core_num, -1);
+	if (result >= 0)
+		INC_METRIC(bpage_remote_allocs, 1);
+	return result;
+}
+
+/**
+ * homa_pool_reclaim() - Scan all of the bpages in a pool and free any that
+ * are owned by a core but contain no allocations and whose lease has
+ * expired. Invoked only when the pool has run out of free bpages.
+ * @pool:      Pool to scan.
+ * @now:       Current time, in get_cycles units.
+ *
+ * Return:     The number of bpages that were freed.
+ */
+int homa_pool_reclaim(struct homa_pool *pool, __u64 now)
+{
+	int i, freed = 0;
+
+	for (i = 0; i < pool->num_bpages; i++) {
+		struct homa_bpage *bpage = &pool->descriptors[i];
+
+		/* Do a quick check without locking the page, and if the
+		 * page looks promising, then lock it and check again
+		 * (must check again in case the owner allocated from it).
+		 */
+		if ((atomic_read(&bpage->refs) != 1) || (bpage->owner < 0)
+				|| (bpage->expiration > now))
+			continue;
+		if (!spin_trylock_bh(&bpage->lock))
+			continue;
+		if ((atomic_read(&bpage->refs) != 1) || (bpage->owner < 0)
+				|| (bpage->expiration > now)) {
+			spin_unlock_bh(&bpage->lock);
+			continue;
+		}
+		bpage->owner = -1;
+		atomic_set(&bpage->refs, 0);
+		spin_unlock_bh(&bpage->lock);
+
+		/* Must make the page available before incrementing
+		 * free_bpages; see homa_pool_get_pages.
+		 */
+		homa_pool_push(pool, i);
+		atomic_inc(&pool->free_bpages);
+		freed++;
+	}
+	return freed;
 }
 
 /**
@@ -128,150 +541,231 @@ void homa_pool_destroy(struct homa_pool *pool)
  * @set_owner:    If nonzero, the current core is marked as owner of all
  *                of the allocated pages (and the expiration time is also
  *                set). Otherwise the pages are left unowned.
+ * @node:         Index in @pool->nodes of the slice from which to allocate
+ *                if possible (pages come from other slices only if this
+ *                one is exhausted); -1 means use the current core's node.
  * Return: 0 for success, -1 if there wasn't enough free space in the pool.
 */
 int homa_pool_get_pages(struct homa_pool *pool, int num_pages, __u32 *pages,
-		int set_owner)
+		int set_owner, int node)
 {
 	int alloced = 0;
 	__u64 now = get_cycles();
-	int limit = 0;
 	int core_num = raw_smp_processor_id();
-	struct homa_pool_core *core = &pool->cores[core_num];
+	__u64 next_reclaim;
+
+	if ((node < 0) || (node >= pool->num_nodes))
+		node = pool->cores[core_num].node;
 
 	if (atomic_sub_return(num_pages, &pool->free_bpages) < 0) {
 		atomic_add(num_pages, &pool->free_bpages);
-		return -1;
+
+		/* Before giving up, see if any bpages are owned by cores
+		 * that haven't used them recently. Leases don't expire
+		 * often, so there's no point in rescanning the pool on
+		 * every failed allocation; only one core may scan per
+		 * lease period.
+		 */
+		next_reclaim = atomic64_read(&pool->next_reclaim);
+		if ((now < next_reclaim) || (atomic64_cmpxchg_relaxed(
+				&pool->next_reclaim, next_reclaim,
+				now + pool->homa->bpage_lease_cycles)
+				!= next_reclaim))
+			return -1;
+		if (homa_pool_reclaim(pool, now) == 0)
+			return -1;
+		if (atomic_sub_return(num_pages, &pool->free_bpages) < 0) {
+			atomic_add(num_pages, &pool->free_bpages);
+			return -1;
+		}
 	}
 
 	/* Once we get to this point we know we will be able to find
-	 * enough free pages; now we just have to find them.
+	 * enough free pages: every free bpage is pushed onto a stack before
+	 * free_bpages is incremented for it. However, the pages may be
+	 * in the caches of other cores, and a page may be in transit between
+	 * stacks when we look, so we may have to try more than once.
 	 */
 	while (alloced != num_pages) {
 		struct homa_bpage *bpage;
-		int cur, ref_count;
-
-		/* If we don't need to use all of the bpages in the pool,
-		 * then try to use only the ones with low indexes. This
-		 * will reduce the cache footprint for the pool by reusing
-		 * a few bpages over and over. Specifically this code will
-		 * not consider any candidate page whose index is >= limit.
-		 * Limit is chosen to make sure there are a reasonable
-		 * number of free pages in the range, so we won't have to
-		 * check a huge number of pages.
-		 */
-		if (limit == 0) {
-			int extra;
-			limit = pool->num_bpages
-					- atomic_read(&pool->free_bpages);
-			extra = limit>>2;
-			limit += (extra < MIN_EXTRA) ? MIN_EXTRA : extra;
-			if (limit > pool->num_bpages)
-				limit = pool->num_bpages;
-		}
+		int cur;
 
-		cur = core->next_candidate;
-		core->next_candidate++;
-		if (cur >= limit) {
-			core->next_candidate = 0;
-
-			/* Must recompute the limit for each new loop through
-			 * the bpage array: we may need to consider a larger
-			 * range of pages because of concurrent allocations.
-			 */
-			limit = 0;
+		cur = homa_pool_get_free(pool, core_num, node);
+		if (cur < 0)
 			continue;
-		}
-		bpage = &pool->descriptors[cur];
 
-		/* Figure out whether this candidate is free (or can be
-		 * stolen). Do a quick check without locking the page, and
-		 * if the page looks promising, then lock it and check again
-		 * (must check again in case someone else snuck in and
-		 * grabbed the page).
+		/* No-one else can access this bpage while it is free, so
+		 * there's no need to lock it.
 		 */
-		ref_count = atomic_read(&bpage->refs);
-		if ((ref_count >= 2) || ((ref_count == 1) && ((bpage->owner < 0)
-				|| (bpage->expiration > now))))
-			continue;
-		if (!spin_trylock_bh(&bpage->lock))
-			continue;
-		ref_count = atomic_read(&bpage->refs);
-		if ((ref_count >= 2) || ((ref_count == 1) && ((bpage->owner < 0)
-				|| (bpage->expiration > now)))) {
-			spin_unlock_bh(&bpage->lock);
-			continue;
-		}
-		if (bpage->owner >= 0)
-			atomic_inc(&pool->free_bpages);
+		bpage = &pool->descriptors[cur];
+		INC_METRIC(bpage_node_allocs[bpage->node], 1);
 		if (set_owner) {
 			atomic_set(&bpage->refs, 2);
 			bpage->owner = core_num;
 			bpage->expiration = now
-					+ pool->hsk->homa->bpage_lease_cycles;
+					+ pool->homa->bpage_lease_cycles;
 		} else {
 			atomic_set(&bpage->refs, 1);
 			bpage->owner = -1;
 		}
-		spin_unlock_bh(&bpage->lock);
 		pages[alloced] = cur;
 		alloced++;
 	}
 	return 0;
 }
 
+/**
+ * homa_pool_admit() - Decide whether a message that needs more than one
+ * bpage may be allocated buffer space now. Such messages may not use the
+ * bpages reserved for short messages, and a single peer may not tie up
+ * too much of the pool in messages that are still being received. These
+ * restrictions ensure that short messages (and messages from other
+ * peers) can always make progress, so buffer exhaustion reduces
+ * throughput rather than causing deadlock.
+ * @pool:        Pool from which space would be allocated.
+ * @rpc:         RPC whose incoming message needs space.
+ * @num_bpages:  Number of bpages the message will require.
+ *
+ * Return:       Nonzero means space may be allocated; zero means the RPC
+ *               must wait.
+ */
+int homa_pool_admit(struct homa_pool *pool, struct homa_rpc *rpc,
+		int num_bpages)
+{
+	if ((atomic_read(&pool->free_bpages) - num_bpages)
+			< homa_pool_reserve(pool, num_bpages)) {
+		INC_METRIC(buffer_reserve_waits, 1);
+		return 0;
+	}
+	if (!list_empty(&pool->charged_rpcs)) {
+		int limited;
+
+		spin_lock_bh(&pool->lock);
+		limited = homa_pool_peer_limited(pool, rpc, num_bpages);
+		spin_unlock_bh(&pool->lock);
+		if (limited) {
+			INC_METRIC(buffer_peer_waits, 1);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/**
+ * homa_pool_peer_bpages() - Returns the number of bpages in a pool that
+ * are currently charged to messages from a given peer. Only messages
+ * using @pool are counted, so a peer's activity in one pool doesn't hold
+ * back its messages in another. The caller must own @pool->lock.
+ * @pool:     Pool whose charges should be counted.
+ * @peer:     Peer whose messages are of interest.
+ */
+int homa_pool_peer_bpages(struct homa_pool *pool, struct homa_peer *peer)
+{
+	struct homa_rpc *rpc;
+	int bpages = 0;
+
+	list_for_each_entry(rpc, &pool->charged_rpcs, msgin.charged_links) {
+		if (rpc->peer == peer)
+			bpages += rpc->msgin.charged_bpages;
+	}
+	return bpages;
+}
+
+/**
+ * homa_pool_uncharge() - Invoked when an RPC's incoming message has been
+ * completely received (or the RPC is being freed); its bpages no longer
+ * count against the limit for its peer. This may allow RPCs waiting for
+ * buffer space to proceed, so the caller must invoke
+ * homa_pool_check_waiting later, once it holds no locks.
+ * @rpc:     RPC whose message no longer needs to be charged. Must be locked
+ *           by caller.
+ */
+void homa_pool_uncharge(struct homa_rpc *rpc)
+{
+	struct homa_pool *pool = rpc->hsk->buffer_pool;
+
+	if (rpc->msgin.charged_bpages == 0)
+		return;
+	spin_lock_bh(&pool->lock);
+	list_del_init(&rpc->msgin.charged_links);
+	rpc->msgin.charged_bpages = 0;
+
+	/* A waiting RPC from this peer may no longer be held back, so
+	 * bpages_needed must be recomputed.
+	 */
+	if (!list_empty(&pool->waiting_for_bufs))
+		set_bpages_needed(pool);
+	spin_unlock_bh(&pool->lock);
+}
+
 /**
  * homa_pool_allocate() - Allocate buffer space for an RPC.
  * @rpc:  RPC that needs space allocated for its incoming message (space must
  *        not already have been allocated). The fields @msgin->num_buffers
  *        and @msgin->buffers are filled in. Must be locked by caller.
  * Return: The return value is normally 0, which means either buffer space
- * was allocated or the @rpc was queued on @hsk->waiting. If a fatal error
- * occurred, such as no buffer pool present, then a negative errno is
- * returned.
+ * was allocated or the @rpc was queued on the pool's waiting_for_bufs. If
+ * a fatal error occurred, such as no buffer pool present, then a negative
+ * errno is returned.
  */
 int homa_pool_allocate(struct homa_rpc *rpc)
 {
-	struct homa_pool *pool = &rpc->hsk->buffer_pool;
-	int full_pages, partial, i, core_id;
+	struct homa_pool *pool = rpc->hsk->buffer_pool;
+	int full_pages, partial, i, core_id, copy_core;
 	__u32 pages[HOMA_MAX_BPAGES];
 	struct homa_pool_core *core;
 	struct homa_bpage *bpage;
 	__u64 now = get_cycles();
 	struct homa_rpc *other;
 
-	if (!pool->region)
+	if (!pool)
 		return -ENOMEM;
 
-	/* First allocate any full bpages that are needed. */
-	full_pages = rpc->msgin.length >> HOMA_BPAGE_SHIFT;
+	/* First allocate any full bpages that are needed. These come from
+	 * the NUMA node of the core that most recently copied data out
+	 * to user space for this socket, since that is likely to be the
+	 * core that touches the data next.
+	 */
+	full_pages = rpc->msgin.length >> pool->bpage_shift;
+	partial = rpc->msgin.length & (pool->bpage_size-1);
 	if (unlikely(full_pages)) {
-		if (homa_pool_get_pages(pool, full_pages, pages, 0) != 0)
+		int needed = full_pages + (partial ? 1 : 0);
+		int node = -1;
+
+		if (!homa_pool_admit(pool, rpc, needed))
+			goto out_of_space;
+		copy_core = READ_ONCE(rpc->hsk->copy_core);
+		if ((copy_core >= 0) && (copy_core < pool->num_cores))
+			node = pool->cores[copy_core].node;
+		if (homa_pool_get_pages(pool, full_pages, pages, 0, node) != 0)
 			goto out_of_space;
 		for (i = 0; i < full_pages; i++)
-			rpc->msgin.bpage_offsets[i] = pages[i] << HOMA_BPAGE_SHIFT;
+			rpc->msgin.bpage_offsets[i] = pages[i] << pool->bpage_shift;
 	}
 	rpc->msgin.num_bpages = full_pages;
 
 	/* The last chunk may be less than a full bpage; for this we use
 	 * the bpage that we own (and reuse it for multiple messages).
 	 */
-	partial = rpc->msgin.length & (HOMA_BPAGE_SIZE-1);
 	if (unlikely(partial == 0))
 		goto success;
 	core_id = raw_smp_processor_id();
 	core = &pool->cores[core_id];
 	bpage = &pool->descriptors[core->page_hint];
 	if (!spin_trylock_bh(&bpage->lock)) {
+		__u64 start = get_cycles();
+
 		tt_record("beginning wait for bpage lock");
 		spin_lock_bh(&bpage->lock);
 		tt_record("ending wait for bpage lock");
+		homa_lock_miss(HOMA_LOCK_BPAGE, "homa_pool_allocate",
+				get_cycles() - start);
 	}
 	if (bpage->owner != core_id) {
 		spin_unlock_bh(&bpage->lock);
 		goto new_page;
 	}
-	if ((core->allocated + partial) > HOMA_BPAGE_SIZE) {
+	if ((core->allocated + partial) > pool->bpage_size) {
 		if (atomic_read(&bpage->refs) == 1) {
 			/* Bpage is totally free, so we can reuse it. */
 			core->allocated = 0;
@@ -288,14 +782,14 @@ int homa_pool_allocate(struct homa_rpc *rpc)
 			goto new_page;
 		}
 	}
-	bpage->expiration = now + pool->hsk->homa->bpage_lease_cycles;
+	bpage->expiration = now + pool->homa->bpage_lease_cycles;
 	atomic_inc(&bpage->refs);
 	spin_unlock_bh(&bpage->lock);
 	goto allocate_partial;
 
 	/* Can't use the current page; get another one. */
 	new_page:
-	if (homa_pool_get_pages(pool, 1, pages, 1) != 0) {
+	if (homa_pool_get_pages(pool, 1, pages, 1, -1) != 0) {
 		homa_pool_release_buffers(pool, rpc->msgin.num_bpages,
 				rpc->msgin.bpage_offsets);
 		rpc->msgin.num_bpages = 0;
@@ -306,38 +800,44 @@ int homa_pool_allocate(struct homa_rpc *rpc)
 
 	allocate_partial:
 	rpc->msgin.bpage_offsets[rpc->msgin.num_bpages] = core->allocated
-			+ (core->page_hint << HOMA_BPAGE_SHIFT);
+			+ (core->page_hint << pool->bpage_shift);
 	rpc->msgin.num_bpages++;
 	core->allocated += partial;
 
 	success:
+	if (full_pages) {
+		spin_lock_bh(&pool->lock);
+		rpc->msgin.charged_bpages = rpc->msgin.num_bpages;
+		list_add_tail(&rpc->msgin.charged_links, &pool->charged_rpcs);
+		spin_unlock_bh(&pool->lock);
+	}
 	tt_record4("Allocated %d bpage pointers on port %d for id %d, "
 			"free_bpages now %d",
-			rpc->msgin.num_bpages, pool->hsk->port, rpc->id,
+			rpc->msgin.num_bpages, rpc->hsk->port, rpc->id,
 			atomic_read(&pool->free_bpages));
 	return 0;
 
 	/* We get here if there wasn't enough buffer space for this
-	 * message; add the RPC to hsk->waiting_for_bufs.
+	 * message; add the RPC to pool->waiting_for_bufs.
 	 */
 	out_of_space:
 	INC_METRIC(buffer_alloc_failures, 1);
 	tt_record4("Buffer allocation failed, port %d, id %d, length %d, "
-			"free_bpages %d", pool->hsk->port, rpc->id,
+			"free_bpages %d", rpc->hsk->port, rpc->id,
 			rpc->msgin.length,
 			atomic_read(&pool->free_bpages));
-	homa_sock_lock(pool->hsk, "homa_pool_allocate");
-	list_for_each_entry(other, &pool->hsk->waiting_for_bufs, buf_links) {
+	spin_lock_bh(&pool->lock);
+	list_for_each_entry(other, &pool->waiting_for_bufs, buf_links) {
 		if (other->msgin.length > rpc->msgin.length) {
 			list_add_tail(&rpc->buf_links, &other->buf_links);
 			goto queued;
 		}
 	}
-	list_add_tail_rcu(&rpc->buf_links, &pool->hsk->waiting_for_bufs);
+	list_add_tail_rcu(&rpc->buf_links, &pool->waiting_for_bufs);
 
 	queued:
 	set_bpages_needed(pool);
-	homa_sock_unlock(pool->hsk);
+	spin_unlock_bh(&pool->lock);
 	return 0;
 }
 
@@ -355,23 +855,25 @@ int homa_pool_allocate(struct homa_rpc *rpc)
  */
 void *homa_pool_get_buffer(struct homa_rpc *rpc, int offset, int *available)
 {
+	struct homa_pool *pool = rpc->hsk->buffer_pool;
 	int bpage_index, bpage_offset;
 
-	bpage_index = offset >> HOMA_BPAGE_SHIFT;
+	bpage_index = offset >> pool->bpage_shift;
 	BUG_ON(bpage_index >= rpc->msgin.num_bpages);
-	bpage_offset = offset & (HOMA_BPAGE_SIZE-1);
+	bpage_offset = offset & (pool->bpage_size-1);
 	*available = (bpage_index < (rpc->msgin.num_bpages-1))
-			? HOMA_BPAGE_SIZE - bpage_offset
+			? pool->bpage_size - bpage_offset
 			: rpc->msgin.length - offset;
-	return rpc->hsk->buffer_pool.region + rpc->msgin.bpage_offsets[bpage_index]
+	return pool->region + rpc->msgin.bpage_offsets[bpage_index]
 			+ bpage_offset;
 }
 
 /**
  * homa_pool_release_buffers() - Release buffer space so that it can be
  * reused.
- * @pool:         Pool that the buffer space belongs to. Doesn't need to
- *                be locked.
+ * @pool:         Pool that the buffer space belongs to (NULL means the
+ *                socket has no pool, in which case nothing happens).
+ *                Doesn't need to be locked.
  * @num_buffers:  How many buffers to release.
  * @buffers:      Points to @num_buffers values, each of which is an offset
  *                from the start of the pool to the buffer to be released.
@@ -381,19 +883,20 @@ void homa_pool_release_buffers(struct homa_pool *pool, int num_buffers,
 {
 	int i;
 
-	if (!pool->region)
+	if (!pool)
 		return;
 	for (i = 0; i < num_buffers; i++) {
-		__u32 bpage_index = buffers[i] >> HOMA_BPAGE_SHIFT;
+		__u32 bpage_index = buffers[i] >> pool->bpage_shift;
 		struct homa_bpage *bpage= &pool->descriptors[bpage_index];
 		if (bpage_index < pool->num_bpages) {
-			 if (atomic_dec_return(&bpage->refs) == 0)
-				 atomic_inc(&pool->free_bpages);
+			if (atomic_dec_return(&bpage->refs) == 0) {
+				homa_pool_push(pool, bpage_index);
+				atomic_inc(&pool->free_bpages);
+			}
 		}
 	}
-	tt_record3("Released %d bpages, free_bpages for port %d now %d",
-			num_buffers, pool->hsk->port,
-			atomic_read(&pool->free_bpages));
+	tt_record2("Released %d bpages, free_bpages now %d",
+			num_buffers, atomic_read(&pool->free_bpages));
 }
 
 /**
@@ -403,41 +906,40 @@ void homa_pool_release_buffers(struct homa_pool *pool, int num_buffers,
  * at a point when the caller holds no locks (homa_pool_release_buffers may
  * be invoked with locks held, so it can't safely invoke this function).
  * This is regrettably tricky, but I can't think of a better solution.
- * @pool:         Information about the buffer pool.
+ * @pool:         Information about the buffer pool (NULL means the socket
+ *                has no pool, in which case nothing happens).
  */
 void homa_pool_check_waiting(struct homa_pool *pool)
 {
+	if (!pool)
+		return;
 #ifdef __UNIT_TEST__
 	pool->check_waiting_invoked += 1;
 #endif
 	while (atomic_read(&pool->free_bpages) >= pool->bpages_needed) {
 		struct homa_rpc *rpc;
-		homa_sock_lock(pool->hsk, "buffer pool");
-		if (list_empty(&pool->hsk->waiting_for_bufs)) {
-			pool->bpages_needed = INT_MAX;
-			homa_sock_unlock(pool->hsk);
+		spin_lock_bh(&pool->lock);
+		rpc = set_bpages_needed(pool);
+		if (!rpc || (atomic_read(&pool->free_bpages)
+				< pool->bpages_needed)) {
+			spin_unlock_bh(&pool->lock);
 			break;
 		}
-		rpc = list_first_entry(&pool->hsk->waiting_for_bufs,
-				struct homa_rpc, buf_links);
 		if (!homa_bucket_try_lock(rpc->bucket, rpc->id,
 				"homa_pool_check_waiting")) {
 			/* Can't just spin on the RPC lock because we're
-			 * holding the socket lock (see sync.txt). Instead,
-			 * release the socket lock and try the entire
-			 * operation again.
+			 * holding the pool lock (RPC locks must be acquired
+			 * first). Instead, release the pool lock and try the
+			 * entire operation again.
 			 */
-			homa_sock_unlock(pool->hsk);
+			spin_unlock_bh(&pool->lock);
 			UNIT_LOG("; ", "rpc lock unavailable in "
 					"homa_pool_release_buffers");
 			continue;
 		}
 		list_del_init(&rpc->buf_links);
-		if (list_empty(&pool->hsk->waiting_for_bufs))
-			pool->bpages_needed = INT_MAX;
-		else
-			set_bpages_needed(pool);
-		homa_sock_unlock(pool->hsk);
+		set_bpages_needed(pool);
+		spin_unlock_bh(&pool->lock);
 		tt_record4("Retrying buffer allocation for id %d, length %d, "
 				"free_bpages %d, new bpages_needed %d",
 				rpc->id, rpc->msgin.length,
@@ -448,7 +950,13 @@ void homa_pool_check_waiting(struct homa_pool *pool)
 			/* Allocation succeeded; "wake up" the RPC. */
 			rpc->msgin.resend_all = 1;
 			homa_grant_check_rpc(rpc);
-		} else
+		} else {
+			/* The RPC has been requeued (some other allocation
+			 * must have gotten the space first). Wait until more
+			 * space is freed.
+			 */
 			homa_rpc_unlock(rpc);
+			break;
+		}
 	}
 }
\ No newline at end of file
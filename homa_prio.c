@@ -0,0 +1,317 @@
+/* Copyright (c) 2024 Homa Developers
+ * SPDX-License-Identifier: BSD-1-Clause
+ */
+
+/* This file computes the priority cutoffs for unscheduled packets
+ * (homa->unsched_cutoffs) from the sizes of recently received messages.
+ * It implements the same algorithm as the user-level program
+ * util/homa_prio, but runs in the timer thread, so no daemon is needed
+ * and the cutoffs can track the workload more quickly. It is enabled by
+ * setting the prio_autotune sysctl value. New cutoffs reach peers
+ * through the usual mechanism (cutoff_version and CUTOFFS packets).
+ */
+
+#include "homa_impl.h"
+
+/**
+ * homa_prio_bucket_max() - Return the largest message size that falls
+ * in a given bucket of a struct homa_prio_tuner.
+ * @bucket:   Index of the bucket.
+ *
+ * Return:    See above.
+ */
+static inline int homa_prio_bucket_max(int bucket)
+{
+	if (bucket < HOMA_NUM_SMALL_COUNTS)
+		return (bucket + 1) * 64;
+	bucket -= HOMA_NUM_SMALL_COUNTS;
+	if (bucket < HOMA_NUM_MEDIUM_COUNTS)
+		return (bucket + 1) * 1024;
+	return HOMA_MAX_MESSAGE_LENGTH;
+}
+
+/**
+ * homa_prio_bucket_bytes() - Return the total number of bytes that have
+ * been received (since Homa was loaded, over all cores) in messages that
+ * fall in a given bucket.
+ * @bucket:   Index of the bucket.
+ *
+ * Return:    See above.
+ */
+static __u64 homa_prio_bucket_bytes(int bucket)
+{
+	__u64 total = 0;
+	int core;
+
+	for (core = 0; core < nr_cpu_ids; core++) {
+		struct homa_metrics *m = &homa_cores[core]->metrics;
+
+		if (bucket < HOMA_NUM_SMALL_COUNTS)
+			total += m->small_msg_bytes[bucket];
+		else if (bucket < HOMA_NUM_SMALL_COUNTS + HOMA_NUM_MEDIUM_COUNTS)
+			total += m->medium_msg_bytes[bucket
+					- HOMA_NUM_SMALL_COUNTS];
+		else
+			total += m->large_msg_bytes;
+	}
+	return total;
+}
+
+/**
+ * homa_prio_unsched() - Estimate how many of the bytes in a bucket of
+ * homa->prio_tuner were transmitted as unscheduled bytes.
+ * @homa:     Overall data about the Homa protocol implementation.
+ * @bucket:   Index of the bucket.
+ *
+ * Return:    See above.
+ */
+static __u64 homa_prio_unsched(struct homa *homa, int bucket)
+{
+	struct homa_prio_tuner *tuner = homa->prio_tuner;
+	__u64 limit;
+
+	if (homa_prio_bucket_max(bucket) <= homa->unsched_bytes)
+		return tuner->bytes[bucket];
+	limit = tuner->msgs[bucket] * homa->unsched_bytes;
+	return (tuner->bytes[bucket] < limit) ? tuner->bytes[bucket] : limit;
+}
+
+/**
+ * homa_prio_sysctl_changed() - Invoked whenever a sysctl value is changed;
+ * any prio_autotune-related parameters are adjusted to be valid.
+ * @homa:    Overall data about the Homa protocol implementation.
+ */
+void homa_prio_sysctl_changed(struct homa *homa)
+{
+	if (homa->prio_autotune_interval < 1)
+		homa->prio_autotune_interval = 1;
+	if (homa->prio_autotune_min_msgs < 1)
+		homa->prio_autotune_min_msgs = 1;
+	if (homa->prio_autotune_min_drift < 0)
+		homa->prio_autotune_min_drift = 0;
+}
+
+/**
+ * homa_prio_check() - Invoked by homa_timer on every tick. If prio_autotune
+ * is enabled and it's time, this function folds the message sizes
+ * received since the last update into the decayed histogram and, if the
+ * size distribution has changed enough, installs new unsched_cutoffs.
+ * @homa:    Overall data about the Homa protocol implementation.
+ */
+void homa_prio_check(struct homa *homa)
+{
+	struct homa_prio_tuner *tuner = homa->prio_tuner;
+	int cutoffs[HOMA_MAX_PRIORITIES];
+	int deciles[9];
+	__u64 total_msgs, large_count;
+	int i, core;
+
+	if (!tuner)
+		return;
+	if (!homa->prio_autotune) {
+		tuner->active = 0;
+		return;
+	}
+	if (tuner->active && ((int) (homa->timer_ticks - tuner->next_tick) < 0))
+		return;
+	tuner->next_tick = homa->timer_ticks + homa->prio_autotune_interval;
+
+	large_count = 0;
+	for (core = 0; core < nr_cpu_ids; core++)
+		large_count += homa_cores[core]->metrics.large_msg_count;
+
+	/* Fold the bytes received since the last update into the histogram,
+	 * halving the older information. Message counts aren't kept for
+	 * most buckets, so estimate them from each bucket's midpoint.
+	 */
+	total_msgs = 0;
+	for (i = 0; i < HOMA_PRIO_BUCKETS; i++) {
+		__u64 total = homa_prio_bucket_bytes(i);
+		__u64 delta = total - tuner->prev_bytes[i];
+		__u64 msgs;
+
+		tuner->prev_bytes[i] = total;
+		if (!tuner->active) {
+			tuner->bytes[i] = 0;
+			tuner->msgs[i] = 0;
+			continue;
+		}
+		if (i == HOMA_PRIO_BUCKETS - 1) {
+			msgs = large_count - tuner->prev_large_count;
+		} else {
+			int max = homa_prio_bucket_max(i);
+			int mid = max - ((i < HOMA_NUM_SMALL_COUNTS) ? 32 : 512);
+
+			msgs = (delta + mid/2) / mid;
+		}
+		tuner->bytes[i] = (tuner->bytes[i] >> 1) + delta;
+		tuner->msgs[i] = (tuner->msgs[i] >> 1) + msgs;
+		total_msgs += tuner->msgs[i];
+	}
+	tuner->prev_large_count = large_count;
+	if (!tuner->active) {
+		tuner->active = 1;
+		for (i = 0; i < 9; i++)
+			tuner->deciles[i] = 0;
+		tuner->num_priorities = homa->num_priorities;
+		return;
+	}
+
+	/* Don't change the cutoffs unless there is enough data to provide
+	 * reasonable statistics and the distribution has changed enough
+	 * (hysteresis).
+	 */
+	if ((total_msgs < homa->prio_autotune_min_msgs)
+			|| (homa->num_priorities < 2))
+		return;
+	homa_prio_deciles(tuner, deciles);
+	if ((homa_prio_drift(tuner->deciles, deciles)
+			< homa->prio_autotune_min_drift)
+			&& (homa->num_priorities == tuner->num_priorities))
+		return;
+	for (i = 0; i < 9; i++)
+		tuner->deciles[i] = deciles[i];
+	tuner->num_priorities = homa->num_priorities;
+
+	homa_prio_compute(homa, cutoffs);
+	for (i = 1; i < HOMA_MAX_PRIORITIES; i++) {
+		if (cutoffs[i] != homa->unsched_cutoffs[i])
+			break;
+	}
+	if (i >= HOMA_MAX_PRIORITIES)
+		return;
+	tt_record4("homa_prio_check installing cutoffs %d %d %d %d",
+			cutoffs[7], cutoffs[6], cutoffs[5], cutoffs[4]);
+	for (i = 0; i < HOMA_MAX_PRIORITIES; i++)
+		homa->unsched_cutoffs[i] = cutoffs[i];
+	homa_prios_changed(homa);
+	INC_METRIC(prio_autotune_updates, 1);
+}
+
+/**
+ * homa_prio_compute() - Compute unscheduled priority cutoffs from the
+ * message size histogram in homa->prio_tuner. Priorities are divided
+ * between scheduled and unscheduled packets in proportion to their bytes,
+ * and the unscheduled priorities are then assigned so that each carries
+ * about the same number of unscheduled bytes.
+ * @homa:     Overall data about the Homa protocol implementation.
+ * @cutoffs:  HOMA_MAX_PRIORITIES cutoffs are stored here, in the same
+ *            form as homa->unsched_cutoffs.
+ */
+void homa_prio_compute(struct homa *homa, int *cutoffs)
+{
+	struct homa_prio_tuner *tuner = homa->prio_tuner;
+	int num_priorities = homa->num_priorities;
+	__u64 total_bytes, total_unsched, cum_unsched;
+	__u64 bytes_per_prio, next_cutoff_bytes;
+	int unsched_prios, next_cutoff, i;
+
+	total_bytes = 0;
+	total_unsched = 0;
+	for (i = 0; i < HOMA_PRIO_BUCKETS; i++) {
+		total_bytes += tuner->bytes[i];
+		total_unsched += homa_prio_unsched(homa, i);
+	}
+
+	/* Divide priorities between scheduled and unscheduled packets. */
+	unsched_prios = 1;
+	if (total_bytes > 0)
+		unsched_prios = (num_priorities * total_unsched
+				+ total_bytes/2) / total_bytes;
+	if (unsched_prios < 1)
+		unsched_prios = 1;
+
+	/* Compute cutoffs for unscheduled priorities. */
+	if (unsched_prios < num_priorities)
+		bytes_per_prio = 1 + total_unsched/unsched_prios;
+	else
+		bytes_per_prio = 1 + total_bytes/num_priorities;
+	next_cutoff_bytes = bytes_per_prio;
+	next_cutoff = num_priorities - 1;
+	cum_unsched = 0;
+	for (i = 0; i < HOMA_PRIO_BUCKETS; i++) {
+		cum_unsched += homa_prio_unsched(homa, i);
+		if (cum_unsched >= total_unsched)
+			break;
+		if ((cum_unsched >= next_cutoff_bytes) && (next_cutoff > 0)) {
+			cutoffs[next_cutoff] = homa_prio_bucket_max(i);
+			next_cutoff--;
+			next_cutoff_bytes = cum_unsched + bytes_per_prio;
+			if (next_cutoff_bytes >= total_unsched)
+				break;
+		}
+	}
+	for ( ; next_cutoff >= 0; next_cutoff--)
+		cutoffs[next_cutoff] = HOMA_MAX_MESSAGE_LENGTH;
+	for (i = num_priorities; i < HOMA_MAX_PRIORITIES; i++)
+		cutoffs[i] = 0;
+}
+
+/**
+ * homa_prio_deciles() - Summarize the message size distribution in
+ * a struct homa_prio_tuner.
+ * @tuner:    Holds the message size histogram.
+ * @deciles:  9 entries are stored here: entry i holds the message
+ *            length l such that (i+1)*10% of all messages in @tuner
+ *            have a length <= l.
+ */
+void homa_prio_deciles(struct homa_prio_tuner *tuner, int *deciles)
+{
+	__u64 total_msgs, msgs_per_decile, next_decile, msgs_so_far;
+	int decile, i;
+
+	total_msgs = 0;
+	for (i = 0; i < HOMA_PRIO_BUCKETS; i++)
+		total_msgs += tuner->msgs[i];
+	msgs_per_decile = total_msgs/10;
+	next_decile = msgs_per_decile;
+	msgs_so_far = 0;
+	decile = 0;
+	for (i = 0; i < HOMA_PRIO_BUCKETS; i++) {
+		if (tuner->msgs[i] == 0)
+			continue;
+		msgs_so_far += tuner->msgs[i];
+		while (msgs_so_far >= next_decile) {
+			deciles[decile] = homa_prio_bucket_max(i);
+			decile++;
+			if (decile >= 9)
+				return;
+			next_decile += msgs_per_decile;
+		}
+	}
+	for ( ; decile < 9; decile++)
+		deciles[decile] = HOMA_MAX_MESSAGE_LENGTH;
+}
+
+/**
+ * homa_prio_drift() - Measure the difference between two message size
+ * distributions.
+ * @d1:      A set of deciles returned by homa_prio_deciles.
+ * @d2:      Another set of deciles returned by homa_prio_deciles.
+ *
+ * Return:   The sum of the fractional differences between corresponding
+ *           entries in the two decile arrays, in thousandths; each pair
+ *           can contribute up to 1000 to the result. A return value of 0
+ *           means that the two arrays were identical.
+ */
+int homa_prio_drift(int *d1, int *d2)
+{
+	int drift = 0;
+	int i;
+
+	for (i = 0; i < 9; i++) {
+		int smaller, larger;
+
+		if (d1[i] < d2[i]) {
+			smaller = d1[i];
+			larger = d2[i];
+		} else {
+			smaller = d2[i];
+			larger = d1[i];
+		}
+		if (larger != 0)
+			drift += (int) ((1000 * (__s64) (larger - smaller))
+					/ larger);
+	}
+	return drift;
+}
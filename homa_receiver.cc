@@ -15,14 +15,18 @@
  *              object.
  * @buf_region: Location of the buffer region that was allocated for
  *              this socket.
+ * @bpage_size: The bpage_size that was specified with SO_HOMA_SET_BUF for
+ *              the socket; 0 means HOMA_BPAGE_SIZE.
  */
-homa::receiver::receiver(int fd, void *buf_region)
+homa::receiver::receiver(int fd, void *buf_region, size_t bpage_size)
 	: fd(fd)
 	, hdr()
 	, control()
 	, source()
         , msg_length(-1)
         , buf_region(reinterpret_cast<char *>(buf_region))
+	, bpage_size(bpage_size ? bpage_size : HOMA_BPAGE_SIZE)
+	, bpage_shift(__builtin_ctzl(this->bpage_size))
 {
 	memset(&hdr, 0, sizeof(hdr));
 	hdr.msg_name = &source;
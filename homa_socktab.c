@@ -116,7 +116,9 @@ void homa_sock_init(struct homa_sock *hsk, struct homa *homa)
 	hsk->homa = homa;
 	hsk->ip_header_length = (hsk->inet.sk.sk_family == AF_INET)
 			? HOMA_IPV4_HEADER_LENGTH : HOMA_IPV6_HEADER_LENGTH;
+	hsk->avg_wait_cycles = 0;
 	hsk->shutdown = false;
+	hsk->use_response_length = false;
 	while (1) {
 		if (homa->next_client_port < HOMA_MIN_DEFAULT_PORT) {
 			homa->next_client_port = HOMA_MIN_DEFAULT_PORT;
@@ -136,7 +138,6 @@ void homa_sock_init(struct homa_sock *hsk, struct homa *homa)
 	INIT_LIST_HEAD(&hsk->active_rpcs);
 	INIT_LIST_HEAD(&hsk->dead_rpcs);
 	hsk->dead_skbs = 0;
-	INIT_LIST_HEAD(&hsk->waiting_for_bufs);
 	INIT_LIST_HEAD(&hsk->ready_requests);
 	INIT_LIST_HEAD(&hsk->ready_responses);
 	INIT_LIST_HEAD(&hsk->request_interests);
@@ -153,7 +154,8 @@ void homa_sock_init(struct homa_sock *hsk, struct homa *homa)
 		INIT_HLIST_HEAD(&bucket->rpcs);
 		bucket->id = i + 1000000;
 	}
-	memset(&hsk->buffer_pool, 0, sizeof(hsk->buffer_pool));
+	hsk->buffer_pool = NULL;
+	hsk->copy_core = -1;
 	spin_unlock_bh(&socktab->write_lock);
 }
 
@@ -206,8 +208,6 @@ void homa_sock_shutdown(struct homa_sock *hsk)
 		wake_up_process(interest->thread);
 	homa_sock_unlock(hsk);
 
-	homa_pool_destroy(&hsk->buffer_pool);
-
 	i = 0;
 	while (!list_empty(&hsk->dead_rpcs)) {
 		homa_rpc_reap(hsk, 1000);
@@ -217,6 +217,14 @@ void homa_sock_shutdown(struct homa_sock *hsk)
 			tt_freeze();
 		}
 	}
+
+	/* Don't detach from the buffer pool until all RPCs have been
+	 * reaped: their buffer space must be returned to the pool, which
+	 * may be shared with other sockets.
+	 */
+	homa_sock_lock(hsk, "homa_socket_shutdown #3");
+	homa_pool_detach(hsk);
+	homa_sock_unlock(hsk);
 }
 
 /**
@@ -308,8 +316,9 @@ struct homa_sock *homa_sock_find(struct homa_socktab *socktab,  __u16 port)
  * available. It waits for the lock, but also records statistics about
  * the waiting time.
  * @hsk:    socket to  lock.
+ * @locker: Static string identifying the locking code.
  */
-void homa_sock_lock_slow(struct homa_sock *hsk)
+void homa_sock_lock_slow(struct homa_sock *hsk, char *locker)
 {
 	__u64 start = get_cycles();
 	tt_record("beginning wait for socket lock");
@@ -317,4 +326,5 @@ void homa_sock_lock_slow(struct homa_sock *hsk)
 	tt_record("ending wait for socket lock");
 	INC_METRIC(socket_lock_misses, 1);
 	INC_METRIC(socket_lock_miss_cycles, get_cycles() - start);
+	homa_lock_miss(HOMA_LOCK_SOCKET, locker, get_cycles() - start);
 }
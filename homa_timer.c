@@ -21,6 +21,23 @@ void homa_check_rpc(struct homa_rpc *rpc)
 	struct resend_header resend;
 	struct homa *homa = rpc->hsk->homa;
 
+	/* Release incoming capacity reserved for a pregranted response that
+	 * hasn't started to arrive (the server may take a long time to
+	 * respond, and the reservation keeps other messages from being
+	 * granted). If the server sends the pregranted bytes later, they
+	 * will be accounted for as they arrive.
+	 */
+	if (homa_is_client(rpc->id) && (rpc->msgin.length < 0)
+			&& (rpc->msgin.rec_incoming != 0)
+			&& ((homa->timer_ticks - rpc->pregrant_timer_ticks)
+			>= homa->resend_ticks)) {
+		tt_record2("releasing pregrant of %d bytes for id %d",
+				rpc->msgin.rec_incoming, rpc->id);
+		atomic_sub(rpc->msgin.rec_incoming, &homa->total_incoming);
+		rpc->msgin.rec_incoming = 0;
+		INC_METRIC(resp_pregrant_expirations, 1);
+	}
+
 	/* See if we need to request an ack for this RPC. */
 	if (!homa_is_client(rpc->id) && (rpc->state == RPC_OUTGOING)
 			&& (rpc->msgout.next_xmit_offset >= rpc->msgout.length)) {
@@ -101,7 +118,11 @@ void homa_check_rpc(struct homa_rpc *rpc)
 	/* Issue a resend for this RPC. */
 	homa_get_resend_range(&rpc->msgin, &resend);
 	resend.priority = homa->num_priorities-1;
-	homa_xmit_control(RESEND, &resend, sizeof(resend), rpc);
+	resend.num_acks = homa_peer_get_acks(rpc->peer, HOMA_MAX_CTRL_ACKS,
+			resend.acks);
+	INC_METRIC(piggybacked_acks, resend.num_acks);
+	homa_xmit_control(RESEND, &resend, offsetof(struct resend_header, acks)
+			+ resend.num_acks * sizeof(struct homa_ack), rpc);
 	if (homa_is_client(rpc->id)) {
 		us = "client";
 		them = "server";
@@ -155,6 +176,7 @@ void homa_timer(struct homa *homa)
 
 	start = get_cycles();
 	homa->timer_ticks++;
+	homa_prio_check(homa);
 
 	total_grants = 0;
 	for (core = 0; core < nr_cpu_ids; core++) {
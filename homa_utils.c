@@ -54,19 +54,29 @@ int homa_init(struct homa *homa)
 			core->last_gro = 0;
 			atomic_set(&core->softirq_backlog, 0);
 			core->softirq_offset = 0;
-			core->gen3_softirq_cores[0] = i^1;
-			for (j = 1; j < NUM_GEN3_SOFTIRQ_CORES; j++)
+			for (j = 0; j < NUM_GEN3_SOFTIRQ_CORES; j++)
 				core->gen3_softirq_cores[j] = -1;
+			core->gen3_num_cores = 1;
+			core->gen3_last_adapt = 0;
+			memset(core->gen3_prev_softirq, 0,
+					sizeof(core->gen3_prev_softirq));
+			core->rfs_core = i;
+			core->busy_poller = NULL;
 			core->last_app_active = 0;
 			core->held_skb = NULL;
 			core->held_bucket = 0;
 			core->rpcs_locked = 0;
+			memset(core->lock_sites, 0, sizeof(core->lock_sites));
 			memset(&core->metrics, 0, sizeof(core->metrics));
 		}
 	}
 
 	homa->pacer_kthread = NULL;
 	init_completion(&homa_pacer_kthread_done);
+	homa->engine_core = -1;
+	homa->engine_kthread = NULL;
+	homa->engine_thread_core = -1;
+	homa->engine_napi_id = 0;
 	atomic64_set(&homa->next_outgoing_id, 2);
 	atomic64_set(&homa->link_idle_time, get_cycles());
 	spin_lock_init(&homa->grantable_lock);
@@ -107,7 +117,9 @@ int homa_init(struct homa *homa)
 	homa->unsched_bytes = 10000;
 	homa->window_param = 10000;
 	homa->link_mbps = 25000;
+	homa->rtt_adaptive = 0;
 	homa->poll_usecs = 50;
+	homa->poll_adaptive = 1;
 	homa->num_priorities = HOMA_MAX_PRIORITIES;
 	for (i = 0; i < HOMA_MAX_PRIORITIES; i++)
 		homa->priority_map[i] = i;
@@ -124,6 +136,16 @@ int homa_init(struct homa *homa)
 #else
 	homa->cutoff_version = 1;
 #endif
+	homa->prio_autotune = 0;
+	homa->prio_autotune_interval = 1000;
+	homa->prio_autotune_min_msgs = 1000;
+	homa->prio_autotune_min_drift = 1000;
+	homa->prio_tuner = kmalloc(sizeof(*homa->prio_tuner), GFP_KERNEL);
+	if (!homa->prio_tuner) {
+		printk(KERN_ERR "Couldn't allocate memory for prio_tuner\n");
+		return -ENOMEM;
+	}
+	homa->prio_tuner->active = 0;
 	homa->fifo_grant_increment = 10000;
 	homa->grant_fifo_fraction = 50;
 	homa->max_overcommit = 8;
@@ -156,6 +178,13 @@ int homa_init(struct homa *homa)
 	homa->gro_policy = HOMA_GRO_NORMAL;
 	homa->busy_usecs = 100;
 	homa->gro_busy_usecs = 5;
+	homa->gen3_adapt_usecs = 200;
+	homa->gen3_expand_pct = 70;
+	homa->gen3_shrink_pct = 30;
+	homa->gen3_auto_cores = 1;
+	homa_gen3_default_cores(-1);
+	memset(homa->rfs_table, 0, sizeof(homa->rfs_table));
+	homa_rfs_default_cores(-1);
 	homa->timer_ticks = 0;
 	spin_lock_init(&homa->metrics_lock);
 	homa->metrics = NULL;
@@ -165,6 +194,8 @@ int homa_init(struct homa *homa)
 	homa->flags = 0;
 	homa->freeze_type = 0;
 	homa->bpage_lease_usecs = 10000;
+	homa->bpage_reserve_pct = 10;
+	homa->bpage_peer_max_pct = 50;
 	homa->next_id = 0;
 	homa_outgoing_sysctl_changed(homa);
 	homa_incoming_sysctl_changed(homa);
@@ -178,6 +209,7 @@ int homa_init(struct homa *homa)
 void homa_destroy(struct homa *homa)
 {
 	int i;
+	homa_engine_stop(homa);
 	if (homa->pacer_kthread) {
 		homa_pacer_stop(homa);
 		wait_for_completion(&homa_pacer_kthread_done);
@@ -193,6 +225,10 @@ void homa_destroy(struct homa *homa)
 			homa_cores[i] = NULL;
 		}
 	}
+	if (homa->prio_tuner) {
+		kfree(homa->prio_tuner);
+		homa->prio_tuner = NULL;
+	}
 	if (homa->metrics)
 		kfree(homa->metrics);
 }
@@ -240,6 +276,11 @@ struct homa_rpc *homa_rpc_new_client(struct homa_sock *hsk,
 	crpc->error = 0;
 	crpc->msgin.length = -1;
 	crpc->msgin.num_bpages = 0;
+	crpc->msgin.charged_bpages = 0;
+	INIT_LIST_HEAD(&crpc->msgin.charged_links);
+	crpc->msgin.rec_incoming = 0;
+	crpc->resp_incoming = 0;
+	crpc->pregrant_timer_ticks = 0;
 	memset(&crpc->msgout, 0, sizeof(crpc->msgout));
 	crpc->msgout.length = -1;
 	INIT_LIST_HEAD(&crpc->ready_links);
@@ -253,6 +294,9 @@ struct homa_rpc *homa_rpc_new_client(struct homa_sock *hsk,
 	crpc->done_timer_ticks = 0;
 	crpc->magic = HOMA_RPC_MAGIC;
 	crpc->start_cycles = get_cycles();
+	crpc->dispatch_cycles = 0;
+	crpc->handoff_cycles = 0;
+	crpc->wakeup_cycles = 0;
 
 	/* Initialize fields that require locking. This allows the most
 	 * expensive work, such as copying in the message from user space,
@@ -341,6 +385,10 @@ struct homa_rpc *homa_rpc_new_server(struct homa_sock *hsk,
 	srpc->error = 0;
 	srpc->msgin.length = -1;
 	srpc->msgin.num_bpages = 0;
+	srpc->msgin.charged_bpages = 0;
+	INIT_LIST_HEAD(&srpc->msgin.charged_links);
+	srpc->msgin.rec_incoming = 0;
+	srpc->resp_incoming = ntohl(h->resp_incoming);
 	memset(&srpc->msgout, 0, sizeof(srpc->msgout));
 	srpc->msgout.length = -1;
 	INIT_LIST_HEAD(&srpc->ready_links);
@@ -354,6 +402,9 @@ struct homa_rpc *homa_rpc_new_server(struct homa_sock *hsk,
 	srpc->done_timer_ticks = 0;
 	srpc->magic = HOMA_RPC_MAGIC;
 	srpc->start_cycles = get_cycles();
+	srpc->dispatch_cycles = 0;
+	srpc->handoff_cycles = 0;
+	srpc->wakeup_cycles = 0;
 	tt_record2("Incoming message for id %d has %d unscheduled bytes",
 			srpc->id, ntohl(h->incoming));
 	err = homa_message_in_init(srpc, ntohl(h->message_length),
@@ -394,8 +445,10 @@ error:
  * @bucket:    The hash table bucket to lock.
  * @id:        ID of the particular RPC being locked (multiple RPCs may
  *             share a single bucket lock).
+ * @locker:    Static string identifying the locking code.
  */
-void homa_bucket_lock_slow(struct homa_rpc_bucket *bucket, __u64 id)
+void homa_bucket_lock_slow(struct homa_rpc_bucket *bucket, __u64 id,
+		char *locker)
 {
 	__u64 start = get_cycles();
 	tt_record2("beginning wait for rpc lock, id %d (bucket %d)",
@@ -410,6 +463,42 @@ void homa_bucket_lock_slow(struct homa_rpc_bucket *bucket, __u64 id)
 		INC_METRIC(server_lock_misses, 1);
 		INC_METRIC(server_lock_miss_cycles, get_cycles() - start);
 	}
+	homa_lock_miss(HOMA_LOCK_BUCKET, locker, get_cycles() - start);
+}
+
+/**
+ * homa_lock_miss() - Record information about a lock that wasn't
+ * immediately available, attributed to the code that tried to acquire it.
+ * Invoked by the slow paths of functions such as homa_sock_lock.
+ * @lock_class:  Kind of lock (a value of enum homa_lock_class).
+ * @locker:      Static string identifying the locking code. Strings are
+ *               matched by address, not contents.
+ * @cycles:      How long the caller waited for the lock.
+ */
+void homa_lock_miss(int lock_class, char *locker, __u64 cycles)
+{
+	struct homa_core *core = homa_cores[raw_smp_processor_id()];
+	struct homa_lock_site *site;
+	int i, index;
+
+	index = (hash_ptr(locker, 16) + lock_class) & (HOMA_MAX_LOCK_SITES - 1);
+	for (i = 0; i < HOMA_MAX_LOCK_SITES; i++) {
+		site = &core->lock_sites[index];
+		if (site->locker == NULL) {
+			site->locker = locker;
+			site->lock_class = lock_class;
+		}
+		if ((site->locker == locker) && (site->lock_class == lock_class))
+			goto found;
+		index = (index + 1) & (HOMA_MAX_LOCK_SITES - 1);
+	}
+	INC_METRIC(lock_site_overflows, 1);
+	return;
+
+found:
+	site->misses++;
+	site->miss_cycles += cycles;
+	site->histogram[homa_lock_bucket(cycles)]++;
 }
 
 /**
@@ -479,6 +568,7 @@ void homa_rpc_free(struct homa_rpc *rpc)
 	UNIT_LOG("; ", "homa_rpc_free invoked");
 	tt_record1("homa_rpc_free invoked for id %d", rpc->id);
 	rpc->state = RPC_DEAD;
+	homa_pool_uncharge(rpc);
 
 	/* The following line must occur before the socket is locked or
 	 * RPC is added to dead_rpcs. This is necessary because homa_grant_free
@@ -487,13 +577,22 @@ void homa_rpc_free(struct homa_rpc *rpc)
 	 */
 	homa_grant_free_rpc(rpc);
 
-	/* Unlink from all lists, so no-one will ever find this RPC again. */
+	/* Unlink from all lists, so no-one will ever find this RPC again.
+	 * The buffer pool's waiting list may be shared with other sockets,
+	 * so it has its own lock.
+	 */
+	if (!list_empty(&rpc->buf_links)) {
+		struct homa_pool *pool = rpc->hsk->buffer_pool;
+
+		spin_lock_bh(&pool->lock);
+		list_del_init(&rpc->buf_links);
+		spin_unlock_bh(&pool->lock);
+	}
 	homa_sock_lock(rpc->hsk, "homa_rpc_free");
 	__hlist_del(&rpc->hash_links);
 	list_del_rcu(&rpc->active_links);
 	list_add_tail_rcu(&rpc->dead_links, &rpc->hsk->dead_rpcs);
 	__list_del_entry(&rpc->ready_links);
-	__list_del_entry(&rpc->buf_links);
 	if (rpc->interest != NULL) {
 		rpc->interest->reg_rpc = NULL;
 		wake_up_process(rpc->interest->thread);
@@ -650,7 +749,7 @@ int homa_rpc_reap(struct homa_sock *hsk, int count)
 
 			if (unlikely(rpc->msgin.num_bpages))
 				homa_pool_release_buffers(
-						&rpc->hsk->buffer_pool,
+						rpc->hsk->buffer_pool,
 						rpc->msgin.num_bpages,
 						rpc->msgin.bpage_offsets);
 			if (rpc->msgin.length >= 0) {
@@ -677,7 +776,7 @@ int homa_rpc_reap(struct homa_sock *hsk, int count)
 		if (!result)
 			break;
 	}
-	homa_pool_check_waiting(&hsk->buffer_pool);
+	homa_pool_check_waiting(hsk->buffer_pool);
 	return result;
 }
 
@@ -924,8 +1023,17 @@ int homa_validate_incoming(struct homa *homa, int verbose, int *link_errors)
 			continue;
 		list_for_each_entry_rcu(rpc, &hsk->active_rpcs, active_links) {
 			int incoming;
-			if (rpc->state != RPC_INCOMING)
+			if (rpc->state != RPC_INCOMING) {
+				/* A client may have reserved incoming
+				 * capacity for a response that hasn't
+				 * arrived yet.
+				 */
+				if ((rpc->state == RPC_OUTGOING)
+						&& homa_is_client(rpc->id))
+					total_incoming +=
+							rpc->msgin.rec_incoming;
 				continue;
+			}
 			incoming = rpc->msgin.granted -
 					(rpc->msgin.length
 					- rpc->msgin.bytes_remaining);
@@ -1036,6 +1144,36 @@ char *homa_print_ipv6_addr(const struct in6_addr *addr)
 	return buffer;
 }
 
+/**
+ * homa_print_acks() - Append a human-readable description of a batch of
+ * acks to a buffer; used by homa_print_packet.
+ * @acks:      First ack in the batch.
+ * @count:     Number of acks claimed by the packet header.
+ * @max:       Largest number of acks the header can hold; @count is
+ *             clamped to this.
+ * @buffer:    Buffer in which to generate the string.
+ * @buf_len:   Number of bytes available at @buffer.
+ * @used:      Number of bytes currently used at @buffer.
+ *
+ * Return:   The number of bytes now used at @buffer.
+ */
+int homa_print_acks(struct homa_ack *acks, int count, int max, char *buffer,
+		int buf_len, int used)
+{
+	int i;
+
+	if (count > max)
+		count = max;
+	used = homa_snprintf(buffer, buf_len, used, ", acks");
+	for (i = 0; i < count; i++)
+		used = homa_snprintf(buffer, buf_len, used,
+				" [cp %d, sp %d, id %llu]",
+				ntohs(acks[i].client_port),
+				ntohs(acks[i].server_port),
+				be64_to_cpu(acks[i].client_id));
+	return used;
+}
+
 /**
  * homa_print_packet() - Print a human-readable string describing the
  * information in a Homa packet.
@@ -1082,6 +1220,10 @@ char *homa_print_packet(struct sk_buff *skb, char *buffer, int buf_len)
 			used = homa_snprintf(buffer, buf_len, used,
 					", cutoff_version %d",
 					ntohs(h->cutoff_version));
+		if (h->resp_incoming != 0)
+			used = homa_snprintf(buffer, buf_len, used,
+					", resp_incoming %d",
+					ntohl(h->resp_incoming));
 		if (h->retransmit)
 			used = homa_snprintf(buffer, buf_len, used,
 					", RETRANSMIT");
@@ -1106,9 +1248,23 @@ char *homa_print_packet(struct sk_buff *skb, char *buffer, int buf_len)
 	case GRANT: {
 		struct grant_header *h = (struct grant_header *) skb->data;
 		char *resend = (h->resend_all) ? ", resend_all" : "";
+		struct homa_extra_grant *extra = homa_grant_extra(h);
+		int i;
 		used = homa_snprintf(buffer, buf_len, used,
 				", offset %d, grant_prio %u%s",
 				ntohl(h->offset), h->priority, resend);
+		for (i = 0; (i < h->num_extra)
+				&& (i < HOMA_MAX_EXTRA_GRANTS)
+				&& (h->num_acks <= HOMA_MAX_CTRL_ACKS); i++)
+			used = homa_snprintf(buffer, buf_len, used,
+					", extra [id %llu, offset %d, "
+					"grant_prio %u]",
+					be64_to_cpu(extra[i].id),
+					ntohl(extra[i].offset),
+					extra[i].priority);
+		if (h->num_acks > 0)
+			used = homa_print_acks(h->acks, h->num_acks,
+					HOMA_MAX_CTRL_ACKS, buffer, buf_len, used);
 		break;
 	}
 	case RESEND: {
@@ -1117,6 +1273,9 @@ char *homa_print_packet(struct sk_buff *skb, char *buffer, int buf_len)
 				", offset %d, length %d, resend_prio %u",
 				ntohl(h->offset), ntohl(h->length),
 				h->priority);
+		if (h->num_acks > 0)
+			used = homa_print_acks(h->acks, h->num_acks,
+					HOMA_MAX_CTRL_ACKS, buffer, buf_len, used);
 		break;
 	}
 	case UNKNOWN:
@@ -1148,16 +1307,8 @@ char *homa_print_packet(struct sk_buff *skb, char *buffer, int buf_len)
 		break;
 	case ACK: {
 		struct ack_header *h = (struct ack_header *) skb->data;
-		int i, count;
-		count = ntohs(h->num_acks);
-		used = homa_snprintf(buffer, buf_len, used, ", acks");
-		for (i = 0; i < count; i++) {
-			used = homa_snprintf(buffer, buf_len, used,
-					" [cp %d, sp %d, id %llu]",
-					ntohs(h->acks[i].client_port),
-					ntohs(h->acks[i].server_port),
-					be64_to_cpu(h->acks[i].client_id));
-		}
+		used = homa_print_acks(h->acks, ntohs(h->num_acks),
+				NUM_PEER_UNACKED_IDS, buffer, buf_len, used);
 		break;
 	}
 	}
@@ -1205,8 +1356,18 @@ char *homa_print_packet_short(struct sk_buff *skb, char *buffer, int buf_len)
 	case GRANT: {
 		struct grant_header *h = (struct grant_header *) common;
 		char *resend = h->resend_all ? " resend_all" : "";
-		snprintf(buffer, buf_len, "GRANT %d@%d%s", ntohl(h->offset),
-				h->priority, resend);
+		struct homa_extra_grant *extra = homa_grant_extra(h);
+		int i, used;
+		used = homa_snprintf(buffer, buf_len, 0, "GRANT %d@%d%s",
+				ntohl(h->offset), h->priority, resend);
+		for (i = 0; (i < h->num_extra)
+				&& (i < HOMA_MAX_EXTRA_GRANTS)
+				&& (h->num_acks <= HOMA_MAX_CTRL_ACKS); i++)
+			used = homa_snprintf(buffer, buf_len, used,
+					" +%llu:%d@%d",
+					be64_to_cpu(extra[i].id),
+					ntohl(extra[i].offset),
+					extra[i].priority);
 		break;
 	}
 	case RESEND: {
@@ -1442,6 +1603,123 @@ void homa_append_metric(struct homa *homa, const char* format, ...)
 	homa->metrics_length += new_chars;
 }
 
+/**
+ * homa_print_latency() - Append the contents of an RPC latency histogram
+ * (such as homa_metrics.client_rpc_latency) to homa->metrics. Only nonzero
+ * buckets are printed.
+ * @homa:       The new data will appended to the @metrics field of
+ *              this structure.
+ * @kind:       Either "client" or "server".
+ * @histogram:  The histogram to print.
+ */
+void homa_print_latency(struct homa *homa, const char *kind,
+		__u64 histogram[HOMA_NUM_SIZE_CLASSES][HOMA_NUM_LATENCY_BUCKETS])
+{
+	int class, bucket, limit;
+
+	limit = HOMA_LATENCY_SIZE_BASE;
+	for (class = 0; class < HOMA_NUM_SIZE_CLASSES; class++) {
+		for (bucket = 0; bucket < HOMA_NUM_LATENCY_BUCKETS; bucket++) {
+			if (histogram[class][bucket] == 0)
+				continue;
+			homa_append_metric(homa,
+					"%s_latency_%d_%-2d      %15llu  "
+					"%s RPCs, request %s %d bytes, latency "
+					">= %llu cycles\n",
+					kind, class, bucket,
+					histogram[class][bucket], kind,
+					(class < HOMA_NUM_SIZE_CLASSES-1)
+					? "<" : ">=",
+					(class < HOMA_NUM_SIZE_CLASSES-1)
+					? limit : limit/10,
+					homa_latency_bucket_min(bucket));
+		}
+		limit *= 10;
+	}
+}
+
+/**
+ * homa_print_stage_latency() - Append the contents of a latency histogram
+ * for one stage of the receive pipeline (such as
+ * homa_metrics.gro_softirq_latency) to homa->metrics. Only nonzero buckets
+ * are printed.
+ * @homa:       The new data will appended to the @metrics field of
+ *              this structure.
+ * @name:       Name of the histogram's metric.
+ * @desc:       Describes the events counted by the histogram.
+ * @histogram:  The histogram to print.
+ */
+void homa_print_stage_latency(struct homa *homa, const char *name,
+		const char *desc, __u64 histogram[HOMA_NUM_LATENCY_BUCKETS])
+{
+	int bucket;
+
+	for (bucket = 0; bucket < HOMA_NUM_LATENCY_BUCKETS; bucket++) {
+		if (histogram[bucket] == 0)
+			continue;
+		homa_append_metric(homa,
+				"%s_%-2d %15llu  %s, delay >= %llu cycles\n",
+				name, bucket, histogram[bucket], desc,
+				homa_latency_bucket_min(bucket));
+	}
+}
+
+/**
+ * homa_print_lock_sites() - Append to homa->metrics the lock contention
+ * statistics for one core, broken down by lock class and call site.
+ * @homa:       The new data will appended to the @metrics field of
+ *              this structure.
+ * @core:       Core whose statistics should be printed.
+ */
+void homa_print_lock_sites(struct homa *homa, struct homa_core *core)
+{
+	static const char *class_names[] = {"socket", "bucket", "grantable",
+			"throttle", "peer_ack", "bpage"};
+	char name[60];
+	int i, j, bucket;
+
+	for (i = 0; i < HOMA_MAX_LOCK_SITES; i++) {
+		struct homa_lock_site *site = &core->lock_sites[i];
+
+		if (site->misses == 0)
+			continue;
+
+		/* Metric names can't contain spaces or other punctuation,
+		 * but some locker strings do.
+		 */
+		snprintf(name, sizeof(name), "lock_%s_%s",
+				class_names[site->lock_class], site->locker);
+		for (j = 0; name[j] != 0; j++) {
+			char c = name[j];
+
+			if (!(((c >= 'a') && (c <= 'z'))
+					|| ((c >= 'A') && (c <= 'Z'))
+					|| ((c >= '0') && (c <= '9'))))
+				name[j] = '_';
+		}
+		homa_append_metric(homa,
+				"%s_misses %15llu  Misses for %s lock in %s\n",
+				name, site->misses,
+				class_names[site->lock_class], site->locker);
+		homa_append_metric(homa,
+				"%s_cycles %15llu  Time waiting for %s lock "
+				"in %s\n",
+				name, site->miss_cycles,
+				class_names[site->lock_class], site->locker);
+		for (bucket = 0; bucket < HOMA_NUM_LOCK_BUCKETS; bucket++) {
+			if (site->histogram[bucket] == 0)
+				continue;
+			homa_append_metric(homa,
+					"%s_wait_%-2d %15llu  Misses waiting "
+					">= %llu cycles\n",
+					name, bucket, site->histogram[bucket],
+					(bucket == 0) ? 0ULL
+					: 1ULL << (HOMA_LOCK_MIN_SHIFT
+					+ bucket));
+		}
+	}
+}
+
 /**
  * homa_print_metrics() - Sample all of the Homa performance metrics and
  * generate a human-readable string describing all of them.
@@ -1583,6 +1861,19 @@ char *homa_print_metrics(struct homa *homa)
 				"poll_cycles               %15llu  "
 				"Time spent polling for incoming messages\n",
 				m->poll_cycles);
+		homa_append_metric(homa,
+				"busy_polls                %15llu  "
+				"NIC polls by threads waiting for messages\n",
+				m->busy_polls);
+		homa_append_metric(homa,
+				"poll_skips                %15llu  "
+				"Waits that slept without polling (slow "
+				"arrivals)\n",
+				m->poll_skips);
+		homa_append_metric(homa,
+				"poll_shortened            %15llu  "
+				"Waits that polled for less than poll_usecs\n",
+				m->poll_shortened);
 		homa_append_metric(homa,
 				"softirq_calls             %15llu  "
 				"Calls to homa_softirq (i.e. # GRO pkts "
@@ -1705,6 +1996,23 @@ char *homa_print_metrics(struct homa *homa)
 				"homa_pacer_xmit invocations from "
 				"homa_check_pacer\n",
 				m->pacer_needed_help);
+		homa_append_metric(homa,
+				"engine_iterations         %15llu  "
+				"Passes through the engine thread's loop\n",
+				m->engine_iterations);
+		homa_append_metric(homa,
+				"engine_cycles             %15llu  "
+				"Time spent in the engine thread's loop\n",
+				m->engine_cycles);
+		homa_append_metric(homa,
+				"engine_busy_cycles        %15llu  "
+				"Engine loop time in passes that found work\n",
+				m->engine_busy_cycles);
+		homa_append_metric(homa,
+				"engine_work               %15llu  "
+				"Packet batches and pacer calls handled by "
+				"engine\n",
+				m->engine_work);
 		homa_append_metric(homa,
 				"throttled_cycles          %15llu  "
 				"Time when the throttled queue was nonempty\n",
@@ -1832,6 +2140,10 @@ char *homa_print_metrics(struct homa *homa)
 				"grantable_lock_miss_cycles%15llu  "
 				"Time lost waiting for grantable lock\n",
 				m->grantable_lock_miss_cycles);
+		homa_append_metric(homa,
+				"lock_site_overflows       %15llu  "
+				"Lock misses not attributed to a call site\n",
+				m->lock_site_overflows);
 		homa_append_metric(homa,
 				"grantable_rpcs_integral   %15llu  "
 				"Integral of homa->num_grantable_rpcs*dt\n",
@@ -1854,6 +2166,26 @@ char *homa_print_metrics(struct homa *homa)
 				"Number of times an RPC moved up in the grant "
 				"priority order\n",
 				m->grant_priority_bumps);
+		homa_append_metric(homa,
+				"resp_pregrants            %15llu  "
+				"Requests whose responses were partially "
+				"granted in advance\n",
+				m->resp_pregrants);
+		homa_append_metric(homa,
+				"resp_pregrant_bytes       %15llu  "
+				"Response bytes granted in advance (beyond "
+				"unsched_bytes)\n",
+				m->resp_pregrant_bytes);
+		homa_append_metric(homa,
+				"resp_pregrant_expirations %15llu  "
+				"Pregrants released because the response "
+				"was slow to arrive\n",
+				m->resp_pregrant_expirations);
+		homa_append_metric(homa,
+				"coalesced_grants          %15llu  "
+				"Grants piggybacked on GRANT packets for "
+				"other RPCs\n",
+				m->coalesced_grants);
 		homa_append_metric(homa,
 				"fifo_grants               %15llu  "
 				"Grants issued using FIFO priority\n",
@@ -1898,6 +2230,30 @@ char *homa_print_metrics(struct homa *homa)
 				"Explicit ACKs sent because peer->acks was "
 				"full\n",
 				m->ack_overflows);
+		homa_append_metric(homa,
+				"piggybacked_acks          %15llu  "
+				"Acks carried in GRANT or RESEND packets\n",
+				m->piggybacked_acks);
+		homa_append_metric(homa,
+				"prio_autotune_updates     %15llu  "
+				"Times unsched_cutoffs were recomputed "
+				"in the kernel\n",
+				m->prio_autotune_updates);
+		homa_append_metric(homa,
+				"peer_rtt_clamped          %15llu  "
+				"Peer RTT samples clamped to twice the "
+				"estimate or the configured range\n",
+				m->peer_rtt_clamped);
+		homa_append_metric(homa,
+				"rtt_unsched_msgs          %15llu  "
+				"Outgoing messages with unscheduled bytes "
+				"based on peer RTT\n",
+				m->rtt_unsched_msgs);
+		homa_append_metric(homa,
+				"rtt_unsched_bytes         %15llu  "
+				"Total unscheduled byte limits for "
+				"rtt_unsched_msgs\n",
+				m->rtt_unsched_bytes);
 		homa_append_metric(homa,
 				"ignored_need_acks         %15llu  "
 				"NEED_ACKs ignored because RPC result not "
@@ -1908,11 +2264,42 @@ char *homa_print_metrics(struct homa *homa)
 				"Buffer page could be reused because ref "
 				"count was zero\n",
 				m->bpage_reuses);
+		homa_append_metric(homa,
+				"bpage_refills             %15llu  "
+				"Per-core free bpage caches refilled from "
+				"node free stacks\n",
+				m->bpage_refills);
+		homa_append_metric(homa,
+				"bpage_steals              %15llu  "
+				"Free bpages taken from other cores' caches\n",
+				m->bpage_steals);
+		for (i = 0; i < HOMA_POOL_MAX_NODES; i++) {
+			homa_append_metric(homa,
+					"bpage_node%d_allocs        %15llu  "
+					"Bpages allocated from the buffer "
+					"pool slice for NUMA node %d\n",
+					i, m->bpage_node_allocs[i], i);
+		}
+		homa_append_metric(homa,
+				"bpage_remote_allocs       %15llu  "
+				"Bpages allocated from another NUMA node's "
+				"slice because the preferred slice was full\n",
+				m->bpage_remote_allocs);
 		homa_append_metric(homa,
 				"buffer_alloc_failures     %15llu  "
 				"homa_pool_allocate didn't find enough buffer "
 				"space for an RPC\n",
 				m->buffer_alloc_failures);
+		homa_append_metric(homa,
+				"buffer_reserve_waits      %15llu  "
+				"Large messages that couldn't use bpages "
+				"reserved for short ones\n",
+				m->buffer_reserve_waits);
+		homa_append_metric(homa,
+				"buffer_peer_waits         %15llu  "
+				"Messages that waited for space because of "
+				"per-peer limit\n",
+				m->buffer_peer_waits);
 		homa_append_metric(homa,
 				"linux_pkt_alloc_bytes     %15llu  "
 				"Bytes allocated in new packets by NIC driver "
@@ -1931,6 +2318,18 @@ char *homa_print_metrics(struct homa *homa)
 				"Gen3 handoffs to secondary core (primary was "
 				"busy)\n",
 				m->gen3_alt_handoffs);
+		homa_append_metric(homa,
+				"gen3_expansions          %15llu  "
+				"SoftIRQ cores added by adaptive Gen3\n",
+				m->gen3_expansions);
+		homa_append_metric(homa,
+				"gen3_contractions        %15llu  "
+				"SoftIRQ cores removed by adaptive Gen3\n",
+				m->gen3_contractions);
+		homa_append_metric(homa,
+				"rfs_handoffs             %15llu  "
+				"GRO handoffs steered toward a waiting thread\n",
+				m->rfs_handoffs);
 		homa_append_metric(homa,
 				"gro_grant_bypasses       %15llu  "
 				"Grant packets passed directly to homa_softirq "
@@ -1941,6 +2340,29 @@ char *homa_print_metrics(struct homa *homa)
 				"Data packets passed directly to homa_softirq "
 				"by homa_gro_receive\n",
 				m->gro_data_bypasses);
+		homa_append_metric(homa,
+				"gro_data_coalesced       %15llu  "
+				"Data packets merged into an earlier packet "
+				"by homa_gro_receive\n",
+				m->gro_data_coalesced);
+		homa_print_latency(homa, "client", m->client_rpc_latency);
+		homa_print_latency(homa, "server", m->server_rpc_latency);
+		homa_print_stage_latency(homa, "gro_softirq_latency",
+				"Packets from GRO to SoftIRQ",
+				m->gro_softirq_latency);
+		homa_print_stage_latency(homa, "softirq_handoff_latency",
+				"Handoffs from SoftIRQ to homa_rpc_handoff",
+				m->softirq_handoff_latency);
+		homa_print_stage_latency(homa, "handoff_wakeup_latency",
+				"Handoffs from homa_rpc_handoff to wakeup",
+				m->handoff_wakeup_latency);
+		homa_print_stage_latency(homa, "wakeup_recvmsg_latency",
+				"Messages from wakeup to recvmsg return",
+				m->wakeup_recvmsg_latency);
+		homa_print_stage_latency(homa, "peer_rtt_latency",
+				"Round-trip time samples for peers",
+				m->peer_rtt_latency);
+		homa_print_lock_sites(homa, homa_cores[core]);
 		for (i = 0; i < NUM_TEMP_METRICS;  i++)
 			homa_append_metric(homa,
 					"temp%-2d                  %15llu  "
@@ -1951,6 +2373,227 @@ char *homa_print_metrics(struct homa *homa)
 	return homa->metrics;
 }
 
+/* Describes all of the fields in struct homa_metrics, in order; used to
+ * generate the schema in homa_metrics_snapshot. This table must be updated
+ * whenever a field is added to struct homa_metrics.
+ */
+#define HOMA_METRIC(field) {#field, \
+		offsetof(struct homa_metrics, field)/sizeof(__u64), \
+		sizeof_field(struct homa_metrics, field)/sizeof(__u64)}
+const struct homa_metric_desc homa_metric_descs[] = {
+	HOMA_METRIC(small_msg_bytes),
+	HOMA_METRIC(medium_msg_bytes),
+	HOMA_METRIC(large_msg_count),
+	HOMA_METRIC(large_msg_bytes),
+	HOMA_METRIC(sent_msg_bytes),
+	HOMA_METRIC(packets_sent),
+	HOMA_METRIC(packets_received),
+	HOMA_METRIC(priority_bytes),
+	HOMA_METRIC(priority_packets),
+	HOMA_METRIC(skb_allocs),
+	HOMA_METRIC(skb_alloc_cycles),
+	HOMA_METRIC(skb_frees),
+	HOMA_METRIC(skb_free_cycles),
+	HOMA_METRIC(requests_received),
+	HOMA_METRIC(requests_queued),
+	HOMA_METRIC(responses_received),
+	HOMA_METRIC(responses_queued),
+	HOMA_METRIC(fast_wakeups),
+	HOMA_METRIC(slow_wakeups),
+	HOMA_METRIC(handoffs_thread_waiting),
+	HOMA_METRIC(handoffs_alt_thread),
+	HOMA_METRIC(poll_cycles),
+	HOMA_METRIC(busy_polls),
+	HOMA_METRIC(poll_skips),
+	HOMA_METRIC(poll_shortened),
+	HOMA_METRIC(softirq_calls),
+	HOMA_METRIC(softirq_cycles),
+	HOMA_METRIC(bypass_softirq_cycles),
+	HOMA_METRIC(linux_softirq_cycles),
+	HOMA_METRIC(napi_cycles),
+	HOMA_METRIC(send_cycles),
+	HOMA_METRIC(send_calls),
+	HOMA_METRIC(recv_cycles),
+	HOMA_METRIC(recv_calls),
+	HOMA_METRIC(blocked_cycles),
+	HOMA_METRIC(reply_cycles),
+	HOMA_METRIC(reply_calls),
+	HOMA_METRIC(abort_cycles),
+	HOMA_METRIC(abort_calls),
+	HOMA_METRIC(so_set_buf_cycles),
+	HOMA_METRIC(so_set_buf_calls),
+	HOMA_METRIC(grantable_lock_cycles),
+	HOMA_METRIC(timer_cycles),
+	HOMA_METRIC(timer_reap_cycles),
+	HOMA_METRIC(data_pkt_reap_cycles),
+	HOMA_METRIC(pacer_cycles),
+	HOMA_METRIC(pacer_lost_cycles),
+	HOMA_METRIC(pacer_bytes),
+	HOMA_METRIC(pacer_skipped_rpcs),
+	HOMA_METRIC(pacer_needed_help),
+	HOMA_METRIC(engine_iterations),
+	HOMA_METRIC(engine_cycles),
+	HOMA_METRIC(engine_busy_cycles),
+	HOMA_METRIC(engine_work),
+	HOMA_METRIC(throttled_cycles),
+	HOMA_METRIC(resent_packets),
+	HOMA_METRIC(peer_hash_links),
+	HOMA_METRIC(peer_new_entries),
+	HOMA_METRIC(peer_kmalloc_errors),
+	HOMA_METRIC(peer_route_errors),
+	HOMA_METRIC(control_xmit_errors),
+	HOMA_METRIC(data_xmit_errors),
+	HOMA_METRIC(unknown_rpcs),
+	HOMA_METRIC(server_cant_create_rpcs),
+	HOMA_METRIC(unknown_packet_types),
+	HOMA_METRIC(short_packets),
+	HOMA_METRIC(packet_discards),
+	HOMA_METRIC(resent_discards),
+	HOMA_METRIC(resent_packets_used),
+	HOMA_METRIC(rpc_timeouts),
+	HOMA_METRIC(server_rpc_discards),
+	HOMA_METRIC(server_rpcs_unknown),
+	HOMA_METRIC(client_lock_misses),
+	HOMA_METRIC(client_lock_miss_cycles),
+	HOMA_METRIC(server_lock_misses),
+	HOMA_METRIC(server_lock_miss_cycles),
+	HOMA_METRIC(socket_lock_miss_cycles),
+	HOMA_METRIC(socket_lock_misses),
+	HOMA_METRIC(throttle_lock_miss_cycles),
+	HOMA_METRIC(throttle_lock_misses),
+	HOMA_METRIC(peer_ack_lock_miss_cycles),
+	HOMA_METRIC(peer_ack_lock_misses),
+	HOMA_METRIC(grantable_lock_miss_cycles),
+	HOMA_METRIC(grantable_lock_misses),
+	HOMA_METRIC(lock_site_overflows),
+	HOMA_METRIC(grantable_rpcs_integral),
+	HOMA_METRIC(grant_recalc_calls),
+	HOMA_METRIC(grant_recalc_loops),
+	HOMA_METRIC(grant_recalc_skips),
+	HOMA_METRIC(grant_priority_bumps),
+	HOMA_METRIC(resp_pregrants),
+	HOMA_METRIC(resp_pregrant_bytes),
+	HOMA_METRIC(resp_pregrant_expirations),
+	HOMA_METRIC(coalesced_grants),
+	HOMA_METRIC(fifo_grants),
+	HOMA_METRIC(fifo_grants_no_incoming),
+	HOMA_METRIC(disabled_reaps),
+	HOMA_METRIC(disabled_rpc_reaps),
+	HOMA_METRIC(reaper_calls),
+	HOMA_METRIC(reaper_dead_skbs),
+	HOMA_METRIC(forced_reaps),
+	HOMA_METRIC(throttle_list_adds),
+	HOMA_METRIC(throttle_list_checks),
+	HOMA_METRIC(ack_overflows),
+	HOMA_METRIC(piggybacked_acks),
+	HOMA_METRIC(prio_autotune_updates),
+	HOMA_METRIC(peer_rtt_clamped),
+	HOMA_METRIC(rtt_unsched_msgs),
+	HOMA_METRIC(rtt_unsched_bytes),
+	HOMA_METRIC(ignored_need_acks),
+	HOMA_METRIC(bpage_reuses),
+	HOMA_METRIC(bpage_refills),
+	HOMA_METRIC(bpage_steals),
+	HOMA_METRIC(bpage_node_allocs),
+	HOMA_METRIC(bpage_remote_allocs),
+	HOMA_METRIC(buffer_alloc_failures),
+	HOMA_METRIC(buffer_reserve_waits),
+	HOMA_METRIC(buffer_peer_waits),
+	HOMA_METRIC(linux_pkt_alloc_bytes),
+	HOMA_METRIC(dropped_data_no_bufs),
+	HOMA_METRIC(gen3_handoffs),
+	HOMA_METRIC(gen3_alt_handoffs),
+	HOMA_METRIC(gen3_expansions),
+	HOMA_METRIC(gen3_contractions),
+	HOMA_METRIC(rfs_handoffs),
+	HOMA_METRIC(gro_grant_bypasses),
+	HOMA_METRIC(gro_data_bypasses),
+	HOMA_METRIC(gro_data_coalesced),
+	HOMA_METRIC(client_rpc_latency),
+	HOMA_METRIC(server_rpc_latency),
+	HOMA_METRIC(gro_softirq_latency),
+	HOMA_METRIC(softirq_handoff_latency),
+	HOMA_METRIC(handoff_wakeup_latency),
+	HOMA_METRIC(wakeup_recvmsg_latency),
+	HOMA_METRIC(peer_rtt_latency),
+	HOMA_METRIC(temp),
+};
+const int homa_num_metric_descs = sizeof(homa_metric_descs)
+		/sizeof(homa_metric_descs[0]);
+
+/**
+ * homa_metrics_snapshot() - Sample all of the Homa performance metrics and
+ * return them in binary form (see struct homa_metrics_raw_header in homa.h).
+ * This is much cheaper than homa_print_metrics, and doesn't require
+ * homa->metrics_lock.
+ * @sum:     Nonzero means return a single block of counters summed over
+ *           all cores; zero means return a block for each core.
+ *
+ * Return:   The snapshot, which starts with a homa_metrics_raw_header
+ *           describing its length. The snapshot was allocated with
+ *           vmalloc; the caller must eventually vfree it. NULL means
+ *           memory couldn't be allocated.
+ */
+char *homa_metrics_snapshot(int sum)
+{
+	struct homa_metrics_raw_header *header;
+	int i, core, schema_length, used;
+	size_t length;
+	char *result;
+	__u64 *counters;
+
+	schema_length = 0;
+	for (i = 0; i < homa_num_metric_descs; i++)
+		schema_length += snprintf(NULL, 0, "%s %d %d\n",
+				homa_metric_descs[i].name,
+				homa_metric_descs[i].offset,
+				homa_metric_descs[i].count);
+
+	/* Leave room for a terminating NULL character. */
+	schema_length = (schema_length + 8) & ~7;
+
+	length = sizeof(*header) + schema_length + (sum ? 1 : nr_cpu_ids)
+			* sizeof(struct homa_metrics);
+	result = vmalloc(length);
+	if (!result)
+		return NULL;
+	header = (struct homa_metrics_raw_header *) result;
+	header->magic = HOMA_METRICS_MAGIC;
+	header->version = HOMA_METRICS_VERSION;
+	header->num_cores = sum ? 1 : nr_cpu_ids;
+	header->num_counters = sizeof(struct homa_metrics)/sizeof(__u64);
+	header->schema_length = schema_length;
+	header->flags = sum ? HOMA_METRICS_SUMMED : 0;
+	header->rdtsc_cycles = get_cycles();
+	header->cpu_khz = cpu_khz;
+
+	memset(result + sizeof(*header), 0, schema_length);
+	used = 0;
+	for (i = 0; i < homa_num_metric_descs; i++)
+		used += snprintf(result + sizeof(*header) + used,
+				schema_length - used, "%s %d %d\n",
+				homa_metric_descs[i].name,
+				homa_metric_descs[i].offset,
+				homa_metric_descs[i].count);
+
+	counters = (__u64 *) (result + sizeof(*header) + schema_length);
+	if (!sum) {
+		for (core = 0; core < nr_cpu_ids; core++)
+			memcpy(&counters[core * header->num_counters],
+					&homa_cores[core]->metrics,
+					sizeof(struct homa_metrics));
+		return result;
+	}
+	memset(counters, 0, sizeof(struct homa_metrics));
+	for (core = 0; core < nr_cpu_ids; core++) {
+		__u64 *src = (__u64 *) &homa_cores[core]->metrics;
+
+		for (i = 0; i < header->num_counters; i++)
+			counters[i] += src[i];
+	}
+	return result;
+}
+
 /**
  * homa_prios_changed() - This function is called whenever configuration
  * information related to priorities, such as @homa->unsched_cutoffs or
@@ -2021,8 +2664,9 @@ void homa_free_skbs(struct sk_buff *head)
  * available. It waits for the lock, but also records statistics about
  * the waiting time.
  * @homa:    Overall data about the Homa protocol implementation.
+ * @locker:  Static string identifying the locking code.
  */
-void homa_throttle_lock_slow(struct homa *homa)
+void homa_throttle_lock_slow(struct homa *homa, char *locker)
 {
 	__u64 start = get_cycles();
 	tt_record("beginning wait for throttle lock");
@@ -2030,6 +2674,7 @@ void homa_throttle_lock_slow(struct homa *homa)
 	tt_record("ending wait for throttle lock");
 	INC_METRIC(throttle_lock_misses, 1);
 	INC_METRIC(throttle_lock_miss_cycles, get_cycles() - start);
+	homa_lock_miss(HOMA_LOCK_THROTTLE, locker, get_cycles() - start);
 }
 
 /**
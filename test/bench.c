@@ -0,0 +1,561 @@
+/* Copyright (c) 2024 Homa Developers
+ * SPDX-License-Identifier: BSD-1-Clause
+ */
+
+/* This file contains microbenchmarks for performance-critical Homa
+ * functions. Like the unit tests, it runs the real Homa code in user
+ * space on top of mock.c; each benchmark sets up state with the same
+ * helpers the unit tests use, then measures individual invocations of
+ * the function of interest with the CPU's cycle counter. Each benchmark
+ * produces one output line with percentiles of the elapsed time, in a
+ * whitespace-separated format that is easy to compare across commits.
+ * Type "bench --help" for information about command-line arguments.
+ *
+ * Measurements include the overhead of the mocked kernel functions
+ * (e.g. kmalloc and spin locks in mock.c track their usage), so they
+ * are most useful for comparing different versions of Homa, not as
+ * absolute predictions of kernel performance.
+ */
+
+#include "homa_impl.h"
+#include "benchutils.h"
+#include "ccutils.h"
+#include "mock.h"
+#include "utils.h"
+
+#define KSELFTEST_NOT_MAIN 1
+#include "kselftest_harness.h"
+
+/* It isn't safe to include some header files, such as stdlib, because
+ * they conflict with kernel header files. The explicit declarations
+ * below replace those header files.
+ */
+
+extern void       exit(int status);
+extern long       strtol(const char *nptr, char **endptr, int base);
+
+extern struct homa *homa;
+
+/* The test harness normally defines these variables in main.c; mock.c and
+ * utils.c use them to report errors.
+ */
+struct __test_metadata *__test_list;
+struct __test_metadata *__current_test;
+unsigned int __test_count;
+unsigned int __fixture_count;
+int __constructor_order;
+
+/* Errors reported by mock.c (e.g. memory leaks) are recorded here. */
+static struct __test_metadata bench_metadata = {.name = "bench", .passed = 1};
+
+/* Number of distinct peers used for incoming messages in the grant
+ * benchmarks.
+ */
+#define BENCH_PEERS 10
+
+/* Size of the (fake) buffer pool region for each socket. */
+#define BENCH_POOL_SIZE (64 << 20)
+
+/* Values of command-line arguments (and their default values): */
+
+static int num_ops = 10000;
+static const char *filter = NULL;
+
+/* Homa state shared by all of the benchmarks; it is recreated by
+ * bench_setup for each benchmark.
+ */
+static struct homa bench_homa;
+static struct homa_sock client_hsk;
+static struct homa_sock server_hsk;
+static struct in6_addr client_ip;
+static struct in6_addr server_ip;
+static int client_port = 40000;
+static int server_port = 99;
+static sockaddr_in_union server_addr;
+
+/* Id to use for the next RPC created by a benchmark (always even, so
+ * it's a client id).
+ */
+static __u64 next_id;
+
+/**
+ * struct bench - Describes one microbenchmark.
+ */
+struct bench {
+	/** @name: Name of the benchmark, printed in the output. */
+	const char *name;
+
+	/**
+	 * @func: Runs the benchmark with the given parameter; must call
+	 * bench_record once for each operation measured.
+	 */
+	void (*func)(int param);
+
+	/**
+	 * @params: Values of the benchmark's parameter; the benchmark is run
+	 * once for each value. A zero value terminates the list.
+	 */
+	int params[4];
+};
+
+/**
+ * bench_xmit() - Invoked (via mock_xmit_hook) whenever Homa transmits a
+ * packet; discards the packet so that the benchmarks don't pay for
+ * logging it.
+ * @skb:        Outgoing packet; this function takes ownership.
+ * @daddr:      Destination address for the packet.
+ * @priority:   Priority level for the packet.
+ */
+static void bench_xmit(struct sk_buff *skb, struct in6_addr *daddr,
+		int priority)
+{
+	kfree_skb(skb);
+}
+
+/**
+ * bench_setup() - Create the Homa state used by a benchmark.
+ */
+static void bench_setup(void)
+{
+	struct homa_sock *hsk;
+	int i;
+
+	homa = &bench_homa;
+	homa_init(&bench_homa);
+	bench_homa.flags |= HOMA_FLAG_DONT_THROTTLE;
+	mock_sock_init(&client_hsk, &bench_homa, 0);
+	mock_sock_init(&server_hsk, &bench_homa, server_port);
+	for (i = 0; i < 2; i++) {
+		hsk = (i == 0) ? &client_hsk : &server_hsk;
+		homa_pool_detach(hsk);
+		if (homa_pool_init(hsk, (void *) 0x1000000,
+				BENCH_POOL_SIZE, 0) != 0) {
+			printf("homa_pool_init failed\n");
+			exit(1);
+		}
+	}
+	server_addr.in6.sin6_family = client_hsk.inet.sk.sk_family;
+	server_addr.in6.sin6_addr = server_ip;
+	server_addr.in6.sin6_port = htons(server_port);
+	next_id = 1000;
+}
+
+/**
+ * bench_teardown() - Delete all of the state created by bench_setup (and
+ * the benchmark), and check for leaks.
+ */
+static void bench_teardown(void)
+{
+	homa_destroy(&bench_homa);
+	unit_teardown();
+}
+
+/**
+ * bench_reap() - Free all of the resources for dead RPCs in a socket.
+ * @hsk:     Socket whose dead RPCs should be reaped.
+ */
+static void bench_reap(struct homa_sock *hsk)
+{
+	while (homa_rpc_reap(hsk, 1000) != 0) {}
+}
+
+/**
+ * data_header() - Returns a header for a DATA packet between the client
+ * and server sockets.
+ * @id:        Value for the sender_id field (the sender's id for the RPC).
+ * @length:    Total length of the message.
+ * @offset:    Offset of the packet's data within the message.
+ */
+static struct data_header data_header(__u64 id, int length, int offset)
+{
+	return (struct data_header){.common = {
+			.sport = htons(client_port),
+			.dport = htons(server_port),
+			.type = DATA,
+			.sender_id = cpu_to_be64(id)},
+			.message_length = htonl(length),
+			.incoming = htonl(length),
+			.cutoff_version = 0,
+			.retransmit = 0,
+			.seg = {.offset = htonl(offset),
+				.segment_length = htonl(
+				UNIT_TEST_DATA_PER_PACKET),
+				.ack = {0, 0, 0}}};
+}
+
+/**
+ * bench_add_packet_common() - Measure homa_add_packet for the packets of a
+ * message, which may arrive in order or reordered.
+ * @reorder:   Zero means packets arrive in order; otherwise each pair of
+ *             adjacent packets arrives swapped, so that every other packet
+ *             creates a gap and the next one fills it.
+ */
+static void bench_add_packet_common(int reorder)
+{
+#define BENCH_PKTS 64
+	struct sk_buff *skbs[BENCH_PKTS];
+	struct data_header h;
+	struct homa_rpc *rpc;
+	int length = BENCH_PKTS*UNIT_TEST_DATA_PER_PACKET;
+	int op, i, index;
+	__u64 start;
+
+	for (op = 0; op < num_ops; op += BENCH_PKTS) {
+		rpc = unit_client_rpc(&client_hsk, UNIT_OUTGOING, &client_ip,
+				&server_ip, server_port, next_id, 100, length);
+		next_id += 2;
+		homa_message_in_init(rpc, length, length);
+		for (i = 0; i < BENCH_PKTS; i++) {
+			h = data_header(rpc->id, length,
+					i*UNIT_TEST_DATA_PER_PACKET);
+			skbs[i] = mock_skb_new(&server_ip, &h.common,
+					UNIT_TEST_DATA_PER_PACKET, 0);
+		}
+		for (i = 0; i < BENCH_PKTS; i++) {
+			index = reorder ? (i ^ 1) : i;
+			start = tt_rdtsc();
+			homa_add_packet(rpc, skbs[index]);
+			bench_record(tt_rdtsc() - start);
+		}
+		homa_rpc_free(rpc);
+		bench_reap(&client_hsk);
+	}
+}
+
+static void bench_add_packet(int unused)
+{
+	bench_add_packet_common(0);
+}
+
+static void bench_add_packet_reorder(int unused)
+{
+	bench_add_packet_common(1);
+}
+
+/**
+ * grant_rpcs() - Create incoming messages that need grants.
+ * @count:     Number of messages to create.
+ *
+ * Return:     The message with the fewest bytes remaining (it will be
+ *             the highest priority message).
+ */
+static struct homa_rpc *grant_rpcs(int count)
+{
+	struct homa_rpc *rpc, *result = NULL;
+	struct in6_addr addr;
+	int i, length;
+
+	for (i = 0; i < count; i++) {
+		addr = ipv4_to_ipv6(htonl(0x0a000001 + (i % BENCH_PEERS)));
+		length = (i == 0) ? 100000 : 200000;
+		rpc = unit_client_rpc(&client_hsk, UNIT_OUTGOING, &client_ip,
+				&addr, server_port, next_id, 100, length);
+		next_id += 2;
+		homa_message_in_init(rpc, length, bench_homa.unsched_bytes);
+		homa_grant_add_rpc(rpc);
+		if (i == 0)
+			result = rpc;
+	}
+	homa_grant_recalc(&bench_homa, 0);
+	return result;
+}
+
+/**
+ * bench_grant_check_rpc() - Measure homa_grant_check_rpc in the normal
+ * case where a packet arrives for the highest priority message and it
+ * can be sent a new grant.
+ * @count:     Number of messages needing grants.
+ */
+static void bench_grant_check_rpc(int count)
+{
+	struct homa_rpc *rpc = grant_rpcs(count);
+	int granted = rpc->msgin.granted;
+	int op, received = 0;
+	__u64 start;
+
+	for (op = 0; op < num_ops; op++) {
+		received += UNIT_TEST_DATA_PER_PACKET;
+		if ((received + bench_homa.grant_window) >= rpc->msgin.length) {
+			/* Start the message over, so it never becomes
+			 * fully granted.
+			 */
+			received = UNIT_TEST_DATA_PER_PACKET;
+			rpc->msgin.granted = granted;
+		}
+		rpc->msgin.bytes_remaining = rpc->msgin.length - received;
+		homa_rpc_lock(rpc, "bench_grant_check_rpc");
+		start = tt_rdtsc();
+		homa_grant_check_rpc(rpc);
+		bench_record(tt_rdtsc() - start);
+	}
+}
+
+/**
+ * bench_grant_recalc() - Measure homa_grant_recalc when the set of active
+ * messages doesn't change.
+ * @count:     Number of messages needing grants.
+ */
+static void bench_grant_recalc(int count)
+{
+	int op;
+	__u64 start;
+
+	grant_rpcs(count);
+	for (op = 0; op < num_ops; op++) {
+		start = tt_rdtsc();
+		homa_grant_recalc(&bench_homa, 0);
+		bench_record(tt_rdtsc() - start);
+	}
+}
+
+/**
+ * bench_pool_allocate() - Measure homa_pool_allocate.
+ * @length:    Length of the message for which to allocate space.
+ */
+static void bench_pool_allocate(int length)
+{
+	struct homa_rpc *rpc = unit_client_rpc(&client_hsk, UNIT_OUTGOING,
+			&client_ip, &server_ip, server_port, next_id, 100,
+			length);
+	int op;
+	__u64 start;
+
+	next_id += 2;
+	homa_message_in_init(rpc, length, 0);
+	for (op = 0; op < num_ops; op++) {
+		homa_pool_release_buffers(client_hsk.buffer_pool,
+				rpc->msgin.num_bpages,
+				rpc->msgin.bpage_offsets);
+		rpc->msgin.num_bpages = 0;
+		homa_rpc_lock(rpc, "bench_pool_allocate");
+		start = tt_rdtsc();
+		homa_pool_allocate(rpc);
+		bench_record(tt_rdtsc() - start);
+		homa_rpc_unlock(rpc);
+	}
+}
+
+/**
+ * incoming_batch() - Create server RPCs that have received their first
+ * packet, plus a list of packets containing the rest of their data.
+ * @num_rpcs:   Number of RPCs to create.
+ * @num_pkts:   Total number of packets to return; must be a multiple of
+ *              @num_rpcs. Packets for different RPCs are interleaved.
+ * @rpcs:       The new RPCs are stored here.
+ *
+ * Return:      The first in a list of packets linked through skb->next.
+ */
+static struct sk_buff *incoming_batch(int num_rpcs, int num_pkts,
+		struct homa_rpc **rpcs)
+{
+	int per_rpc = num_pkts/num_rpcs;
+	int length = (per_rpc + 1)*UNIT_TEST_DATA_PER_PACKET;
+	struct sk_buff *head = NULL, **tail = &head;
+	struct data_header h;
+	int i;
+
+	for (i = 0; i < num_rpcs; i++) {
+		rpcs[i] = unit_server_rpc(&server_hsk, UNIT_RCVD_ONE_PKT,
+				&client_ip, &server_ip, client_port,
+				next_id + 1, length, 100);
+		next_id += 2;
+	}
+	for (i = 0; i < num_pkts; i++) {
+		h = data_header(rpcs[i % num_rpcs]->id ^ 1, length,
+				(1 + i/num_rpcs)*UNIT_TEST_DATA_PER_PACKET);
+		*tail = mock_skb_new(&client_ip, &h.common,
+				UNIT_TEST_DATA_PER_PACKET, 0);
+		tail = &(*tail)->next;
+	}
+	return head;
+}
+
+/**
+ * free_batch() - Delete the RPCs created by incoming_batch.
+ * @num_rpcs:   Number of RPCs.
+ * @rpcs:       The RPCs to delete.
+ */
+static void free_batch(int num_rpcs, struct homa_rpc **rpcs)
+{
+	int i;
+
+	for (i = 0; i < num_rpcs; i++)
+		homa_rpc_free(rpcs[i]);
+	bench_reap(&server_hsk);
+	unit_log_clear();
+}
+
+/**
+ * bench_dispatch_pkts() - Measure homa_dispatch_pkts for a batch of
+ * packets that all belong to the same RPC.
+ * @num_pkts:   Number of packets in the batch.
+ */
+static void bench_dispatch_pkts(int num_pkts)
+{
+	struct homa_rpc *rpc;
+	struct sk_buff *skbs;
+	int op;
+	__u64 start;
+
+	for (op = 0; op < num_ops; op++) {
+		skbs = incoming_batch(1, num_pkts, &rpc);
+		start = tt_rdtsc();
+		homa_dispatch_pkts(skbs, &bench_homa);
+		bench_record(tt_rdtsc() - start);
+		free_batch(1, &rpc);
+	}
+}
+
+/**
+ * bench_softirq_common() - Measure homa_softirq for a GRO batch of
+ * packets, which must be grouped by RPC before dispatching.
+ * @num_pkts:   Number of packets in the batch.
+ * @num_rpcs:   Number of different RPCs the packets belong to.
+ */
+static void bench_softirq_common(int num_pkts, int num_rpcs)
+{
+	struct homa_rpc *rpcs[64];
+	struct sk_buff *skb;
+	int op;
+	__u64 start;
+
+	for (op = 0; op < num_ops; op++) {
+		skb = incoming_batch(num_rpcs, num_pkts, rpcs);
+		skb_shinfo(skb)->frag_list = skb->next;
+		skb->next = NULL;
+		start = tt_rdtsc();
+		homa_softirq(skb);
+		bench_record(tt_rdtsc() - start);
+		free_batch(num_rpcs, rpcs);
+	}
+}
+
+static void bench_softirq(int num_rpcs)
+{
+	bench_softirq_common(32, num_rpcs);
+}
+
+static void bench_softirq_64(int num_rpcs)
+{
+	bench_softirq_common(64, num_rpcs);
+}
+
+/**
+ * bench_message_out_init() - Measure homa_message_out_init (without
+ * transmitting any packets).
+ * @length:    Length of the outgoing message.
+ */
+static void bench_message_out_init(int length)
+{
+	struct homa_rpc *rpc;
+	int op;
+	__u64 start;
+
+	for (op = 0; op < num_ops; op++) {
+		rpc = homa_rpc_new_client(&client_hsk, &server_addr);
+		if (IS_ERR(rpc)) {
+			printf("homa_rpc_new_client failed\n");
+			exit(1);
+		}
+		start = tt_rdtsc();
+		homa_message_out_init(rpc, unit_iov_iter(NULL, length), 0);
+		bench_record(tt_rdtsc() - start);
+		homa_rpc_free(rpc);
+		homa_rpc_unlock(rpc);
+		bench_reap(&client_hsk);
+		unit_log_clear();
+	}
+}
+
+static struct bench benches[] = {
+	{"add_packet",           bench_add_packet,       {1}},
+	{"add_packet_reorder",   bench_add_packet_reorder, {1}},
+	{"grant_check_rpc",      bench_grant_check_rpc,  {1, 10, 100}},
+	{"grant_recalc",         bench_grant_recalc,     {1, 10, 100}},
+	{"pool_allocate",        bench_pool_allocate,    {1000, 100000}},
+	{"dispatch_pkts",        bench_dispatch_pkts,    {1, 8, 32}},
+	{"softirq",              bench_softirq,          {1, 4, 16, 32}},
+	{"softirq_64",           bench_softirq_64,       {1, 4, 16, 64}},
+	{"message_out_init",     bench_message_out_init, {100, 10000, 100000}},
+	{NULL,                   NULL,                   {0}}
+};
+
+/**
+ * print_help() - Print out usage information for this program.
+ * @name:   Name of the program (argv[0])
+ */
+static void print_help(const char *name)
+{
+	printf("Usage: %s [option option ...]\n\n"
+		"Runs microbenchmarks for performance-critical Homa functions\n"
+		"and prints one line of statistics for each. The following\n"
+		"options are supported:\n\n"
+		"--filter         Only run benchmarks whose names contain this\n"
+		"                 string\n"
+		"--help           Print this message and exit\n"
+		"--ops            Number of operations to measure for each\n"
+		"                 benchmark (default: %d)\n",
+		name, num_ops);
+}
+
+int main(int argc, const char **argv)
+{
+	struct bench *bench;
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		const char *option = argv[i];
+
+		if (strcmp(option, "--help") == 0) {
+			print_help(argv[0]);
+			exit(0);
+		}
+		if ((i + 1) >= argc) {
+			printf("No value provided for %s option\n", option);
+			exit(1);
+		}
+		if (strcmp(option, "--filter") == 0) {
+			filter = argv[i+1];
+		} else if (strcmp(option, "--ops") == 0) {
+			num_ops = strtol(argv[i+1], NULL, 10);
+			if (num_ops <= 0) {
+				printf("Bad value %s for --ops\n", argv[i+1]);
+				exit(1);
+			}
+		} else {
+			printf("Unknown option %s; type '%s --help' for help\n",
+					option, argv[0]);
+			exit(1);
+		}
+		i++;
+	}
+
+	__current_test = &bench_metadata;
+	mock_ipv6 = true;
+	mock_cycles = ~0;
+	mock_xmit_hook = bench_xmit;
+	client_ip = unit_get_in_addr("196.168.0.1");
+	server_ip = unit_get_in_addr("1.2.3.4");
+	bench_calibrate();
+	bench_report_header();
+
+	for (bench = benches; bench->name != NULL; bench++) {
+		if (filter && (strstr(bench->name, filter) == NULL))
+			continue;
+		for (i = 0; (i < 4) && (bench->params[i] != 0); i++) {
+			bench_setup();
+			bench->func(bench->params[i]);
+			bench_report(bench->name, bench->params[i]);
+			bench_teardown();
+
+			/* mock_teardown resets these. */
+			mock_cycles = ~0;
+			mock_xmit_hook = bench_xmit;
+		}
+	}
+	if (!bench_metadata.passed) {
+		printf("Benchmarks encountered errors (see above)\n");
+		exit(1);
+	}
+	return 0;
+}
@@ -0,0 +1,97 @@
+/* Copyright (c) 2024 Homa Developers
+ * SPDX-License-Identifier: BSD-1-Clause
+ */
+
+/* This file contains utility functions for the microbenchmarks (bench.c)
+ * that are more conveniently implemented in C++, such as clock calibration
+ * and computing statistics. As with ccutils.cc, this file cannot access
+ * kernel internal stuff such as homa_impl.h.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+#include <x86intrin.h>
+
+#include "benchutils.h"
+
+/* Cycle counts for each operation measured since the last call to
+ * bench_report.
+ */
+static std::vector<uint64_t> samples;
+
+/* Rate of the cycle counter, in cycles per nanosecond; 0 means
+ * bench_calibrate hasn't been called yet.
+ */
+static double cycles_per_ns = 0.0;
+
+/**
+ * bench_calibrate() - Measure the rate of the CPU's cycle counter (which is
+ * what get_cycles returns when mock_cycles is ~0).
+ *
+ * Return:   The rate of the cycle counter, in GHz.
+ */
+double bench_calibrate(void)
+{
+	auto start = std::chrono::steady_clock::now();
+	uint64_t start_cycles = __rdtsc();
+	std::chrono::nanoseconds elapsed;
+
+	do {
+		elapsed = std::chrono::steady_clock::now() - start;
+	} while (elapsed.count() < 20000000);
+	cycles_per_ns = static_cast<double>(__rdtsc() - start_cycles)
+			/elapsed.count();
+	return cycles_per_ns;
+}
+
+/**
+ * bench_record() - Record the time taken by one operation.
+ * @cycles:   Elapsed time for the operation, in cycle counter units.
+ */
+void bench_record(uint64_t cycles)
+{
+	samples.push_back(cycles);
+}
+
+/**
+ * bench_report() - Print a line of statistics for all of the operations
+ * recorded since the last call to this function, then discard them.
+ * @name:     Name of the benchmark.
+ * @param:    Benchmark-specific parameter (e.g. number of RPCs or message
+ *            length); printed as part of the line.
+ */
+void bench_report(const char *name, int param)
+{
+	size_t count = samples.size();
+	double sum = 0.0;
+
+	if (count == 0)
+		return;
+	std::sort(samples.begin(), samples.end());
+	for (uint64_t cycles: samples)
+		sum += cycles;
+	printf("%-24s %8d %8lu %8lu %8lu %8lu %9.1f %9.1f %9.1f %9.1f\n",
+			name, param, count, samples[count/2],
+			samples[count*9/10], samples[count*99/100],
+			samples[count/2]/cycles_per_ns,
+			samples[count*9/10]/cycles_per_ns,
+			samples[count*99/100]/cycles_per_ns,
+			sum/count/cycles_per_ns);
+	samples.clear();
+}
+
+/**
+ * bench_report_header() - Print the header lines that describe the output
+ * of bench_report.
+ */
+void bench_report_header(void)
+{
+	printf("# Homa microbenchmarks; cycle counter runs at %.3f GHz\n",
+			cycles_per_ns);
+	printf("# benchmark                 param      ops  cyc_p50  cyc_p90  "
+			"cyc_p99    ns_p50    ns_p90    ns_p99   ns_mean\n");
+}
@@ -0,0 +1,16 @@
+/* Copyright (c) 2024 Homa Developers
+ * SPDX-License-Identifier: BSD-1-Clause
+ */
+
+/* Utility functions for the microbenchmarks (bench.c), implemented in C++. */
+
+#ifdef __cplusplus
+#define CEXTERN extern "C"
+#else
+#define CEXTERN extern
+#endif
+
+CEXTERN double        bench_calibrate(void);
+CEXTERN void          bench_record(uint64_t cycles);
+CEXTERN void          bench_report(const char *name, int param);
+CEXTERN void          bench_report_header(void);
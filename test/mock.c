@@ -30,6 +30,7 @@ extern void      *memcpy(void *dest, const void *src, size_t n);
  * call after that, and so on.
  */
 int mock_alloc_skb_errors = 0;
+int mock_coalesce_errors = 0;
 int mock_copy_data_errors = 0;
 int mock_copy_to_iter_errors = 0;
 int mock_copy_to_user_errors = 0;
@@ -60,6 +61,14 @@ int mock_xmit_log_verbose = 0;
  */
 int mock_xmit_log_homa_info = 0;
 
+/* If a test sets this variable, ip_queue_xmit and ip6_xmit will pass
+ * outgoing packets to it (along with the destination address and the
+ * packet's priority) instead of logging them; the function takes ownership
+ * of the packet. Used by the simulator (sim.c).
+ */
+void (*mock_xmit_hook)(struct sk_buff *skb, struct in6_addr *daddr,
+		int priority) = NULL;
+
 /* If a test sets this variable to nonzero, call_rcu_sched will log
  * whenever it is invoked.
  */
@@ -72,6 +81,11 @@ int mock_log_rcu_sched = 0;
  */
 int mock_copy_to_user_dont_copy = 0;
 
+/* If nonzero, sockfd_lookup will return a socket referring to this sock
+ * (for any file descriptor); otherwise it returns EBADF.
+ */
+struct sock *mock_sockfd_sk = NULL;
+
 /* HOMA_BPAGE_SIZE will evaluate to this. */
 int mock_bpage_size = 0x10000;
 
@@ -129,6 +143,19 @@ bool mock_ipv6_default;
 /* Linux's idea of the current CPU number. */
 int cpu_number = 1;
 
+/* CPU topology returned by mock_cpu_topology: entry i gives the physical
+ * core, last-level cache, and NUMA node for core i. A negative physical
+ * core means the core is offline. The default describes one socket with
+ * 4 physical cores, each with 2 hyperthreads (core i and core i+4 are
+ * siblings).
+ */
+#define MOCK_TOPOLOGY_CORES 8
+static const int mock_cpu_phys_default[MOCK_TOPOLOGY_CORES] =
+		{0, 1, 2, 3, 0, 1, 2, 3};
+int mock_cpu_phys[MOCK_TOPOLOGY_CORES] = {0, 1, 2, 3, 0, 1, 2, 3};
+int mock_cpu_llc[MOCK_TOPOLOGY_CORES];
+int mock_cpu_node[MOCK_TOPOLOGY_CORES];
+
 /* List of priorities for all outbound packets. */
 char mock_xmit_prios[1000];
 int mock_xmit_prios_offset = 0;
@@ -147,6 +174,7 @@ struct net_device mock_net_device = {
 
 static struct hrtimer_clock_base clock_base;
 unsigned int cpu_khz = 1000000;
+struct cpumask __cpu_online_mask = {.bits = {0xff}};
 struct task_struct *current_task = &mock_task;
 unsigned long ex_handler_refcount = 0;
 struct net init_net;
@@ -206,6 +234,15 @@ void call_rcu_sched(struct rcu_head *head, rcu_callback_t func)
 
 void __check_object_size(const void *ptr, unsigned long n, bool to_user) {}
 
+void __cpuhp_remove_state(enum cpuhp_state state, bool invoke) {}
+
+int __cpuhp_setup_state(enum cpuhp_state state, const char *name,
+		bool invoke, int (*startup)(unsigned int cpu),
+		int (*teardown)(unsigned int cpu), bool multi_instance)
+{
+	return CPUHP_AP_ONLINE_DYN;
+}
+
 size_t _copy_from_iter(void *addr, size_t bytes, struct iov_iter *iter)
 {
 	size_t bytes_left = bytes;
@@ -310,6 +347,8 @@ void dst_release(struct dst_entry *dst)
 void finish_wait(struct wait_queue_head *wq_head,
 		struct wait_queue_entry *wq_entry) {}
 
+void fput(struct file *file) {}
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(5,18,0)
 void get_random_bytes(void *buf, int nbytes)
 #else
@@ -550,12 +589,16 @@ unsigned int ip6_mtu(const struct dst_entry *dst)
 int ip6_xmit(const struct sock *sk, struct sk_buff *skb, struct flowi6 *fl6,
 	     __u32 mark, struct ipv6_txoptions *opt, int tclass, u32 priority)
 {
-	char buffer[200];
+	char buffer[1000];
 	const char *prefix = " ";
 	if (mock_check_error(&mock_ip6_xmit_errors)) {
 		kfree_skb(skb);
 		return -ENETDOWN;
 	}
+	if (mock_xmit_hook) {
+		mock_xmit_hook(skb, &fl6->daddr, tclass >> 4);
+		return 0;
+	}
 	if (mock_xmit_prios_offset == 0)
 		prefix = "";
 	mock_xmit_prios_offset += snprintf(
@@ -579,7 +622,7 @@ int ip6_xmit(const struct sock *sk, struct sk_buff *skb, struct flowi6 *fl6,
 
 int ip_queue_xmit(struct sock *sk, struct sk_buff *skb, struct flowi *fl)
 {
-	char buffer[200];
+	char buffer[1000];
 	const char *prefix = " ";
 	if (mock_check_error(&mock_ip_queue_xmit_errors)) {
 		/* Latest data (as of 1/2019) suggests that ip_queue_xmit
@@ -588,6 +631,12 @@ int ip_queue_xmit(struct sock *sk, struct sk_buff *skb, struct flowi *fl)
 		kfree_skb(skb);
 		return -ENETDOWN;
 	}
+	if (mock_xmit_hook) {
+		struct in6_addr daddr = ipv4_to_ipv6(fl->u.ip4.daddr);
+
+		mock_xmit_hook(skb, &daddr, ((struct inet_sock *) sk)->tos>>5);
+		return 0;
+	}
 	if (mock_xmit_prios_offset == 0)
 		prefix = "";
 	mock_xmit_prios_offset += snprintf(
@@ -696,6 +745,11 @@ void kfree_skb_reason(struct sk_buff *skb, enum skb_drop_reason reason)
 	free(skb);
 }
 
+void kfree_skb_partial(struct sk_buff *skb, bool head_stolen)
+{
+	kfree_skb(skb);
+}
+
 void *mock_kmalloc(size_t size, gfp_t flags)
 {
 	if (mock_check_error(&mock_kmalloc_errors))
@@ -711,6 +765,11 @@ void *mock_kmalloc(size_t size, gfp_t flags)
 	return block;
 }
 
+void kthread_bind(struct task_struct *k, unsigned int cpu)
+{
+	unit_log_printf("; ", "kthread_bind core %d", cpu);
+}
+
 struct task_struct *kthread_create_on_node(int (*threadfn)(void *data),
 					   void *data, int node,
 					   const char namefmt[],
@@ -719,8 +778,14 @@ struct task_struct *kthread_create_on_node(int (*threadfn)(void *data),
 	return NULL;
 }
 
+bool kthread_should_stop(void)
+{
+	return true;
+}
+
 int kthread_stop(struct task_struct *k)
 {
+	unit_log_printf("; ", "kthread_stop");
 	return 0;
 }
 
@@ -769,6 +834,14 @@ void mutex_unlock(struct mutex *lock)
 	mock_active_locks--;
 }
 
+void napi_busy_loop(unsigned int napi_id,
+		    bool (*loop_end)(void *, unsigned long),
+		    void *loop_end_arg, bool prefer_busy_poll, u16 budget)
+{
+	unit_log_printf("; ", "napi_busy_loop napi_id %u", napi_id);
+	UNIT_HOOK("napi_busy_loop");
+}
+
 int netif_receive_skb(struct sk_buff *skb)
 {
 	struct data_header *h = (struct data_header *)
@@ -980,6 +1053,36 @@ struct sk_buff *skb_segment(struct sk_buff *head_skb,
 	return skb1;
 }
 
+/* The real skb_try_coalesce appends @from's data to @to as page fragments.
+ * Mock skbs are always linear, so this version grows @to's head instead
+ * (header offsets in the skb are relative to head, so they're unaffected).
+ */
+bool skb_try_coalesce(struct sk_buff *to, struct sk_buff *from,
+		bool *fragstolen, int *delta_truesize)
+{
+	int shinfo_size = SKB_DATA_ALIGN(sizeof(struct skb_shared_info));
+	int old_size, new_size;
+	unsigned char *head;
+
+	if (mock_check_error(&mock_coalesce_errors))
+		return false;
+	old_size = skb_end_offset(to);
+	new_size = SKB_DATA_ALIGN(old_size + from->len);
+	head = malloc(new_size + shinfo_size);
+	memset(head, 0, new_size + shinfo_size);
+	memcpy(head, to->head, old_size);
+	memcpy(head + new_size, skb_shinfo(to), shinfo_size);
+	to->data = head + (to->data - to->head);
+	free(to->head);
+	to->head = head;
+	to->end = new_size;
+	memcpy(skb_put(to, from->len), from->data, from->len);
+	*fragstolen = false;
+	*delta_truesize = 0;
+	UNIT_LOG("; ", "skb_try_coalesce appended %d bytes", from->len);
+	return true;
+}
+
 int sock_common_getsockopt(struct socket *sock, int level, int optname,
 		char __user *optval, int __user *optlen)
 {
@@ -1025,6 +1128,19 @@ int sock_no_socketpair(struct socket *sock1, struct socket *sock2)
 	return 0;
 }
 
+struct socket *sockfd_lookup(int fd, int *err)
+{
+	static struct socket sock;
+
+	if ((fd < 0) || !mock_sockfd_sk) {
+		*err = -EBADF;
+		return NULL;
+	}
+	sock.sk = mock_sockfd_sk;
+	sock.file = NULL;
+	return &sock;
+}
+
 void synchronize_sched(void) {}
 
 void __tasklet_hi_schedule(struct tasklet_struct *t) {}
@@ -1120,6 +1236,27 @@ void mock_clear_xmit_prios()
 	mock_xmit_prios[0] = 0;
 }
 
+/**
+ * mock_cpu_topology() - Replacement for the CPU topology lookup in
+ * homa_cpu_topology; returns information from mock_cpu_phys, mock_cpu_llc,
+ * and mock_cpu_node.
+ * @cpu:    Core of interest.
+ * @phys:   Stored here: physical core containing @cpu.
+ * @llc:    Stored here: last-level cache used by @cpu.
+ * @node:   Stored here: NUMA node containing @cpu.
+ *
+ * Return:  Nonzero if @cpu is online, zero otherwise.
+ */
+int mock_cpu_topology(int cpu, int *phys, int *llc, int *node)
+{
+	if ((cpu >= MOCK_TOPOLOGY_CORES) || (mock_cpu_phys[cpu] < 0))
+		return 0;
+	*phys = mock_cpu_phys[cpu];
+	*llc = mock_cpu_llc[cpu];
+	*node = mock_cpu_node[cpu];
+	return 1;
+}
+
 /**
  * mock_data_ready() - Invoked through sk->sk_data_ready; logs a message
  * to indicate that it was invoked.
@@ -1252,10 +1389,14 @@ struct sk_buff *mock_skb_new(struct in6_addr *saddr, struct common_header *h,
 		ipv6_hdr(skb)->version = 6;
 		ipv6_hdr(skb)->saddr = *saddr;
 		ipv6_hdr(skb)->nexthdr = IPPROTO_HOMA;
+		ipv6_hdr(skb)->payload_len = htons(header_size + extra_bytes);
 	} else {
 		ip_hdr(skb)->version = 4;
+		ip_hdr(skb)->ihl = 5;
 		ip_hdr(skb)->saddr = saddr->in6_u.u6_addr32[3];
 		ip_hdr(skb)->protocol = IPPROTO_HOMA;
+		ip_hdr(skb)->tot_len = htons(ip_size + header_size
+				+ extra_bytes);
 	}
 	skb->_skb_refdst = 0;
 	skb->hash = 3;
@@ -1287,6 +1428,7 @@ void mock_sock_init(struct homa_sock *hsk, struct homa *homa, int port)
 	memset(hsk, 0, sizeof(*hsk));
 	sk->sk_data_ready = mock_data_ready;
 	sk->sk_family = mock_ipv6 ? AF_INET6 : AF_INET;
+	sk->sk_protocol = IPPROTO_HOMA;
 	if ((port != 0) && (port >= HOMA_MIN_DEFAULT_PORT))
 		homa->next_client_port = port;
 	homa_sock_init(hsk, homa);
@@ -1298,7 +1440,7 @@ void mock_sock_init(struct homa_sock *hsk, struct homa *homa, int port)
 	mock_mtu = UNIT_TEST_DATA_PER_PACKET + hsk->ip_header_length
 		+ sizeof(struct data_header);
 	mock_net_device.gso_max_size = mock_mtu;
-	homa_pool_init(hsk, (void *) 0x1000000, 100*HOMA_BPAGE_SIZE);
+	homa_pool_init(hsk, (void *) 0x1000000, 100*HOMA_BPAGE_SIZE, 0);
 }
 
 /**
@@ -1323,10 +1465,14 @@ void mock_teardown(void)
 	cpu_number = 1;
 	cpu_khz = 1000000;
 	mock_alloc_skb_errors = 0;
+	mock_coalesce_errors = 0;
 	mock_copy_data_errors = 0;
 	mock_copy_to_iter_errors = 0;
 	mock_copy_to_user_errors = 0;
 	mock_cpu_idle = 0;
+	memcpy(mock_cpu_phys, mock_cpu_phys_default, sizeof(mock_cpu_phys));
+	memset(mock_cpu_llc, 0, sizeof(mock_cpu_llc));
+	memset(mock_cpu_node, 0, sizeof(mock_cpu_node));
 	mock_cycles = 0;
 	mock_ipv6 = mock_ipv6_default;
 	mock_import_single_range_errors = 0;
@@ -1345,8 +1491,10 @@ void mock_teardown(void)
 	mock_vmalloc_errors = 0;
 	memset(&mock_task, 0, sizeof(mock_task));
 	mock_signal_pending = 0;
+	mock_sockfd_sk = NULL;
 	mock_xmit_log_verbose = 0;
 	mock_xmit_log_homa_info = 0;
+	mock_xmit_hook = NULL;
 	mock_mtu = 0;
 	mock_net_device.gso_max_size = 0;
 
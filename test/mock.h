@@ -8,10 +8,14 @@ extern int         cpu_number;
 extern int         mock_alloc_skb_errors;
 extern             int mock_bpage_size;
 extern             int mock_bpage_shift;
+extern int         mock_coalesce_errors;
 extern int         mock_copy_data_errors;
 extern int         mock_copy_to_user_dont_copy;
 extern int         mock_copy_to_user_errors;
 extern int         mock_cpu_idle;
+extern int         mock_cpu_llc[];
+extern int         mock_cpu_node[];
+extern int         mock_cpu_phys[];
 extern cycles_t    mock_cycles;
 extern int         mock_import_iovec_errors;
 extern int         mock_import_single_range_errors;
@@ -28,15 +32,21 @@ extern struct net_device
 		   mock_net_device;
 extern int         mock_route_errors;
 extern int         mock_spin_lock_held;
+extern struct sock *
+		   mock_sockfd_sk;
 extern struct task_struct
 		   mock_task;
 extern int         mock_trylock_errors;
 extern int         mock_vmalloc_errors;
+extern void        (*mock_xmit_hook)(struct sk_buff *skb,
+			struct in6_addr *daddr, int priority);
 extern int         mock_xmit_log_verbose;
 extern int         mock_xmit_log_homa_info;
 
 extern int         mock_check_error(int *errorMask);
 extern void        mock_clear_xmit_prios(void);
+extern int         mock_cpu_topology(int cpu, int *phys, int *llc,
+			int *node);
 extern void        mock_data_ready(struct sock *sk);
 extern cycles_t    mock_get_cycles(void);
 extern unsigned int
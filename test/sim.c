@@ -0,0 +1,1035 @@
+/* Copyright (c) 2024 Homa Developers
+ * SPDX-License-Identifier: BSD-1-Clause
+ */
+
+/* This file contains a discrete-event simulator that runs the real Homa
+ * protocol code (compiled for user space against mock.c, just like the
+ * unit tests) on a collection of simulated hosts connected by a single
+ * modeled switch. Each host has its own struct homa, a client socket
+ * that issues requests according to one of the standard workloads, and
+ * a server socket that echoes requests back. The switch has one egress
+ * port per host, with a strict-priority queue for each Homa priority, and
+ * a limited amount of shared buffer space. Type "sim --help" for
+ * information about command-line arguments.
+ *
+ * Simulated hosts are infinitely fast: Homa code runs in zero simulated
+ * time, so the simulator is useful for studying network-level policies
+ * (grants, overcommitment, priorities, pacing) but not CPU effects.
+ */
+
+#include "homa_impl.h"
+#include "ccutils.h"
+#include "mock.h"
+#include "simutils.h"
+#include "utils.h"
+
+#define KSELFTEST_NOT_MAIN 1
+#include "kselftest_harness.h"
+
+/* It isn't safe to include some header files, such as stdlib, because
+ * they conflict with kernel header files. The explicit declarations
+ * below replace those header files.
+ */
+
+extern void       exit(int status);
+extern void       free(void *ptr);
+extern void      *malloc(size_t size);
+extern void      *realloc(void *ptr, size_t size);
+extern double     strtod(const char *nptr, char **endptr);
+
+extern struct homa *homa;
+extern char *core_memory;
+
+/* The test harness normally defines these variables in main.c; mock.c and
+ * utils.c use them to report errors.
+ */
+struct __test_metadata *__test_list;
+struct __test_metadata *__current_test;
+unsigned int __test_count;
+unsigned int __fixture_count;
+int __constructor_order;
+
+/* Errors reported by mock.c (e.g. memory leaks) are recorded here. */
+static struct __test_metadata sim_metadata = {.name = "sim", .passed = 1};
+
+/* Port number used by the server socket on each host. */
+#define SIM_SERVER_PORT 1
+
+/* Interval between calls to homa_timer on each host, in ns. */
+#define SIM_TIMER_INTERVAL 1000000
+
+/* Values of command-line arguments (and their default values): */
+
+static int num_hosts = 16;
+static const char *workload = "w4";
+static double gbps = 10.0;
+static bool one_way = false;
+static double link_gbps = 25.0;
+static int link_ns = 250;
+static int buffer_kb = 16000;
+static int port_kb = 0;
+static double sim_ms = 10.0;
+static double warmup_ms = 1.0;
+static int sample_ns = 1000;
+static int pool_mb = 64;
+static int max_message = HOMA_MAX_MESSAGE_LENGTH;
+static int seed = 12345;
+static const char *output = NULL;
+
+/**
+ * struct sim_param - Describes a field of struct homa that can be set with
+ * the --sysctl option. Names are the same as in /proc/sys/net/homa.
+ */
+struct sim_param {
+	/** @name: Name of the parameter. */
+	const char *name;
+
+	/** @offset: Location of the (int) parameter within struct homa. */
+	int offset;
+
+	/** @set: True means a value was specified on the command line. */
+	bool set;
+
+	/** @value: Value specified on the command line. */
+	int value;
+};
+
+#define SIM_PARAM(name, field) {name, offsetof(struct homa, field), false, 0}
+
+static struct sim_param sim_params[] = {
+	SIM_PARAM("dead_buffs_limit",     dead_buffs_limit),
+	SIM_PARAM("fifo_grant_increment", fifo_grant_increment),
+	SIM_PARAM("grant_fifo_fraction",  grant_fifo_fraction),
+	SIM_PARAM("max_incoming",         max_incoming),
+	SIM_PARAM("max_nic_queue_ns",     max_nic_queue_ns),
+	SIM_PARAM("max_overcommit",       max_overcommit),
+	SIM_PARAM("max_rpcs_per_peer",    max_rpcs_per_peer),
+	SIM_PARAM("max_sched_prio",       max_sched_prio),
+	SIM_PARAM("num_priorities",       num_priorities),
+	SIM_PARAM("pacer_fifo_fraction",  pacer_fifo_fraction),
+	SIM_PARAM("reap_limit",           reap_limit),
+	SIM_PARAM("resend_interval",      resend_interval),
+	SIM_PARAM("resend_ticks",         resend_ticks),
+	SIM_PARAM("throttle_min_bytes",   throttle_min_bytes),
+	SIM_PARAM("timeout_resends",      timeout_resends),
+	SIM_PARAM("unsched_bytes",        unsched_bytes),
+	SIM_PARAM("window",               window_param),
+	{NULL, 0, false, 0}
+};
+
+/**
+ * struct sim_packet - A packet in flight between two simulated hosts.
+ */
+struct sim_packet {
+	/**
+	 * @skb: The packet, in the form it will have when it arrives at
+	 * its destination.
+	 */
+	struct sk_buff *skb;
+
+	/** @priority: Priority level at which the packet was sent. */
+	int priority;
+
+	/** @wire_bytes: Bytes occupied by the packet on the wire. */
+	int wire_bytes;
+
+	/** @next: Next packet in the same queue (NULL means end of list). */
+	struct sim_packet *next;
+};
+
+/**
+ * struct sim_port - Models a switch egress port (the downlink to a host).
+ */
+struct sim_port {
+	/** @heads: First packet queued at each priority level. */
+	struct sim_packet *heads[HOMA_MAX_PRIORITIES];
+
+	/** @tails: Last packet queued at each priority level. */
+	struct sim_packet *tails[HOMA_MAX_PRIORITIES];
+
+	/**
+	 * @queued_bytes: Total wire bytes in packets that are queued for
+	 * this port, including the one currently being transmitted.
+	 */
+	int queued_bytes;
+
+	/** @busy: True means a packet is currently being transmitted. */
+	bool busy;
+};
+
+/**
+ * struct sim_host - Holds all of the state for one simulated host.
+ */
+struct sim_host {
+	/** @id: Index of this host in @hosts. */
+	int id;
+
+	/** @addr: IP address of this host. */
+	struct in6_addr addr;
+
+	/** @homa: Homa's overall state for this host. */
+	struct homa homa;
+
+	/**
+	 * @cores: Core-specific data for this host; copied into homa_cores
+	 * whenever this host is the current one.
+	 */
+	struct homa_core **cores;
+
+	/** @core_memory: Block of memory containing @cores. */
+	char *core_memory;
+
+	/** @client: Socket used to issue requests. */
+	struct homa_sock client;
+
+	/** @server: Socket used to receive requests and send responses. */
+	struct homa_sock server;
+
+	/** @client_args: Used for all recvmsg calls on @client. */
+	struct homa_recvmsg_args client_args;
+
+	/** @server_args: Used for all recvmsg calls on @server. */
+	struct homa_recvmsg_args server_args;
+
+	/**
+	 * @nic_idle: Time when the host's uplink will finish transmitting
+	 * all of the packets passed to it so far.
+	 */
+	__u64 nic_idle;
+
+	/** @pacer_scheduled: True means a SIM_PACER event is pending. */
+	bool pacer_scheduled;
+
+	/** @port: Switch egress port leading to this host. */
+	struct sim_port port;
+};
+
+/* Legal values for the type field of struct sim_event. */
+enum sim_event_type {
+	/* Time for @host to issue a new request. */
+	SIM_REQUEST                = 1,
+
+	/* @packet arrives at the switch, headed for @host. */
+	SIM_SWITCH                 = 2,
+
+	/* The egress port for @host has finished transmitting @packet. */
+	SIM_PORT_DONE              = 3,
+
+	/* @packet arrives at @host. */
+	SIM_DELIVER                = 4,
+
+	/* Time to invoke the pacer on @host. */
+	SIM_PACER                  = 5,
+
+	/* Time to invoke homa_timer on @host. */
+	SIM_TIMER                  = 6,
+
+	/* Time to sample buffer occupancy in the switch. */
+	SIM_SAMPLE                 = 7,
+};
+
+/**
+ * struct sim_event - Something that will happen at a particular time.
+ */
+struct sim_event {
+	/** @time: When the event occurs (ns, same as get_cycles). */
+	__u64 time;
+
+	/** @seq: Breaks ties between events with the same time (FIFO). */
+	__u64 seq;
+
+	/** @type: What happens: one of the values of enum sim_event_type. */
+	int type;
+
+	/** @host: Host to which the event applies (may be NULL). */
+	struct sim_host *host;
+
+	/** @packet: Packet to which the event applies (may be NULL). */
+	struct sim_packet *packet;
+};
+
+/* All of the simulated hosts. */
+static struct sim_host **hosts;
+
+/* The host whose Homa state is currently installed in the globals. */
+static struct sim_host *current_host;
+
+/* Pending events, organized as a binary min-heap on (time, seq). */
+static struct sim_event *events;
+static int num_events;
+static int max_events;
+static __u64 next_seq;
+
+/* Total wire bytes currently queued in the switch. */
+static int switch_bytes;
+
+/* Number of packets dropped by the switch because of buffer overflow. */
+static __u64 switch_drops;
+
+/* Average request length in the workload. */
+static double mean_length;
+
+/* Number of requests issued after warmup, and how many completed. */
+static __u64 requests_sent;
+static __u64 responses_received;
+
+/* Times (in ns) when warmup ends and when the simulation ends. */
+static __u64 warmup_end;
+static __u64 sim_end;
+
+/* Simulated time at which the simulation starts (nonzero, since
+ * Homa sometimes uses a zero time to mean "not set").
+ */
+#define SIM_START 1000000000
+
+/**
+ * print_help() - Print out usage information for this program.
+ * @name:   Name of the program (argv[0])
+ */
+static void print_help(const char *name)
+{
+	printf("Usage: %s options\n\n"
+		"Simulate a cluster of hosts running Homa, connected by a\n"
+		"single switch; print RPC slowdowns and buffer usage.\n"
+		"The following options are available:\n"
+		"--buffer-kb       Total buffer space in the switch (default: %d)\n"
+		"--gbps            Rate at which each host issues request bytes\n"
+		"                  (default: %.1f)\n"
+		"--help            Print this message\n"
+		"--hosts           Number of simulated hosts (default: %d)\n"
+		"--link-gbps       Speed of each host link (default: %.1f)\n"
+		"--link-ns         Propagation delay on each link (default: %d)\n"
+		"--max-message     Largest message length (default: %d)\n"
+		"--ms              Simulated time to run, in ms (default: %.1f)\n"
+		"--one-way         Make all responses 100 B, instead of the same\n"
+		"                  length as the request\n"
+		"--output          Write detailed results to files with this\n"
+		"                  prefix: .data (slowdowns, in cperf.py's\n"
+		"                  format), .rtts (cp_node's format), and\n"
+		"                  .port_occupancy/.switch_occupancy (CDFs)\n"
+		"--pool-mb         Size of each socket's buffer pool (default: %d)\n"
+		"--port-kb         Limit on buffer space for each egress port\n"
+		"                  (default: 0, which means no limit beyond\n"
+		"                  --buffer-kb)\n"
+		"--sample-ns       Interval between samples of buffer occupancy\n"
+		"                  (default: %d)\n"
+		"--seed            Seed for random number generation (default: %d)\n"
+		"--sysctl          Two values: the name of a Homa configuration\n"
+		"                  parameter (as in /proc/sys/net/homa) and a value\n"
+		"                  for it, used on all hosts. May be repeated\n"
+		"--warmup-ms       Don't record statistics for this much time at\n"
+		"                  the start of the simulation (default: %.1f)\n"
+		"--workload        Distribution of request lengths: w1-w5 or a\n"
+		"                  fixed length (default: %s)\n",
+		name, buffer_kb, gbps, num_hosts, link_gbps, link_ns,
+		max_message, sim_ms, pool_mb, port_kb, sample_ns, seed,
+		warmup_ms, workload);
+}
+
+/**
+ * wire_ns() - Returns the time to transmit a given number of bytes on a
+ * link.
+ * @bytes:   Number of bytes (including all headers and framing).
+ */
+static __u64 wire_ns(int bytes)
+{
+	return (__u64) (bytes*8/link_gbps);
+}
+
+/**
+ * host_addr() - Returns the IP address for a given host.
+ * @id:    Index of the host.
+ */
+static struct in6_addr host_addr(int id)
+{
+	struct in6_addr addr = {};
+
+	addr.s6_addr32[0] = htonl(0xfc000000);
+	addr.s6_addr32[3] = htonl(id + 1);
+	return addr;
+}
+
+/**
+ * addr_host() - Returns the host with a given address, or NULL if there
+ * is no such host.
+ * @addr:   IP address of the desired host.
+ */
+static struct sim_host *addr_host(const struct in6_addr *addr)
+{
+	int id = ntohl(addr->s6_addr32[3]) - 1;
+
+	if ((addr->s6_addr32[0] != htonl(0xfc000000)) || (id < 0)
+			|| (id >= num_hosts))
+		return NULL;
+	return hosts[id];
+}
+
+/**
+ * schedule_event() - Arrange for an event to occur in the future.
+ * @time:     When the event should occur.
+ * @type:     Value from enum sim_event_type.
+ * @host:     Host to which the event applies (may be NULL).
+ * @packet:   Packet to which the event applies (may be NULL).
+ */
+static void schedule_event(__u64 time, int type, struct sim_host *host,
+		struct sim_packet *packet)
+{
+	struct sim_event event = {time, next_seq++, type, host, packet};
+	int i, parent;
+
+	if (num_events >= max_events) {
+		max_events = (max_events == 0) ? 1000 : 2*max_events;
+		events = realloc(events, max_events*sizeof(*events));
+	}
+	for (i = num_events++; i > 0; i = parent) {
+		parent = (i - 1)/2;
+		if ((events[parent].time < time) || ((events[parent].time
+				== time) && (events[parent].seq < event.seq)))
+			break;
+		events[i] = events[parent];
+	}
+	events[i] = event;
+}
+
+/**
+ * next_event() - Remove the earliest event from @events.
+ * @event:    The event is copied here.
+ *
+ * Return:    False if there are no more events, true otherwise.
+ */
+static bool next_event(struct sim_event *event)
+{
+	struct sim_event last;
+	int i, child;
+
+	if (num_events == 0)
+		return false;
+	*event = events[0];
+	last = events[--num_events];
+	for (i = 0; ; i = child) {
+		child = 2*i + 1;
+		if (child >= num_events)
+			break;
+		if (((child + 1) < num_events) && ((events[child+1].time
+				< events[child].time) || ((events[child+1].time
+				== events[child].time) && (events[child+1].seq
+				< events[child].seq))))
+			child++;
+		if ((last.time < events[child].time) || ((last.time
+				== events[child].time)
+				&& (last.seq < events[child].seq)))
+			break;
+		events[i] = events[child];
+	}
+	events[i] = last;
+	return true;
+}
+
+/**
+ * enter_host() - Install a host's Homa state in the global variables used
+ * by Homa, so that Homa code will run on behalf of that host.
+ * @host:     Host that is about to execute.
+ */
+static void enter_host(struct sim_host *host)
+{
+	current_host = host;
+	homa = &host->homa;
+	memcpy(homa_cores, host->cores, nr_cpu_ids*sizeof(homa_cores[0]));
+}
+
+/**
+ * sim_xmit() - Invoked (via mock_xmit_hook) whenever Homa transmits a
+ * packet. Converts the packet into the form it will have when it arrives
+ * at its destination and passes it to the sending host's uplink.
+ * @skb:        Outgoing packet; this function takes ownership.
+ * @daddr:      Destination address for the packet.
+ * @priority:   Priority level for the packet.
+ */
+static void sim_xmit(struct sk_buff *skb, struct in6_addr *daddr,
+		int priority)
+{
+	struct common_header *h = (struct common_header *) skb->data;
+	struct sim_host *dest = addr_host(daddr);
+	struct sim_packet *packet;
+	int data_bytes = 0;
+	__u64 start;
+
+	if (dest == NULL) {
+		FAIL("sim_xmit couldn't find destination host");
+		kfree_skb(skb);
+		return;
+	}
+	if (skb_shinfo(skb)->gso_segs > 1)
+		FAIL("sim_xmit received GSO packet with %d segments",
+				skb_shinfo(skb)->gso_segs);
+	if (h->type == DATA)
+		data_bytes = ntohl(((struct data_header *) h)
+				->seg.segment_length);
+	packet = malloc(sizeof(*packet));
+	packet->skb = mock_skb_new(&current_host->addr, h, data_bytes, 0);
+	packet->priority = priority;
+	packet->wire_bytes = skb->len + HOMA_IPV6_HEADER_LENGTH
+			+ HOMA_ETH_OVERHEAD;
+	packet->next = NULL;
+	kfree_skb(skb);
+
+	/* The uplink transmits packets in FIFO order. */
+	start = current_host->nic_idle;
+	if (start < mock_cycles)
+		start = mock_cycles;
+	current_host->nic_idle = start + wire_ns(packet->wire_bytes);
+	schedule_event(current_host->nic_idle + link_ns, SIM_SWITCH, dest,
+			packet);
+}
+
+/**
+ * port_start() - If an egress port is idle and has packets queued, start
+ * transmitting the highest-priority one.
+ * @host:    Host whose egress port should be checked.
+ */
+static void port_start(struct sim_host *host)
+{
+	struct sim_port *port = &host->port;
+	struct sim_packet *packet;
+	int i;
+
+	if (port->busy)
+		return;
+	for (i = HOMA_MAX_PRIORITIES - 1; i >= 0; i--) {
+		packet = port->heads[i];
+		if (packet == NULL)
+			continue;
+		port->heads[i] = packet->next;
+		if (port->heads[i] == NULL)
+			port->tails[i] = NULL;
+		port->busy = true;
+		schedule_event(mock_cycles + wire_ns(packet->wire_bytes),
+				SIM_PORT_DONE, host, packet);
+		return;
+	}
+}
+
+/**
+ * switch_arrive() - Invoked when a packet arrives at the switch; queues
+ * it on the appropriate egress port (or drops it if there isn't enough
+ * buffer space).
+ * @host:     Destination host for the packet.
+ * @packet:   The packet.
+ */
+static void switch_arrive(struct sim_host *host, struct sim_packet *packet)
+{
+	struct sim_port *port = &host->port;
+	int priority = packet->priority;
+
+	if (((switch_bytes + packet->wire_bytes) > 1024*buffer_kb)
+			|| ((port_kb != 0) && ((port->queued_bytes
+			+ packet->wire_bytes) > 1024*port_kb))) {
+		switch_drops++;
+		kfree_skb(packet->skb);
+		free(packet);
+		return;
+	}
+	if (port->tails[priority])
+		port->tails[priority]->next = packet;
+	else
+		port->heads[priority] = packet;
+	port->tails[priority] = packet;
+	port->queued_bytes += packet->wire_bytes;
+	switch_bytes += packet->wire_bytes;
+	port_start(host);
+}
+
+/**
+ * check_pacer() - Make sure that a SIM_PACER event is scheduled for a
+ * host if it has throttled RPCs.
+ * @host:    Host to check.
+ */
+static void check_pacer(struct sim_host *host)
+{
+	__u64 idle, when;
+
+	if (host->pacer_scheduled || list_empty(&host->homa.throttled_rpcs))
+		return;
+
+	/* Wait until the NIC queue is short enough for homa_pacer_xmit
+	 * to transmit (otherwise it would spin forever, since time doesn't
+	 * advance while it runs).
+	 */
+	idle = atomic64_read(&host->homa.link_idle_time);
+	when = mock_cycles;
+	if (idle > (when + host->homa.max_nic_queue_cycles))
+		when = idle - host->homa.max_nic_queue_cycles;
+	schedule_event(when, SIM_PACER, host, NULL);
+	host->pacer_scheduled = true;
+}
+
+/**
+ * init_msghdr() - Initialize a msghdr for use with homa_sendmsg or
+ * homa_recvmsg.
+ * @msg:        Structure to initialize.
+ * @addr:       Peer address for the message.
+ * @control:    Value for msg_control.
+ * @length:     Size of @control.
+ */
+static void init_msghdr(struct msghdr *msg, sockaddr_in_union *addr,
+		void *control, int length)
+{
+	memset(msg, 0, sizeof(*msg));
+	msg->msg_name = addr;
+	msg->msg_namelen = sizeof(addr->in6);
+	msg->msg_control = control;
+	msg->msg_controllen = length;
+	msg->msg_control_is_user = 1;
+}
+
+/**
+ * issue_request() - Send a new request from a given host to a random
+ * other host, and schedule the host's next request.
+ * @host:     Host that will issue the request.
+ */
+static void issue_request(struct sim_host *host)
+{
+	struct homa_sendmsg_args args;
+	sockaddr_in_union addr;
+	struct msghdr msg;
+	int length, dest, err;
+
+	length = sim_dist_sample();
+	dest = sim_rand_int(num_hosts - 1);
+	if (dest >= host->id)
+		dest++;
+	addr.in6.sin6_family = AF_INET6;
+	addr.in6.sin6_addr = hosts[dest]->addr;
+	addr.in6.sin6_port = htons(SIM_SERVER_PORT);
+	init_msghdr(&msg, &addr, &args, sizeof(args));
+	msg.msg_iter = *unit_iov_iter(NULL, length);
+
+	/* The completion cookie records both the request's start time and
+	 * its length, since the response may have a different length.
+	 */
+	args.id = 0;
+	args.completion_cookie = (mock_cycles << 20) | length;
+	args.response_length = 0;
+	args._pad1 = 0;
+	err = homa_sendmsg(&host->client.inet.sk, &msg, length);
+	if (err != 0)
+		FAIL("homa_sendmsg failed for request: %d", err);
+	else if (mock_cycles >= warmup_end)
+		requests_sent++;
+
+	schedule_event(mock_cycles + (__u64) sim_exp_sample(
+			mean_length*8.0/gbps), SIM_REQUEST, host, NULL);
+}
+
+/**
+ * run_apps() - Simulate the application on a host: receive any complete
+ * requests and respond to them, and receive any complete responses.
+ * @host:     Host whose sockets should be checked.
+ */
+static void run_apps(struct sim_host *host)
+{
+	struct homa_sendmsg_args send_args;
+	sockaddr_in_union addr;
+	struct msghdr msg;
+	int length, addr_len, err;
+	__u64 start;
+
+	while (1) {
+		init_msghdr(&msg, &addr, &host->server_args,
+				sizeof(host->server_args));
+		host->server_args.id = 0;
+		length = homa_recvmsg(&host->server.inet.sk, &msg, 0, 0,
+				&addr_len);
+		if (length == -EAGAIN)
+			break;
+		if (length < 0)
+			continue;
+		if (one_way)
+			length = 100;
+		init_msghdr(&msg, &addr, &send_args, sizeof(send_args));
+		msg.msg_iter = *unit_iov_iter(NULL, length);
+		send_args.id = host->server_args.id;
+		send_args.completion_cookie = 0;
+		send_args.response_length = 0;
+		send_args._pad1 = 0;
+		err = homa_sendmsg(&host->server.inet.sk, &msg, length);
+		if (err != 0)
+			FAIL("homa_sendmsg failed for response: %d", err);
+	}
+
+	while (1) {
+		init_msghdr(&msg, &addr, &host->client_args,
+				sizeof(host->client_args));
+		host->client_args.id = 0;
+		length = homa_recvmsg(&host->client.inet.sk, &msg, 0, 0,
+				&addr_len);
+		if (length == -EAGAIN)
+			break;
+		if (length < 0) {
+			FAIL("RPC failed with error %d", length);
+			continue;
+		}
+		start = host->client_args.completion_cookie >> 20;
+		if (start < warmup_end)
+			continue;
+		responses_received++;
+		sim_record_rtt(host->client_args.completion_cookie
+				& ((1 << 20) - 1), (mock_cycles - start)/1000.0);
+	}
+}
+
+/**
+ * host_init() - Create a new simulated host, including its Homa state and
+ * sockets.
+ * @id:       Index of the new host.
+ *
+ * Return:    The new host.
+ */
+static struct sim_host *host_init(int id)
+{
+	struct sim_host *host = malloc(sizeof(*host));
+	struct sim_param *param;
+	struct homa_sock *hsk;
+	int i;
+
+	memset(host, 0, sizeof(*host));
+	host->id = id;
+	host->addr = host_addr(id);
+
+	/* Force homa_init to allocate a new set of homa_cores. */
+	core_memory = NULL;
+	homa = &host->homa;
+	if (homa_init(&host->homa) != 0) {
+		printf("homa_init failed for host %d\n", id);
+		exit(1);
+	}
+	host->core_memory = core_memory;
+	host->cores = malloc(nr_cpu_ids*sizeof(*host->cores));
+	memcpy(host->cores, homa_cores, nr_cpu_ids*sizeof(*host->cores));
+	enter_host(host);
+
+	host->homa.link_mbps = (int) (1000*link_gbps);
+	for (param = sim_params; param->name != NULL; param++) {
+		if (param->set)
+			*((int *) ((char *) &host->homa + param->offset)) =
+					param->value;
+	}
+	homa_incoming_sysctl_changed(&host->homa);
+	homa_outgoing_sysctl_changed(&host->homa);
+	homa_prios_changed(&host->homa);
+
+	mock_sock_init(&host->client, &host->homa, 0);
+	mock_sock_init(&host->server, &host->homa, SIM_SERVER_PORT);
+	for (i = 0; i < 2; i++) {
+		hsk = (i == 0) ? &host->client : &host->server;
+		homa_pool_detach(hsk);
+		if (homa_pool_init(hsk, (void *) 0x1000000,
+				((__u64) pool_mb) << 20, 0) != 0) {
+			printf("homa_pool_init failed for host %d\n", id);
+			exit(1);
+		}
+	}
+	host->client_args.flags = HOMA_RECVMSG_RESPONSE
+			| HOMA_RECVMSG_NONBLOCKING;
+	host->server_args.flags = HOMA_RECVMSG_REQUEST
+			| HOMA_RECVMSG_NONBLOCKING;
+	return host;
+}
+
+/**
+ * host_destroy() - Clean up all of the state for a host.
+ * @host:     Host to destroy.
+ */
+static void host_destroy(struct sim_host *host)
+{
+	enter_host(host);
+	core_memory = host->core_memory;
+	homa_destroy(&host->homa);
+	free(host->cores);
+	free(host);
+}
+
+/**
+ * run() - Process events until the end of the simulation.
+ */
+static void run(void)
+{
+	struct sim_event event;
+	struct sim_host *host;
+	int i;
+
+	while (next_event(&event)) {
+		if (event.time >= sim_end) {
+			schedule_event(event.time, event.type, event.host,
+					event.packet);
+			break;
+		}
+		mock_cycles = event.time;
+		host = event.host;
+		switch (event.type) {
+		case SIM_REQUEST:
+			enter_host(host);
+			issue_request(host);
+			check_pacer(host);
+			break;
+		case SIM_SWITCH:
+			switch_arrive(host, event.packet);
+			break;
+		case SIM_PORT_DONE:
+			host->port.queued_bytes -= event.packet->wire_bytes;
+			switch_bytes -= event.packet->wire_bytes;
+			host->port.busy = false;
+			schedule_event(mock_cycles + link_ns, SIM_DELIVER, host,
+					event.packet);
+			port_start(host);
+			break;
+		case SIM_DELIVER:
+			enter_host(host);
+			homa_softirq(event.packet->skb);
+			free(event.packet);
+			run_apps(host);
+			check_pacer(host);
+			break;
+		case SIM_PACER:
+			enter_host(host);
+			host->pacer_scheduled = false;
+
+			/* Other packets may have been queued since this
+			 * event was scheduled; see check_pacer.
+			 */
+			if ((mock_cycles + host->homa.max_nic_queue_cycles)
+					>= atomic64_read(
+					&host->homa.link_idle_time))
+				homa_pacer_xmit(&host->homa);
+			run_apps(host);
+			check_pacer(host);
+			break;
+		case SIM_TIMER:
+			enter_host(host);
+			homa_timer(&host->homa);
+			run_apps(host);
+			check_pacer(host);
+			schedule_event(mock_cycles + SIM_TIMER_INTERVAL,
+					SIM_TIMER, host, NULL);
+			break;
+		case SIM_SAMPLE:
+			if (mock_cycles >= warmup_end) {
+				for (i = 0; i < num_hosts; i++)
+					sim_record_occupancy(SIM_PORT_OCCUPANCY,
+						hosts[i]->port.queued_bytes);
+				sim_record_occupancy(SIM_SWITCH_OCCUPANCY,
+						switch_bytes);
+			}
+			schedule_event(mock_cycles + sample_ns, SIM_SAMPLE,
+					NULL, NULL);
+			break;
+		}
+
+		/* Homa code and mock.c log information for unit tests;
+		 * discard it so it doesn't accumulate.
+		 */
+		unit_log_clear();
+	}
+}
+
+/**
+ * print_results() - Print a summary of the simulation results on standard
+ * output, and write detailed results to files if requested.
+ */
+static void print_results(void)
+{
+	char name[1000];
+	double base_usecs;
+
+	/* Best-case RTT for a tiny RPC: each message crosses two links
+	 * (with store-and-forward in the switch).
+	 */
+	base_usecs = 4*(link_ns + wire_ns(sizeof(struct data_header)
+			+ HOMA_IPV6_HEADER_LENGTH + HOMA_ETH_OVERHEAD))/1000.0;
+	printf("Requests sent:          %llu\n", requests_sent);
+	printf("Responses received:     %llu\n", responses_received);
+	printf("Switch drops:           %llu\n", switch_drops);
+	printf("Average slowdown:       %.2f\n",
+			sim_avg_slowdown(base_usecs, link_gbps));
+	printf("Port occupancy (KB):    P50 %.1f, P99 %.1f, max %.1f\n",
+			sim_occupancy_percentile(SIM_PORT_OCCUPANCY, 0.5)/1024.0,
+			sim_occupancy_percentile(SIM_PORT_OCCUPANCY, 0.99)/1024.0,
+			sim_occupancy_percentile(SIM_PORT_OCCUPANCY, 1.0)/1024.0);
+	printf("Switch occupancy (KB):  P50 %.1f, P99 %.1f, max %.1f\n",
+			sim_occupancy_percentile(SIM_SWITCH_OCCUPANCY, 0.5)
+			/1024.0,
+			sim_occupancy_percentile(SIM_SWITCH_OCCUPANCY, 0.99)
+			/1024.0,
+			sim_occupancy_percentile(SIM_SWITCH_OCCUPANCY, 1.0)
+			/1024.0);
+	if (output == NULL) {
+		printf("\n");
+		sim_write_digest(NULL, base_usecs, link_gbps);
+		return;
+	}
+	snprintf(name, sizeof(name), "%s.data", output);
+	if (sim_write_digest(name, base_usecs, link_gbps) != 0)
+		printf("Couldn't write %s\n", name);
+	snprintf(name, sizeof(name), "%s.rtts", output);
+	if (sim_write_rtts(name) != 0)
+		printf("Couldn't write %s\n", name);
+	snprintf(name, sizeof(name), "%s.port_occupancy", output);
+	if (sim_write_occupancy(name, SIM_PORT_OCCUPANCY) != 0)
+		printf("Couldn't write %s\n", name);
+	snprintf(name, sizeof(name), "%s.switch_occupancy", output);
+	if (sim_write_occupancy(name, SIM_SWITCH_OCCUPANCY) != 0)
+		printf("Couldn't write %s\n", name);
+}
+
+/**
+ * parse_double() - Parse a floating-point command-line argument; exits
+ * the program if the value is bad.
+ * @value:    Value to parse (may be NULL).
+ * @option:   Name of the option (for error messages).
+ * @min:      Smallest acceptable value.
+ */
+static double parse_double(const char *value, const char *option, double min)
+{
+	double result;
+	char *end;
+
+	if (value == NULL) {
+		printf("No value provided for %s\n", option);
+		exit(1);
+	}
+	result = strtod(value, &end);
+	if ((*end != 0) || (result < min)) {
+		printf("Bad value '%s' for %s; must be a number >= %g\n",
+				value, option, min);
+		exit(1);
+	}
+	return result;
+}
+
+int main(int argc, const char **argv)
+{
+	struct sim_event event;
+	struct sim_param *param;
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		const char *option = argv[i];
+		const char *value = argv[i+1];
+
+		if (strcmp(option, "--help") == 0) {
+			print_help(argv[0]);
+			exit(0);
+		} else if (strcmp(option, "--buffer-kb") == 0) {
+			buffer_kb = parse_double(value, option, 1);
+		} else if (strcmp(option, "--gbps") == 0) {
+			gbps = parse_double(value, option, 0.001);
+		} else if (strcmp(option, "--hosts") == 0) {
+			num_hosts = parse_double(value, option, 2);
+		} else if (strcmp(option, "--link-gbps") == 0) {
+			link_gbps = parse_double(value, option, 0.1);
+		} else if (strcmp(option, "--link-ns") == 0) {
+			link_ns = parse_double(value, option, 0);
+		} else if (strcmp(option, "--max-message") == 0) {
+			max_message = parse_double(value, option, 1);
+			if (max_message > HOMA_MAX_MESSAGE_LENGTH)
+				max_message = HOMA_MAX_MESSAGE_LENGTH;
+		} else if (strcmp(option, "--ms") == 0) {
+			sim_ms = parse_double(value, option, 0.001);
+		} else if (strcmp(option, "--one-way") == 0) {
+			one_way = true;
+			continue;
+		} else if (strcmp(option, "--output") == 0) {
+			if (value == NULL) {
+				printf("No value provided for %s\n", option);
+				exit(1);
+			}
+			output = value;
+		} else if (strcmp(option, "--pool-mb") == 0) {
+			pool_mb = parse_double(value, option, 1);
+		} else if (strcmp(option, "--port-kb") == 0) {
+			port_kb = parse_double(value, option, 0);
+		} else if (strcmp(option, "--sample-ns") == 0) {
+			sample_ns = parse_double(value, option, 1);
+		} else if (strcmp(option, "--seed") == 0) {
+			seed = parse_double(value, option, 0);
+		} else if (strcmp(option, "--sysctl") == 0) {
+			for (param = sim_params; param->name != NULL; param++) {
+				if ((value != NULL)
+						&& (strcmp(param->name, value) == 0))
+					break;
+			}
+			if (param->name == NULL) {
+				printf("Unknown Homa parameter '%s' for "
+						"--sysctl\n", value ? : "");
+				exit(1);
+			}
+			param->set = true;
+			param->value = parse_double(argv[i+2], option, 0);
+			i++;
+		} else if (strcmp(option, "--warmup-ms") == 0) {
+			warmup_ms = parse_double(value, option, 0);
+		} else if (strcmp(option, "--workload") == 0) {
+			if (value == NULL) {
+				printf("No value provided for %s\n", option);
+				exit(1);
+			}
+			workload = value;
+		} else {
+			printf("Unknown option '%s'; type '%s --help' for help\n",
+					option, argv[0]);
+			exit(1);
+		}
+		i++;
+	}
+
+	__current_test = &sim_metadata;
+	mock_ipv6 = true;
+	mock_cycles = SIM_START;
+	mock_xmit_hook = sim_xmit;
+	warmup_end = SIM_START + (__u64) (warmup_ms*1e06);
+	sim_end = warmup_end + (__u64) (sim_ms*1e06);
+	mean_length = sim_dist_init(workload, max_message, seed);
+
+	hosts = malloc(num_hosts*sizeof(*hosts));
+	for (i = 0; i < num_hosts; i++) {
+		hosts[i] = host_init(i);
+		schedule_event(SIM_START + (__u64) sim_exp_sample(
+				mean_length*8.0/gbps), SIM_REQUEST, hosts[i],
+				NULL);
+		schedule_event(SIM_START + (i*(__u64) SIM_TIMER_INTERVAL)
+				/num_hosts, SIM_TIMER, hosts[i], NULL);
+	}
+	schedule_event(SIM_START, SIM_SAMPLE, NULL, NULL);
+	run();
+	print_results();
+
+	/* Clean up, so that mock.c can check for leaks. */
+	while (next_event(&event)) {
+		if (event.packet) {
+			kfree_skb(event.packet->skb);
+			free(event.packet);
+		}
+	}
+	for (i = 0; i < num_hosts; i++) {
+		struct sim_port *port = &hosts[i]->port;
+		struct sim_packet *packet;
+		int prio;
+
+		for (prio = 0; prio < HOMA_MAX_PRIORITIES; prio++) {
+			while ((packet = port->heads[prio]) != NULL) {
+				port->heads[prio] = packet->next;
+				kfree_skb(packet->skb);
+				free(packet);
+			}
+		}
+		host_destroy(hosts[i]);
+	}
+	free(hosts);
+	free(events);
+	mock_teardown();
+	if (!sim_metadata.passed) {
+		printf("Simulation encountered errors (see above)\n");
+		exit(1);
+	}
+	return 0;
+}
@@ -0,0 +1,270 @@
+/* Copyright (c) 2024 Homa Developers
+ * SPDX-License-Identifier: BSD-1-Clause
+ */
+
+/* This file contains utility functions for the simulator (sim.c) that
+ * are more conveniently implemented in C++, such as generating message
+ * lengths from the standard workloads and computing statistics. As with
+ * ccutils.cc, this file cannot access kernel internal stuff such as
+ * homa_impl.h.
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <map>
+#include <random>
+#include <vector>
+
+#include "../util/dist.h"
+#include "simutils.h"
+
+/* Used for all random numbers, so that runs are reproducible. */
+static std::mt19937 rand_gen;
+
+/* Generates message lengths; NULL means sim_dist_init hasn't been called. */
+static dist_point_gen *dist = NULL;
+
+/* Keys are request lengths; values are the RTTs (in usecs) of all the
+ * RPCs recorded with that length.
+ */
+static std::map<int, std::vector<double>> rtts;
+
+/* Buffer occupancy samples (in bytes), indexed by enum sim_occupancy_kind. */
+static std::vector<int> occupancy[SIM_OCCUPANCY_KINDS];
+
+/**
+ * optimal_usecs() - Returns the best possible RTT for an RPC, used as the
+ * denominator when computing slowdowns (same approach as cperf.py).
+ * @length:       Length of the request message, in bytes.
+ * @base_usecs:   Best-case RTT for a very small RPC.
+ * @link_gbps:    Speed of host links, in Gbps.
+ */
+static double optimal_usecs(int length, double base_usecs, double link_gbps)
+{
+	return base_usecs + length*8.0/(link_gbps*1000.0);
+}
+
+/**
+ * sim_avg_slowdown() - Returns the average slowdown across all of the RPCs
+ * recorded by sim_record_rtt.
+ * @base_usecs:   Best-case RTT for a very small RPC.
+ * @link_gbps:    Speed of host links, in Gbps.
+ */
+double sim_avg_slowdown(double base_usecs, double link_gbps)
+{
+	double sum = 0.0;
+	int count = 0;
+
+	for (auto &entry: rtts) {
+		double optimal = optimal_usecs(entry.first, base_usecs,
+				link_gbps);
+		for (double rtt: entry.second)
+			sum += rtt/optimal;
+		count += entry.second.size();
+	}
+	return (count == 0) ? 0.0 : sum/count;
+}
+
+/**
+ * sim_dist_init() - Select the workload used to generate request lengths,
+ * and seed the random number generator.
+ * @workload:    Name of a workload understood by dist_point_gen ("w1"-"w5",
+ *               or a fixed length).
+ * @max_length:  Lengths will not exceed this value.
+ * @seed:        Seed for the random number generator.
+ *
+ * Return:       The average message length in the workload.
+ */
+double sim_dist_init(const char *workload, int max_length, unsigned int seed)
+{
+	rand_gen.seed(seed);
+	delete dist;
+	dist = new dist_point_gen(workload, max_length);
+	return dist->get_mean();
+}
+
+/**
+ * sim_dist_sample() - Returns a random message length from the workload
+ * selected by sim_dist_init.
+ */
+int sim_dist_sample(void)
+{
+	return (*dist)(rand_gen);
+}
+
+/**
+ * sim_exp_sample() - Returns a random value from an exponential
+ * distribution (e.g. for Poisson arrivals).
+ * @mean:   Average of the distribution.
+ */
+double sim_exp_sample(double mean)
+{
+	std::exponential_distribution<double> exp_dist(1.0/mean);
+
+	return exp_dist(rand_gen);
+}
+
+/**
+ * sim_occupancy_percentile() - Returns a given percentile of the occupancy
+ * samples of a given kind.
+ * @kind:       Kind of samples: a value from enum sim_occupancy_kind.
+ * @fraction:   Desired percentile, expressed as a fraction (1.0 returns
+ *              the largest sample).
+ *
+ * Return:      The percentile, in bytes (0 if there are no samples).
+ */
+int sim_occupancy_percentile(int kind, double fraction)
+{
+	std::vector<int> &samples = occupancy[kind];
+	size_t index;
+
+	if (samples.empty())
+		return 0;
+	std::sort(samples.begin(), samples.end());
+	index = static_cast<size_t>(fraction*samples.size());
+	if (index >= samples.size())
+		index = samples.size() - 1;
+	return samples[index];
+}
+
+/**
+ * sim_rand_int() - Returns a random integer in the range [0, @limit).
+ * @limit:   Upper bound (exclusive) on the result.
+ */
+int sim_rand_int(int limit)
+{
+	std::uniform_int_distribution<int> int_dist(0, limit-1);
+
+	return int_dist(rand_gen);
+}
+
+/**
+ * sim_record_occupancy() - Record one sample of buffer occupancy.
+ * @kind:    Kind of sample: a value from enum sim_occupancy_kind.
+ * @bytes:   Number of bytes queued when the sample was taken.
+ */
+void sim_record_occupancy(int kind, int bytes)
+{
+	occupancy[kind].push_back(bytes);
+}
+
+/**
+ * sim_record_rtt() - Record the round-trip time for a completed RPC.
+ * @length:   Length of the request message, in bytes.
+ * @usecs:    Time from when the request was sent until the response
+ *            was received.
+ */
+void sim_record_rtt(int length, double usecs)
+{
+	rtts[length].push_back(usecs);
+}
+
+/**
+ * sim_rtt_count() - Returns the number of RTTs recorded so far.
+ */
+int sim_rtt_count(void)
+{
+	int count = 0;
+
+	for (auto &entry: rtts)
+		count += entry.second.size();
+	return count;
+}
+
+/**
+ * sim_write_digest() - Write RTT and slowdown percentiles for each request
+ * length, in the same format as the .data files generated by cperf.py
+ * (so they can be plotted with the same tools).
+ * @file:         Name of the file to write; NULL means standard output.
+ * @base_usecs:   Best-case RTT for a very small RPC.
+ * @link_gbps:    Speed of host links, in Gbps.
+ *
+ * Return:        0 for success, -1 if the file couldn't be opened.
+ */
+int sim_write_digest(const char *file, double base_usecs, double link_gbps)
+{
+	FILE *f = stdout;
+	int total = sim_rtt_count();
+	int cumulative = 0;
+
+	if (file) {
+		f = fopen(file, "w");
+		if (f == NULL)
+			return -1;
+	}
+	fprintf(f, "# Digested data for simulation\n");
+	fprintf(f, "# length  cum_frac  samples     p50      p99     p999   "
+			"s50    s99    s999\n");
+	for (auto &entry: rtts) {
+		std::vector<double> &times = entry.second;
+		double optimal = optimal_usecs(entry.first, base_usecs,
+				link_gbps);
+		size_t count = times.size();
+
+		std::sort(times.begin(), times.end());
+		cumulative += count;
+		fprintf(f, " %7d %9.6f %8lu %7.1f %8.1f %8.1f %5.1f %6.1f %7.1f\n",
+				entry.first, static_cast<double>(cumulative)/total,
+				count, times[count/2], times[count*99/100],
+				times[count*999/1000], times[count/2]/optimal,
+				times[count*99/100]/optimal,
+				times[count*999/1000]/optimal);
+	}
+	if (file)
+		fclose(f);
+	return 0;
+}
+
+/**
+ * sim_write_occupancy() - Write a CDF of the occupancy samples of a given
+ * kind.
+ * @file:     Name of the file to write.
+ * @kind:     Kind of samples: a value from enum sim_occupancy_kind.
+ *
+ * Return:    0 for success, -1 if the file couldn't be opened.
+ */
+int sim_write_occupancy(const char *file, int kind)
+{
+	std::vector<int> &samples = occupancy[kind];
+	FILE *f = fopen(file, "w");
+	size_t i;
+
+	if (f == NULL)
+		return -1;
+	fprintf(f, "# CDF of %s buffer occupancy (%lu samples)\n",
+			(kind == SIM_PORT_OCCUPANCY) ? "egress port" : "switch",
+			samples.size());
+	fprintf(f, "#    bytes  cum_frac\n");
+	std::sort(samples.begin(), samples.end());
+	for (i = 0; i < samples.size(); i++) {
+		/* Only output the last sample with each value. */
+		if (((i + 1) < samples.size()) && (samples[i+1] == samples[i]))
+			continue;
+		fprintf(f, " %9d %9.6f\n", samples[i],
+				static_cast<double>(i + 1)/samples.size());
+	}
+	fclose(f);
+	return 0;
+}
+
+/**
+ * sim_write_rtts() - Write all of the recorded RTTs, in the same format
+ * as cp_node's "dump_times" command (so cperf.py can read them).
+ * @file:     Name of the file to write.
+ *
+ * Return:    0 for success, -1 if the file couldn't be opened.
+ */
+int sim_write_rtts(const char *file)
+{
+	FILE *f = fopen(file, "w");
+
+	if (f == NULL)
+		return -1;
+	fprintf(f, "# Length   RTT (usec)\n");
+	for (auto &entry: rtts) {
+		for (double rtt: entry.second)
+			fprintf(f, "%8d %12.2f\n", entry.first, rtt);
+	}
+	fclose(f);
+	return 0;
+}
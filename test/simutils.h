@@ -0,0 +1,38 @@
+/* Copyright (c) 2024 Homa Developers
+ * SPDX-License-Identifier: BSD-1-Clause
+ */
+
+/* Utility functions for the simulator (sim.c), implemented in C++. */
+
+#ifdef __cplusplus
+#define CEXTERN extern "C"
+#else
+#define CEXTERN extern
+#endif
+
+/**
+ * enum sim_occupancy_kind - Identifies a particular kind of buffer
+ * occupancy sample, for sim_record_occupancy.
+ * SIM_PORT_OCCUPANCY -    Bytes queued for a single egress port.
+ * SIM_SWITCH_OCCUPANCY -  Bytes queued in the entire switch.
+ */
+enum sim_occupancy_kind {
+	SIM_PORT_OCCUPANCY      = 0,
+	SIM_SWITCH_OCCUPANCY    = 1,
+	SIM_OCCUPANCY_KINDS     = 2,
+};
+
+CEXTERN double        sim_avg_slowdown(double base_usecs, double link_gbps);
+CEXTERN double        sim_dist_init(const char *workload, int max_length,
+			unsigned int seed);
+CEXTERN int           sim_dist_sample(void);
+CEXTERN double        sim_exp_sample(double mean);
+CEXTERN int           sim_occupancy_percentile(int kind, double fraction);
+CEXTERN int           sim_rand_int(int limit);
+CEXTERN void          sim_record_occupancy(int kind, int bytes);
+CEXTERN void          sim_record_rtt(int length, double usecs);
+CEXTERN int           sim_rtt_count(void);
+CEXTERN int           sim_write_digest(const char *file, double base_usecs,
+			double link_gbps);
+CEXTERN int           sim_write_occupancy(const char *file, int kind);
+CEXTERN int           sim_write_rtts(const char *file);
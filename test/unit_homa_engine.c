@@ -0,0 +1,126 @@
+/* Copyright (c) 2024 Homa Developers
+ * SPDX-License-Identifier: BSD-1-Clause
+ */
+
+#include "homa_impl.h"
+#define KSELFTEST_NOT_MAIN 1
+#include "kselftest_harness.h"
+#include "ccutils.h"
+#include "mock.h"
+#include "utils.h"
+
+static int hook_softirq_calls;
+static void busy_loop_hook(char *id)
+{
+	if (strcmp(id, "napi_busy_loop") != 0)
+		return;
+	homa_cores[cpu_number]->metrics.softirq_calls += hook_softirq_calls;
+}
+
+FIXTURE(homa_engine) {
+	struct in6_addr client_ip[1];
+	int client_port;
+	struct in6_addr server_ip[1];
+	int server_port;
+	__u64 client_id;
+	struct homa homa;
+	struct homa_sock hsk;
+};
+FIXTURE_SETUP(homa_engine)
+{
+	self->client_ip[0] = unit_get_in_addr("196.168.0.1");
+	self->client_port = 40000;
+	self->server_ip[0] = unit_get_in_addr("1.2.3.4");
+	self->server_port = 99;
+	self->client_id = 1234;
+	homa_init(&self->homa);
+	mock_cycles = 10000;
+	atomic64_set(&self->homa.link_idle_time, 10000);
+	self->homa.cycles_per_kbyte = 1000;
+	self->homa.flags |= HOMA_FLAG_DONT_THROTTLE;
+	mock_sock_init(&self->hsk, &self->homa, self->client_port);
+	unit_log_clear();
+}
+FIXTURE_TEARDOWN(homa_engine)
+{
+	homa_destroy(&self->homa);
+	unit_teardown();
+}
+
+/* Don't know how to unit test homa_engine_main... */
+
+TEST_F(homa_engine, homa_engine_run_once__nothing_to_do)
+{
+	EXPECT_EQ(0, homa_engine_run_once(&self->homa));
+	EXPECT_STREQ("", unit_log_get());
+}
+#ifdef CONFIG_NET_RX_BUSY_POLL
+TEST_F(homa_engine, homa_engine_run_once__busy_poll)
+{
+	self->homa.engine_napi_id = MIN_NAPI_ID + 3;
+	hook_softirq_calls = 2;
+	unit_hook_register(busy_loop_hook);
+	EXPECT_EQ(2, homa_engine_run_once(&self->homa));
+	EXPECT_SUBSTR("napi_busy_loop napi_id", unit_log_get());
+}
+#endif
+TEST_F(homa_engine, homa_engine_run_once__pacer)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 5000, 1000);
+
+	homa_add_to_throttled(crpc);
+	self->homa.max_nic_queue_cycles = 2000;
+	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
+	unit_log_clear();
+	EXPECT_EQ(1, homa_engine_run_once(&self->homa));
+	EXPECT_STREQ("xmit DATA 1400@0; xmit DATA 1400@1400",
+			unit_log_get());
+}
+
+TEST_F(homa_engine, homa_engine_sysctl_changed__start_thread)
+{
+	self->homa.engine_core = 3;
+	homa_engine_sysctl_changed(&self->homa);
+	EXPECT_STREQ("kthread_bind core 3; wake_up_process pid -1",
+			unit_log_get());
+	EXPECT_EQ(3, self->homa.engine_thread_core);
+}
+TEST_F(homa_engine, homa_engine_sysctl_changed__no_such_core)
+{
+	self->homa.engine_core = 8;
+	homa_engine_sysctl_changed(&self->homa);
+	EXPECT_STREQ("", unit_log_get());
+	EXPECT_EQ(-1, self->homa.engine_core);
+	EXPECT_EQ(-1, self->homa.engine_thread_core);
+}
+TEST_F(homa_engine, homa_engine_sysctl_changed__already_running)
+{
+	self->homa.engine_kthread = &mock_task;
+	self->homa.engine_thread_core = 3;
+	self->homa.engine_core = 3;
+	homa_engine_sysctl_changed(&self->homa);
+	EXPECT_STREQ("", unit_log_get());
+	EXPECT_EQ(&mock_task, self->homa.engine_kthread);
+}
+TEST_F(homa_engine, homa_engine_sysctl_changed__move_thread)
+{
+	self->homa.engine_kthread = &mock_task;
+	self->homa.engine_thread_core = 3;
+	self->homa.engine_core = 5;
+	homa_engine_sysctl_changed(&self->homa);
+	EXPECT_STREQ("kthread_stop; kthread_bind core 5; "
+			"wake_up_process pid -1", unit_log_get());
+	EXPECT_EQ(5, self->homa.engine_thread_core);
+}
+TEST_F(homa_engine, homa_engine_sysctl_changed__stop_thread)
+{
+	self->homa.engine_kthread = &mock_task;
+	self->homa.engine_thread_core = 3;
+	self->homa.engine_core = -1;
+	homa_engine_sysctl_changed(&self->homa);
+	EXPECT_STREQ("kthread_stop", unit_log_get());
+	EXPECT_EQ(NULL, self->homa.engine_kthread);
+	EXPECT_EQ(-1, self->homa.engine_thread_core);
+}
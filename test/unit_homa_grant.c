@@ -418,6 +418,41 @@ TEST_F(homa_grant, homa_grant_send__basics)
 	EXPECT_EQ(0, rpc->silent_ticks);
 	EXPECT_STREQ("xmit GRANT 10000@3", unit_log_get());
 }
+TEST_F(homa_grant, homa_grant_send__start_rtt_probe)
+{
+	struct homa_rpc *rpc = test_rpc(self, 100, self->server_ip, 20000);
+
+	/* No probe if nothing was granted previously. */
+	mock_cycles = 4000;
+	homa_grant_send(rpc, &self->homa);
+	EXPECT_EQ(10000, rpc->msgin.granted);
+	EXPECT_EQ(0, rpc->msgin.rtt_probe_offset);
+
+	rpc->msgin.bytes_remaining = 15000;
+	homa_grant_send(rpc, &self->homa);
+	EXPECT_EQ(15000, rpc->msgin.granted);
+	EXPECT_EQ(10000, rpc->msgin.rtt_probe_offset);
+	EXPECT_EQ(4000, rpc->msgin.rtt_probe_cycles);
+
+	/* Don't start a new probe while one is in progress. */
+	mock_cycles = 7000;
+	rpc->msgin.bytes_remaining = 12000;
+	homa_grant_send(rpc, &self->homa);
+	EXPECT_EQ(18000, rpc->msgin.granted);
+	EXPECT_EQ(10000, rpc->msgin.rtt_probe_offset);
+	EXPECT_EQ(4000, rpc->msgin.rtt_probe_cycles);
+}
+TEST_F(homa_grant, homa_grant_send__window_from_peer_rtt)
+{
+	struct homa_rpc *rpc = test_rpc(self, 100, self->server_ip, 40000);
+
+	self->homa.rtt_adaptive = 1;
+	rpc->peer->rtt_bytes = 15000;
+	unit_log_clear();
+	homa_grant_send(rpc, &self->homa);
+	EXPECT_EQ(15000, rpc->msgin.granted);
+	EXPECT_STREQ("xmit GRANT 15000@0", unit_log_get());
+}
 TEST_F(homa_grant, homa_grant_send__incoming_negative)
 {
 	struct homa_rpc *rpc = test_rpc(self, 100, self->server_ip, 20000);
@@ -477,6 +512,120 @@ TEST_F(homa_grant, homa_grant_send__resend_all)
 	EXPECT_EQ(0, rpc->msgin.resend_all);
 	EXPECT_STREQ("xmit GRANT 10000@0 resend_all", unit_log_get());
 }
+TEST_F(homa_grant, homa_grant_send__piggyback_acks)
+{
+	struct homa_rpc *rpc = test_rpc(self, 100, self->server_ip, 20000);
+	rpc->peer->acks[0] = (struct homa_ack) {
+			.client_port = htons(1000),
+			.server_port = htons(99),
+			.client_id = cpu_to_be64(90)};
+	rpc->peer->acks[1] = (struct homa_ack) {
+			.client_port = htons(1001),
+			.server_port = htons(99),
+			.client_id = cpu_to_be64(92)};
+	rpc->peer->num_acks = 2;
+
+	unit_log_clear();
+	mock_xmit_log_verbose = 1;
+	EXPECT_EQ(1, homa_grant_send(rpc, &self->homa));
+	EXPECT_SUBSTR("offset 10000, grant_prio 0, acks "
+			"[cp 1000, sp 99, id 90] [cp 1001, sp 99, id 92]",
+			unit_log_get());
+	EXPECT_EQ(0, rpc->peer->num_acks);
+	EXPECT_EQ(2, homa_cores[cpu_number]->metrics.piggybacked_acks);
+}
+
+TEST_F(homa_grant, homa_grant_xmit_batch__basics)
+{
+	struct homa_extra_grant grants[4];
+	struct homa_rpc *rpcs[4];
+	char pending[4] = {1, 1, 0, 1};
+	int i;
+
+	rpcs[0] = test_rpc(self, 100, self->server_ip, 20000);
+	rpcs[1] = test_rpc(self, 102, self->server_ip+1, 20000);
+	rpcs[2] = test_rpc(self, 104, self->server_ip, 20000);
+	rpcs[3] = test_rpc(self, 106, self->server_ip, 20000);
+	for (i = 0; i < 4; i++) {
+		grants[i].id = cpu_to_be64(rpcs[i]->id);
+		grants[i].offset = htonl(1000*(i+1));
+		grants[i].priority = i;
+	}
+
+	unit_log_clear();
+	homa_grant_xmit_batch(rpcs, grants, pending, 4);
+	EXPECT_STREQ("xmit GRANT 1000@0 +106:4000@3; xmit GRANT 2000@1",
+			unit_log_get());
+	EXPECT_EQ(0, pending[0] + pending[1] + pending[2] + pending[3]);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.coalesced_grants);
+}
+TEST_F(homa_grant, homa_grant_xmit_batch__different_ports)
+{
+	struct homa_extra_grant grants[2];
+	struct homa_rpc *rpcs[2];
+	char pending[2] = {1, 1};
+	int i;
+
+	rpcs[0] = test_rpc(self, 100, self->server_ip, 20000);
+	rpcs[1] = test_rpc(self, 102, self->server_ip, 20000);
+	rpcs[1]->dport = self->server_port + 1;
+	for (i = 0; i < 2; i++) {
+		grants[i].id = cpu_to_be64(rpcs[i]->id);
+		grants[i].offset = htonl(1000*(i+1));
+		grants[i].priority = 0;
+	}
+
+	unit_log_clear();
+	homa_grant_xmit_batch(rpcs, grants, pending, 2);
+	EXPECT_STREQ("xmit GRANT 1000@0; xmit GRANT 2000@0", unit_log_get());
+}
+TEST_F(homa_grant, homa_grant_xmit_batch__extras_follow_acks)
+{
+	struct homa_extra_grant grants[2];
+	struct homa_rpc *rpcs[2];
+	char pending[2] = {1, 1};
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		rpcs[i] = test_rpc(self, 100 + 2*i, self->server_ip, 20000);
+		grants[i].id = cpu_to_be64(rpcs[i]->id);
+		grants[i].offset = htonl(1000*(i+1));
+		grants[i].priority = 0;
+	}
+	rpcs[0]->peer->acks[0] = (struct homa_ack) {
+			.client_port = htons(1000),
+			.server_port = htons(99),
+			.client_id = cpu_to_be64(90)};
+	rpcs[0]->peer->num_acks = 1;
+
+	unit_log_clear();
+	mock_xmit_log_verbose = 1;
+	homa_grant_xmit_batch(rpcs, grants, pending, 2);
+	EXPECT_SUBSTR("offset 1000, grant_prio 0, extra [id 102, "
+			"offset 2000, grant_prio 0], acks "
+			"[cp 1000, sp 99, id 90]", unit_log_get());
+}
+TEST_F(homa_grant, homa_grant_xmit_batch__packet_full)
+{
+	struct homa_extra_grant grants[HOMA_MAX_EXTRA_GRANTS+2];
+	struct homa_rpc *rpcs[HOMA_MAX_EXTRA_GRANTS+2];
+	char pending[HOMA_MAX_EXTRA_GRANTS+2];
+	int i;
+
+	for (i = 0; i < HOMA_MAX_EXTRA_GRANTS+2; i++) {
+		rpcs[i] = test_rpc(self, 100 + 2*i, self->server_ip, 20000);
+		grants[i].id = cpu_to_be64(rpcs[i]->id);
+		grants[i].offset = htonl(1000*(i+1));
+		grants[i].priority = 0;
+		pending[i] = 1;
+	}
+
+	unit_log_clear();
+	homa_grant_xmit_batch(rpcs, grants, pending, HOMA_MAX_EXTRA_GRANTS+2);
+	EXPECT_STREQ("xmit GRANT 1000@0 +102:2000@0 +104:3000@0 +106:4000@0 "
+			"+108:5000@0; xmit GRANT 6000@0", unit_log_get());
+	EXPECT_EQ(4, homa_cores[cpu_number]->metrics.coalesced_grants);
+}
 
 TEST_F(homa_grant, homa_grant_check_rpc__msgin_not_initialized)
 {
@@ -714,9 +863,8 @@ TEST_F(homa_grant, homa_grant_recalc__basics)
 
 	unit_log_clear();
 	homa_grant_recalc(&self->homa, 0);
-	EXPECT_STREQ("xmit GRANT 10000@2; "
-			"xmit GRANT 10000@1; "
-			"xmit GRANT 10000@0", unit_log_get());
+	EXPECT_STREQ("xmit GRANT 10000@2 +102:10000@0; "
+			"xmit GRANT 10000@1", unit_log_get());
 	EXPECT_EQ(0, atomic_read(&rpc1->msgin.rank));
 	EXPECT_EQ(2, rpc1->msgin.priority);
 	EXPECT_EQ(10000, rpc1->msgin.granted);
@@ -736,7 +884,7 @@ TEST_F(homa_grant, homa_grant_recalc__already_locked)
 {
 	struct homa_rpc *rpc = test_rpc(self, 100, self->server_ip, 20000);
 
-	homa_grantable_lock(&self->homa, 0);
+	homa_grantable_lock(&self->homa, 0, "unit test");
 	unit_log_clear();
 	homa_grant_recalc(&self->homa, 1);
 	EXPECT_STREQ("xmit GRANT 10000@0", unit_log_get());
@@ -784,7 +932,7 @@ TEST_F(homa_grant, homa_grant_recalc__use_only_lowest_priorities)
 
 	unit_log_clear();
 	homa_grant_recalc(&self->homa, 0);
-	EXPECT_STREQ("xmit GRANT 10000@1; xmit GRANT 10000@0", unit_log_get());
+	EXPECT_STREQ("xmit GRANT 10000@1 +102:10000@0", unit_log_get());
 	EXPECT_EQ(1, rpc1->msgin.priority);
 	EXPECT_EQ(0, rpc2->msgin.priority);
 }
@@ -800,10 +948,8 @@ TEST_F(homa_grant, homa_grant_recalc__share_lowest_priority_level)
 
 	unit_log_clear();
 	homa_grant_recalc(&self->homa, 0);
-	EXPECT_STREQ("xmit GRANT 10000@2; "
-			"xmit GRANT 10000@1; "
-			"xmit GRANT 10000@0; "
-			"xmit GRANT 10000@0", unit_log_get());
+	EXPECT_STREQ("xmit GRANT 10000@2 +102:10000@1 +100:10000@0 "
+			"+102:10000@0", unit_log_get());
 	EXPECT_EQ(2, rpc1->msgin.priority);
 	EXPECT_EQ(1, rpc2->msgin.priority);
 	EXPECT_EQ(0, rpc3->msgin.priority);
@@ -818,7 +964,7 @@ TEST_F(homa_grant, homa_grant_recalc__compute_window_size)
 	self->homa.max_incoming = 100000;
 
         /* First try: fixed window size. */
-	homa_grantable_lock(&self->homa, 0);
+	homa_grantable_lock(&self->homa, 0, "unit test");
 	self->homa.window_param = 5000;
 	homa_grant_recalc(&self->homa, 1);
 	EXPECT_EQ(5000, self->homa.grant_window);
@@ -1004,6 +1150,104 @@ TEST_F(homa_grant, homa_grant_find_oldest__no_good_candidates)
 	EXPECT_EQ(NULL, self->homa.oldest_rpc);
 }
 
+TEST_F(homa_grant, homa_grant_pregrant__basics)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk, UNIT_OUTGOING,
+			self->client_ip, self->server_ip, self->server_port,
+			100, 1000, 2000);
+	self->homa.grant_window = 30000;
+	homa_grant_pregrant(crpc, 25000);
+	EXPECT_EQ(25000, crpc->resp_incoming);
+	EXPECT_EQ(25000, crpc->msgin.rec_incoming);
+	EXPECT_EQ(25000, atomic_read(&self->homa.total_incoming));
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.resp_pregrants);
+	EXPECT_EQ(15000, homa_cores[cpu_number]->metrics.resp_pregrant_bytes);
+}
+TEST_F(homa_grant, homa_grant_pregrant__response_fits_in_unsched_bytes)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk, UNIT_OUTGOING,
+			self->client_ip, self->server_ip, self->server_port,
+			100, 1000, 2000);
+	self->homa.grant_window = 30000;
+	crpc->resp_incoming = 5000;
+	homa_grant_pregrant(crpc, 10000);
+	EXPECT_EQ(0, crpc->resp_incoming);
+	EXPECT_EQ(0, atomic_read(&self->homa.total_incoming));
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.resp_pregrants);
+}
+TEST_F(homa_grant, homa_grant_pregrant__unsched_bytes_from_peer_rtt)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk, UNIT_OUTGOING,
+			self->client_ip, self->server_ip, self->server_port,
+			100, 1000, 2000);
+	self->homa.grant_window = 30000;
+	self->homa.window_param = 0;
+	self->homa.rtt_adaptive = 1;
+	crpc->peer->rtt_bytes = 20000;
+
+	/* The server will send all of this response unscheduled. */
+	homa_grant_pregrant(crpc, 18000);
+	EXPECT_EQ(0, crpc->resp_incoming);
+
+	homa_grant_pregrant(crpc, 25000);
+	EXPECT_EQ(25000, crpc->resp_incoming);
+	EXPECT_EQ(5000, homa_cores[cpu_number]->metrics.resp_pregrant_bytes);
+}
+TEST_F(homa_grant, homa_grant_pregrant__limited_by_grant_window)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk, UNIT_OUTGOING,
+			self->client_ip, self->server_ip, self->server_port,
+			100, 1000, 2000);
+	self->homa.grant_window = 30000;
+	homa_grant_pregrant(crpc, 100000);
+	EXPECT_EQ(30000, crpc->resp_incoming);
+	EXPECT_EQ(30000, atomic_read(&self->homa.total_incoming));
+}
+TEST_F(homa_grant, homa_grant_pregrant__priority_too_low)
+{
+	struct homa_rpc *crpc1, *crpc2;
+
+	test_rpc(self, 100, self->server_ip, 20000);
+	test_rpc(self, 102, self->server_ip, 30000);
+	self->homa.max_overcommit = 2;
+	homa_grant_recalc(&self->homa, 0);
+	EXPECT_EQ(20000, atomic_read(&self->homa.total_incoming));
+	self->homa.grant_window = 30000;
+	self->homa.max_incoming = 100000;
+	crpc1 = unit_client_rpc(&self->hsk, UNIT_OUTGOING, self->client_ip,
+			self->server_ip, self->server_port, 104, 1000, 2000);
+	crpc2 = unit_client_rpc(&self->hsk, UNIT_OUTGOING, self->client_ip,
+			self->server_ip, self->server_port, 106, 1000, 2000);
+
+	homa_grant_pregrant(crpc1, 40000);
+	EXPECT_EQ(0, crpc1->resp_incoming);
+	EXPECT_EQ(20000, atomic_read(&self->homa.total_incoming));
+
+	homa_grant_pregrant(crpc2, 25000);
+	EXPECT_EQ(25000, crpc2->resp_incoming);
+	EXPECT_EQ(45000, atomic_read(&self->homa.total_incoming));
+}
+TEST_F(homa_grant, homa_grant_pregrant__limited_by_max_incoming)
+{
+	struct homa_rpc *crpc1, *crpc2;
+
+	crpc1 = unit_client_rpc(&self->hsk, UNIT_OUTGOING, self->client_ip,
+			self->server_ip, self->server_port, 100, 1000, 2000);
+	crpc2 = unit_client_rpc(&self->hsk, UNIT_OUTGOING, self->client_ip,
+			self->server_ip, self->server_port, 102, 1000, 2000);
+	self->homa.grant_window = 30000;
+	atomic_set(&self->homa.total_incoming, 35000);
+
+	homa_grant_pregrant(crpc1, 40000);
+	EXPECT_EQ(15000, crpc1->resp_incoming);
+	EXPECT_EQ(50000, atomic_read(&self->homa.total_incoming));
+
+	atomic_set(&self->homa.total_incoming, 42000);
+	homa_grant_pregrant(crpc2, 40000);
+	EXPECT_EQ(0, crpc2->resp_incoming);
+	EXPECT_EQ(42000, atomic_read(&self->homa.total_incoming));
+}
+
 TEST_F(homa_grant, homa_grant_rpc_free__rpc_not_grantable)
 {
 	struct homa_rpc *rpc = unit_client_rpc(&self->hsk, UNIT_OUTGOING,
@@ -1061,7 +1305,7 @@ TEST_F(homa_grant, homa_grantable_lock_slow__basics)
 	mock_cycles = 500;
 	unit_hook_register(grantable_spinlock_hook);
 
-	EXPECT_EQ(1, homa_grantable_lock_slow(&self->homa, 0));
+	EXPECT_EQ(1, homa_grantable_lock_slow(&self->homa, 0, "unit test"));
 	homa_grantable_unlock(&self->homa);
 
 	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.grantable_lock_misses);
@@ -1074,7 +1318,7 @@ TEST_F(homa_grant, homa_grantable_lock_slow__recalc_count)
 	hook_homa = &self->homa;
 	mock_trylock_errors = 0xff;
 
-	EXPECT_EQ(0, homa_grantable_lock_slow(&self->homa, 1));
+	EXPECT_EQ(0, homa_grantable_lock_slow(&self->homa, 1, "unit test"));
 	hook_homa = NULL;
 
 	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.grantable_lock_misses);
@@ -1082,7 +1326,7 @@ TEST_F(homa_grant, homa_grantable_lock_slow__recalc_count)
 
 	/* Make sure the check only occurs if the recalc argument is set. */
 	mock_trylock_errors = 0xff;
-	EXPECT_EQ(1, homa_grantable_lock_slow(&self->homa, 0));
+	EXPECT_EQ(1, homa_grantable_lock_slow(&self->homa, 0, "unit test"));
 	EXPECT_EQ(2, homa_cores[cpu_number]->metrics.grantable_lock_misses);
 	homa_grantable_unlock(&self->homa);
 }
\ No newline at end of file
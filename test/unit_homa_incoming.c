@@ -48,6 +48,21 @@ void poll_hook(char *id)
 	}
 }
 
+/* The following hook function marks an RPC ready after several NIC polls. */
+int busy_poll_count = 0;
+void busy_poll_hook(char *id)
+{
+	if (strcmp(id, "napi_busy_loop") != 0)
+		return;
+	if (busy_poll_count <= 0)
+		return;
+	busy_poll_count--;
+	if (busy_poll_count == 0) {
+		hook_rpc->error = -EFAULT;
+		homa_rpc_handoff(hook_rpc);
+	}
+}
+
 /* The following hook function hands off an RPC (with an error). */
 void handoff_hook2(char *id)
 {
@@ -182,7 +197,7 @@ TEST_F(homa_incoming, homa_message_in_init__pool_doesnt_exist)
 	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
 			UNIT_OUTGOING, self->client_ip, self->server_ip,
 			self->server_port, 99, 1000, 1000);
-	homa_pool_destroy(&self->hsk.buffer_pool);
+	homa_pool_detach(&self->hsk);
 	EXPECT_EQ(ENOMEM, -homa_message_in_init(crpc, HOMA_BPAGE_SIZE*2, 0));
 	EXPECT_EQ(0, crpc->msgin.num_bpages);
 }
@@ -191,7 +206,7 @@ TEST_F(homa_incoming, homa_message_in_init__no_buffers_available)
 	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
 			UNIT_OUTGOING, self->client_ip, self->server_ip,
 			self->server_port, 99, 1000, 1000);
-	atomic_set(&self->hsk.buffer_pool.free_bpages, 0);
+	atomic_set(self->hsk.buffer_pool->free_bpages, 0);
 	EXPECT_EQ(0, homa_message_in_init(crpc, HOMA_BPAGE_SIZE*2, 10000));
 	EXPECT_EQ(0, crpc->msgin.num_bpages);
 	EXPECT_EQ(0, crpc->msgin.granted);
@@ -552,8 +567,8 @@ TEST_F(homa_incoming, homa_copy_to_user__basics)
 {
 	struct homa_rpc *crpc;
 
-	mock_bpage_size = 2048;
-	mock_bpage_shift = 11;
+	self->hsk.buffer_pool->bpage_size = 2048;
+	self->hsk.buffer_pool->bpage_shift = 11;
 	crpc = unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, self->client_ip,
 			self->server_ip, self->server_port, self->client_id,
 			1000, 4000);
@@ -569,7 +584,9 @@ TEST_F(homa_incoming, homa_copy_to_user__basics)
 
 	unit_log_clear();
 	mock_copy_to_user_dont_copy = -1;
+	EXPECT_EQ(-1, self->hsk.copy_core);
 	EXPECT_EQ(0, -homa_copy_to_user(crpc));
+	EXPECT_EQ(cpu_number, self->hsk.copy_core);
 	EXPECT_STREQ("skb_copy_datagram_iter: 1400 bytes to 0x1000000: 0-1399; "
 			"skb_copy_datagram_iter: 648 bytes to 0x1000578: "
 			"101000-101647; "
@@ -646,8 +663,8 @@ TEST_F(homa_incoming, homa_copy_to_user__many_chunks_for_one_skb)
 {
 	struct homa_rpc *crpc;
 
-	mock_bpage_size = 512;
-	mock_bpage_shift = 9;
+	self->hsk.buffer_pool->bpage_size = 512;
+	self->hsk.buffer_pool->bpage_shift = 9;
 	crpc = unit_client_rpc(&self->hsk, UNIT_OUTGOING, self->client_ip,
 			self->server_ip, self->server_port, self->client_id,
 			1000, 4000);
@@ -852,6 +869,24 @@ TEST_F(homa_incoming, homa_dispatch_pkts__new_server_rpc)
 	EXPECT_EQ(1, unit_list_length(&self->hsk2.active_rpcs));
 	EXPECT_EQ(1, mock_skb_count());
 }
+#ifdef CONFIG_NET_RX_BUSY_POLL
+TEST_F(homa_incoming, homa_dispatch_pkts__record_napi_id)
+{
+	struct sk_buff *skb;
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 20000, 1600);
+	ASSERT_NE(NULL, crpc);
+
+	self->data.common.sender_id = cpu_to_be64(self->server_id);
+	self->data.common.dport = htons(self->hsk.port);
+	skb = mock_skb_new(self->server_ip, &self->data.common, 1400, 0);
+	skb->napi_id = MIN_NAPI_ID + 5;
+	homa_dispatch_pkts(skb, &self->homa);
+	EXPECT_EQ(MIN_NAPI_ID + 5, crpc->peer->napi_id);
+	EXPECT_EQ(MIN_NAPI_ID + 5, self->hsk.sock.sk_napi_id);
+}
+#endif
 TEST_F(homa_incoming, homa_dispatch_pkts__cant_create_server_rpc)
 {
 	mock_kmalloc_errors = 1;
@@ -1028,7 +1063,7 @@ TEST_F(homa_incoming, homa_dispatch_pkts__handle_ack)
 	EXPECT_STREQ("DEAD", homa_symbol_for_state(srpc));
 	EXPECT_SUBSTR("ack 1235", unit_log_get());
 }
-TEST_F(homa_incoming, homa_dispatch_pkts__too_many_acks)
+TEST_F(homa_incoming, homa_dispatch_pkts__process_acks_when_array_full)
 {
 	struct sk_buff *skb, *skb2, *skb3;
 	self->data.seg.ack = (struct homa_ack) {
@@ -1045,8 +1080,31 @@ TEST_F(homa_incoming, homa_dispatch_pkts__too_many_acks)
 	skb->next = skb2;
 	skb2->next = skb3;
 	homa_dispatch_pkts(skb, &self->homa);
-	EXPECT_STREQ("sk->sk_data_ready invoked; ack 1237; ack 1235",
-				unit_log_get());
+	EXPECT_STREQ("sk->sk_data_ready invoked; ack 1235; ack 1237; "
+			"ack 1239", unit_log_get());
+}
+TEST_F(homa_incoming, homa_dispatch_pkts__acks_piggybacked_on_grant)
+{
+	struct homa_rpc *srpc = unit_server_rpc(&self->hsk2, UNIT_OUTGOING,
+			self->client_ip, self->server_ip, self->client_port,
+			self->server_id, 100, 3000);
+	ASSERT_NE(NULL, srpc);
+	struct grant_header h = {{.sport = htons(self->client_port),
+	                .dport = htons(self->server_port),
+			.sender_id = cpu_to_be64(self->client_id+10),
+			.type = GRANT},
+		        .offset = htonl(5000),
+			.priority = 3,
+			.num_acks = 1};
+	h.acks[0] = (struct homa_ack) {
+			.client_port = htons(self->client_port),
+			.server_port = htons(self->server_port),
+			.client_id = cpu_to_be64(self->client_id)};
+	unit_log_clear();
+	homa_dispatch_pkts(mock_skb_new(self->client_ip, &h.common, 0, 0),
+			&self->homa);
+	EXPECT_STREQ("DEAD", homa_symbol_for_state(srpc));
+	EXPECT_SUBSTR("ack 1235", unit_log_get());
 }
 TEST_F(homa_incoming, homa_dispatch_pkts__invoke_homa_grant_check_rpc)
 {
@@ -1058,6 +1116,13 @@ TEST_F(homa_incoming, homa_dispatch_pkts__invoke_homa_grant_check_rpc)
 	unit_log_grantables(&self->homa);
 	EXPECT_SUBSTR("id 1235", unit_log_get());
 }
+TEST_F(homa_incoming, homa_dispatch_pkts__check_waiting_for_buffers)
+{
+	self->hsk2.buffer_pool->check_waiting_invoked = 0;
+	homa_dispatch_pkts(mock_skb_new(self->client_ip, &self->data.common,
+			1400, 0), &self->homa);
+	EXPECT_EQ(1, self->hsk2.buffer_pool->check_waiting_invoked);
+}
 TEST_F(homa_incoming, homa_dispatch_pkts__forced_reap)
 {
 	struct homa_rpc *dead = unit_client_rpc(&self->hsk,
@@ -1088,6 +1153,120 @@ TEST_F(homa_incoming, homa_dispatch_pkts__forced_reap)
 	EXPECT_NE(0, homa_cores[cpu_number]->metrics.data_pkt_reap_cycles);
 }
 
+TEST_F(homa_incoming, homa_extract_acks__resend)
+{
+	struct homa_ack acks[HOMA_MAX_CTRL_ACKS];
+	struct resend_header h = {{.sport = htons(self->client_port),
+	                .dport = htons(self->server_port),
+			.sender_id = cpu_to_be64(self->client_id),
+			.type = RESEND},
+		        .offset = htonl(100),
+			.length = htonl(200),
+			.priority = 3,
+			.num_acks = 3};
+	struct sk_buff *skb;
+	int i;
+
+	for (i = 0; i < 3; i++)
+		h.acks[i] = (struct homa_ack) {
+				.client_port = htons(self->client_port),
+				.server_port = htons(self->server_port),
+				.client_id = cpu_to_be64(100 + 2*i)};
+	skb = mock_skb_new(self->client_ip, &h.common, 0, 0);
+	EXPECT_EQ(3, homa_extract_acks(skb, acks, HOMA_MAX_CTRL_ACKS));
+	EXPECT_STREQ("client_port 40000, server_port 99, client_id 104",
+			unit_ack_string(&acks[2]));
+
+	/* Not enough space at dst. */
+	EXPECT_EQ(2, homa_extract_acks(skb, acks, 2));
+	kfree_skb(skb);
+}
+TEST_F(homa_incoming, homa_extract_acks__packet_too_short)
+{
+	struct homa_ack acks[HOMA_MAX_CTRL_ACKS];
+	struct grant_header h = {{.sport = htons(self->client_port),
+	                .dport = htons(self->server_port),
+			.sender_id = cpu_to_be64(self->client_id),
+			.type = GRANT},
+		        .offset = htonl(5000),
+			.priority = 3,
+			.num_acks = 3};
+	struct sk_buff *skb;
+
+	skb = mock_skb_new(self->client_ip, &h.common, 0, 0);
+	skb->len = offsetof(struct grant_header, acks)
+			+ sizeof(struct homa_ack) + 4;
+	EXPECT_EQ(1, homa_extract_acks(skb, acks, HOMA_MAX_CTRL_ACKS));
+	kfree_skb(skb);
+}
+TEST_F(homa_incoming, homa_extract_acks__other_packet_type)
+{
+	struct homa_ack acks[HOMA_MAX_CTRL_ACKS];
+	struct sk_buff *skb;
+
+	skb = mock_skb_new(self->client_ip, &self->data.common, 1400, 0);
+	EXPECT_EQ(0, homa_extract_acks(skb, acks, HOMA_MAX_CTRL_ACKS));
+	kfree_skb(skb);
+}
+
+TEST_F(homa_incoming, homa_extract_extra_grants__follow_acks)
+{
+	struct homa_extra_grant extra[HOMA_MAX_EXTRA_GRANTS];
+	struct grant_header h = {{.sport = htons(self->client_port),
+	                .dport = htons(self->server_port),
+			.sender_id = cpu_to_be64(self->client_id),
+			.type = GRANT},
+		        .offset = htonl(5000),
+			.priority = 3,
+			.num_extra = 2,
+			.num_acks = 1};
+	struct sk_buff *skb;
+
+	homa_grant_extra(&h)[0] = (struct homa_extra_grant)
+			{cpu_to_be64(100), htonl(11000), 2};
+	homa_grant_extra(&h)[1] = (struct homa_extra_grant)
+			{cpu_to_be64(102), htonl(12000), 1};
+	skb = mock_skb_new(self->client_ip, &h.common, 0, 0);
+	EXPECT_EQ(2, homa_extract_extra_grants(skb, extra));
+	EXPECT_EQ(102, be64_to_cpu(extra[1].id));
+	EXPECT_EQ(12000, ntohl(extra[1].offset));
+	EXPECT_EQ(1, extra[1].priority);
+	kfree_skb(skb);
+}
+TEST_F(homa_incoming, homa_extract_extra_grants__packet_too_short)
+{
+	struct homa_extra_grant extra[HOMA_MAX_EXTRA_GRANTS];
+	struct grant_header h = {{.sport = htons(self->client_port),
+	                .dport = htons(self->server_port),
+			.sender_id = cpu_to_be64(self->client_id),
+			.type = GRANT},
+		        .offset = htonl(5000),
+			.priority = 3,
+			.num_extra = 3,
+			.num_acks = 1};
+	struct sk_buff *skb;
+
+	skb = mock_skb_new(self->client_ip, &h.common, 0, 0);
+	skb->len = offsetof(struct grant_header, acks)
+			+ sizeof(struct homa_ack)
+			+ 2 * sizeof(struct homa_extra_grant) + 4;
+	EXPECT_EQ(2, homa_extract_extra_grants(skb, extra));
+
+	/* Not even room for the acks. */
+	skb->len = offsetof(struct grant_header, acks) + 4;
+	EXPECT_EQ(0, homa_extract_extra_grants(skb, extra));
+	kfree_skb(skb);
+}
+TEST_F(homa_incoming, homa_extract_extra_grants__other_packet_type)
+{
+	struct homa_extra_grant extra[HOMA_MAX_EXTRA_GRANTS];
+	struct sk_buff *skb;
+
+	skb = mock_skb_new(self->client_ip, &self->data.common, 1400, 0);
+	EXPECT_EQ(0, homa_extract_extra_grants(skb, extra));
+	kfree_skb(skb);
+}
+
 TEST_F(homa_incoming, homa_data_pkt__basics)
 {
 	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
@@ -1106,6 +1285,31 @@ TEST_F(homa_incoming, homa_data_pkt__basics)
 	EXPECT_EQ(1600, crpc->msgin.granted);
 	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.responses_received);
 }
+TEST_F(homa_incoming, homa_data_pkt__rtt_probe)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_ONE_PKT, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 1000, 20000);
+	ASSERT_NE(NULL, crpc);
+	crpc->msgin.rtt_probe_offset = 11000;
+	crpc->msgin.rtt_probe_cycles = 2000;
+	mock_cycles = 9000;
+
+	/* This packet could have been sent before the grant. */
+	self->data.message_length = htonl(20000);
+	self->data.seg.offset = htonl(1400);
+	homa_data_pkt(mock_skb_new(self->server_ip, &self->data.common,
+			1400, 1400), crpc);
+	EXPECT_EQ(11000, crpc->msgin.rtt_probe_offset);
+	EXPECT_EQ(0, crpc->peer->srtt_cycles);
+
+	/* This one was sent in response to the grant. */
+	self->data.seg.offset = htonl(11200);
+	homa_data_pkt(mock_skb_new(self->server_ip, &self->data.common,
+			1400, 11200), crpc);
+	EXPECT_EQ(0, crpc->msgin.rtt_probe_offset);
+	EXPECT_EQ(7000, crpc->peer->srtt_cycles);
+}
 TEST_F(homa_incoming, homa_data_pkt__wrong_client_rpc_state)
 {
 	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
@@ -1141,7 +1345,7 @@ TEST_F(homa_incoming, homa_data_pkt__no_buffer_pool)
 			UNIT_OUTGOING, self->client_ip, self->server_ip,
 			self->server_port, self->client_id, 1000, 1600);
 	ASSERT_NE(NULL, crpc);
-	homa_pool_destroy(&self->hsk.buffer_pool);
+	homa_pool_detach(&self->hsk);
 	unit_log_clear();
 	homa_data_pkt(mock_skb_new(self->server_ip, &self->data.common,
 			1400, 0), crpc);
@@ -1167,12 +1371,39 @@ TEST_F(homa_incoming, homa_data_pkt__no_buffers)
 	EXPECT_NE(NULL, crpc);
 	unit_log_clear();
 
-	atomic_set(&self->hsk.buffer_pool.free_bpages, 0);
+	atomic_set(self->hsk.buffer_pool->free_bpages, 0);
 	homa_data_pkt(mock_skb_new(self->server_ip, &self->data.common,
 			1400, 0), crpc);
 	EXPECT_EQ(1400, homa_cores[cpu_number]->metrics.dropped_data_no_bufs);
 	EXPECT_EQ(0, skb_queue_len(&crpc->msgin.packets));
 }
+TEST_F(homa_incoming, homa_data_pkt__uncharge_peer_when_complete)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_ONE_PKT, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 1000, 3000);
+	ASSERT_NE(NULL, crpc);
+	crpc->msgin.charged_bpages = 2;
+	list_add_tail(&crpc->msgin.charged_links,
+			&self->hsk.buffer_pool->charged_rpcs);
+
+	self->data.message_length = htonl(3000);
+	self->data.seg.offset = htonl(1400);
+	self->data.seg.segment_length = htonl(1400);
+	homa_data_pkt(mock_skb_new(self->server_ip, &self->data.common,
+			1400, 1400), crpc);
+	EXPECT_EQ(2, homa_pool_peer_bpages(self->hsk.buffer_pool,
+			crpc->peer));
+
+	self->data.seg.offset = htonl(2800);
+	self->data.seg.segment_length = htonl(200);
+	homa_data_pkt(mock_skb_new(self->server_ip, &self->data.common,
+			200, 2800), crpc);
+	EXPECT_EQ(0, crpc->msgin.bytes_remaining);
+	EXPECT_EQ(0, crpc->msgin.charged_bpages);
+	EXPECT_EQ(0, homa_pool_peer_bpages(self->hsk.buffer_pool,
+			crpc->peer));
+}
 TEST_F(homa_incoming, homa_data_pkt__update_delta)
 {
 	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
@@ -1228,6 +1459,25 @@ TEST_F(homa_incoming, homa_data_pkt__handoff)
 			1400, 0), crpc);
 	EXPECT_STREQ("", unit_log_get());
 }
+TEST_F(homa_incoming, homa_data_pkt__record_handoff_latency)
+{
+	struct sk_buff *skb;
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 1000, 3000);
+	ASSERT_NE(NULL, crpc);
+	crpc->msgout.next_xmit_offset = crpc->msgout.length;
+
+	self->data.message_length = htonl(3000);
+	skb = mock_skb_new(self->server_ip, &self->data.common, 1400, 0);
+	homa_set_rcv_cycles(skb, 1000);
+	mock_cycles = 3048;
+	homa_data_pkt(skb, crpc);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics
+			.softirq_handoff_latency[4]);
+	EXPECT_EQ(0, crpc->dispatch_cycles);
+	EXPECT_EQ(3048, crpc->handoff_cycles);
+}
 TEST_F(homa_incoming, homa_data_pkt__send_cutoffs)
 {
 	self->homa.cutoff_version = 2;
@@ -1306,6 +1556,36 @@ TEST_F(homa_incoming, homa_grant_pkt__basics)
 	/* Must restore old state to avoid potential crashes. */
 	srpc->state = RPC_OUTGOING;
 }
+TEST_F(homa_incoming, homa_grant_pkt__rtt_sample)
+{
+	struct homa_rpc *srpc = unit_server_rpc(&self->hsk, UNIT_OUTGOING,
+			self->client_ip, self->server_ip, self->client_port,
+			self->server_id, 100, 20000);
+	ASSERT_NE(NULL, srpc);
+	mock_cycles = 1000;
+	homa_xmit_data(srpc, false);
+	EXPECT_EQ(0, srpc->peer->srtt_cycles);
+
+	struct grant_header h = {{.sport = htons(srpc->dport),
+	                .dport = htons(self->hsk.port),
+			.sender_id = cpu_to_be64(self->client_id),
+			.type = GRANT},
+		        .offset = htonl(11000),
+			.priority = 3,
+			.resend_all = 0};
+	mock_cycles = 6000;
+	homa_dispatch_pkts(mock_skb_new(self->client_ip, &h.common, 0, 0),
+			&self->homa);
+	EXPECT_EQ(5000, srpc->peer->srtt_cycles);
+
+	/* Only the first grant provides a sample. */
+	h.offset = htonl(12000);
+	mock_cycles = 100000;
+	homa_dispatch_pkts(mock_skb_new(self->client_ip, &h.common, 0, 0),
+			&self->homa);
+	EXPECT_EQ(12000, srpc->msgout.granted);
+	EXPECT_EQ(5000, srpc->peer->srtt_cycles);
+}
 TEST_F(homa_incoming, homa_grant_pkt__reset)
 {
 	struct homa_rpc *srpc = unit_server_rpc(&self->hsk, UNIT_OUTGOING,
@@ -1355,6 +1635,145 @@ TEST_F(homa_incoming, homa_grant_pkt__grant_past_end_of_message)
 			&self->homa);
 	EXPECT_EQ(20000, crpc->msgout.granted);
 }
+TEST_F(homa_incoming, homa_grant_pkt__extra_grants)
+{
+	struct homa_rpc *crpc1 = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 20000, 1600);
+	struct homa_rpc *crpc2 = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id+2, 20000, 1600);
+	struct homa_rpc *crpc3 = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id+4, 20000, 1600);
+	ASSERT_NE(NULL, crpc1);
+	ASSERT_NE(NULL, crpc2);
+	ASSERT_NE(NULL, crpc3);
+	unit_log_clear();
+
+	struct grant_header h = {{.sport = htons(self->server_port),
+	                .dport = htons(self->hsk.port),
+			.sender_id = cpu_to_be64(self->server_id),
+			.type = GRANT},
+		        .offset = htonl(12600),
+			.priority = 3,
+			.num_extra = 3};
+	struct homa_extra_grant *extra = homa_grant_extra(&h);
+
+	extra[0] = (struct homa_extra_grant)
+			{cpu_to_be64(self->server_id+2), htonl(11000), 2};
+	extra[1] = (struct homa_extra_grant)
+			{cpu_to_be64(99991), htonl(15000), 2};
+	extra[2] = (struct homa_extra_grant)
+			{cpu_to_be64(self->server_id+4), htonl(14000), 1};
+	homa_dispatch_pkts(mock_skb_new(self->server_ip, &h.common, 0, 0),
+			&self->homa);
+	EXPECT_EQ(12600, crpc1->msgout.granted);
+	EXPECT_EQ(3, crpc1->msgout.sched_priority);
+	EXPECT_EQ(11000, crpc2->msgout.granted);
+	EXPECT_EQ(2, crpc2->msgout.sched_priority);
+	EXPECT_EQ(14000, crpc3->msgout.granted);
+	EXPECT_EQ(1, crpc3->msgout.sched_priority);
+}
+TEST_F(homa_incoming, homa_grant_pkt__extra_grants_overflow_batch)
+{
+	struct homa_rpc *crpc1 = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 20000, 1600);
+	struct homa_rpc *crpc2 = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id+2, 20000, 1600);
+	struct homa_rpc *crpc3 = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id+4, 20000, 1600);
+	struct homa_rpc *crpc4 = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id+6, 20000, 1600);
+	struct sk_buff *skb, *skb2;
+	ASSERT_NE(NULL, crpc1);
+	ASSERT_NE(NULL, crpc2);
+	ASSERT_NE(NULL, crpc3);
+	ASSERT_NE(NULL, crpc4);
+	unit_log_clear();
+
+	/* The batch carries more extra grants than dispatch can hold. */
+	struct grant_header h = {{.sport = htons(self->server_port),
+	                .dport = htons(self->hsk.port),
+			.sender_id = cpu_to_be64(self->server_id),
+			.type = GRANT},
+		        .offset = htonl(12600),
+			.priority = 3,
+			.num_extra = 3};
+	struct homa_extra_grant *extra = homa_grant_extra(&h);
+
+	extra[0] = (struct homa_extra_grant)
+			{cpu_to_be64(self->server_id+2), htonl(11000), 2};
+	extra[1] = (struct homa_extra_grant)
+			{cpu_to_be64(self->server_id+4), htonl(11000), 2};
+	extra[2] = (struct homa_extra_grant)
+			{cpu_to_be64(self->server_id+6), htonl(11000), 2};
+	skb = mock_skb_new(self->server_ip, &h.common, 0, 0);
+	h.offset = htonl(13600);
+	extra[0].offset = htonl(13000);
+	extra[1].offset = htonl(13000);
+	extra[2].offset = htonl(14000);
+	skb2 = mock_skb_new(self->server_ip, &h.common, 0, 0);
+	skb->next = skb2;
+	homa_dispatch_pkts(skb, &self->homa);
+	EXPECT_EQ(13600, crpc1->msgout.granted);
+	EXPECT_EQ(13000, crpc2->msgout.granted);
+	EXPECT_EQ(13000, crpc3->msgout.granted);
+	EXPECT_EQ(14000, crpc4->msgout.granted);
+}
+TEST_F(homa_incoming, homa_grant_pkt__extra_grants_but_primary_rpc_unknown)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 20000, 1600);
+	ASSERT_NE(NULL, crpc);
+	unit_log_clear();
+
+	struct grant_header h = {{.sport = htons(self->server_port),
+	                .dport = htons(self->hsk.port),
+			.sender_id = cpu_to_be64(99991),
+			.type = GRANT},
+		        .offset = htonl(12600),
+			.priority = 3,
+			.num_extra = 1};
+
+	homa_grant_extra(&h)[0] = (struct homa_extra_grant)
+			{cpu_to_be64(self->server_id), htonl(13000), 2};
+	homa_dispatch_pkts(mock_skb_new(self->server_ip, &h.common, 0, 0),
+			&self->homa);
+	EXPECT_EQ(13000, crpc->msgout.granted);
+}
+
+TEST_F(homa_incoming, homa_grant_extras__server_rpc)
+{
+	struct homa_extra_grant grant;
+	struct homa_rpc *srpc = unit_server_rpc(&self->hsk, UNIT_OUTGOING,
+			self->client_ip, self->server_ip, self->client_port,
+			self->server_id, 100, 20000);
+	ASSERT_NE(NULL, srpc);
+	homa_xmit_data(srpc, false);
+	srpc->silent_ticks = 3;
+	unit_log_clear();
+
+	grant.id = cpu_to_be64(self->client_id);
+	grant.offset = htonl(11000);
+	grant.priority = 2;
+	homa_grant_extras(&self->hsk, self->client_ip, self->client_port,
+			&grant, 1);
+	EXPECT_EQ(11000, srpc->msgout.granted);
+	EXPECT_EQ(0, srpc->silent_ticks);
+	EXPECT_STREQ("xmit DATA 1400@10000", unit_log_get());
+
+	/* Port doesn't match: RPC can't be found. */
+	grant.offset = htonl(12000);
+	homa_grant_extras(&self->hsk, self->client_ip, self->client_port+1,
+			&grant, 1);
+	EXPECT_EQ(11000, srpc->msgout.granted);
+}
 
 TEST_F(homa_incoming, homa_resend_pkt__unknown_rpc)
 {
@@ -2079,6 +2498,27 @@ TEST_F(homa_incoming, homa_register_interests__specified_id_not_ready)
 	EXPECT_EQ(NULL, (struct homa_rpc *)
 			atomic_long_read(&self->interest.ready_rpc));
 }
+TEST_F(homa_incoming, homa_register_interests__record_core_for_rfs)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 20000, 1600);
+	ASSERT_NE(NULL, crpc);
+	int index = homa_rfs_index(crpc->id);
+
+	int result = homa_register_interests(&self->interest, &self->hsk,
+			HOMA_RECVMSG_RESPONSE, crpc->id);
+	EXPECT_EQ(0, result);
+	EXPECT_EQ(0, self->homa.rfs_table[index]);
+	crpc->interest = NULL;
+
+	self->homa.gro_policy |= HOMA_GRO_RFS;
+	cpu_number = 3;
+	result = homa_register_interests(&self->interest, &self->hsk,
+			HOMA_RECVMSG_RESPONSE, crpc->id);
+	EXPECT_EQ(0, result);
+	EXPECT_EQ((crpc->id << 16) | 3, self->homa.rfs_table[index]);
+}
 TEST_F(homa_incoming, homa_register_interests__return_queued_response)
 {
 	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
@@ -2142,6 +2582,67 @@ TEST_F(homa_incoming, homa_register_interests__call_sk_data_ready)
 	homa_rpc_unlock(srpc2);
 }
 
+TEST_F(homa_incoming, homa_poll_window__no_history)
+{
+	self->homa.poll_cycles = 1000;
+	EXPECT_EQ(1000, homa_poll_window(&self->hsk));
+}
+TEST_F(homa_incoming, homa_poll_window__not_adaptive)
+{
+	self->homa.poll_cycles = 1000;
+	self->homa.poll_adaptive = 0;
+	self->hsk.avg_wait_cycles = 5000;
+	EXPECT_EQ(1000, homa_poll_window(&self->hsk));
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.poll_skips);
+}
+TEST_F(homa_incoming, homa_poll_window__skip_polling)
+{
+	self->homa.poll_cycles = 1000;
+	self->hsk.avg_wait_cycles = 2001;
+	EXPECT_EQ(0, homa_poll_window(&self->hsk));
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.poll_skips);
+	self->hsk.avg_wait_cycles = 2000;
+	EXPECT_EQ(1000, homa_poll_window(&self->hsk));
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.poll_skips);
+}
+TEST_F(homa_incoming, homa_poll_window__shorten_polling)
+{
+	self->homa.poll_cycles = 1000;
+	self->hsk.avg_wait_cycles = 200;
+	EXPECT_EQ(400, homa_poll_window(&self->hsk));
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.poll_shortened);
+	self->hsk.avg_wait_cycles = 500;
+	EXPECT_EQ(1000, homa_poll_window(&self->hsk));
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.poll_shortened);
+}
+
+TEST_F(homa_incoming, homa_poll_record_wait__first_sample)
+{
+	self->homa.poll_cycles = 1000;
+	homa_poll_record_wait(&self->hsk, 300);
+	EXPECT_EQ(300, self->hsk.avg_wait_cycles);
+}
+TEST_F(homa_incoming, homa_poll_record_wait__average)
+{
+	self->homa.poll_cycles = 1000;
+	self->hsk.avg_wait_cycles = 800;
+	homa_poll_record_wait(&self->hsk, 1600);
+	EXPECT_EQ(900, self->hsk.avg_wait_cycles);
+}
+TEST_F(homa_incoming, homa_poll_record_wait__cap_sample)
+{
+	self->homa.poll_cycles = 1000;
+	self->hsk.avg_wait_cycles = 800;
+	homa_poll_record_wait(&self->hsk, 1000000);
+	EXPECT_EQ(1200, self->hsk.avg_wait_cycles);
+}
+TEST_F(homa_incoming, homa_poll_record_wait__zero_wait)
+{
+	self->homa.poll_cycles = 1000;
+	homa_poll_record_wait(&self->hsk, 0);
+	EXPECT_EQ(1, self->hsk.avg_wait_cycles);
+}
+
 TEST_F(homa_incoming, homa_wait_for_message__rpc_from_register_interests)
 {
 	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
@@ -2155,6 +2656,26 @@ TEST_F(homa_incoming, homa_wait_for_message__rpc_from_register_interests)
 	EXPECT_EQ(crpc, rpc);
 	homa_rpc_unlock(crpc);
 }
+TEST_F(homa_incoming, homa_wait_for_message__record_wakeup_latency)
+{
+	mock_cycles = 1000;
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_MSG, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 20000, 1600);
+	ASSERT_NE(NULL, crpc);
+	EXPECT_EQ(1000, crpc->handoff_cycles);
+
+	mock_cycles = 6000;
+	struct homa_rpc *rpc = homa_wait_for_message(&self->hsk,
+			HOMA_RECVMSG_RESPONSE|HOMA_RECVMSG_NONBLOCKING,
+			self->client_id);
+	EXPECT_EQ(crpc, rpc);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics
+			.handoff_wakeup_latency[8]);
+	EXPECT_EQ(0, crpc->handoff_cycles);
+	EXPECT_EQ(6000, crpc->wakeup_cycles);
+	homa_rpc_unlock(crpc);
+}
 TEST_F(homa_incoming, homa_wait_for_message__error_from_register_interests)
 {
 	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
@@ -2187,8 +2708,51 @@ TEST_F(homa_incoming, homa_wait_for_message__rpc_arrives_while_polling)
 	EXPECT_EQ(NULL, crpc1->interest);
 	EXPECT_STREQ("wake_up_process pid 0", unit_log_get());
 	EXPECT_EQ(0, self->hsk.dead_skbs);
+	EXPECT_EQ(1, self->hsk.avg_wait_cycles);
 	homa_rpc_unlock(rpc);
 }
+TEST_F(homa_incoming, homa_wait_for_message__skip_polling)
+{
+	struct homa_rpc *rpc;
+	struct homa_rpc *crpc1 = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 20000, 1600);
+	ASSERT_NE(NULL, crpc1);
+
+	hook_rpc = crpc1;
+	self->homa.poll_cycles = 1000000;
+	self->hsk.avg_wait_cycles = 3000000;
+	unit_hook_register(handoff_hook);
+	unit_log_clear();
+	rpc = homa_wait_for_message(&self->hsk, 0, self->client_id);
+	EXPECT_EQ(crpc1, rpc);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.poll_skips);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.poll_cycles);
+	EXPECT_EQ(2625000, self->hsk.avg_wait_cycles);
+	homa_rpc_unlock(rpc);
+}
+#ifdef CONFIG_NET_RX_BUSY_POLL
+TEST_F(homa_incoming, homa_wait_for_message__rpc_arrives_while_busy_polling)
+{
+	struct homa_rpc *rpc;
+	struct homa_rpc *crpc1 = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 20000, 1600);
+	ASSERT_NE(NULL, crpc1);
+
+	self->hsk.sock.sk_ll_usec = 50;
+	crpc1->peer->napi_id = MIN_NAPI_ID + 1;
+	hook_rpc = crpc1;
+	busy_poll_count = 3;
+	unit_hook_register(busy_poll_hook);
+	unit_log_clear();
+	rpc = homa_wait_for_message(&self->hsk, 0, self->client_id);
+	EXPECT_EQ(crpc1, rpc);
+	EXPECT_EQ(3, homa_cores[cpu_number]->metrics.busy_polls);
+	EXPECT_EQ(NULL, homa_cores[cpu_number]->busy_poller);
+	homa_rpc_unlock(rpc);
+}
+#endif
 TEST_F(homa_incoming, homa_wait_for_message__nothing_ready_nonblocking)
 {
 	struct homa_rpc *rpc;
@@ -2203,6 +2767,62 @@ TEST_F(homa_incoming, homa_wait_for_message__nothing_ready_nonblocking)
 			self->client_id);
 	EXPECT_EQ(EAGAIN, -PTR_ERR(rpc));
 }
+TEST_F(homa_incoming, homa_busy_poll__not_enabled)
+{
+	struct homa_interest interest;
+
+	homa_interest_init(&interest);
+	self->hsk.sock.sk_napi_id = 1000000;
+	EXPECT_EQ(0, homa_busy_poll(&self->hsk, &interest));
+	EXPECT_STREQ("", unit_log_get());
+}
+#ifdef CONFIG_NET_RX_BUSY_POLL
+TEST_F(homa_incoming, homa_busy_poll__use_peer_napi_id)
+{
+	struct homa_interest interest;
+	char expected[100];
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 20000, 1600);
+	ASSERT_NE(NULL, crpc);
+
+	homa_interest_init(&interest);
+	interest.peer = crpc->peer;
+	crpc->peer->napi_id = MIN_NAPI_ID + 7;
+	self->hsk.sock.sk_napi_id = MIN_NAPI_ID + 2;
+	self->hsk.sock.sk_ll_usec = 50;
+	unit_log_clear();
+	EXPECT_EQ(1, homa_busy_poll(&self->hsk, &interest));
+	snprintf(expected, sizeof(expected), "napi_busy_loop napi_id %u",
+			MIN_NAPI_ID + 7);
+	EXPECT_STREQ(expected, unit_log_get());
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.busy_polls);
+}
+TEST_F(homa_incoming, homa_busy_poll__use_socket_napi_id)
+{
+	struct homa_interest interest;
+	char expected[100];
+
+	homa_interest_init(&interest);
+	self->hsk.sock.sk_napi_id = MIN_NAPI_ID + 2;
+	self->hsk.sock.sk_ll_usec = 50;
+	EXPECT_EQ(1, homa_busy_poll(&self->hsk, &interest));
+	snprintf(expected, sizeof(expected), "napi_busy_loop napi_id %u",
+			MIN_NAPI_ID + 2);
+	EXPECT_STREQ(expected, unit_log_get());
+}
+TEST_F(homa_incoming, homa_busy_poll__no_napi_id)
+{
+	struct homa_interest interest;
+
+	homa_interest_init(&interest);
+	self->hsk.sock.sk_napi_id = 0;
+	self->hsk.sock.sk_ll_usec = 50;
+	EXPECT_EQ(0, homa_busy_poll(&self->hsk, &interest));
+	EXPECT_STREQ("", unit_log_get());
+}
+#endif
+
 TEST_F(homa_incoming, homa_wait_for_message__rpc_arrives_while_sleeping)
 {
 	struct homa_rpc *rpc;
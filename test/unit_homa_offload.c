@@ -96,6 +96,219 @@ TEST_F(homa_offload, homa_gso_segment_set_ip_ids)
 	kfree_skb(segs);
 }
 
+TEST_F(homa_offload, homa_gro_coalesce__basics)
+{
+	struct sk_buff *skb, *skb2;
+	struct data_header *h;
+	int length;
+
+	self->header.seg.offset = htonl(6000);
+	skb = mock_skb_new(&self->ip, &self->header.common, 1400, 6000);
+	skb_shinfo(self->skb2)->frag_list = skb;
+	NAPI_GRO_CB(self->skb2)->last = skb;
+	length = skb->len;
+
+	self->header.seg.offset = htonl(7400);
+	self->header.incoming = htonl(12000);
+	skb2 = mock_skb_new(&self->ip, &self->header.common, 1400, 7400);
+	unit_log_clear();
+	EXPECT_EQ(1, homa_gro_coalesce(self->skb2, skb2));
+	EXPECT_STREQ("skb_try_coalesce appended 1400 bytes", unit_log_get());
+	h = (struct data_header *) skb_transport_header(skb);
+	EXPECT_EQ(6000, ntohl(h->seg.offset));
+	EXPECT_EQ(2800, ntohl(h->seg.segment_length));
+	EXPECT_EQ(12000, ntohl(h->incoming));
+	EXPECT_EQ(length + 1400, skb->len);
+	if (mock_ipv6)
+		EXPECT_EQ(sizeof(struct data_header) + 2800,
+				ntohs(ipv6_hdr(skb)->payload_len));
+	else
+		EXPECT_EQ(20 + sizeof(struct data_header) + 2800,
+				ntohs(ip_hdr(skb)->tot_len));
+	EXPECT_EQ(skb, NAPI_GRO_CB(self->skb2)->last);
+	EXPECT_EQ(3, mock_skb_count());
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.gro_data_coalesced);
+}
+TEST_F(homa_offload, homa_gro_coalesce__last_is_held_skb)
+{
+	struct sk_buff *skb;
+
+	self->header.seg.offset = htonl(5400);
+	skb = mock_skb_new(&self->ip, &self->header.common, 1400, 5400);
+	EXPECT_EQ(0, homa_gro_coalesce(self->skb2, skb));
+	kfree_skb(skb);
+}
+TEST_F(homa_offload, homa_gro_coalesce__new_packet_has_ack)
+{
+	struct sk_buff *skb, *skb2;
+
+	self->header.seg.offset = htonl(6000);
+	skb = mock_skb_new(&self->ip, &self->header.common, 1400, 6000);
+	skb_shinfo(self->skb2)->frag_list = skb;
+	NAPI_GRO_CB(self->skb2)->last = skb;
+
+	self->header.seg.offset = htonl(7400);
+	self->header.seg.ack.client_id = cpu_to_be64(100);
+	skb2 = mock_skb_new(&self->ip, &self->header.common, 1400, 7400);
+	EXPECT_EQ(0, homa_gro_coalesce(self->skb2, skb2));
+	kfree_skb(skb2);
+}
+TEST_F(homa_offload, homa_gro_coalesce__different_rpc)
+{
+	struct sk_buff *skb, *skb2;
+
+	self->header.seg.offset = htonl(6000);
+	skb = mock_skb_new(&self->ip, &self->header.common, 1400, 6000);
+	skb_shinfo(self->skb2)->frag_list = skb;
+	NAPI_GRO_CB(self->skb2)->last = skb;
+
+	self->header.seg.offset = htonl(7400);
+	self->header.common.sender_id = cpu_to_be64(1004);
+	skb2 = mock_skb_new(&self->ip, &self->header.common, 1400, 7400);
+	EXPECT_EQ(0, homa_gro_coalesce(self->skb2, skb2));
+	kfree_skb(skb2);
+}
+TEST_F(homa_offload, homa_gro_coalesce__not_contiguous)
+{
+	struct sk_buff *skb, *skb2;
+
+	self->header.seg.offset = htonl(6000);
+	skb = mock_skb_new(&self->ip, &self->header.common, 1400, 6000);
+	skb_shinfo(self->skb2)->frag_list = skb;
+	NAPI_GRO_CB(self->skb2)->last = skb;
+
+	self->header.seg.offset = htonl(8800);
+	skb2 = mock_skb_new(&self->ip, &self->header.common, 1400, 8800);
+	EXPECT_EQ(0, homa_gro_coalesce(self->skb2, skb2));
+	kfree_skb(skb2);
+}
+TEST_F(homa_offload, homa_gro_coalesce__update_ipv4_header)
+{
+	struct sk_buff *skb, *skb2;
+
+	mock_ipv6 = false;
+	self->header.seg.offset = htonl(6000);
+	skb = mock_skb_new(&self->ip, &self->header.common, 1400, 6000);
+	skb_shinfo(self->skb2)->frag_list = skb;
+	NAPI_GRO_CB(self->skb2)->last = skb;
+	ip_hdr(skb)->check = 0x1234;
+
+	self->header.seg.offset = htonl(7400);
+	skb2 = mock_skb_new(&self->ip, &self->header.common, 1400, 7400);
+	EXPECT_EQ(1, homa_gro_coalesce(self->skb2, skb2));
+	EXPECT_EQ(20 + sizeof(struct data_header) + 2800,
+			ntohs(ip_hdr(skb)->tot_len));
+	EXPECT_NE(0x1234, ip_hdr(skb)->check);
+}
+TEST_F(homa_offload, homa_gro_coalesce__new_packet_padded)
+{
+	struct sk_buff *skb, *skb2;
+
+	self->header.seg.offset = htonl(6000);
+	skb = mock_skb_new(&self->ip, &self->header.common, 1400, 6000);
+	skb_shinfo(self->skb2)->frag_list = skb;
+	NAPI_GRO_CB(self->skb2)->last = skb;
+
+	self->header.seg.offset = htonl(7400);
+	self->header.seg.segment_length = htonl(1300);
+	skb2 = mock_skb_new(&self->ip, &self->header.common, 1400, 7400);
+	EXPECT_EQ(0, homa_gro_coalesce(self->skb2, skb2));
+	kfree_skb(skb2);
+}
+TEST_F(homa_offload, homa_gro_coalesce__last_packet_padded)
+{
+	struct sk_buff *skb, *skb2;
+
+	/* The last packet has 100 bytes of padding after its segment;
+	 * merging would insert them into the message.
+	 */
+	self->header.seg.offset = htonl(6000);
+	self->header.seg.segment_length = htonl(1300);
+	skb = mock_skb_new(&self->ip, &self->header.common, 1400, 6000);
+	skb_shinfo(self->skb2)->frag_list = skb;
+	NAPI_GRO_CB(self->skb2)->last = skb;
+
+	self->header.seg.offset = htonl(7300);
+	self->header.seg.segment_length = htonl(1400);
+	skb2 = mock_skb_new(&self->ip, &self->header.common, 1400, 7300);
+	EXPECT_EQ(0, homa_gro_coalesce(self->skb2, skb2));
+	kfree_skb(skb2);
+}
+TEST_F(homa_offload, homa_gro_coalesce__ip_length_mismatch)
+{
+	struct sk_buff *skb, *skb2;
+
+	self->header.seg.offset = htonl(6000);
+	skb = mock_skb_new(&self->ip, &self->header.common, 1400, 6000);
+	skb_shinfo(self->skb2)->frag_list = skb;
+	NAPI_GRO_CB(self->skb2)->last = skb;
+
+	self->header.seg.offset = htonl(7400);
+	skb2 = mock_skb_new(&self->ip, &self->header.common, 1400, 7400);
+	if (mock_ipv6)
+		ipv6_hdr(skb2)->payload_len = htons(100);
+	else
+		ip_hdr(skb2)->tot_len = htons(100);
+	EXPECT_EQ(0, homa_gro_coalesce(self->skb2, skb2));
+	kfree_skb(skb2);
+}
+TEST_F(homa_offload, homa_gro_coalesce__merged_packet_too_long)
+{
+	struct sk_buff *skb, *skb2;
+
+	mock_ipv6 = true;
+	self->header.seg.offset = htonl(6000);
+	self->header.seg.segment_length = htonl(64000);
+	self->header.message_length = htonl(100000);
+	skb = mock_skb_new(&self->ip, &self->header.common, 64000, 6000);
+	skb_shinfo(self->skb2)->frag_list = skb;
+	NAPI_GRO_CB(self->skb2)->last = skb;
+
+	self->header.seg.offset = htonl(70000);
+	self->header.seg.segment_length = htonl(1400);
+	skb2 = mock_skb_new(&self->ip, &self->header.common, 1400, 70000);
+	EXPECT_EQ(0, homa_gro_coalesce(self->skb2, skb2));
+	kfree_skb(skb2);
+}
+TEST_F(homa_offload, homa_gro_coalesce__different_source_address)
+{
+	struct in6_addr ip2 = unit_get_in_addr("197.168.0.1");
+	struct sk_buff *skb, *skb2;
+
+	self->header.seg.offset = htonl(6000);
+	skb = mock_skb_new(&self->ip, &self->header.common, 1400, 6000);
+	skb_shinfo(self->skb2)->frag_list = skb;
+	NAPI_GRO_CB(self->skb2)->last = skb;
+
+	self->header.seg.offset = htonl(7400);
+	skb2 = mock_skb_new(&ip2, &self->header.common, 1400, 7400);
+	EXPECT_EQ(0, homa_gro_coalesce(self->skb2, skb2));
+	kfree_skb(skb2);
+}
+TEST_F(homa_offload, homa_gro_coalesce__skb_try_coalesce_fails)
+{
+	struct sk_buff *skb, *skb2;
+	struct data_header *h;
+	int length;
+
+	self->header.seg.offset = htonl(6000);
+	skb = mock_skb_new(&self->ip, &self->header.common, 1400, 6000);
+	skb_shinfo(self->skb2)->frag_list = skb;
+	NAPI_GRO_CB(self->skb2)->last = skb;
+
+	self->header.seg.offset = htonl(7400);
+	skb2 = mock_skb_new(&self->ip, &self->header.common, 1400, 7400);
+	length = skb2->len;
+	mock_coalesce_errors = 1;
+	EXPECT_EQ(0, homa_gro_coalesce(self->skb2, skb2));
+	EXPECT_EQ(length, skb2->len);
+	h = (struct data_header *) skb2->data;
+	EXPECT_EQ(7400, ntohl(h->seg.offset));
+	h = (struct data_header *) skb_transport_header(skb);
+	EXPECT_EQ(1400, ntohl(h->seg.segment_length));
+	kfree_skb(skb2);
+}
+
 TEST_F(homa_offload, homa_gro_receive__HOMA_GRO_SHORT_BYPASS)
 {
 	struct in6_addr client_ip = unit_get_in_addr("196.168.0.1");
@@ -222,6 +435,20 @@ TEST_F(homa_offload, homa_gro_receive__no_held_skb)
 	EXPECT_EQ(3, homa_cores[cpu_number]->held_bucket);
 	kfree_skb(skb);
 }
+TEST_F(homa_offload, homa_gro_receive__record_rcv_cycles)
+{
+	struct sk_buff *skb;
+	self->header.seg.offset = htonl(6000);
+	skb = mock_skb_new(&self->ip, &self->header.common, 1400, 0);
+	homa_cores[cpu_number]->held_skb = NULL;
+	NAPI_GRO_CB(skb)->last = skb;
+	mock_cycles = 5000;
+	EXPECT_EQ(NULL, homa_gro_receive(&self->empty_list, skb));
+	EXPECT_EQ(5000, homa_get_rcv_cycles(skb));
+	EXPECT_EQ(0, skb->tstamp);
+	EXPECT_EQ(skb, NAPI_GRO_CB(skb)->last);
+	kfree_skb(skb);
+}
 TEST_F(homa_offload, homa_gro_receive__empty_merge_list)
 {
 	struct sk_buff *skb;
@@ -272,6 +499,32 @@ TEST_F(homa_offload, homa_gro_receive__merge)
 			"data_length 1400, incoming 10000",
 			unit_log_get());
 }
+TEST_F(homa_offload, homa_gro_receive__coalesce)
+{
+	struct sk_buff *skb;
+
+	self->homa.gro_policy |= HOMA_GRO_COALESCE;
+	homa_cores[cpu_number]->held_skb = self->skb2;
+	homa_cores[cpu_number]->held_bucket = 2;
+
+	self->header.seg.offset = htonl(6000);
+	skb = mock_skb_new(&self->ip, &self->header.common, 1400, 0);
+	EXPECT_EQ(NULL, homa_gro_receive(&self->napi.gro_hash[3].list, skb));
+	EXPECT_EQ(2, NAPI_GRO_CB(self->skb2)->count);
+
+	self->header.seg.offset = htonl(7400);
+	skb = mock_skb_new(&self->ip, &self->header.common, 1400, 0);
+	EXPECT_EQ(EINPROGRESS, -PTR_ERR(homa_gro_receive(
+			&self->napi.gro_hash[3].list, skb)));
+	EXPECT_EQ(3, NAPI_GRO_CB(self->skb2)->count);
+
+	unit_log_clear();
+	unit_log_frag_list(self->skb2, 1);
+	EXPECT_STREQ("DATA from 196.168.0.1:40000, dport 88, id 1002, "
+			"message_length 10000, offset 6000, "
+			"data_length 2800, incoming 10000",
+			unit_log_get());
+}
 TEST_F(homa_offload, homa_gro_receive__max_gro_skbs)
 {
 	struct sk_buff *skb;
@@ -387,6 +640,326 @@ TEST_F(homa_offload, homa_gro_gen3__stop_on_negative_core_id)
 	EXPECT_EQ(3, self->skb->hash - 32);
 	EXPECT_EQ(5000, homa_cores[3]->last_active);
 }
+TEST_F(homa_offload, homa_gro_gen3__adaptive_uses_gro_core)
+{
+	homa->gro_policy = HOMA_GRO_GEN3|HOMA_GRO_GEN3_ADAPTIVE;
+	struct homa_core *core = homa_cores[cpu_number];
+	core->gen3_softirq_cores[0] = 3;
+	core->gen3_softirq_cores[1] = 7;
+	core->gen3_softirq_cores[2] = 5;
+	core->gen3_num_cores = 0;
+	core->gen3_last_adapt = 4000;
+	self->homa.gen3_adapt_cycles = 2000;
+	mock_cycles = 5000;
+
+	homa_gro_complete(self->skb, 0);
+	EXPECT_EQ(cpu_number, self->skb->hash - 32);
+	EXPECT_EQ(5000, core->last_active);
+	EXPECT_EQ(4000, core->gen3_last_adapt);
+	EXPECT_EQ(0, core->metrics.gen3_alt_handoffs);
+}
+TEST_F(homa_offload, homa_gro_gen3__adaptive_limits_candidates)
+{
+	homa->gro_policy = HOMA_GRO_GEN3|HOMA_GRO_GEN3_ADAPTIVE;
+	struct homa_core *core = homa_cores[cpu_number];
+	core->gen3_softirq_cores[0] = 3;
+	core->gen3_softirq_cores[1] = 7;
+	core->gen3_softirq_cores[2] = 5;
+	core->gen3_num_cores = 1;
+	core->gen3_last_adapt = 4000;
+	self->homa.gen3_adapt_cycles = 2000;
+	homa_cores[3]->last_app_active = 4100;
+	mock_cycles = 5000;
+	self->homa.busy_cycles = 1000;
+
+	homa_gro_complete(self->skb, 0);
+	EXPECT_EQ(3, self->skb->hash - 32);
+	EXPECT_EQ(1, atomic_read(&homa_cores[3]->softirq_backlog));
+}
+TEST_F(homa_offload, homa_gro_gen3__adaptive_invokes_adapt)
+{
+	homa->gro_policy = HOMA_GRO_GEN3|HOMA_GRO_GEN3_ADAPTIVE;
+	struct homa_core *core = homa_cores[cpu_number];
+	core->gen3_softirq_cores[0] = 3;
+	core->gen3_softirq_cores[1] = 7;
+	core->gen3_softirq_cores[2] = 5;
+	core->gen3_num_cores = 1;
+	core->gen3_last_adapt = 3000;
+	self->homa.gen3_adapt_cycles = 2000;
+	self->homa.gen3_shrink_pct = 30;
+	mock_cycles = 5000;
+
+	homa_gro_complete(self->skb, 0);
+	EXPECT_EQ(cpu_number, self->skb->hash - 32);
+	EXPECT_EQ(5000, core->gen3_last_adapt);
+	EXPECT_EQ(0, core->gen3_num_cores);
+}
+
+TEST_F(homa_offload, homa_gro_gen3_adapt__expand_from_gro_core)
+{
+	struct homa_core *core = homa_cores[cpu_number];
+	core->gen3_softirq_cores[0] = 3;
+	core->gen3_softirq_cores[1] = 7;
+	core->gen3_softirq_cores[2] = -1;
+	core->gen3_num_cores = 0;
+	core->gen3_last_adapt = 1000;
+	core->gen3_prev_softirq[0] = 500;
+	core->metrics.softirq_cycles = 900;
+	self->homa.gen3_expand_pct = 70;
+
+	/* 40% is above expand_pct/2. */
+	homa_gro_gen3_adapt(cpu_number, 2000);
+	EXPECT_EQ(1, core->gen3_num_cores);
+	EXPECT_EQ(2000, core->gen3_last_adapt);
+	EXPECT_EQ(900, core->gen3_prev_softirq[0]);
+	EXPECT_EQ(1, core->metrics.gen3_expansions);
+}
+TEST_F(homa_offload, homa_gro_gen3_adapt__expand_because_of_load)
+{
+	struct homa_core *core = homa_cores[cpu_number];
+	core->gen3_softirq_cores[0] = 3;
+	core->gen3_softirq_cores[1] = 7;
+	core->gen3_softirq_cores[2] = -1;
+	core->gen3_num_cores = 1;
+	core->gen3_last_adapt = 1000;
+	core->gen3_prev_softirq[1] = 100;
+	homa_cores[3]->metrics.softirq_cycles = 900;
+	homa_cores[7]->metrics.softirq_cycles = 300;
+	self->homa.gen3_expand_pct = 70;
+
+	homa_gro_gen3_adapt(cpu_number, 2000);
+	EXPECT_EQ(2, core->gen3_num_cores);
+	EXPECT_EQ(900, core->gen3_prev_softirq[1]);
+	EXPECT_EQ(300, core->gen3_prev_softirq[2]);
+}
+TEST_F(homa_offload, homa_gro_gen3_adapt__expand_because_of_backlog)
+{
+	struct homa_core *core = homa_cores[cpu_number];
+	core->gen3_softirq_cores[0] = 3;
+	core->gen3_softirq_cores[1] = 7;
+	core->gen3_softirq_cores[2] = -1;
+	core->gen3_num_cores = 1;
+	core->gen3_last_adapt = 1000;
+	homa_cores[3]->metrics.softirq_cycles = 500;
+	atomic_set(&homa_cores[3]->softirq_backlog, 2);
+	self->homa.gen3_expand_pct = 70;
+
+	homa_gro_gen3_adapt(cpu_number, 2000);
+	EXPECT_EQ(2, core->gen3_num_cores);
+}
+TEST_F(homa_offload, homa_gro_gen3_adapt__no_more_cores)
+{
+	struct homa_core *core = homa_cores[cpu_number];
+	core->gen3_softirq_cores[0] = 3;
+	core->gen3_softirq_cores[1] = -1;
+	core->gen3_softirq_cores[2] = 5;
+	core->gen3_num_cores = 3;
+	core->gen3_last_adapt = 1000;
+	homa_cores[3]->metrics.softirq_cycles = 900;
+	self->homa.gen3_expand_pct = 70;
+
+	homa_gro_gen3_adapt(cpu_number, 2000);
+	EXPECT_EQ(1, core->gen3_num_cores);
+	EXPECT_EQ(0, core->metrics.gen3_expansions);
+}
+TEST_F(homa_offload, homa_gro_gen3_adapt__hysteresis)
+{
+	struct homa_core *core = homa_cores[cpu_number];
+	core->gen3_softirq_cores[0] = 3;
+	core->gen3_softirq_cores[1] = 7;
+	core->gen3_softirq_cores[2] = -1;
+	core->gen3_num_cores = 2;
+	core->gen3_last_adapt = 1000;
+	homa_cores[3]->metrics.softirq_cycles = 300;
+	homa_cores[7]->metrics.softirq_cycles = 200;
+	self->homa.gen3_expand_pct = 70;
+	self->homa.gen3_shrink_pct = 30;
+
+	/* Total 50% is too much for one core at 30%. */
+	homa_gro_gen3_adapt(cpu_number, 2000);
+	EXPECT_EQ(2, core->gen3_num_cores);
+	EXPECT_EQ(0, core->metrics.gen3_expansions);
+	EXPECT_EQ(0, core->metrics.gen3_contractions);
+}
+TEST_F(homa_offload, homa_gro_gen3_adapt__shrink)
+{
+	struct homa_core *core = homa_cores[cpu_number];
+	core->gen3_softirq_cores[0] = 3;
+	core->gen3_softirq_cores[1] = 7;
+	core->gen3_softirq_cores[2] = -1;
+	core->gen3_num_cores = 2;
+	core->gen3_last_adapt = 1000;
+	homa_cores[3]->metrics.softirq_cycles = 150;
+	homa_cores[7]->metrics.softirq_cycles = 100;
+	self->homa.gen3_shrink_pct = 30;
+
+	homa_gro_gen3_adapt(cpu_number, 2000);
+	EXPECT_EQ(1, core->gen3_num_cores);
+	EXPECT_EQ(1, core->metrics.gen3_contractions);
+
+	/* Next interval: still light, so collapse onto the GRO core. */
+	homa_cores[3]->metrics.softirq_cycles = 250;
+	homa_gro_gen3_adapt(cpu_number, 3000);
+	EXPECT_EQ(0, core->gen3_num_cores);
+	EXPECT_EQ(2, core->metrics.gen3_contractions);
+}
+
+TEST_F(homa_offload, homa_gen3_choose_cores__prefer_same_llc)
+{
+	int cores[NUM_GEN3_SOFTIRQ_CORES];
+	mock_cpu_llc[2] = 1;
+	mock_cpu_llc[3] = 1;
+	mock_cpu_llc[6] = 1;
+	mock_cpu_llc[7] = 1;
+
+	homa_gen3_choose_cores(1, -1, cores);
+	EXPECT_EQ(4, cores[0]);
+	EXPECT_EQ(2, cores[1]);
+	EXPECT_EQ(3, cores[2]);
+}
+TEST_F(homa_offload, homa_gen3_choose_cores__stay_on_numa_node)
+{
+	int cores[NUM_GEN3_SOFTIRQ_CORES];
+	mock_cpu_llc[2] = mock_cpu_node[2] = 1;
+	mock_cpu_llc[3] = mock_cpu_node[3] = 1;
+	mock_cpu_llc[6] = mock_cpu_node[6] = 1;
+	mock_cpu_llc[7] = mock_cpu_node[7] = 1;
+
+	homa_gen3_choose_cores(1, -1, cores);
+	EXPECT_EQ(4, cores[0]);
+	EXPECT_EQ(-1, cores[1]);
+	EXPECT_EQ(-1, cores[2]);
+}
+TEST_F(homa_offload, homa_gen3_choose_cores__skip_offline_and_excluded)
+{
+	int cores[NUM_GEN3_SOFTIRQ_CORES];
+	mock_cpu_phys[2] = -1;
+
+	homa_gen3_choose_cores(1, 3, cores);
+	EXPECT_EQ(4, cores[0]);
+	EXPECT_EQ(6, cores[1]);
+	EXPECT_EQ(7, cores[2]);
+}
+TEST_F(homa_offload, homa_gen3_choose_cores__no_candidates)
+{
+	int cores[NUM_GEN3_SOFTIRQ_CORES];
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		if (i != 5)
+			mock_cpu_llc[i] = mock_cpu_node[i] = 1;
+	}
+	homa_gen3_choose_cores(5, -1, cores);
+	EXPECT_EQ(5, cores[0]);
+	EXPECT_EQ(-1, cores[1]);
+	EXPECT_EQ(-1, cores[2]);
+}
+
+TEST_F(homa_offload, homa_gen3_default_cores)
+{
+	/* homa_init already computed defaults. */
+	EXPECT_EQ(2, homa_cores[1]->gen3_softirq_cores[0]);
+	EXPECT_EQ(3, homa_cores[1]->gen3_softirq_cores[1]);
+	EXPECT_EQ(4, homa_cores[1]->gen3_softirq_cores[2]);
+	EXPECT_EQ(0, homa_cores[7]->gen3_softirq_cores[0]);
+	EXPECT_EQ(1, homa_cores[7]->gen3_softirq_cores[1]);
+	EXPECT_EQ(2, homa_cores[7]->gen3_softirq_cores[2]);
+
+	homa_gen3_default_cores(2);
+	EXPECT_EQ(3, homa_cores[1]->gen3_softirq_cores[0]);
+	EXPECT_EQ(4, homa_cores[1]->gen3_softirq_cores[1]);
+	EXPECT_EQ(6, homa_cores[1]->gen3_softirq_cores[2]);
+}
+
+TEST_F(homa_offload, homa_offload_cpu_offline)
+{
+	homa_offload_cpu_offline(3);
+	EXPECT_EQ(2, homa_cores[1]->gen3_softirq_cores[0]);
+	EXPECT_EQ(4, homa_cores[1]->gen3_softirq_cores[1]);
+	EXPECT_EQ(7, homa_cores[1]->gen3_softirq_cores[2]);
+
+	/* Cores were set explicitly, so don't recompute. */
+	homa->gen3_auto_cores = 0;
+	homa_cores[1]->gen3_softirq_cores[0] = 6;
+	homa_offload_cpu_online(3);
+	EXPECT_EQ(6, homa_cores[1]->gen3_softirq_cores[0]);
+}
+
+TEST_F(homa_offload, homa_rfs_choose_core__smt_sibling)
+{
+	EXPECT_EQ(5, homa_rfs_choose_core(1, -1));
+	EXPECT_EQ(2, homa_rfs_choose_core(6, -1));
+}
+TEST_F(homa_offload, homa_rfs_choose_core__same_llc)
+{
+	mock_cpu_llc[2] = 1;
+	mock_cpu_llc[6] = 1;
+	EXPECT_EQ(3, homa_rfs_choose_core(1, 5));
+}
+TEST_F(homa_offload, homa_rfs_choose_core__no_options)
+{
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		if (i != 1)
+			mock_cpu_llc[i] = 1;
+	}
+	mock_cpu_phys[5] = -1;
+	EXPECT_EQ(1, homa_rfs_choose_core(1, -1));
+}
+
+TEST_F(homa_offload, homa_rfs_default_cores)
+{
+	/* homa_init already computed defaults. */
+	EXPECT_EQ(5, homa_cores[1]->rfs_core);
+	EXPECT_EQ(3, homa_cores[7]->rfs_core);
+
+	homa_offload_cpu_offline(5);
+	EXPECT_EQ(2, homa_cores[1]->rfs_core);
+}
+
+TEST_F(homa_offload, homa_gro_rfs__basics)
+{
+	struct data_header *h = (struct data_header *)
+			skb_transport_header(self->skb);
+	homa->gro_policy = HOMA_GRO_GEN3|HOMA_GRO_RFS;
+	h->common.sender_id = cpu_to_be64(1235);
+	homa_rfs_record(homa, 1234, 3);
+	mock_cycles = 5000;
+
+	homa_gro_complete(self->skb, 0);
+	EXPECT_EQ(7, self->skb->hash - 32);
+	EXPECT_EQ(5000, homa_cores[7]->last_active);
+	EXPECT_EQ(1, atomic_read(&homa_cores[7]->softirq_backlog));
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.rfs_handoffs);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.gen3_handoffs);
+}
+TEST_F(homa_offload, homa_gro_rfs__server_rpc)
+{
+	homa->gro_policy = HOMA_GRO_GEN3|HOMA_GRO_RFS;
+	homa_rfs_record(homa, 1001, 3);
+
+	/* The fixture's packet is a request (local id 1001). */
+	homa_gro_complete(self->skb, 0);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.rfs_handoffs);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.gen3_handoffs);
+}
+TEST_F(homa_offload, homa_gro_rfs__no_thread_waiting)
+{
+	struct data_header *h = (struct data_header *)
+			skb_transport_header(self->skb);
+	homa->gro_policy = HOMA_GRO_GEN3|HOMA_GRO_RFS;
+	h->common.sender_id = cpu_to_be64(1235);
+
+	homa_gro_complete(self->skb, 0);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.rfs_handoffs);
+
+	/* Entry is for a different RPC that hashes to the same slot. */
+	homa_rfs_record(homa, 1234 + 2*HOMA_RFS_ENTRIES, 3);
+	homa_gro_complete(self->skb, 0);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.rfs_handoffs);
+	EXPECT_EQ(2, homa_cores[cpu_number]->metrics.gen3_handoffs);
+}
 TEST_F(homa_offload, homa_gro_gen3__all_cores_busy_so_pick_first)
 {
 	homa->gro_policy = HOMA_GRO_GEN3;
@@ -405,6 +978,21 @@ TEST_F(homa_offload, homa_gro_gen3__all_cores_busy_so_pick_first)
 	EXPECT_EQ(5000, homa_cores[3]->last_active);
 }
 
+TEST_F(homa_offload, homa_gro_complete__busy_poller)
+{
+	homa->gro_policy = HOMA_GRO_IDLE;
+	homa_cores[6]->last_active = 30;
+	homa_cores[7]->last_active = 25;
+	homa_cores[0]->last_active = 20;
+	homa_cores[1]->last_active = 15;
+	homa_cores[2]->last_active = 10;
+	cpu_number = 5;
+	homa_cores[5]->busy_poller = &mock_task;
+	homa_gro_complete(self->skb, 0);
+	EXPECT_EQ(5, self->skb->hash - 32);
+	homa_cores[5]->busy_poller = NULL;
+}
+
 TEST_F(homa_offload, homa_gro_complete__GRO_IDLE)
 {
 	homa->gro_policy = HOMA_GRO_IDLE;
@@ -427,3 +1015,23 @@ TEST_F(homa_offload, homa_gro_complete__GRO_IDLE)
 	homa_gro_complete(self->skb, 0);
 	EXPECT_EQ(2, self->skb->hash - 32);
 }
+TEST_F(homa_offload, homa_gro_complete__move_backlog_when_resteered)
+{
+	homa->gro_policy = HOMA_GRO_IDLE;
+	homa_cores[6]->last_active = 30;
+	homa_cores[7]->last_active = 25;
+	homa_cores[0]->last_active = 20;
+	homa_cores[1]->last_active = 15;
+	homa_cores[2]->last_active = 10;
+
+	cpu_number = 5;
+	homa_gro_complete(self->skb, 0);
+	EXPECT_EQ(1, self->skb->hash - 32);
+	EXPECT_EQ(1, atomic_read(&homa_cores[1]->softirq_backlog));
+
+	homa_cores[6]->last_active = 5;
+	homa_gro_complete(self->skb, 0);
+	EXPECT_EQ(6, self->skb->hash - 32);
+	EXPECT_EQ(0, atomic_read(&homa_cores[1]->softirq_backlog));
+	EXPECT_EQ(1, atomic_read(&homa_cores[6]->softirq_backlog));
+}
@@ -76,6 +76,8 @@ TEST_F(homa_outgoing, set_priority__priority_mapping)
 	h.offset = htonl(12345);
 	h.priority = 4;
 	h.resend_all = 0;
+	h.num_extra = 0;
+	h.num_acks = 0;
 	EXPECT_EQ(0, homa_xmit_control(GRANT, &h, sizeof(h), srpc));
 	self->homa.priority_map[7] = 3;
 	EXPECT_EQ(0, homa_xmit_control(GRANT, &h, sizeof(h), srpc));
@@ -92,7 +94,7 @@ TEST_F(homa_outgoing, homa_message_out_init__basics)
 	homa_rpc_unlock(crpc);
 	EXPECT_EQ(3000, crpc->msgout.granted);
 	EXPECT_EQ(1, unit_list_length(&self->hsk.active_rpcs));
-	EXPECT_STREQ("mtu 1500, max_pkt_data 1400, gso_size 1500, "
+	EXPECT_STREQ("mtu 1504, max_pkt_data 1400, gso_size 1504, "
 			"gso_pkt_data 1400; "
 			"_copy_from_iter 1400 bytes at 1000; "
 			"_copy_from_iter 1400 bytes at 2400; "
@@ -169,7 +171,7 @@ TEST_F(homa_outgoing, homa_message_out_init__max_gso_size_limit)
 	ASSERT_EQ(0, -homa_message_out_init(crpc1,
 			unit_iov_iter((void *) 1000, 5000), 0));
 	homa_rpc_unlock(crpc1);
-	EXPECT_SUBSTR("gso_size 8600, gso_pkt_data 8400;", unit_log_get());
+	EXPECT_SUBSTR("gso_size 8604, gso_pkt_data 8400;", unit_log_get());
 
 	// Second RPC: limited by homa.gso_max_size.
 	self->homa.max_gso_size = 3000;
@@ -180,7 +182,7 @@ TEST_F(homa_outgoing, homa_message_out_init__max_gso_size_limit)
 	ASSERT_EQ(0, -homa_message_out_init(crpc2,
 			unit_iov_iter((void *) 1000, 5000), 0));
 	homa_rpc_unlock(crpc2);
-	EXPECT_SUBSTR("gso_size 2920, gso_pkt_data 2800;", unit_log_get());
+	EXPECT_SUBSTR("gso_size 2924, gso_pkt_data 2800;", unit_log_get());
 }
 TEST_F(homa_outgoing, homa_message_out_init__gso_limit_less_than_mtu)
 {
@@ -193,7 +195,7 @@ TEST_F(homa_outgoing, homa_message_out_init__gso_limit_less_than_mtu)
 	ASSERT_EQ(0, -homa_message_out_init(crpc,
 			unit_iov_iter((void *) 1000, 5000), 0));
 	homa_rpc_unlock(crpc);
-	EXPECT_SUBSTR("gso_size 1500, gso_pkt_data 1400;", unit_log_get());
+	EXPECT_SUBSTR("gso_size 1504, gso_pkt_data 1400;", unit_log_get());
 }
 TEST_F(homa_outgoing, homa_message_out_init__packet_header)
 {
@@ -218,6 +220,99 @@ TEST_F(homa_outgoing, homa_message_out_init__packet_header)
 					crpc->msgout.packets)->next_skb,
 					buffer, sizeof(buffer)));
 }
+TEST_F(homa_outgoing, homa_message_out_init__request_carries_resp_incoming)
+{
+	struct homa_rpc *crpc = homa_rpc_new_client(&self->hsk,
+			&self->server_addr);
+	ASSERT_FALSE(crpc == NULL);
+	crpc->resp_incoming = 25000;
+	ASSERT_EQ(0, -homa_message_out_init(crpc,
+			unit_iov_iter((void *) 1000, 500), 0));
+	homa_rpc_unlock(crpc);
+	char buffer[1000];
+	EXPECT_STREQ("DATA from 0.0.0.0:40000, dport 99, id 2, "
+			"message_length 500, offset 0, data_length 500, "
+			"incoming 500, resp_incoming 25000",
+			homa_print_packet(crpc->msgout.packets, buffer,
+			sizeof(buffer)));
+}
+TEST_F(homa_outgoing, homa_message_out_init__pregranted_response)
+{
+	struct homa_rpc *srpc;
+
+	self->homa.grant_window = 30000;
+	srpc = unit_server_rpc(&self->hsk, UNIT_IN_SERVICE, self->client_ip,
+		self->server_ip, self->client_port, self->server_id, 100, 100);
+	ASSERT_NE(NULL, srpc);
+	srpc->resp_incoming = 25000;
+	ASSERT_EQ(0, -homa_message_out_init(srpc,
+			unit_iov_iter((void *) 1000, 40000), 0));
+	EXPECT_EQ(25000, srpc->msgout.unscheduled);
+	EXPECT_EQ(25000, srpc->msgout.granted);
+
+	/* The pregrant must never exceed the message length. */
+	homa_rpc_free(srpc);
+	srpc = unit_server_rpc(&self->hsk, UNIT_IN_SERVICE, self->client_ip,
+		self->server_ip, self->client_port, self->server_id+2, 100, 100);
+	ASSERT_NE(NULL, srpc);
+	srpc->resp_incoming = 25000;
+	ASSERT_EQ(0, -homa_message_out_init(srpc,
+			unit_iov_iter((void *) 1000, 20000), 0));
+	EXPECT_EQ(20000, srpc->msgout.unscheduled);
+}
+TEST_F(homa_outgoing, homa_message_out_init__limit_pregranted_response)
+{
+	struct homa_rpc *srpc;
+
+	self->homa.grant_window = 30000;
+	srpc = unit_server_rpc(&self->hsk, UNIT_IN_SERVICE, self->client_ip,
+		self->server_ip, self->client_port, self->server_id, 100, 100);
+	ASSERT_NE(NULL, srpc);
+	srpc->resp_incoming = 500000;
+	ASSERT_EQ(0, -homa_message_out_init(srpc,
+			unit_iov_iter((void *) 1000, 100000), 0));
+	EXPECT_EQ(30000, srpc->msgout.unscheduled);
+
+	homa_rpc_free(srpc);
+	self->homa.max_incoming = 20000;
+	srpc = unit_server_rpc(&self->hsk, UNIT_IN_SERVICE, self->client_ip,
+		self->server_ip, self->client_port, self->server_id+2, 100, 100);
+	ASSERT_NE(NULL, srpc);
+	srpc->resp_incoming = 500000;
+	ASSERT_EQ(0, -homa_message_out_init(srpc,
+			unit_iov_iter((void *) 1000, 100000), 0));
+	EXPECT_EQ(20000, srpc->msgout.unscheduled);
+}
+TEST_F(homa_outgoing, homa_message_out_init__unsched_bytes_from_rtt)
+{
+	struct homa_rpc *crpc = homa_rpc_new_client(&self->hsk,
+			&self->server_addr);
+	ASSERT_FALSE(crpc == NULL);
+	self->homa.unsched_bytes = 10000;
+	self->homa.rtt_adaptive = 1;
+	crpc->peer->rtt_bytes = 5000;
+	ASSERT_EQ(0, -homa_message_out_init(crpc,
+			unit_iov_iter((void *) 1000, 20000), 0));
+	homa_rpc_unlock(crpc);
+	EXPECT_EQ(5000, crpc->msgout.unscheduled);
+	EXPECT_EQ(5000, crpc->msgout.granted);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.rtt_unsched_msgs);
+	EXPECT_EQ(5000, homa_cores[cpu_number]->metrics.rtt_unsched_bytes);
+}
+TEST_F(homa_outgoing, homa_message_out_init__no_rtt_estimate)
+{
+	struct homa_rpc *crpc = homa_rpc_new_client(&self->hsk,
+			&self->server_addr);
+	ASSERT_FALSE(crpc == NULL);
+	self->homa.unsched_bytes = 10000;
+	self->homa.rtt_adaptive = 1;
+	crpc->peer->rtt_bytes = 0;
+	ASSERT_EQ(0, -homa_message_out_init(crpc,
+			unit_iov_iter((void *) 1000, 20000), 0));
+	homa_rpc_unlock(crpc);
+	EXPECT_EQ(10000, crpc->msgout.unscheduled);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.rtt_unsched_msgs);
+}
 TEST_F(homa_outgoing, homa_message_out_init__compute_skb_length)
 {
 	mock_net_device.gso_max_size = 3000;
@@ -405,6 +500,8 @@ TEST_F(homa_outgoing, homa_xmit_control__server_request)
 	h.offset = htonl(12345);
 	h.priority = 4;
 	h.resend_all = 0;
+	h.num_extra = 0;
+	h.num_acks = 0;
 	h.common.sender_id = cpu_to_be64(self->client_id);
 	mock_xmit_log_verbose = 1;
 	EXPECT_EQ(0, homa_xmit_control(GRANT, &h, sizeof(h), srpc));
@@ -427,6 +524,8 @@ TEST_F(homa_outgoing, homa_xmit_control__client_response)
 	h.offset = htonl(12345);
 	h.priority = 4;
 	h.resend_all = 0;
+	h.num_extra = 0;
+	h.num_acks = 0;
 	mock_xmit_log_verbose = 1;
 	EXPECT_EQ(0, homa_xmit_control(GRANT, &h, sizeof(h), crpc));
 	EXPECT_STREQ("xmit GRANT from 0.0.0.0:40000, dport 99, id 1234, "
@@ -449,6 +548,8 @@ TEST_F(homa_outgoing, __homa_xmit_control__cant_alloc_skb)
 	h.offset = htonl(12345);
 	h.priority = 4;
 	h.resend_all = 0;
+	h.num_extra = 0;
+	h.num_acks = 0;
 	mock_xmit_log_verbose = 1;
 	mock_alloc_skb_errors = 1;
 	EXPECT_EQ(ENOBUFS, -__homa_xmit_control(&h, sizeof(h), srpc->peer,
@@ -469,6 +570,28 @@ TEST_F(homa_outgoing, __homa_xmit_control__pad_packet)
 			"xmit unknown packet type 0x0",
 			unit_log_get());
 }
+TEST_F(homa_outgoing, __homa_xmit_control__longer_than_max_header)
+{
+	struct homa_rpc *srpc;
+	struct ack_header h;
+	int i;
+
+	srpc = unit_server_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, self->client_ip,
+		self->server_ip, self->client_port, 1111, 10000, 10000);
+	ASSERT_NE(NULL, srpc);
+	for (i = 0; i < NUM_PEER_UNACKED_IDS; i++)
+		h.acks[i] = (struct homa_ack) {
+				.client_port = htons(1000 + i),
+				.server_port = htons(self->server_port),
+				.client_id = cpu_to_be64(100 + 2*i)};
+	h.num_acks = htons(NUM_PEER_UNACKED_IDS);
+	unit_log_clear();
+	mock_xmit_log_verbose = 1;
+	EXPECT_EQ(0, homa_xmit_control(ACK, &h, sizeof(h), srpc));
+	EXPECT_SUBSTR("acks [cp 1000, sp 99, id 100] [cp 1001, sp 99, id 102]",
+			unit_log_get());
+	EXPECT_SUBSTR("[cp 1031, sp 99, id 162]", unit_log_get());
+}
 TEST_F(homa_outgoing, __homa_xmit_control__ipv4_error)
 {
 	struct homa_rpc *srpc;
@@ -487,6 +610,8 @@ TEST_F(homa_outgoing, __homa_xmit_control__ipv4_error)
 	h.offset = htonl(12345);
 	h.priority = 4;
 	h.resend_all = 0;
+	h.num_extra = 0;
+	h.num_acks = 0;
 	mock_xmit_log_verbose = 1;
 	mock_ip_queue_xmit_errors = 1;
 	EXPECT_EQ(ENETDOWN, -homa_xmit_control(GRANT, &h, sizeof(h), srpc));
@@ -511,6 +636,8 @@ TEST_F(homa_outgoing, __homa_xmit_control__ipv6_error)
 	h.offset = htonl(12345);
 	h.priority = 4;
 	h.resend_all = 0;
+	h.num_extra = 0;
+	h.num_acks = 0;
 	mock_xmit_log_verbose = 1;
 	mock_ip6_xmit_errors = 1;
 	EXPECT_EQ(ENETDOWN, -homa_xmit_control(GRANT, &h, sizeof(h), srpc));
@@ -559,6 +686,38 @@ TEST_F(homa_outgoing, homa_xmit_data__basics)
 	unit_log_throttled(&self->homa);
 	EXPECT_STREQ("", unit_log_get());
 }
+TEST_F(homa_outgoing, homa_xmit_data__start_rtt_probe)
+{
+	struct homa_rpc *crpc = homa_rpc_new_client(&self->hsk,
+			&self->server_addr);
+	ASSERT_FALSE(crpc == NULL);
+	self->homa.unsched_bytes = 10000;
+	ASSERT_EQ(0, -homa_message_out_init(crpc,
+			unit_iov_iter((void *) 1000, 20000), 0));
+	mock_cycles = 5000;
+	homa_xmit_data(crpc, false);
+	EXPECT_EQ(5000, crpc->msgout.rtt_probe_cycles);
+
+	/* Later transmissions don't restart the probe. */
+	mock_cycles = 8000;
+	crpc->msgout.granted = 15000;
+	homa_xmit_data(crpc, false);
+	homa_rpc_unlock(crpc);
+	EXPECT_EQ(5000, crpc->msgout.rtt_probe_cycles);
+}
+TEST_F(homa_outgoing, homa_xmit_data__no_rtt_probe_for_unscheduled_message)
+{
+	struct homa_rpc *crpc = homa_rpc_new_client(&self->hsk,
+			&self->server_addr);
+	ASSERT_FALSE(crpc == NULL);
+	self->homa.unsched_bytes = 10000;
+	ASSERT_EQ(0, -homa_message_out_init(crpc,
+			unit_iov_iter((void *) 1000, 5000), 0));
+	mock_cycles = 5000;
+	homa_xmit_data(crpc, false);
+	homa_rpc_unlock(crpc);
+	EXPECT_EQ(0, crpc->msgout.rtt_probe_cycles);
+}
 TEST_F(homa_outgoing, homa_xmit_data__stop_because_no_more_granted)
 {
 	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
@@ -791,7 +950,7 @@ TEST_F(homa_outgoing, homa_resend_data__set_homa_info)
 	mock_xmit_log_homa_info = 1;
 	homa_resend_data(crpc, 8400, 8800, 2);
 	EXPECT_STREQ("xmit DATA retrans 1400@8400; "
-			"homa_info: wire_bytes 1542, data_bytes 1400",
+			"homa_info: wire_bytes 1546, data_bytes 1400",
 			unit_log_get());
 }
 TEST_F(homa_outgoing, homa_resend_data__advance_next_xmit)
@@ -1170,6 +1329,26 @@ TEST_F(homa_outgoing, homa_add_to_throttled__inc_metrics)
 	EXPECT_EQ(3, homa_cores[cpu_number]->metrics.throttle_list_adds);
 	EXPECT_EQ(3, homa_cores[cpu_number]->metrics.throttle_list_checks);
 }
+TEST_F(homa_outgoing, homa_add_to_throttled__engine_running)
+{
+	struct homa_rpc *crpc1 = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 5000, 1000);
+	struct homa_rpc *crpc2 = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id+2, 10000, 1000);
+
+	unit_log_clear();
+	homa_add_to_throttled(crpc1);
+	EXPECT_STREQ("wake_up_process pid -1", unit_log_get());
+
+	/* Engine thread runs the pacer, so don't wake the pacer thread. */
+	self->homa.engine_kthread = &mock_task;
+	unit_log_clear();
+	homa_add_to_throttled(crpc2);
+	EXPECT_STREQ("", unit_log_get());
+	self->homa.engine_kthread = NULL;
+}
 
 TEST_F(homa_outgoing, homa_remove_from_throttled)
 {
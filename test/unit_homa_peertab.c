@@ -323,14 +323,14 @@ TEST_F(homa_peertab, homa_peer_lock_slow)
 			&self->hsk.inet);
 	ASSERT_NE(NULL, peer);
 
-	homa_peer_lock(peer);
+	homa_peer_lock(peer, "unit test");
 	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.peer_ack_lock_misses);
 	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.peer_ack_lock_miss_cycles);
 	homa_peer_unlock(peer);
 
 	mock_trylock_errors = 1;
 	unit_hook_register(peer_spinlock_hook);
-	homa_peer_lock(peer);
+	homa_peer_lock(peer, "unit test");
 	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.peer_ack_lock_misses);
 	EXPECT_EQ(1000, homa_cores[cpu_number]->metrics.peer_ack_lock_miss_cycles);
 	homa_peer_unlock(peer);
@@ -348,45 +348,182 @@ TEST_F(homa_peertab, homa_peer_add_ack)
 		self->client_ip, self->server_ip, self->server_port,
 		103, 100, 100);
 	struct homa_peer *peer = crpc1->peer;
+	int i;
 	EXPECT_EQ(0, peer->num_acks);
 
-	/* Initialize 3 acks in the peer. */
-	peer->acks[0] = (struct homa_ack) {
-			.client_port = htons(1000),
-			.server_port = htons(self->server_port),
-			.client_id = cpu_to_be64(90)};
-	peer->acks[1] = (struct homa_ack) {
-			.client_port = htons(1001),
-			.server_port = htons(self->server_port),
-			.client_id = cpu_to_be64(91)};
-	peer->acks[2] = (struct homa_ack) {
-			.client_port = htons(1002),
-			.server_port = htons(self->server_port),
-			.client_id = cpu_to_be64(92)};
-	peer->num_acks = 3;
+	/* Fill the peer except for its last 2 slots. */
+	for (i = 0; i < NUM_PEER_UNACKED_IDS - 2; i++)
+		peer->acks[i] = (struct homa_ack) {
+				.client_port = htons(1000 + i),
+				.server_port = htons(self->server_port),
+				.client_id = cpu_to_be64(90 + 2*i)};
+	peer->num_acks = NUM_PEER_UNACKED_IDS - 2;
 
 	/* Add one RPC to unacked (fits). */
 	homa_peer_add_ack(crpc1);
-	EXPECT_EQ(4, peer->num_acks);
+	EXPECT_EQ(NUM_PEER_UNACKED_IDS - 1, peer->num_acks);
 	EXPECT_STREQ("client_port 32768, server_port 99, client_id 101",
-			unit_ack_string(&peer->acks[3]));
+			unit_ack_string(&peer->acks[NUM_PEER_UNACKED_IDS - 2]));
 
 	/* Add another RPC to unacked (also fits). */
 	homa_peer_add_ack(crpc2);
-	EXPECT_EQ(5, peer->num_acks);
+	EXPECT_EQ(NUM_PEER_UNACKED_IDS, peer->num_acks);
 	EXPECT_STREQ("client_port 32768, server_port 99, client_id 102",
-			unit_ack_string(&peer->acks[4]));
+			unit_ack_string(&peer->acks[NUM_PEER_UNACKED_IDS - 1]));
 
 	/* Third RPC overflows, triggers ACK transmission. */
 	unit_log_clear();
 	mock_xmit_log_verbose = 1;
 	homa_peer_add_ack(crpc3);
 	EXPECT_EQ(0, peer->num_acks);
-	EXPECT_STREQ("xmit ACK from 0.0.0.0:32768, dport 99, id 103, acks "
-			"[cp 1000, sp 99, id 90] [cp 1001, sp 99, id 91] "
-			"[cp 1002, sp 99, id 92] [cp 32768, sp 99, id 101] "
-			"[cp 32768, sp 99, id 102]",
-			unit_log_get());
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.ack_overflows);
+	EXPECT_SUBSTR("xmit ACK from 0.0.0.0:32768, dport 99, id 103, acks "
+			"[cp 1000, sp 99, id 90] [cp 1001, sp 99, id 92] "
+			"[cp 1002, sp 99, id 94]", unit_log_get());
+	EXPECT_SUBSTR("[cp 32768, sp 99, id 101] "
+			"[cp 32768, sp 99, id 102]", unit_log_get());
+}
+
+TEST_F(homa_peertab, homa_peer_add_rtt__first_sample)
+{
+	struct homa_peer *peer = homa_peer_find(&self->peertab, ip1111,
+			&self->hsk.inet);
+	ASSERT_NE(NULL, peer);
+	EXPECT_EQ(0, peer->srtt_cycles);
+	EXPECT_EQ(0, peer->rtt_bytes);
+
+	self->homa.cycles_per_kbyte = 500;
+	homa_peer_add_rtt(&self->homa, peer, 8000);
+	EXPECT_EQ(8000, peer->srtt_cycles);
+	EXPECT_EQ(16000, peer->rtt_bytes);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.peer_rtt_latency[
+			homa_latency_bucket(8000)]);
+}
+TEST_F(homa_peertab, homa_peer_add_rtt__smoothing)
+{
+	struct homa_peer *peer = homa_peer_find(&self->peertab, ip1111,
+			&self->hsk.inet);
+	ASSERT_NE(NULL, peer);
+
+	self->homa.cycles_per_kbyte = 1000;
+	homa_peer_add_rtt(&self->homa, peer, 8000);
+	homa_peer_add_rtt(&self->homa, peer, 4000);
+	EXPECT_EQ(7500, peer->srtt_cycles);
+	EXPECT_EQ(7500, peer->rtt_bytes);
+	homa_peer_add_rtt(&self->homa, peer, 14700);
+	EXPECT_EQ(8400, peer->srtt_cycles);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.peer_rtt_clamped);
+}
+TEST_F(homa_peertab, homa_peer_add_rtt__clamp_large_sample)
+{
+	struct homa_peer *peer = homa_peer_find(&self->peertab, ip1111,
+			&self->hsk.inet);
+	ASSERT_NE(NULL, peer);
+
+	self->homa.cycles_per_kbyte = 1000;
+	self->homa.unsched_bytes = 8000;
+	homa_peer_add_rtt(&self->homa, peer, 1000);
+	homa_peer_add_rtt(&self->homa, peer, 50000);
+	EXPECT_EQ(1125, peer->srtt_cycles);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.peer_rtt_clamped);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.peer_rtt_latency[
+			homa_latency_bucket(50000)]);
+}
+TEST_F(homa_peertab, homa_peer_add_rtt__first_sample_above_configured_range)
+{
+	struct homa_peer *peer = homa_peer_find(&self->peertab, ip1111,
+			&self->hsk.inet);
+	ASSERT_NE(NULL, peer);
+
+	self->homa.cycles_per_kbyte = 1000;
+	self->homa.unsched_bytes = 10000;
+	homa_peer_add_rtt(&self->homa, peer, 1000000);
+	EXPECT_EQ(80000, peer->srtt_cycles);
+	EXPECT_EQ(80000, peer->rtt_bytes);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.peer_rtt_clamped);
+}
+TEST_F(homa_peertab, homa_peer_add_rtt__first_sample_below_configured_range)
+{
+	struct homa_peer *peer = homa_peer_find(&self->peertab, ip1111,
+			&self->hsk.inet);
+	ASSERT_NE(NULL, peer);
+
+	self->homa.cycles_per_kbyte = 1000;
+	self->homa.unsched_bytes = 10000;
+	homa_peer_add_rtt(&self->homa, peer, 100);
+	EXPECT_EQ(1250, peer->srtt_cycles);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.peer_rtt_clamped);
+
+	/* Later samples are clamped too. */
+	homa_peer_add_rtt(&self->homa, peer, 10);
+	EXPECT_EQ(1250, peer->srtt_cycles);
+	EXPECT_EQ(2, homa_cores[cpu_number]->metrics.peer_rtt_clamped);
+}
+TEST_F(homa_peertab, homa_peer_add_rtt__no_configured_rtt)
+{
+	struct homa_peer *peer = homa_peer_find(&self->peertab, ip1111,
+			&self->hsk.inet);
+	ASSERT_NE(NULL, peer);
+
+	self->homa.cycles_per_kbyte = 0;
+	homa_peer_add_rtt(&self->homa, peer, 100);
+	EXPECT_EQ(100, peer->srtt_cycles);
+	EXPECT_EQ(0, peer->rtt_bytes);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.peer_rtt_clamped);
+}
+TEST_F(homa_peertab, homa_peer_add_rtt__huge_first_sample)
+{
+	struct homa_peer *peer = homa_peer_find(&self->peertab, ip1111,
+			&self->hsk.inet);
+	ASSERT_NE(NULL, peer);
+
+	self->homa.cycles_per_kbyte = 1000000;
+	self->homa.unsched_bytes = 1000000;
+	homa_peer_add_rtt(&self->homa, peer, 1000000000000ULL);
+	EXPECT_EQ(INT_MAX/2, peer->srtt_cycles);
+	EXPECT_EQ(1073741, peer->rtt_bytes);
+}
+TEST_F(homa_peertab, homa_peer_unsched_bytes)
+{
+	struct homa_peer *peer = homa_peer_find(&self->peertab, ip1111,
+			&self->hsk.inet);
+	ASSERT_NE(NULL, peer);
+
+	self->homa.unsched_bytes = 10000;
+	self->homa.rtt_adaptive = 0;
+	peer->rtt_bytes = 20000;
+	EXPECT_EQ(10000, homa_peer_unsched_bytes(&self->homa, peer));
+	self->homa.rtt_adaptive = 1;
+	EXPECT_EQ(20000, homa_peer_unsched_bytes(&self->homa, peer));
+	peer->rtt_bytes = 0;
+	EXPECT_EQ(10000, homa_peer_unsched_bytes(&self->homa, peer));
+	peer->rtt_bytes = 100;
+	EXPECT_EQ(1250, homa_peer_unsched_bytes(&self->homa, peer));
+	peer->rtt_bytes = 200000;
+	EXPECT_EQ(80000, homa_peer_unsched_bytes(&self->homa, peer));
+}
+TEST_F(homa_peertab, homa_peer_grant_window)
+{
+	struct homa_peer *peer = homa_peer_find(&self->peertab, ip1111,
+			&self->hsk.inet);
+	ASSERT_NE(NULL, peer);
+
+	self->homa.window_param = 10000;
+	self->homa.grant_window = 5000;
+	self->homa.rtt_adaptive = 0;
+	peer->rtt_bytes = 30000;
+	EXPECT_EQ(5000, homa_peer_grant_window(&self->homa, peer));
+	self->homa.rtt_adaptive = 1;
+	EXPECT_EQ(30000, homa_peer_grant_window(&self->homa, peer));
+	peer->rtt_bytes = 500;
+	EXPECT_EQ(1250, homa_peer_grant_window(&self->homa, peer));
+	peer->rtt_bytes = 0;
+	EXPECT_EQ(5000, homa_peer_grant_window(&self->homa, peer));
+
+	/* Dynamic windows aren't affected by RTT. */
+	peer->rtt_bytes = 30000;
+	self->homa.window_param = 0;
+	EXPECT_EQ(5000, homa_peer_grant_window(&self->homa, peer));
 }
 
 TEST_F(homa_peertab, homa_peer_get_acks)
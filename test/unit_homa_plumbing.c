@@ -96,6 +96,7 @@ FIXTURE_SETUP(homa_plumbing)
 	self->sendmsg_hdr.msg_control_is_user = 1;
 	self->sendmsg_args.id = 0;
 	self->sendmsg_args.completion_cookie = 0;
+	self->sendmsg_args.response_length = 0;
 	self->optval.user = (void *) 0x100000;
 	self->optval.is_kernel = 0;
 	unit_log_clear();
@@ -260,18 +261,138 @@ TEST_F(homa_plumbing, homa_set_sock_opt__success)
 	struct homa_set_buf_args args;
 	char buffer[5000];
 
+	memset(&args, 0, sizeof(args));
 	args.start = (void *) (((__u64) (buffer + PAGE_SIZE - 1))
 			& ~(PAGE_SIZE - 1));
 	args.length = 64*HOMA_BPAGE_SIZE;
 	self->optval.user = &args;
-	homa_pool_destroy(&self->hsk.buffer_pool);
+	homa_pool_detach(&self->hsk);
 	EXPECT_EQ(0, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
 			SO_HOMA_SET_BUF, self->optval,
 			sizeof(struct homa_set_buf_args)));
-	EXPECT_EQ(args.start, self->hsk.buffer_pool.region);
-	EXPECT_EQ(64, self->hsk.buffer_pool.num_bpages);
+	EXPECT_EQ(args.start, self->hsk.buffer_pool->region);
+	EXPECT_EQ(64, self->hsk.buffer_pool->num_bpages);
 	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.so_set_buf_calls);
 }
+TEST_F(homa_plumbing, homa_set_sock_opt__response_length)
+{
+	int enable = 1;
+
+	self->optval.user = &enable;
+	EXPECT_EQ(EINVAL, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_RESPONSE_LENGTH, self->optval,
+			sizeof(enable) - 1));
+	EXPECT_FALSE(self->hsk.use_response_length);
+	mock_copy_data_errors = 1;
+	EXPECT_EQ(EFAULT, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_RESPONSE_LENGTH, self->optval, sizeof(enable)));
+	EXPECT_FALSE(self->hsk.use_response_length);
+	EXPECT_EQ(0, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_RESPONSE_LENGTH, self->optval, sizeof(enable)));
+	EXPECT_TRUE(self->hsk.use_response_length);
+	enable = 0;
+	EXPECT_EQ(0, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_RESPONSE_LENGTH, self->optval, sizeof(enable)));
+	EXPECT_FALSE(self->hsk.use_response_length);
+}
+TEST_F(homa_plumbing, homa_set_sock_opt__socket_already_has_pool)
+{
+	struct homa_pool *pool = self->hsk.buffer_pool;
+	struct homa_set_buf_args args;
+	char buffer[5000];
+
+	memset(&args, 0, sizeof(args));
+	args.start = (void *) (((__u64) (buffer + PAGE_SIZE - 1))
+			& ~(PAGE_SIZE - 1));
+	args.length = 64*HOMA_BPAGE_SIZE;
+	self->optval.user = &args;
+	EXPECT_EQ(EINVAL, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_SET_BUF, self->optval,
+			sizeof(struct homa_set_buf_args)));
+	EXPECT_EQ(pool, self->hsk.buffer_pool);
+	EXPECT_EQ(100, self->hsk.buffer_pool->num_bpages);
+}
+TEST_F(homa_plumbing, homa_set_sock_opt__bpage_size)
+{
+	struct homa_set_buf_args args;
+	char buffer[5000];
+
+	memset(&args, 0, sizeof(args));
+	args.start = (void *) (((__u64) (buffer + PAGE_SIZE - 1))
+			& ~(PAGE_SIZE - 1));
+	args.length = 64*HOMA_BPAGE_SIZE;
+	args.bpage_size = 4*HOMA_BPAGE_SIZE;
+	self->optval.user = &args;
+	homa_pool_detach(&self->hsk);
+	EXPECT_EQ(0, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_SET_BUF, self->optval,
+			sizeof(struct homa_set_buf_args)));
+	EXPECT_EQ(16, self->hsk.buffer_pool->num_bpages);
+	EXPECT_EQ(4*HOMA_BPAGE_SIZE, self->hsk.buffer_pool->bpage_size);
+}
+TEST_F(homa_plumbing, homa_set_sock_opt__args_without_bpage_size)
+{
+	struct homa_set_buf_args args;
+	char buffer[5000];
+
+	args.start = (void *) (((__u64) (buffer + PAGE_SIZE - 1))
+			& ~(PAGE_SIZE - 1));
+	args.length = 64*HOMA_BPAGE_SIZE;
+	args.bpage_size = 12345;
+	self->optval.user = &args;
+	homa_pool_detach(&self->hsk);
+	EXPECT_EQ(0, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_SET_BUF, self->optval,
+			offsetof(struct homa_set_buf_args, bpage_size)));
+	EXPECT_EQ(64, self->hsk.buffer_pool->num_bpages);
+	EXPECT_EQ(HOMA_BPAGE_SIZE, self->hsk.buffer_pool->bpage_size);
+}
+TEST_F(homa_plumbing, homa_set_sock_opt__share_buf_bad_length)
+{
+	int fd = 5;
+
+	self->optval.user = &fd;
+	EXPECT_EQ(EINVAL, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_SHARE_BUF, self->optval, sizeof(fd) + 1));
+}
+TEST_F(homa_plumbing, homa_set_sock_opt__share_buf_bad_fd)
+{
+	int fd = 5;
+
+	self->optval.user = &fd;
+	EXPECT_EQ(EBADF, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_SHARE_BUF, self->optval, sizeof(fd)));
+}
+TEST_F(homa_plumbing, homa_set_sock_opt__share_buf_not_homa_socket)
+{
+	struct homa_pool *pool = self->hsk.buffer_pool;
+	struct homa_sock hsk2;
+	int fd = 5;
+
+	mock_sock_init(&hsk2, &self->homa, 0);
+	hsk2.sock.sk_protocol = IPPROTO_TCP;
+	mock_sockfd_sk = &hsk2.sock;
+	self->optval.user = &fd;
+	EXPECT_EQ(EINVAL, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_SHARE_BUF, self->optval, sizeof(fd)));
+	EXPECT_EQ(pool, self->hsk.buffer_pool);
+	homa_sock_destroy(&hsk2);
+}
+TEST_F(homa_plumbing, homa_set_sock_opt__share_buf_success)
+{
+	struct homa_sock hsk2;
+	int fd = 5;
+
+	mock_sock_init(&hsk2, &self->homa, 0);
+	mock_sockfd_sk = &hsk2.sock;
+	self->optval.user = &fd;
+	homa_pool_detach(&self->hsk);
+	EXPECT_EQ(0, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_SHARE_BUF, self->optval, sizeof(fd)));
+	EXPECT_EQ(hsk2.buffer_pool, self->hsk.buffer_pool);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.so_set_buf_calls);
+	homa_sock_destroy(&hsk2);
+}
 
 TEST_F(homa_plumbing, homa_sendmsg__args_not_in_user_space)
 {
@@ -348,6 +469,46 @@ TEST_F(homa_plumbing, homa_sendmsg__request_sent_successfully)
 	EXPECT_EQ(88888, crpc->completion_cookie);
 	homa_rpc_unlock(crpc);
 }
+TEST_F(homa_plumbing, homa_sendmsg__request_with_response_length)
+{
+	struct homa_rpc *crpc;
+	self->hsk.use_response_length = true;
+	self->homa.grant_window = 30000;
+	self->sendmsg_args.response_length = 50000;
+	EXPECT_EQ(0, -homa_sendmsg(&self->hsk.inet.sk,
+		&self->sendmsg_hdr, self->sendmsg_hdr.msg_iter.count));
+	crpc = homa_find_client_rpc(&self->hsk, self->sendmsg_args.id);
+	ASSERT_NE(NULL, crpc);
+	EXPECT_EQ(30000, crpc->resp_incoming);
+	EXPECT_EQ(30000, atomic_read(&self->homa.total_incoming));
+	homa_rpc_unlock(crpc);
+}
+TEST_F(homa_plumbing, homa_sendmsg__response_length_not_enabled)
+{
+	struct homa_rpc *crpc;
+	self->homa.grant_window = 30000;
+	self->sendmsg_args.response_length = 50000;
+	EXPECT_EQ(0, -homa_sendmsg(&self->hsk.inet.sk,
+		&self->sendmsg_hdr, self->sendmsg_hdr.msg_iter.count));
+	crpc = homa_find_client_rpc(&self->hsk, self->sendmsg_args.id);
+	ASSERT_NE(NULL, crpc);
+	EXPECT_EQ(0, crpc->resp_incoming);
+	EXPECT_EQ(0, atomic_read(&self->homa.total_incoming));
+	homa_rpc_unlock(crpc);
+}
+TEST_F(homa_plumbing, homa_sendmsg__response_length_too_large)
+{
+	struct homa_rpc *crpc;
+	self->hsk.use_response_length = true;
+	self->homa.grant_window = 30000;
+	self->sendmsg_args.response_length = 0xffffffff;
+	EXPECT_EQ(0, -homa_sendmsg(&self->hsk.inet.sk,
+		&self->sendmsg_hdr, self->sendmsg_hdr.msg_iter.count));
+	crpc = homa_find_client_rpc(&self->hsk, self->sendmsg_args.id);
+	ASSERT_NE(NULL, crpc);
+	EXPECT_EQ(30000, crpc->resp_incoming);
+	homa_rpc_unlock(crpc);
+}
 TEST_F(homa_plumbing, homa_sendmsg__response_nonzero_completion_cookie)
 {
 	struct homa_rpc *srpc = unit_server_rpc(&self->hsk, UNIT_IN_SERVICE,
@@ -476,18 +637,18 @@ TEST_F(homa_plumbing, homa_recvmsg__bogus_flags)
 }
 TEST_F(homa_plumbing, homa_recvmsg__release_buffers)
 {
-	EXPECT_EQ(0, -homa_pool_get_pages(&self->hsk.buffer_pool, 2,
-			self->recvmsg_args.bpage_offsets, 0));
-	EXPECT_EQ(1, atomic_read(&self->hsk.buffer_pool.descriptors[0].refs));
-	EXPECT_EQ(1, atomic_read(&self->hsk.buffer_pool.descriptors[1].refs));
+	EXPECT_EQ(0, -homa_pool_get_pages(self->hsk.buffer_pool, 2,
+			self->recvmsg_args.bpage_offsets, 0, -1));
+	EXPECT_EQ(1, atomic_read(self->hsk.buffer_pool->descriptors[0].refs));
+	EXPECT_EQ(1, atomic_read(self->hsk.buffer_pool->descriptors[1].refs));
 	self->recvmsg_args.num_bpages = 2;
 	self->recvmsg_args.bpage_offsets[0] = 0;
 	self->recvmsg_args.bpage_offsets[1] = HOMA_BPAGE_SIZE;
 
 	EXPECT_EQ(EAGAIN, -homa_recvmsg(&self->hsk.inet.sk, &self->recvmsg_hdr,
 			0, 0, &self->recvmsg_hdr.msg_namelen));
-	EXPECT_EQ(0, atomic_read(&self->hsk.buffer_pool.descriptors[0].refs));
-	EXPECT_EQ(0, atomic_read(&self->hsk.buffer_pool.descriptors[1].refs));
+	EXPECT_EQ(0, atomic_read(self->hsk.buffer_pool->descriptors[0].refs));
+	EXPECT_EQ(0, atomic_read(self->hsk.buffer_pool->descriptors[1].refs));
 }
 TEST_F(homa_plumbing, homa_recvmsg__error_in_homa_wait_for_message)
 {
@@ -505,7 +666,8 @@ TEST_F(homa_plumbing, homa_recvmsg__normal_completion_ipv4)
 	mock_sock_init(&self->hsk, &self->homa, 0);
 	__u32 pages[2];
 
-	EXPECT_EQ(0, -homa_pool_get_pages(&self->hsk.buffer_pool, 2, pages, 0));
+	EXPECT_EQ(0, -homa_pool_get_pages(self->hsk.buffer_pool, 2, pages, 0,
+			-1));
 	struct homa_rpc *crpc = unit_client_rpc(&self->hsk, UNIT_RCVD_MSG,
 			self->client_ip, self->server_ip, self->server_port,
 			self->client_id, 100, 2000);
@@ -591,6 +753,57 @@ TEST_F(homa_plumbing, homa_recvmsg__add_ack)
 			0, 0, &self->recvmsg_hdr.msg_namelen));
 	EXPECT_EQ(1, crpc->peer->num_acks);
 }
+TEST_F(homa_plumbing, homa_recvmsg__record_client_latency)
+{
+	mock_cycles = 1000;
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk, UNIT_RCVD_MSG,
+			self->client_ip, self->server_ip, self->server_port,
+			self->client_id, 20000, 2000);
+	EXPECT_NE(NULL, crpc);
+
+	mock_cycles = 6000;
+	EXPECT_EQ(2000, homa_recvmsg(&self->hsk.inet.sk, &self->recvmsg_hdr,
+			0, 0, &self->recvmsg_hdr.msg_namelen));
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.client_rpc_latency[2][8]);
+}
+TEST_F(homa_plumbing, homa_recvmsg__record_server_latency)
+{
+	mock_cycles = 1000;
+	struct homa_rpc *srpc = unit_server_rpc(&self->hsk, UNIT_RCVD_MSG,
+			self->client_ip, self->server_ip, self->client_port,
+		        self->server_id, 100, 200);
+	EXPECT_NE(NULL, srpc);
+
+	mock_cycles = 3048;
+	EXPECT_EQ(100, homa_recvmsg(&self->hsk.inet.sk, &self->recvmsg_hdr,
+			0, 0, &self->recvmsg_hdr.msg_namelen));
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.server_rpc_latency[0][4]);
+}
+TEST_F(homa_plumbing, homa_recvmsg__dont_record_latency_after_error)
+{
+	struct homa_rpc *srpc = unit_server_rpc(&self->hsk, UNIT_RCVD_MSG,
+			self->client_ip, self->server_ip, self->client_port,
+		        self->server_id, 100, 200);
+	EXPECT_NE(NULL, srpc);
+	srpc->error = -ENOMEM;
+
+	EXPECT_EQ(ENOMEM, -homa_recvmsg(&self->hsk.inet.sk, &self->recvmsg_hdr,
+			0, 0, &self->recvmsg_hdr.msg_namelen));
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.server_rpc_latency[0][0]);
+}
+TEST_F(homa_plumbing, homa_recvmsg__record_wakeup_latency)
+{
+	struct homa_rpc *srpc = unit_server_rpc(&self->hsk, UNIT_RCVD_MSG,
+			self->client_ip, self->server_ip, self->client_port,
+		        self->server_id, 100, 200);
+	EXPECT_NE(NULL, srpc);
+
+	mock_cycles = 3000;
+	EXPECT_EQ(100, homa_recvmsg(&self->hsk.inet.sk, &self->recvmsg_hdr,
+			0, 0, &self->recvmsg_hdr.msg_namelen));
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.wakeup_recvmsg_latency[0]);
+	EXPECT_EQ(0, srpc->wakeup_cycles);
+}
 TEST_F(homa_plumbing, homa_recvmsg__server_normal_completion)
 {
 	struct homa_rpc *srpc = unit_server_rpc(&self->hsk, UNIT_RCVD_MSG,
@@ -635,10 +848,10 @@ TEST_F(homa_plumbing, homa_recvmsg__error_copying_out_args)
 }
 TEST_F(homa_plumbing, homa_recvmsg__copy_back_args_even_after_error)
 {
-	EXPECT_EQ(0, -homa_pool_get_pages(&self->hsk.buffer_pool, 2,
-			self->recvmsg_args.bpage_offsets, 0));
-	EXPECT_EQ(1, atomic_read(&self->hsk.buffer_pool.descriptors[0].refs));
-	EXPECT_EQ(1, atomic_read(&self->hsk.buffer_pool.descriptors[1].refs));
+	EXPECT_EQ(0, -homa_pool_get_pages(self->hsk.buffer_pool, 2,
+			self->recvmsg_args.bpage_offsets, 0, -1));
+	EXPECT_EQ(1, atomic_read(self->hsk.buffer_pool->descriptors[0].refs));
+	EXPECT_EQ(1, atomic_read(self->hsk.buffer_pool->descriptors[1].refs));
 	self->recvmsg_args.num_bpages = 2;
 	self->recvmsg_args.bpage_offsets[0] = 0;
 	self->recvmsg_args.bpage_offsets[1] = HOMA_BPAGE_SIZE;
@@ -655,6 +868,25 @@ TEST_F(homa_plumbing, homa_softirq__basics)
 	homa_softirq(skb);
 	EXPECT_EQ(1, unit_list_length(&self->hsk.active_rpcs));
 }
+TEST_F(homa_plumbing, homa_softirq__decrement_backlog_of_steered_core)
+{
+	struct sk_buff *skb;
+	skb = mock_skb_new(self->client_ip, &self->data.common, 1400, 1400);
+	__skb_set_sw_hash(skb, 3 + rps_cpu_mask + 1, false);
+	atomic_set(&homa_cores[3]->softirq_backlog, 2);
+	atomic_set(&homa_cores[cpu_number]->softirq_backlog, 2);
+	homa_softirq(skb);
+	EXPECT_EQ(1, atomic_read(&homa_cores[3]->softirq_backlog));
+	EXPECT_EQ(2, atomic_read(&homa_cores[cpu_number]->softirq_backlog));
+}
+TEST_F(homa_plumbing, homa_softirq__batch_not_steered_by_homa)
+{
+	struct sk_buff *skb;
+	skb = mock_skb_new(self->client_ip, &self->data.common, 1400, 1400);
+	atomic_set(&homa_cores[cpu_number]->softirq_backlog, 0);
+	homa_softirq(skb);
+	EXPECT_EQ(0, atomic_read(&homa_cores[cpu_number]->softirq_backlog));
+}
 TEST_F(homa_plumbing, homa_softirq__cant_pull_header)
 {
 	struct sk_buff *skb;
@@ -677,7 +909,7 @@ TEST_F(homa_plumbing, homa_softirq__packet_too_short)
 	struct ack_header h;
 	h.common.type = ACK;
 	skb = mock_skb_new(self->client_ip, &h.common, 0, 0);
-	skb->len -= 1;
+	skb->len = offsetof(struct ack_header, acks) - 1;
 	homa_softirq(skb);
 	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
 	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.short_packets);
@@ -691,6 +923,26 @@ TEST_F(homa_plumbing, homa_softirq__bogus_packet_type)
 	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
 	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.short_packets);
 }
+TEST_F(homa_plumbing, homa_softirq__record_gro_latency)
+{
+	struct sk_buff *skb;
+	skb = mock_skb_new(self->client_ip, &self->data.common, 1400, 1400);
+	homa_set_rcv_cycles(skb, 1000);
+	mock_cycles = 6000;
+	homa_softirq(skb);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.gro_softirq_latency[8]);
+}
+TEST_F(homa_plumbing, homa_softirq__gro_time_in_future)
+{
+	struct sk_buff *skb;
+	skb = mock_skb_new(self->client_ip, &self->data.common, 1400, 1400);
+	homa_set_rcv_cycles(skb, 7000);
+	mock_cycles = 6000;
+	homa_softirq(skb);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.gro_softirq_latency[0]);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.gro_softirq_latency[
+			HOMA_NUM_LATENCY_BUCKETS-1]);
+}
 TEST_F(homa_plumbing, homa_softirq__process_short_packets_first)
 {
 	struct sk_buff *skb, *skb2, *skb3, *skb4;
@@ -795,6 +1047,63 @@ TEST_F(homa_plumbing, homa_softirq__per_rpc_batching)
 			"sk->sk_data_ready invoked",
 			unit_log_get());
 }
+TEST_F(homa_plumbing, homa_softirq__same_id_different_addresses)
+{
+	struct in6_addr client_ip2 = unit_get_in_addr("197.168.0.1");
+	struct sk_buff *skb, *tail;
+
+	self->data.common.sender_id = cpu_to_be64(2000);
+	self->data.message_length = htonl(10000);
+	skb = mock_skb_new(self->client_ip, &self->data.common, 1400, 0);
+	tail = skb;
+
+	tail->next = mock_skb_new(&client_ip2, &self->data.common, 1400, 0);
+	tail = tail->next;
+
+	self->data.seg.offset = htonl(1400);
+	tail->next = mock_skb_new(self->client_ip, &self->data.common,
+			1400, 0);
+	tail = tail->next;
+
+	skb_shinfo(skb)->frag_list = skb->next;
+	skb->next = NULL;
+	unit_log_clear();
+	homa_softirq(skb);
+	EXPECT_STREQ("id 2001, offsets 0 1400; "
+			"sk->sk_data_ready invoked; "
+			"id 2001, offsets 0; "
+			"sk->sk_data_ready invoked",
+			unit_log_get());
+}
+TEST_F(homa_plumbing, homa_softirq__too_many_rpcs_for_one_pass)
+{
+	struct sk_buff *skb, *tail;
+	int i;
+
+	self->data.message_length = htonl(10000);
+	self->data.common.sender_id = cpu_to_be64(2000);
+	skb = mock_skb_new(self->client_ip, &self->data.common, 1400, 0);
+	tail = skb;
+	for (i = 1; i <= HOMA_SOFTIRQ_GROUPS; i++) {
+		self->data.common.sender_id = cpu_to_be64(2000 + 2*i);
+		tail->next = mock_skb_new(self->client_ip, &self->data.common,
+				1400, 0);
+		tail = tail->next;
+	}
+	self->data.seg.offset = htonl(1400);
+	tail->next = mock_skb_new(self->client_ip, &self->data.common,
+			1400, 0);
+	tail = tail->next;
+
+	skb_shinfo(skb)->frag_list = skb->next;
+	skb->next = NULL;
+	unit_log_clear();
+	homa_softirq(skb);
+	EXPECT_EQ(HOMA_SOFTIRQ_GROUPS+1, unit_list_length(
+			&self->hsk.active_rpcs));
+	EXPECT_SUBSTR("id 2031, offsets 0; sk->sk_data_ready invoked; "
+			"id 2033, offsets 0 1400", unit_log_get());
+}
 
 TEST_F(homa_plumbing, homa_metrics_open)
 {
@@ -849,3 +1158,35 @@ TEST_F(homa_plumbing, homa_metrics_release)
 	EXPECT_EQ(0, homa_metrics_release(NULL, NULL));
 	EXPECT_EQ(0, self->homa.metrics_active_opens);
 }
+
+TEST_F(homa_plumbing, homa_metrics_raw_read)
+{
+	struct homa_metrics_raw_header *header;
+	struct file file;
+	char *buffer;
+	loff_t offset = 0;
+	size_t total;
+
+	homa_cores[1]->metrics.temp[0] = 12345;
+	EXPECT_EQ(0, homa_metrics_raw_open(NULL, &file));
+	header = file.private_data;
+	total = sizeof(*header) + header->schema_length + 8
+			* sizeof(struct homa_metrics);
+	buffer = malloc(total + 100);
+	EXPECT_EQ(100, homa_metrics_raw_read(&file, buffer, 100, &offset));
+	EXPECT_EQ(100, offset);
+	EXPECT_EQ(total - 100, homa_metrics_raw_read(&file, buffer + 100,
+			total, &offset));
+	EXPECT_EQ(0, homa_metrics_raw_read(&file, buffer, 100, &offset));
+	EXPECT_EQ(0, memcmp(buffer, header, total));
+	EXPECT_EQ(0, homa_metrics_raw_release(NULL, &file));
+	EXPECT_EQ(NULL, file.private_data);
+	free(buffer);
+}
+TEST_F(homa_plumbing, homa_metrics_sum_open__no_memory)
+{
+	struct file file;
+
+	mock_vmalloc_errors = 1;
+	EXPECT_EQ(ENOMEM, -homa_metrics_sum_open(NULL, &file));
+}
@@ -21,10 +21,14 @@ FIXTURE(homa_pool) {
 FIXTURE_SETUP(homa_pool)
 {
 	homa_init(&self->homa);
+
+	/* Most tests don't want the reservation policy getting in the way. */
+	self->homa.bpage_reserve_pct = 0;
+	self->homa.bpage_peer_max_pct = 0;
 	mock_sock_init(&self->hsk, &self->homa, 0);
 	self->client_ip = unit_get_in_addr("196.168.0.1");
 	self->server_ip = unit_get_in_addr("1.2.3.4");
-	cur_pool = &self->hsk.buffer_pool;
+	cur_pool = self->hsk.buffer_pool;
 }
 FIXTURE_TEARDOWN(homa_pool)
 {
@@ -33,28 +37,6 @@ FIXTURE_TEARDOWN(homa_pool)
 	unit_teardown();
 }
 
-static void steal_bpages_hook(char *id)
-{
-	if (strcmp(id, "spin_lock") != 0)
-		return;
-	if (!cur_pool)
-		return;
-	switch (cur_pool->cores[1].next_candidate) {
-	case 1:
-		atomic_set(&cur_pool->descriptors[0].refs, 2);
-		break;
-	case 2:
-		atomic_set(&cur_pool->descriptors[1].refs, 1);
-		cur_pool->descriptors[1].owner = 3;
-		cur_pool->descriptors[1].expiration = mock_cycles + 1;
-	case 3:
-		atomic_set(&cur_pool->descriptors[2].refs, 1);
-		cur_pool->descriptors[2].owner = 3;
-		cur_pool->descriptors[2].expiration = mock_cycles - 1;
-	case 4:
-		atomic_set(&cur_pool->descriptors[3].refs, 1);
-	}
-}
 static void change_owner_hook(char *id)
 {
 	if (strcmp(id, "spin_lock") != 0)
@@ -66,165 +48,459 @@ static void change_owner_hook(char *id)
 
 TEST_F(homa_pool, homa_pool_set_bpages_needed)
 {
-	struct homa_pool *pool = &self->hsk.buffer_pool;
+	struct homa_pool *pool = self->hsk.buffer_pool;
 	atomic_set(&pool->free_bpages, 0);
 	unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, &self->client_ip,
 			&self->server_ip, 4000, 98, 1000, 2*HOMA_BPAGE_SIZE+1);
-	ASSERT_FALSE(list_empty(&self->hsk.waiting_for_bufs));
+	ASSERT_FALSE(list_empty(&self->hsk.buffer_pool->waiting_for_bufs));
 	EXPECT_EQ(3, pool->bpages_needed);
 	unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, &self->client_ip,
 			&self->server_ip, 4000, 98, 1000, 2*HOMA_BPAGE_SIZE);
 	EXPECT_EQ(2, pool->bpages_needed);
 }
 
+TEST_F(homa_pool, homa_pool_set_bpages_needed__include_reserve)
+{
+	struct homa_pool *pool = self->hsk.buffer_pool;
+	self->homa.bpage_reserve_pct = 10;
+	atomic_set(&pool->free_bpages, 0);
+	unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, &self->client_ip,
+			&self->server_ip, 4000, 98, 1000, 2*HOMA_BPAGE_SIZE+1);
+	EXPECT_EQ(13, pool->bpages_needed);
+	unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, &self->client_ip,
+			&self->server_ip, 4000, 98, 1000, 2000);
+	EXPECT_EQ(1, pool->bpages_needed);
+}
+TEST_F(homa_pool, homa_pool_set_bpages_needed__reserve_capped)
+{
+	struct homa_pool *pool = self->hsk.buffer_pool;
+	self->homa.bpage_reserve_pct = 90;
+	atomic_set(&pool->free_bpages, 0);
+	unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, &self->client_ip,
+			&self->server_ip, 4000, 98, 1000, 15*HOMA_BPAGE_SIZE);
+	EXPECT_EQ(100, pool->bpages_needed);
+}
+TEST_F(homa_pool, homa_pool_set_bpages_needed__skip_rpcs_held_back_by_peer)
+{
+	struct homa_pool *pool = self->hsk.buffer_pool;
+	struct in6_addr server_ip2 = unit_get_in_addr("1.2.3.5");
+	struct homa_rpc *crpc;
+
+	self->homa.bpage_peer_max_pct = 5;
+	atomic_set(&pool->free_bpages, 0);
+	crpc = unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT,
+			&self->client_ip, &self->server_ip, 4000, 98, 1000,
+			2*HOMA_BPAGE_SIZE);
+	ASSERT_NE(NULL, crpc);
+	EXPECT_EQ(2, pool->bpages_needed);
+	crpc->msgin.charged_bpages = 4;
+	list_add_tail(&crpc->msgin.charged_links, &pool->charged_rpcs);
+	unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, &self->client_ip,
+			&server_ip2, 4000, 100, 1000, 3*HOMA_BPAGE_SIZE);
+	EXPECT_EQ(3, pool->bpages_needed);
+}
 TEST_F(homa_pool, homa_pool_init__basics)
 {
-	struct homa_pool *pool = &self->hsk.buffer_pool;
+	struct homa_pool *pool = self->hsk.buffer_pool;
 	EXPECT_EQ(100, pool->num_bpages);
 	EXPECT_EQ(-1, pool->descriptors[98].owner);
 }
+TEST_F(homa_pool, homa_pool_init__bpage_size)
+{
+	struct homa_pool *pool;
+
+	homa_pool_detach(&self->hsk);
+	EXPECT_EQ(0, homa_pool_init(&self->hsk, (void *) 0x1000000,
+			10*HOMA_MAX_BPAGE_SIZE, HOMA_MAX_BPAGE_SIZE));
+	pool = self->hsk.buffer_pool;
+	EXPECT_EQ(HOMA_MAX_BPAGE_SIZE, pool->bpage_size);
+	EXPECT_EQ(HOMA_MAX_BPAGE_SHIFT, pool->bpage_shift);
+	EXPECT_EQ(10, pool->num_bpages);
+}
+TEST_F(homa_pool, homa_pool_init__default_bpage_size)
+{
+	struct homa_pool *pool = self->hsk.buffer_pool;
+	EXPECT_EQ(HOMA_BPAGE_SIZE, pool->bpage_size);
+	EXPECT_EQ(HOMA_BPAGE_SHIFT, pool->bpage_shift);
+}
+TEST_F(homa_pool, homa_pool_init__bad_bpage_size)
+{
+	homa_pool_detach(&self->hsk);
+	EXPECT_EQ(EINVAL, -homa_pool_init(&self->hsk, (void *) 0x1000000,
+			100*HOMA_BPAGE_SIZE, HOMA_BPAGE_SIZE/2));
+	EXPECT_EQ(EINVAL, -homa_pool_init(&self->hsk, (void *) 0x1000000,
+			100*HOMA_BPAGE_SIZE, 2*HOMA_MAX_BPAGE_SIZE));
+	EXPECT_EQ(EINVAL, -homa_pool_init(&self->hsk, (void *) 0x1000000,
+			100*HOMA_BPAGE_SIZE, 3*HOMA_BPAGE_SIZE));
+}
 TEST_F(homa_pool, homa_pool_init__region_not_page_aligned)
 {
-	homa_pool_destroy(&self->hsk.buffer_pool);
+	homa_pool_detach(&self->hsk);
 	EXPECT_EQ(EINVAL, -homa_pool_init(&self->hsk,
 			((char *) 0x1000000) + 10,
-			100*HOMA_BPAGE_SIZE));
+			100*HOMA_BPAGE_SIZE, 0));
 }
 TEST_F(homa_pool, homa_pool_init__region_too_small)
 {
-	homa_pool_destroy(&self->hsk.buffer_pool);
+	homa_pool_detach(&self->hsk);
 	EXPECT_EQ(EINVAL, -homa_pool_init(&self->hsk, (void *) 0x1000000,
-			HOMA_BPAGE_SIZE));
+			HOMA_BPAGE_SIZE, 0));
 }
-TEST_F(homa_pool, homa_pool_init__cant_allocate_descriptors)
+TEST_F(homa_pool, homa_pool_init__socket_already_has_pool)
 {
+	struct homa_pool *old = self->hsk.buffer_pool;
+
+	EXPECT_EQ(EINVAL, -homa_pool_init(&self->hsk, (void *) 0x1000000,
+			10*HOMA_BPAGE_SIZE, 0));
+	EXPECT_EQ(old, self->hsk.buffer_pool);
+	EXPECT_EQ(100, self->hsk.buffer_pool->num_bpages);
+}
+TEST_F(homa_pool, homa_pool_init__cant_allocate_pool)
+{
+	homa_pool_detach(&self->hsk);
 	mock_kmalloc_errors = 1;
-	homa_pool_destroy(&self->hsk.buffer_pool);
 	EXPECT_EQ(ENOMEM, -homa_pool_init(&self->hsk, (void *) 0x100000,
-			100*HOMA_BPAGE_SIZE));
+			100*HOMA_BPAGE_SIZE, 0));
+	EXPECT_EQ(NULL, self->hsk.buffer_pool);
 }
-TEST_F(homa_pool, homa_pool_init__cant_allocate_core_info)
+TEST_F(homa_pool, homa_pool_init__cant_allocate_descriptors)
 {
-	homa_pool_destroy(&self->hsk.buffer_pool);
 	mock_kmalloc_errors = 2;
+	homa_pool_detach(&self->hsk);
+	EXPECT_EQ(ENOMEM, -homa_pool_init(&self->hsk, (void *) 0x100000,
+			100*HOMA_BPAGE_SIZE, 0));
+	EXPECT_EQ(NULL, self->hsk.buffer_pool);
+}
+TEST_F(homa_pool, homa_pool_init__cant_allocate_core_info)
+{
+	homa_pool_detach(&self->hsk);
+	mock_kmalloc_errors = 4;
 	EXPECT_EQ(ENOMEM, -homa_pool_init(&self->hsk, (void *) 0x100000,
-			100*HOMA_BPAGE_SIZE));
+			100*HOMA_BPAGE_SIZE, 0));
 }
 
-TEST_F(homa_pool, homa_pool_destroy__idempotent)
+TEST_F(homa_pool, homa_pool_init__cant_allocate_free_stack)
+{
+	homa_pool_detach(&self->hsk);
+	mock_kmalloc_errors = 8;
+	EXPECT_EQ(ENOMEM, -homa_pool_init(&self->hsk, (void *) 0x100000,
+			100*HOMA_BPAGE_SIZE, 0));
+}
+TEST_F(homa_pool, homa_pool_init__free_stack)
 {
-	homa_pool_destroy(&self->hsk.buffer_pool);
-	homa_pool_destroy(&self->hsk.buffer_pool);
+	struct homa_pool *pool = self->hsk.buffer_pool;
+	EXPECT_EQ(100, pool->nodes[0].free_top);
+	EXPECT_EQ(99, pool->nodes[0].free_stack[0]);
+	EXPECT_EQ(0, pool->nodes[0].free_stack[99]);
+	EXPECT_EQ(0, pool->cores[cpu_number].num_free);
+}
+TEST_F(homa_pool, homa_pool_init__numa_slices)
+{
+	struct homa_pool *pool;
+
+	mock_cpu_node[4] = mock_cpu_node[5] = 1;
+	mock_cpu_node[6] = mock_cpu_node[7] = 1;
+	homa_pool_detach(&self->hsk);
+	ASSERT_EQ(0, homa_pool_init(&self->hsk, (void *) 0x1000000,
+			101*HOMA_BPAGE_SIZE, 0));
+	pool = self->hsk.buffer_pool;
+	EXPECT_EQ(2, pool->num_nodes);
+	EXPECT_EQ(0, pool->cores[3].node);
+	EXPECT_EQ(1, pool->cores[4].node);
+	EXPECT_EQ(0, pool->nodes[0].first_bpage);
+	EXPECT_EQ(50, pool->nodes[0].num_bpages);
+	EXPECT_EQ(50, pool->nodes[0].free_top);
+	EXPECT_EQ(49, pool->nodes[0].free_stack[0]);
+	EXPECT_EQ(50, pool->nodes[1].first_bpage);
+	EXPECT_EQ(51, pool->nodes[1].num_bpages);
+	EXPECT_EQ(51, pool->nodes[1].free_top);
+	EXPECT_EQ(100, pool->nodes[1].free_stack[0]);
+	EXPECT_EQ(50, pool->nodes[1].free_stack[50]);
+	EXPECT_EQ(0, pool->descriptors[49].node);
+	EXPECT_EQ(1, pool->descriptors[50].node);
+}
+TEST_F(homa_pool, homa_pool_init__node_numbers_wrap)
+{
+	struct homa_pool *pool;
+
+	mock_cpu_node[3] = HOMA_POOL_MAX_NODES + 2;
+	mock_cpu_phys[5] = -1;
+	mock_cpu_node[5] = 4;
+	homa_pool_detach(&self->hsk);
+	ASSERT_EQ(0, homa_pool_init(&self->hsk, (void *) 0x1000000,
+			100*HOMA_BPAGE_SIZE, 0));
+	pool = self->hsk.buffer_pool;
+	EXPECT_EQ(3, pool->num_nodes);
+	EXPECT_EQ(2, pool->cores[3].node);
+	EXPECT_EQ(0, pool->cores[5].node);
+}
+
+TEST_F(homa_pool, homa_pool_detach__idempotent)
+{
+	homa_pool_detach(&self->hsk);
+	EXPECT_EQ(NULL, self->hsk.buffer_pool);
+	homa_pool_detach(&self->hsk);
+}
+TEST_F(homa_pool, homa_pool_detach__pool_still_shared)
+{
+	struct homa_pool *pool = self->hsk.buffer_pool;
+	struct homa_sock hsk2;
+
+	mock_sock_init(&hsk2, &self->homa, 0);
+	homa_pool_detach(&hsk2);
+	EXPECT_EQ(0, homa_pool_share(&hsk2, &self->hsk));
+	EXPECT_EQ(2, atomic_read(&pool->refs));
+	homa_pool_detach(&self->hsk);
+	EXPECT_EQ(NULL, self->hsk.buffer_pool);
+	EXPECT_EQ(1, atomic_read(&pool->refs));
+	EXPECT_EQ(100, hsk2.buffer_pool->num_bpages);
+	homa_sock_destroy(&hsk2);
+}
+
+TEST_F(homa_pool, homa_pool_share__basics)
+{
+	struct homa_sock hsk2;
+
+	mock_sock_init(&hsk2, &self->homa, 0);
+	homa_pool_detach(&hsk2);
+	EXPECT_EQ(0, homa_pool_share(&hsk2, &self->hsk));
+	EXPECT_EQ(self->hsk.buffer_pool, hsk2.buffer_pool);
+	EXPECT_EQ(2, atomic_read(&hsk2.buffer_pool->refs));
+	homa_sock_destroy(&hsk2);
+	EXPECT_EQ(1, atomic_read(&self->hsk.buffer_pool->refs));
+}
+TEST_F(homa_pool, homa_pool_share__socket_already_has_pool)
+{
+	struct homa_pool *pool = self->hsk.buffer_pool;
+	struct homa_pool *pool2;
+	struct homa_sock hsk2;
+
+	mock_sock_init(&hsk2, &self->homa, 0);
+	pool2 = hsk2.buffer_pool;
+	EXPECT_EQ(EINVAL, -homa_pool_share(&hsk2, &self->hsk));
+	EXPECT_EQ(pool2, hsk2.buffer_pool);
+	EXPECT_EQ(1, atomic_read(&pool->refs));
+	homa_sock_destroy(&hsk2);
+}
+TEST_F(homa_pool, homa_pool_share__pool_from_other_process)
+{
+	struct homa_pool *pool = self->hsk.buffer_pool;
+	struct homa_sock hsk2;
+
+	mock_sock_init(&hsk2, &self->homa, 0);
+	homa_pool_detach(&hsk2);
+	pool->mm = (struct mm_struct *) 1000;
+	EXPECT_EQ(EINVAL, -homa_pool_share(&hsk2, &self->hsk));
+	EXPECT_EQ(NULL, hsk2.buffer_pool);
+	EXPECT_EQ(1, atomic_read(&pool->refs));
+	homa_sock_destroy(&hsk2);
+}
+TEST_F(homa_pool, homa_pool_share__other_has_no_pool)
+{
+	struct homa_pool *pool = self->hsk.buffer_pool;
+	struct homa_sock hsk2;
+
+	mock_sock_init(&hsk2, &self->homa, 0);
+	homa_pool_detach(&hsk2);
+	EXPECT_EQ(EINVAL, -homa_pool_share(&self->hsk, &hsk2));
+	EXPECT_EQ(pool, self->hsk.buffer_pool);
+	homa_sock_destroy(&hsk2);
+}
+TEST_F(homa_pool, homa_pool_share__waiting_list_spans_sockets)
+{
+	struct homa_pool *pool = self->hsk.buffer_pool;
+	struct homa_rpc *crpc1, *crpc2;
+	struct homa_sock hsk2;
+
+	mock_sock_init(&hsk2, &self->homa, 0);
+	homa_pool_detach(&hsk2);
+	EXPECT_EQ(0, homa_pool_share(&hsk2, &self->hsk));
+	atomic_set(&pool->free_bpages, 0);
+	crpc1 = unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT,
+			&self->client_ip, &self->server_ip, 4000, 98, 1000,
+			3*HOMA_BPAGE_SIZE);
+	ASSERT_NE(NULL, crpc1);
+	crpc2 = unit_client_rpc(&hsk2, UNIT_RCVD_ONE_PKT,
+			&self->client_ip, &self->server_ip, 4000, 100, 1000,
+			2*HOMA_BPAGE_SIZE);
+	ASSERT_NE(NULL, crpc2);
+	EXPECT_EQ(2, unit_list_length(&pool->waiting_for_bufs));
+	EXPECT_EQ(2, pool->bpages_needed);
+
+	/* Space freed on either socket can be used by RPCs on the other. */
+	atomic_set(&pool->free_bpages, 2);
+	homa_pool_check_waiting(pool);
+	EXPECT_EQ(0, crpc1->msgin.num_bpages);
+	EXPECT_EQ(2, crpc2->msgin.num_bpages);
+	EXPECT_EQ(3, pool->bpages_needed);
+
+	/* Freeing an RPC removes it from the shared list. */
+	homa_rpc_free(crpc1);
+	EXPECT_EQ(0, unit_list_length(&pool->waiting_for_bufs));
+	homa_sock_destroy(&hsk2);
 }
 
 TEST_F(homa_pool, homa_pool_get_pages__basics)
 {
-	struct homa_pool *pool = &self->hsk.buffer_pool;
+	struct homa_pool *pool = self->hsk.buffer_pool;
 	__u32 pages[10];
-	EXPECT_EQ(0, homa_pool_get_pages(pool, 2, pages, 0));
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 2, pages, 0, -1));
 	EXPECT_EQ(0, pages[0]);
 	EXPECT_EQ(1, pages[1]);
 	EXPECT_EQ(1, atomic_read(&pool->descriptors[1].refs));
 	EXPECT_EQ(-1, pool->descriptors[1].owner);
-	EXPECT_EQ(2, pool->cores[cpu_number].next_candidate);
+	EXPECT_EQ(HOMA_POOL_BATCH - 2, pool->cores[cpu_number].num_free);
+	EXPECT_EQ(100 - HOMA_POOL_BATCH, pool->nodes[0].free_top);
 	EXPECT_EQ(98, atomic_read(&pool->free_bpages));
 }
 TEST_F(homa_pool, homa_pool_get_pages__not_enough_space)
 {
-	struct homa_pool *pool = &self->hsk.buffer_pool;
+	struct homa_pool *pool = self->hsk.buffer_pool;
 	__u32 pages[10];
 	atomic_set(&pool->free_bpages, 1);
-	EXPECT_EQ(-1, homa_pool_get_pages(pool, 2, pages, 0));
+	EXPECT_EQ(-1, homa_pool_get_pages(pool, 2, pages, 0, -1));
 	atomic_set(&pool->free_bpages, 2);
-	EXPECT_EQ(0, homa_pool_get_pages(pool, 2, pages, 0));
-}
-TEST_F(homa_pool, homa_pool_get_pages__set_limit)
-{
-	struct homa_pool *pool = &self->hsk.buffer_pool;
-	__u32 pages[10];
-	atomic_set(&pool->free_bpages, 62);
-	pool->cores[cpu_number].next_candidate = 49;
-	EXPECT_EQ(0, homa_pool_get_pages(pool, 2, pages, 0));
-	EXPECT_EQ(49, pages[0]);
-	EXPECT_EQ(0, pages[1]);
-}
-TEST_F(homa_pool, homa_pool_get_pages__set_limit_with_MIN_EXTRA)
-{
-	struct homa_pool *pool = &self->hsk.buffer_pool;
-	__u32 pages[10];
-	atomic_set(&pool->free_bpages, 92);
-	pool->cores[cpu_number].next_candidate = 13;
-	EXPECT_EQ(0, homa_pool_get_pages(pool, 2, pages, 0));
-	EXPECT_EQ(13, pages[0]);
-	EXPECT_EQ(0, pages[1]);
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 2, pages, 0, -1));
 }
-TEST_F(homa_pool, homa_pool_get_pages__skip_unusable_bpages)
+TEST_F(homa_pool, homa_pool_get_pages__reclaim_expired_pages)
 {
-	struct homa_pool *pool = &self->hsk.buffer_pool;
+	struct homa_pool *pool = self->hsk.buffer_pool;
 	__u32 pages[10];
-	mock_cycles = 1000;
-	atomic_set(&pool->descriptors[0].refs, 2);
-	atomic_set(&pool->descriptors[1].refs, 1);
-	pool->descriptors[1].owner = 3;
-	pool->descriptors[1].expiration = mock_cycles + 1;
-	atomic_set(&pool->descriptors[2].refs, 1);
-	pool->descriptors[2].owner = 3;
-	pool->descriptors[2].expiration = mock_cycles - 1;
-	atomic_set(&pool->descriptors[3].refs, 1);
-	EXPECT_EQ(0, homa_pool_get_pages(pool, 2, pages, 0));
-	EXPECT_EQ(2, pages[0]);
-	EXPECT_EQ(4, pages[1]);
+	mock_cycles = 5000;
+	atomic_set(&pool->free_bpages, 0);
+	atomic_set(&pool->descriptors[40].refs, 1);
+	pool->descriptors[40].owner = 3;
+	pool->descriptors[40].expiration = mock_cycles - 1;
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 1, pages, 0, -1));
+	EXPECT_EQ(40, pages[0]);
+	EXPECT_EQ(-1, pool->descriptors[40].owner);
+	EXPECT_EQ(1, atomic_read(&pool->descriptors[40].refs));
+	EXPECT_EQ(0, atomic_read(&pool->free_bpages));
 }
-TEST_F(homa_pool, homa_pool_get_pages__cant_lock_pages)
+TEST_F(homa_pool, homa_pool_get_pages__reclaim_not_enough)
 {
-	struct homa_pool *pool = &self->hsk.buffer_pool;
+	struct homa_pool *pool = self->hsk.buffer_pool;
 	__u32 pages[10];
-	mock_cycles = 1000;
-	mock_trylock_errors = 3;
-	EXPECT_EQ(0, homa_pool_get_pages(pool, 2, pages, 0));
-	EXPECT_EQ(2, pages[0]);
-	EXPECT_EQ(3, pages[1]);
+	mock_cycles = 5000;
+	atomic_set(&pool->free_bpages, 0);
+	atomic_set(&pool->descriptors[40].refs, 1);
+	pool->descriptors[40].owner = 3;
+	pool->descriptors[40].expiration = mock_cycles - 1;
+	EXPECT_EQ(-1, homa_pool_get_pages(pool, 2, pages, 0, -1));
+	EXPECT_EQ(-1, pool->descriptors[40].owner);
+	EXPECT_EQ(1, atomic_read(&pool->free_bpages));
 }
-TEST_F(homa_pool, homa_pool_get_pages__state_changes_while_locking)
+TEST_F(homa_pool, homa_pool_get_pages__reclaim_rate_limited)
 {
-	struct homa_pool *pool = &self->hsk.buffer_pool;
+	struct homa_pool *pool = self->hsk.buffer_pool;
 	__u32 pages[10];
-	mock_cycles = 1000;
-	unit_hook_register(steal_bpages_hook);
-	EXPECT_EQ(0, homa_pool_get_pages(pool, 2, pages, 0));
-	EXPECT_EQ(2, pages[0]);
-	EXPECT_EQ(4, pages[1]);
+	self->homa.bpage_lease_cycles = 1000;
+	mock_cycles = 5000;
+	atomic_set(&pool->free_bpages, 0);
+	EXPECT_EQ(-1, homa_pool_get_pages(pool, 1, pages, 0, -1));
+	EXPECT_EQ(6000, atomic64_read(&pool->next_reclaim));
+
+	/* Too soon to scan again. */
+	atomic_set(&pool->descriptors[40].refs, 1);
+	pool->descriptors[40].owner = 3;
+	pool->descriptors[40].expiration = mock_cycles - 1;
+	mock_cycles = 5999;
+	EXPECT_EQ(-1, homa_pool_get_pages(pool, 1, pages, 0, -1));
+	EXPECT_EQ(3, pool->descriptors[40].owner);
+
+	mock_cycles = 6000;
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 1, pages, 0, -1));
+	EXPECT_EQ(40, pages[0]);
+	EXPECT_EQ(7000, atomic64_read(&pool->next_reclaim));
 }
-TEST_F(homa_pool, homa_pool_get_pages__steal_expired_page)
+TEST_F(homa_pool, homa_pool_get_pages__steal_from_other_core)
 {
-	struct homa_pool *pool = &self->hsk.buffer_pool;
+	struct homa_pool *pool = self->hsk.buffer_pool;
 	__u32 pages[10];
-	pool->descriptors[0].owner = 5;
-	mock_cycles = 5000;
-	pool->descriptors[0].expiration = mock_cycles - 1;
-	atomic_set(&pool->free_bpages, 20);
-	EXPECT_EQ(0, homa_pool_get_pages(pool, 2, pages, 0));
-	EXPECT_EQ(0, pages[0]);
-	EXPECT_EQ(1, pages[1]);
-	EXPECT_EQ(-1, pool->descriptors[0].owner);
-	EXPECT_EQ(19, atomic_read(&pool->free_bpages));
+
+	/* Move all free pages into the cache for core 3. */
+	pool->nodes[0].free_top = 0;
+	pool->cores[3].free[0] = 17;
+	pool->cores[3].free[1] = 23;
+	pool->cores[3].num_free = 2;
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 2, pages, 0, -1));
+	EXPECT_EQ(23, pages[0]);
+	EXPECT_EQ(17, pages[1]);
+	EXPECT_EQ(0, pool->cores[3].num_free);
+	EXPECT_EQ(2, homa_cores[cpu_number]->metrics.bpage_steals);
 }
 TEST_F(homa_pool, homa_pool_get_pages__set_owner)
 {
-	struct homa_pool *pool = &self->hsk.buffer_pool;
+	struct homa_pool *pool = self->hsk.buffer_pool;
 	__u32 pages[10];
 	self->homa.bpage_lease_cycles = 1000;
 	mock_cycles = 5000;
-	EXPECT_EQ(0, homa_pool_get_pages(pool, 2, pages, 1));
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 2, pages, 1, -1));
 	EXPECT_EQ(1, pool->descriptors[pages[0]].owner);
 	EXPECT_EQ(mock_cycles + 1000,
 			pool->descriptors[pages[1]].expiration);
 	EXPECT_EQ(2, atomic_read(&pool->descriptors[1].refs));
 }
+TEST_F(homa_pool, homa_pool_get_pages__preferred_node)
+{
+	struct homa_pool *pool;
+	__u32 pages[10];
+
+	mock_cpu_node[4] = mock_cpu_node[5] = 1;
+	homa_pool_detach(&self->hsk);
+	ASSERT_EQ(0, homa_pool_init(&self->hsk, (void *) 0x1000000,
+			100*HOMA_BPAGE_SIZE, 0));
+	pool = self->hsk.buffer_pool;
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 2, pages, 0, 1));
+	EXPECT_EQ(50, pages[0]);
+	EXPECT_EQ(51, pages[1]);
+	EXPECT_EQ(0, pool->cores[cpu_number].num_free);
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 1, pages, 0, -1));
+	EXPECT_EQ(0, pages[0]);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.bpage_node_allocs[0]);
+	EXPECT_EQ(2, homa_cores[cpu_number]->metrics.bpage_node_allocs[1]);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.bpage_remote_allocs);
+}
+TEST_F(homa_pool, homa_pool_get_pages__fall_back_to_other_node)
+{
+	struct homa_pool *pool;
+	__u32 pages[10];
+
+	mock_cpu_node[4] = mock_cpu_node[5] = 1;
+	homa_pool_detach(&self->hsk);
+	ASSERT_EQ(0, homa_pool_init(&self->hsk, (void *) 0x1000000,
+			100*HOMA_BPAGE_SIZE, 0));
+	pool = self->hsk.buffer_pool;
+	pool->nodes[1].free_top = 1;
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 2, pages, 0, 1));
+	EXPECT_EQ(99, pages[0]);
+	EXPECT_EQ(0, pages[1]);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.bpage_node_allocs[0]);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.bpage_remote_allocs);
+}
+TEST_F(homa_pool, homa_pool_get_pages__steal_from_other_node)
+{
+	struct homa_pool *pool;
+	__u32 pages[10];
+
+	mock_cpu_node[4] = mock_cpu_node[5] = 1;
+	homa_pool_detach(&self->hsk);
+	ASSERT_EQ(0, homa_pool_init(&self->hsk, (void *) 0x1000000,
+			100*HOMA_BPAGE_SIZE, 0));
+	pool = self->hsk.buffer_pool;
+	pool->nodes[0].free_top = 0;
+	pool->nodes[1].free_top = 0;
+	pool->cores[5].free[0] = 70;
+	pool->cores[5].num_free = 1;
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 1, pages, 0, -1));
+	EXPECT_EQ(70, pages[0]);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.bpage_steals);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.bpage_remote_allocs);
+}
 
 TEST_F(homa_pool, homa_pool_allocate__basics)
 {
-	struct homa_pool *pool = &self->hsk.buffer_pool;
+	struct homa_pool *pool = self->hsk.buffer_pool;
 	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
 			UNIT_RCVD_ONE_PKT, &self->client_ip, &self->server_ip,
 			4000, 98, 1000,	150000);
@@ -238,19 +514,61 @@ TEST_F(homa_pool, homa_pool_allocate__basics)
 	EXPECT_EQ(150000 - 2*HOMA_BPAGE_SIZE,
 			pool->cores[cpu_number].allocated);
 }
+TEST_F(homa_pool, homa_pool_allocate__use_node_of_copy_core)
+{
+	struct homa_pool *pool;
+	struct homa_rpc *crpc;
+
+	mock_cpu_node[6] = mock_cpu_node[7] = 1;
+	homa_pool_detach(&self->hsk);
+	ASSERT_EQ(0, homa_pool_init(&self->hsk, (void *) 0x1000000,
+			100*HOMA_BPAGE_SIZE, 0));
+	pool = self->hsk.buffer_pool;
+	self->hsk.copy_core = 6;
+	crpc = unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT,
+			&self->client_ip, &self->server_ip, 4000, 98, 1000,
+			150000);
+	ASSERT_NE(NULL, crpc);
+
+	/* Full bpages come from node 1, but the partial bpage is owned
+	 * by the current core, so it comes from node 0.
+	 */
+	EXPECT_EQ(3, crpc->msgin.num_bpages);
+	EXPECT_EQ(50*HOMA_BPAGE_SIZE, crpc->msgin.bpage_offsets[0]);
+	EXPECT_EQ(51*HOMA_BPAGE_SIZE, crpc->msgin.bpage_offsets[1]);
+	EXPECT_EQ(0, crpc->msgin.bpage_offsets[2]);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.bpage_remote_allocs);
+}
+TEST_F(homa_pool, homa_pool_allocate__large_bpages)
+{
+	struct homa_pool *pool;
+	struct homa_rpc *crpc;
+
+	homa_pool_detach(&self->hsk);
+	ASSERT_EQ(0, homa_pool_init(&self->hsk, (void *) 0x1000000,
+			10*HOMA_MAX_BPAGE_SIZE, HOMA_MAX_BPAGE_SIZE));
+	pool = self->hsk.buffer_pool;
+	crpc = unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, &self->client_ip,
+			&self->server_ip, 4000, 98, 1000, 1000000);
+	ASSERT_NE(NULL, crpc);
+
+	EXPECT_EQ(1, crpc->msgin.num_bpages);
+	EXPECT_EQ(0, crpc->msgin.bpage_offsets[0]);
+	EXPECT_EQ(1000000, pool->cores[cpu_number].allocated);
+	EXPECT_EQ(9, atomic_read(&pool->free_bpages));
+}
 TEST_F(homa_pool, homa_pool_no_buffer_pool)
 {
-	struct homa_pool *pool = &self->hsk.buffer_pool;
 	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
 			UNIT_RCVD_ONE_PKT, &self->client_ip, &self->server_ip,
 			4000, 98, 1000,	150000);
 	ASSERT_NE(NULL, crpc);
-	homa_pool_destroy(pool);
+	homa_pool_detach(&self->hsk);
 	EXPECT_EQ(ENOMEM, -homa_pool_allocate(crpc));
 }
 TEST_F(homa_pool, homa_pool_allocate__cant_allocate_full_bpages)
 {
-	struct homa_pool *pool = &self->hsk.buffer_pool;
+	struct homa_pool *pool = self->hsk.buffer_pool;
 	atomic_set(&pool->free_bpages, 1);
 	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
 			UNIT_RCVD_ONE_PKT, &self->client_ip, &self->server_ip,
@@ -263,7 +581,7 @@ TEST_F(homa_pool, homa_pool_allocate__cant_allocate_full_bpages)
 }
 TEST_F(homa_pool, homa_pool_allocate__no_partial_page)
 {
-	struct homa_pool *pool = &self->hsk.buffer_pool;
+	struct homa_pool *pool = self->hsk.buffer_pool;
 	atomic_set(&pool->free_bpages, 2);
 	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
 			UNIT_RCVD_ONE_PKT, &self->client_ip, &self->server_ip,
@@ -277,8 +595,11 @@ TEST_F(homa_pool, homa_pool_allocate__no_partial_page)
 }
 TEST_F(homa_pool, homa_pool_allocate__owned_page_locked_and_page_stolen)
 {
-	struct homa_pool *pool = &self->hsk.buffer_pool;
-	pool->cores[cpu_number].next_candidate = 2;
+	struct homa_pool *pool = self->hsk.buffer_pool;
+
+	/* Skip the first two bpages. */
+	homa_pool_pop(pool, cpu_number);
+	homa_pool_pop(pool, cpu_number);
 	atomic_set(&pool->free_bpages, 40);
 	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
 			UNIT_RCVD_ONE_PKT, &self->client_ip, &self->server_ip,
@@ -304,7 +625,7 @@ TEST_F(homa_pool, homa_pool_allocate__owned_page_locked_and_page_stolen)
 }
 TEST_F(homa_pool, homa_pool_allocate__page_wrap_around)
 {
-	struct homa_pool *pool = &self->hsk.buffer_pool;
+	struct homa_pool *pool = self->hsk.buffer_pool;
 	pool->cores[cpu_number].page_hint = 2;
 	pool->cores[cpu_number].allocated = HOMA_BPAGE_SIZE-1900;
 	atomic_set(&pool->descriptors[2].refs, 1);
@@ -323,8 +644,11 @@ TEST_F(homa_pool, homa_pool_allocate__page_wrap_around)
 }
 TEST_F(homa_pool, homa_pool_allocate__owned_page_overflow)
 {
-	struct homa_pool *pool = &self->hsk.buffer_pool;
-	pool->cores[cpu_number].next_candidate = 2;
+	struct homa_pool *pool = self->hsk.buffer_pool;
+
+	/* Skip the first two bpages. */
+	homa_pool_pop(pool, cpu_number);
+	homa_pool_pop(pool, cpu_number);
 	atomic_set(&pool->free_bpages, 50);
 	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
 			UNIT_RCVD_ONE_PKT, &self->client_ip, &self->server_ip,
@@ -346,8 +670,11 @@ TEST_F(homa_pool, homa_pool_allocate__owned_page_overflow)
 }
 TEST_F(homa_pool, homa_pool_allocate__reuse_owned_page)
 {
-	struct homa_pool *pool = &self->hsk.buffer_pool;
-	pool->cores[cpu_number].next_candidate = 2;
+	struct homa_pool *pool = self->hsk.buffer_pool;
+
+	/* Skip the first two bpages. */
+	homa_pool_pop(pool, cpu_number);
+	homa_pool_pop(pool, cpu_number);
 	struct homa_rpc *crpc1 = unit_client_rpc(&self->hsk,
 			UNIT_RCVD_ONE_PKT, &self->client_ip, &self->server_ip,
 			4000, 98, 1000, 2000);
@@ -367,7 +694,7 @@ TEST_F(homa_pool, homa_pool_allocate__reuse_owned_page)
 }
 TEST_F(homa_pool, homa_pool_allocate__cant_allocate_partial_bpage)
 {
-	struct homa_pool *pool = &self->hsk.buffer_pool;
+	struct homa_pool *pool = self->hsk.buffer_pool;
 	atomic_set(&pool->free_bpages, 5);
 	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
 			UNIT_RCVD_ONE_PKT, &self->client_ip, &self->server_ip,
@@ -383,7 +710,7 @@ TEST_F(homa_pool, homa_pool_allocate__cant_allocate_partial_bpage)
 TEST_F(homa_pool, homa_pool_allocate__out_of_space)
 {
 	/* Queue up several RPCs to make sure they are properly sorted. */
-	struct homa_pool *pool = &self->hsk.buffer_pool;
+	struct homa_pool *pool = self->hsk.buffer_pool;
 	atomic_set(&pool->free_bpages, 0);
 	unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, &self->client_ip,
 			&self->server_ip, 4000, 98, 1000, 2000);
@@ -393,24 +720,224 @@ TEST_F(homa_pool, homa_pool_allocate__out_of_space)
 			&self->server_ip, 4000, 102, 1000, 2000);
 
 	ASSERT_EQ(0, atomic_read(&pool->free_bpages));
-	ASSERT_FALSE(list_empty(&self->hsk.waiting_for_bufs));
-	struct homa_rpc *rpc = list_first_entry(&self->hsk.waiting_for_bufs,
+	ASSERT_FALSE(list_empty(&self->hsk.buffer_pool->waiting_for_bufs));
+	struct homa_rpc *rpc = list_first_entry(&self->hsk.buffer_pool->waiting_for_bufs,
 			struct homa_rpc, buf_links);
 	EXPECT_EQ(98, rpc->id);
-	ASSERT_FALSE(list_is_last(&rpc->buf_links, &self->hsk.waiting_for_bufs));
+	ASSERT_FALSE(list_is_last(&rpc->buf_links, &self->hsk.buffer_pool->waiting_for_bufs));
 	rpc = list_next_entry(rpc, buf_links);
 	EXPECT_EQ(102, rpc->id);
-	ASSERT_FALSE(list_is_last(&rpc->buf_links, &self->hsk.waiting_for_bufs));
+	ASSERT_FALSE(list_is_last(&rpc->buf_links, &self->hsk.buffer_pool->waiting_for_bufs));
 	rpc = list_next_entry(rpc, buf_links);
 	EXPECT_EQ(100, rpc->id);
-	EXPECT_TRUE(list_is_last(&rpc->buf_links, &self->hsk.waiting_for_bufs));
+	EXPECT_TRUE(list_is_last(&rpc->buf_links, &self->hsk.buffer_pool->waiting_for_bufs));
 	EXPECT_EQ(3, homa_cores[cpu_number]->metrics.buffer_alloc_failures);
 	EXPECT_EQ(1, pool->bpages_needed);
 }
 
+TEST_F(homa_pool, homa_pool_allocate__reserve_prevents_deadlock)
+{
+	struct homa_pool *pool = self->hsk.buffer_pool;
+	struct homa_rpc *crpc1, *crpc2;
+
+	/* Without a reserve, a large message can consume all of the
+	 * remaining space, leaving none for short messages.
+	 */
+	atomic_set(&pool->free_bpages, 3);
+	crpc1 = unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT,
+			&self->client_ip, &self->server_ip, 4000, 98, 1000,
+			3*HOMA_BPAGE_SIZE);
+	ASSERT_NE(NULL, crpc1);
+	EXPECT_EQ(3, crpc1->msgin.num_bpages);
+	crpc2 = unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT,
+			&self->client_ip, &self->server_ip, 4000, 100, 1000,
+			2000);
+	ASSERT_NE(NULL, crpc2);
+	EXPECT_EQ(0, crpc2->msgin.num_bpages);
+	homa_rpc_free(crpc1);
+	homa_rpc_free(crpc2);
+
+	/* With a reserve, the large message waits and the short one gets
+	 * space.
+	 */
+	self->homa.bpage_reserve_pct = 10;
+	atomic_set(&pool->free_bpages, 12);
+	crpc1 = unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT,
+			&self->client_ip, &self->server_ip, 4000, 102, 1000,
+			3*HOMA_BPAGE_SIZE);
+	ASSERT_NE(NULL, crpc1);
+	EXPECT_EQ(0, crpc1->msgin.num_bpages);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.buffer_reserve_waits);
+	crpc2 = unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT,
+			&self->client_ip, &self->server_ip, 4000, 104, 1000,
+			2000);
+	ASSERT_NE(NULL, crpc2);
+	EXPECT_EQ(1, crpc2->msgin.num_bpages);
+}
+TEST_F(homa_pool, homa_pool_admit__basics)
+{
+	struct homa_pool *pool = self->hsk.buffer_pool;
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, &self->client_ip, &self->server_ip,
+			4000, 98, 1000, 1000);
+	ASSERT_NE(NULL, crpc);
+
+	self->homa.bpage_reserve_pct = 10;
+	self->homa.bpage_peer_max_pct = 5;
+	atomic_set(&pool->free_bpages, 13);
+	EXPECT_EQ(1, homa_pool_admit(pool, crpc, 3));
+	EXPECT_EQ(0, homa_pool_admit(pool, crpc, 4));
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.buffer_reserve_waits);
+}
+TEST_F(homa_pool, homa_pool_admit__reserve_capped_for_large_message)
+{
+	struct homa_pool *pool = self->hsk.buffer_pool;
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, &self->client_ip, &self->server_ip,
+			4000, 98, 1000, 1000);
+	ASSERT_NE(NULL, crpc);
+
+	self->homa.bpage_reserve_pct = 90;
+	EXPECT_EQ(1, homa_pool_admit(pool, crpc, 15));
+	atomic_set(&pool->free_bpages, 99);
+	EXPECT_EQ(0, homa_pool_admit(pool, crpc, 15));
+}
+TEST_F(homa_pool, homa_pool_admit__peer_limit)
+{
+	struct homa_pool *pool = self->hsk.buffer_pool;
+	struct in6_addr server_ip2 = unit_get_in_addr("1.2.3.5");
+	struct homa_rpc *crpc1, *crpc2, *crpc3;
+
+	self->homa.bpage_peer_max_pct = 5;
+	crpc1 = unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT,
+			&self->client_ip, &self->server_ip, 4000, 98, 1000,
+			150000);
+	ASSERT_NE(NULL, crpc1);
+	EXPECT_EQ(3, crpc1->msgin.num_bpages);
+	EXPECT_EQ(3, homa_pool_peer_bpages(pool, crpc1->peer));
+
+	crpc2 = unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT,
+			&self->client_ip, &self->server_ip, 4000, 100, 1000,
+			150000);
+	ASSERT_NE(NULL, crpc2);
+	EXPECT_EQ(0, crpc2->msgin.num_bpages);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.buffer_peer_waits);
+
+	/* A different peer isn't affected. */
+	crpc3 = unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT,
+			&self->client_ip, &server_ip2, 4000, 102, 1000,
+			150000);
+	ASSERT_NE(NULL, crpc3);
+	EXPECT_EQ(3, crpc3->msgin.num_bpages);
+}
+TEST_F(homa_pool, homa_pool_admit__peer_has_nothing_charged)
+{
+	struct homa_pool *pool = self->hsk.buffer_pool;
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, &self->client_ip, &self->server_ip,
+			4000, 98, 1000, 1000);
+	ASSERT_NE(NULL, crpc);
+
+	/* Even a message larger than the limit must be able to make
+	 * progress eventually.
+	 */
+	self->homa.bpage_peer_max_pct = 1;
+	EXPECT_EQ(1, homa_pool_admit(pool, crpc, 3));
+	crpc->msgin.charged_bpages = 1;
+	list_add_tail(&crpc->msgin.charged_links, &pool->charged_rpcs);
+	EXPECT_EQ(0, homa_pool_admit(pool, crpc, 3));
+}
+TEST_F(homa_pool, homa_pool_admit__peer_charges_are_per_pool)
+{
+	struct homa_rpc *crpc1, *crpc2;
+	struct homa_sock hsk2;
+
+	self->homa.bpage_peer_max_pct = 5;
+	mock_sock_init(&hsk2, &self->homa, 0);
+	crpc1 = unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT,
+			&self->client_ip, &self->server_ip, 4000, 98, 1000,
+			150000);
+	ASSERT_NE(NULL, crpc1);
+	EXPECT_EQ(3, crpc1->msgin.num_bpages);
+
+	/* Same peer, but a different pool: not held back by crpc1. */
+	crpc2 = unit_client_rpc(&hsk2, UNIT_RCVD_ONE_PKT,
+			&self->client_ip, &self->server_ip, 4000, 100, 1000,
+			150000);
+	ASSERT_NE(NULL, crpc2);
+	EXPECT_EQ(3, crpc2->msgin.num_bpages);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.buffer_peer_waits);
+	EXPECT_EQ(3, homa_pool_peer_bpages(self->hsk.buffer_pool,
+			crpc1->peer));
+	EXPECT_EQ(3, homa_pool_peer_bpages(hsk2.buffer_pool, crpc2->peer));
+	homa_sock_destroy(&hsk2);
+}
+
+TEST_F(homa_pool, homa_pool_peer_bpages)
+{
+	struct homa_pool *pool = self->hsk.buffer_pool;
+	struct in6_addr server_ip2 = unit_get_in_addr("1.2.3.5");
+	struct homa_rpc *crpc1, *crpc2, *crpc3;
+
+	crpc1 = unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT,
+			&self->client_ip, &self->server_ip, 4000, 98, 1000,
+			150000);
+	crpc2 = unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT,
+			&self->client_ip, &self->server_ip, 4000, 100, 1000,
+			2*HOMA_BPAGE_SIZE);
+	crpc3 = unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT,
+			&self->client_ip, &server_ip2, 4000, 102, 1000,
+			150000);
+	ASSERT_NE(NULL, crpc1);
+	ASSERT_NE(NULL, crpc2);
+	ASSERT_NE(NULL, crpc3);
+	EXPECT_EQ(5, homa_pool_peer_bpages(pool, crpc1->peer));
+	EXPECT_EQ(3, homa_pool_peer_bpages(pool, crpc3->peer));
+}
+
+TEST_F(homa_pool, homa_pool_uncharge)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_ONE_PKT, &self->client_ip, &self->server_ip,
+			4000, 98, 1000, 150000);
+	ASSERT_NE(NULL, crpc);
+	EXPECT_EQ(3, crpc->msgin.charged_bpages);
+	EXPECT_EQ(3, homa_pool_peer_bpages(self->hsk.buffer_pool,
+			crpc->peer));
+	homa_pool_uncharge(crpc);
+	EXPECT_EQ(0, crpc->msgin.charged_bpages);
+	EXPECT_EQ(0, homa_pool_peer_bpages(self->hsk.buffer_pool,
+			crpc->peer));
+	EXPECT_TRUE(list_empty(&self->hsk.buffer_pool->charged_rpcs));
+	homa_pool_uncharge(crpc);
+	EXPECT_EQ(0, homa_pool_peer_bpages(self->hsk.buffer_pool,
+			crpc->peer));
+}
+TEST_F(homa_pool, homa_pool_uncharge__recompute_bpages_needed)
+{
+	struct homa_pool *pool = self->hsk.buffer_pool;
+	struct homa_rpc *crpc1, *crpc2;
+
+	self->homa.bpage_peer_max_pct = 5;
+	crpc1 = unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT,
+			&self->client_ip, &self->server_ip, 4000, 98, 1000,
+			3*HOMA_BPAGE_SIZE);
+	ASSERT_NE(NULL, crpc1);
+	EXPECT_EQ(3, crpc1->msgin.num_bpages);
+	crpc2 = unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT,
+			&self->client_ip, &self->server_ip, 4000, 100, 1000,
+			3*HOMA_BPAGE_SIZE);
+	ASSERT_NE(NULL, crpc2);
+	EXPECT_EQ(0, crpc2->msgin.num_bpages);
+	EXPECT_EQ(INT_MAX, pool->bpages_needed);
+
+	homa_pool_uncharge(crpc1);
+	EXPECT_EQ(3, pool->bpages_needed);
+}
+
 TEST_F(homa_pool, homa_pool_get_buffer)
 {
-	struct homa_pool *pool = &self->hsk.buffer_pool;
+	struct homa_pool *pool = self->hsk.buffer_pool;
 	int available;
 	void *buffer;
 
@@ -428,7 +955,7 @@ TEST_F(homa_pool, homa_pool_get_buffer)
 
 TEST_F(homa_pool, homa_pool_release_buffers__basics)
 {
-	struct homa_pool *pool = &self->hsk.buffer_pool;
+	struct homa_pool *pool = self->hsk.buffer_pool;
 	char *saved_region;
 
 	struct homa_rpc *crpc1 = unit_client_rpc(&self->hsk,
@@ -451,6 +978,8 @@ TEST_F(homa_pool, homa_pool_release_buffers__basics)
 	EXPECT_EQ(0, atomic_read(&pool->descriptors[1].refs));
 	EXPECT_EQ(2, atomic_read(&pool->descriptors[2].refs));
 	EXPECT_EQ(99, atomic_read(&pool->free_bpages));
+	EXPECT_EQ(1, homa_pool_pop(pool, cpu_number));
+	EXPECT_EQ(0, homa_pool_pop(pool, cpu_number));
 
 	/* Ignore requests if pool not initialized. */
 	saved_region = pool->region;
@@ -461,9 +990,151 @@ TEST_F(homa_pool, homa_pool_release_buffers__basics)
 	pool->region = saved_region;
 }
 
+TEST_F(homa_pool, homa_pool_pop__refill_from_global_stack)
+{
+	struct homa_pool *pool = self->hsk.buffer_pool;
+	EXPECT_EQ(0, homa_pool_pop(pool, 2));
+	EXPECT_EQ(HOMA_POOL_BATCH - 1, pool->cores[2].num_free);
+	EXPECT_EQ(100 - HOMA_POOL_BATCH, pool->nodes[0].free_top);
+	EXPECT_EQ(1, homa_pool_pop(pool, 2));
+	EXPECT_EQ(HOMA_POOL_BATCH, homa_pool_pop(pool, 3));
+	EXPECT_EQ(2, homa_cores[cpu_number]->metrics.bpage_refills);
+}
+TEST_F(homa_pool, homa_pool_pop__global_stack_nearly_empty)
+{
+	struct homa_pool *pool = self->hsk.buffer_pool;
+	pool->nodes[0].free_top = 2;
+	EXPECT_EQ(98, homa_pool_pop(pool, 2));
+	EXPECT_EQ(99, homa_pool_pop(pool, 2));
+	EXPECT_EQ(-1, homa_pool_pop(pool, 2));
+	EXPECT_EQ(0, pool->nodes[0].free_top);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.bpage_refills);
+}
+
+TEST_F(homa_pool, homa_pool_push__basics)
+{
+	struct homa_pool *pool = self->hsk.buffer_pool;
+	homa_pool_push(pool, 44);
+	homa_pool_push(pool, 45);
+	EXPECT_EQ(2, pool->cores[cpu_number].num_free);
+	EXPECT_EQ(45, homa_pool_pop(pool, cpu_number));
+	EXPECT_EQ(44, homa_pool_pop(pool, cpu_number));
+}
+TEST_F(homa_pool, homa_pool_push__cache_full)
+{
+	struct homa_pool *pool = self->hsk.buffer_pool;
+	int i;
+
+	pool->nodes[0].free_top = 0;
+	for (i = 0; i < HOMA_POOL_CACHE_SIZE; i++)
+		homa_pool_push(pool, i);
+	EXPECT_EQ(0, pool->nodes[0].free_top);
+	homa_pool_push(pool, 50);
+	EXPECT_EQ(HOMA_POOL_BATCH, pool->nodes[0].free_top);
+	EXPECT_EQ(HOMA_POOL_BATCH - 1, pool->nodes[0].free_stack[HOMA_POOL_BATCH - 1]);
+	EXPECT_EQ(HOMA_POOL_CACHE_SIZE - HOMA_POOL_BATCH + 1,
+			pool->cores[cpu_number].num_free);
+	EXPECT_EQ(HOMA_POOL_BATCH, pool->cores[cpu_number].free[0]);
+	EXPECT_EQ(50, homa_pool_pop(pool, cpu_number));
+}
+TEST_F(homa_pool, homa_pool_push__bpage_from_other_node)
+{
+	struct homa_pool *pool;
+
+	mock_cpu_node[4] = mock_cpu_node[5] = 1;
+	homa_pool_detach(&self->hsk);
+	ASSERT_EQ(0, homa_pool_init(&self->hsk, (void *) 0x1000000,
+			100*HOMA_BPAGE_SIZE, 0));
+	pool = self->hsk.buffer_pool;
+	pool->nodes[1].free_top = 0;
+	homa_pool_push(pool, 60);
+	EXPECT_EQ(0, pool->cores[cpu_number].num_free);
+	EXPECT_EQ(1, pool->nodes[1].free_top);
+	EXPECT_EQ(60, pool->nodes[1].free_stack[0]);
+}
+
+TEST_F(homa_pool, homa_pool_steal__no_free_pages)
+{
+	struct homa_pool *pool = self->hsk.buffer_pool;
+	EXPECT_EQ(-1, homa_pool_steal(pool, 2, -1));
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.bpage_steals);
+}
+TEST_F(homa_pool, homa_pool_steal__wrap_around)
+{
+	struct homa_pool *pool = self->hsk.buffer_pool;
+	pool->cores[0].free[0] = 12;
+	pool->cores[0].num_free = 1;
+	pool->cores[4].free[0] = 13;
+	pool->cores[4].num_free = 1;
+	EXPECT_EQ(12, homa_pool_steal(pool, 5, -1));
+	EXPECT_EQ(13, homa_pool_steal(pool, 5, -1));
+	EXPECT_EQ(-1, homa_pool_steal(pool, 5, -1));
+	EXPECT_EQ(2, homa_cores[cpu_number]->metrics.bpage_steals);
+}
+TEST_F(homa_pool, homa_pool_steal__only_from_node)
+{
+	struct homa_pool *pool;
+
+	mock_cpu_node[4] = mock_cpu_node[5] = 1;
+	homa_pool_detach(&self->hsk);
+	ASSERT_EQ(0, homa_pool_init(&self->hsk, (void *) 0x1000000,
+			100*HOMA_BPAGE_SIZE, 0));
+	pool = self->hsk.buffer_pool;
+	pool->cores[2].free[0] = 12;
+	pool->cores[2].num_free = 1;
+	pool->cores[5].free[0] = 70;
+	pool->cores[5].num_free = 1;
+	EXPECT_EQ(70, homa_pool_steal(pool, cpu_number, 1));
+	EXPECT_EQ(-1, homa_pool_steal(pool, cpu_number, 1));
+	EXPECT_EQ(12, homa_pool_steal(pool, cpu_number, 0));
+}
+
+TEST_F(homa_pool, homa_pool_reclaim__basics)
+{
+	struct homa_pool *pool = self->hsk.buffer_pool;
+	mock_cycles = 5000;
+
+	/* Page 10: can be reclaimed. */
+	atomic_set(&pool->descriptors[10].refs, 1);
+	pool->descriptors[10].owner = 3;
+	pool->descriptors[10].expiration = mock_cycles - 1;
+
+	/* Page 11: lease hasn't expired. */
+	atomic_set(&pool->descriptors[11].refs, 1);
+	pool->descriptors[11].owner = 3;
+	pool->descriptors[11].expiration = mock_cycles + 1;
+
+	/* Page 12: has allocations. */
+	atomic_set(&pool->descriptors[12].refs, 2);
+	pool->descriptors[12].owner = 3;
+	pool->descriptors[12].expiration = mock_cycles - 1;
+
+	/* Page 13: not owned. */
+	atomic_set(&pool->descriptors[13].refs, 1);
+
+	atomic_set(&pool->free_bpages, 0);
+	EXPECT_EQ(1, homa_pool_reclaim(pool, mock_cycles));
+	EXPECT_EQ(0, atomic_read(&pool->descriptors[10].refs));
+	EXPECT_EQ(-1, pool->descriptors[10].owner);
+	EXPECT_EQ(3, pool->descriptors[11].owner);
+	EXPECT_EQ(1, atomic_read(&pool->free_bpages));
+	EXPECT_EQ(10, homa_pool_pop(pool, cpu_number));
+}
+TEST_F(homa_pool, homa_pool_reclaim__cant_lock_page)
+{
+	struct homa_pool *pool = self->hsk.buffer_pool;
+	mock_cycles = 5000;
+	atomic_set(&pool->descriptors[10].refs, 1);
+	pool->descriptors[10].owner = 3;
+	pool->descriptors[10].expiration = mock_cycles - 1;
+	mock_trylock_errors = 1;
+	EXPECT_EQ(0, homa_pool_reclaim(pool, mock_cycles));
+	EXPECT_EQ(3, pool->descriptors[10].owner);
+}
+
 TEST_F(homa_pool, homa_pool_check_waiting__basics)
 {
-	struct homa_pool *pool = &self->hsk.buffer_pool;
+	struct homa_pool *pool = self->hsk.buffer_pool;
 
         /* Queue up 2 RPCs that together need a total of 5 bpages. */
 	atomic_set(&pool->free_bpages, 0);
@@ -497,7 +1168,7 @@ TEST_F(homa_pool, homa_pool_check_waiting__basics)
 }
 TEST_F(homa_pool, homa_pool_check_waiting__bpages_needed_but_no_queued_rpcs)
 {
-	struct homa_pool *pool = &self->hsk.buffer_pool;
+	struct homa_pool *pool = self->hsk.buffer_pool;
 	pool->bpages_needed = 1;
 	homa_pool_check_waiting(pool);
 	EXPECT_EQ(100, atomic_read(&pool->free_bpages));
@@ -505,7 +1176,7 @@ TEST_F(homa_pool, homa_pool_check_waiting__bpages_needed_but_no_queued_rpcs)
 }
 TEST_F(homa_pool, homa_pool_check_waiting__rpc_initially_locked)
 {
-	struct homa_pool *pool = &self->hsk.buffer_pool;
+	struct homa_pool *pool = self->hsk.buffer_pool;
 
 	atomic_set(&pool->free_bpages, 0);
 	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
@@ -522,11 +1193,11 @@ TEST_F(homa_pool, homa_pool_check_waiting__rpc_initially_locked)
 			"rpc lock unavailable in homa_pool_release_buffers",
 			unit_log_get());
 	EXPECT_EQ(1, crpc->msgin.num_bpages);
-	EXPECT_TRUE(list_empty(&self->hsk.waiting_for_bufs));
+	EXPECT_TRUE(list_empty(&self->hsk.buffer_pool->waiting_for_bufs));
 }
 TEST_F(homa_pool, homa_pool_check_waiting__reset_bpages_needed)
 {
-	struct homa_pool *pool = &self->hsk.buffer_pool;
+	struct homa_pool *pool = self->hsk.buffer_pool;
 
 	atomic_set(&pool->free_bpages, 0);
 	struct homa_rpc *crpc1 = unit_client_rpc(&self->hsk,
@@ -551,7 +1222,7 @@ TEST_F(homa_pool, homa_pool_check_waiting__reset_bpages_needed)
 }
 TEST_F(homa_pool, homa_pool_check_waiting__wake_up_waiting_rpc)
 {
-	struct homa_pool *pool = &self->hsk.buffer_pool;
+	struct homa_pool *pool = self->hsk.buffer_pool;
 
         /* Queue up an RPC that needs 2 bpages. */
 	atomic_set(&pool->free_bpages, 0);
@@ -569,9 +1240,47 @@ TEST_F(homa_pool, homa_pool_check_waiting__wake_up_waiting_rpc)
 	EXPECT_EQ(2, crpc->msgin.num_bpages);
 	EXPECT_STREQ("xmit GRANT 10000@0 resend_all", unit_log_get());
 }
+TEST_F(homa_pool, homa_pool_check_waiting__skip_rpcs_held_back_by_peer)
+{
+	struct homa_pool *pool = self->hsk.buffer_pool;
+	struct in6_addr server_ip2 = unit_get_in_addr("1.2.3.5");
+	struct homa_rpc *crpc1, *crpc2, *crpc3;
+
+	/* crpc1 uses up its peer's share of the pool, so crpc2 (same peer)
+	 * must wait even after crpc3 (different peer) gets space.
+	 */
+	self->homa.bpage_peer_max_pct = 5;
+	crpc1 = unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT,
+			&self->client_ip, &self->server_ip, 4000, 98, 1000,
+			3*HOMA_BPAGE_SIZE);
+	ASSERT_NE(NULL, crpc1);
+	EXPECT_EQ(3, crpc1->msgin.num_bpages);
+	atomic_set(&pool->free_bpages, 0);
+	crpc2 = unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT,
+			&self->client_ip, &self->server_ip, 4000, 100, 1000,
+			3*HOMA_BPAGE_SIZE);
+	ASSERT_NE(NULL, crpc2);
+	crpc3 = unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT,
+			&self->client_ip, &server_ip2, 4000, 102, 1000,
+			3*HOMA_BPAGE_SIZE);
+	ASSERT_NE(NULL, crpc3);
+	EXPECT_EQ(3, pool->bpages_needed);
+
+	atomic_set(&pool->free_bpages, 10);
+	homa_pool_check_waiting(pool);
+	EXPECT_EQ(0, crpc2->msgin.num_bpages);
+	EXPECT_EQ(3, crpc3->msgin.num_bpages);
+	EXPECT_EQ(INT_MAX, pool->bpages_needed);
+
+	/* Once crpc1's message completes, crpc2 can proceed. */
+	homa_pool_uncharge(crpc1);
+	homa_pool_check_waiting(pool);
+	EXPECT_EQ(3, crpc2->msgin.num_bpages);
+	EXPECT_TRUE(list_empty(&pool->waiting_for_bufs));
+}
 TEST_F(homa_pool, homa_pool_check_waiting__reallocation_fails)
 {
-	struct homa_pool *pool = &self->hsk.buffer_pool;
+	struct homa_pool *pool = self->hsk.buffer_pool;
 
         /* Queue up an RPC that needs 4 bpages. */
 	atomic_set(&pool->free_bpages, 0);
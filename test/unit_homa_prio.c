@@ -0,0 +1,281 @@
+/* Copyright (c) 2024 Homa Developers
+ * SPDX-License-Identifier: BSD-1-Clause
+ */
+
+#include "homa_impl.h"
+#define KSELFTEST_NOT_MAIN 1
+#include "kselftest_harness.h"
+#include "ccutils.h"
+#include "mock.h"
+#include "utils.h"
+
+/* Bucket indexes for a few message sizes. */
+#define BUCKET_100 1
+#define BUCKET_1000 15
+#define BUCKET_5000 (HOMA_NUM_SMALL_COUNTS + 4)
+#define BUCKET_LARGE (HOMA_PRIO_BUCKETS - 1)
+
+FIXTURE(homa_prio) {
+	struct homa homa;
+	struct homa_prio_tuner *tuner;
+};
+FIXTURE_SETUP(homa_prio)
+{
+	homa_init(&self->homa);
+	self->homa.num_priorities = 8;
+	self->homa.unsched_bytes = 10000;
+	self->homa.prio_autotune = 1;
+	self->homa.prio_autotune_interval = 10;
+	self->tuner = self->homa.prio_tuner;
+	unit_log_clear();
+}
+FIXTURE_TEARDOWN(homa_prio)
+{
+	homa_destroy(&self->homa);
+	unit_teardown();
+}
+
+/* Fill in the metrics for a mix of message sizes: 100000 bytes each
+ * of 100-byte, 1000-byte, and 5000-byte messages, plus one 200000-byte
+ * message.
+ */
+static void add_traffic(void)
+{
+	struct homa_metrics *m = &homa_cores[cpu_number]->metrics;
+
+	m->small_msg_bytes[BUCKET_100] += 100000;
+	m->small_msg_bytes[BUCKET_1000] += 100000;
+	m->medium_msg_bytes[4] += 100000;
+	m->large_msg_count += 1;
+	m->large_msg_bytes += 200000;
+}
+
+/* Store the same traffic as add_traffic directly in the tuner. */
+static void set_histogram(struct homa_prio_tuner *tuner)
+{
+	memset(tuner->bytes, 0, sizeof(tuner->bytes));
+	memset(tuner->msgs, 0, sizeof(tuner->msgs));
+	tuner->bytes[BUCKET_100] = 100000;
+	tuner->msgs[BUCKET_100] = 1000;
+	tuner->bytes[BUCKET_1000] = 100000;
+	tuner->msgs[BUCKET_1000] = 100;
+	tuner->bytes[BUCKET_5000] = 100000;
+	tuner->msgs[BUCKET_5000] = 20;
+	tuner->bytes[BUCKET_LARGE] = 200000;
+	tuner->msgs[BUCKET_LARGE] = 1;
+}
+
+TEST_F(homa_prio, homa_prio_sysctl_changed)
+{
+	self->homa.prio_autotune_interval = 0;
+	self->homa.prio_autotune_min_msgs = -5;
+	self->homa.prio_autotune_min_drift = -1;
+	homa_prio_sysctl_changed(&self->homa);
+	EXPECT_EQ(1, self->homa.prio_autotune_interval);
+	EXPECT_EQ(1, self->homa.prio_autotune_min_msgs);
+	EXPECT_EQ(0, self->homa.prio_autotune_min_drift);
+}
+
+TEST_F(homa_prio, homa_prio_check__disabled)
+{
+	self->tuner->active = 1;
+	self->homa.prio_autotune = 0;
+	homa_prio_check(&self->homa);
+	EXPECT_EQ(0, self->tuner->active);
+}
+TEST_F(homa_prio, homa_prio_check__first_call_ignores_old_traffic)
+{
+	add_traffic();
+	homa_prio_check(&self->homa);
+	EXPECT_EQ(1, self->tuner->active);
+	EXPECT_EQ(10, self->tuner->next_tick);
+	EXPECT_EQ(100000, self->tuner->prev_bytes[BUCKET_100]);
+	EXPECT_EQ(1, self->tuner->prev_large_count);
+	EXPECT_EQ(0, self->tuner->bytes[BUCKET_100]);
+	EXPECT_EQ(0, self->tuner->msgs[BUCKET_LARGE]);
+}
+TEST_F(homa_prio, homa_prio_check__not_time_yet)
+{
+	homa_prio_check(&self->homa);
+	add_traffic();
+	self->homa.timer_ticks = 9;
+	homa_prio_check(&self->homa);
+	EXPECT_EQ(0, self->tuner->bytes[BUCKET_100]);
+	self->homa.timer_ticks = 10;
+	homa_prio_check(&self->homa);
+	EXPECT_EQ(100000, self->tuner->bytes[BUCKET_100]);
+	EXPECT_EQ(20, self->tuner->next_tick);
+}
+TEST_F(homa_prio, homa_prio_check__decay_and_estimate_messages)
+{
+	homa_prio_check(&self->homa);
+	self->tuner->bytes[BUCKET_100] = 5000;
+	self->tuner->msgs[BUCKET_100] = 50;
+	self->tuner->msgs[BUCKET_LARGE] = 3;
+	add_traffic();
+	self->homa.timer_ticks = 10;
+	homa_prio_check(&self->homa);
+	EXPECT_EQ(102500, self->tuner->bytes[BUCKET_100]);
+	EXPECT_EQ(1067, self->tuner->msgs[BUCKET_100]);
+	EXPECT_EQ(101, self->tuner->msgs[BUCKET_1000]);
+	EXPECT_EQ(22, self->tuner->msgs[BUCKET_5000]);
+	EXPECT_EQ(2, self->tuner->msgs[BUCKET_LARGE]);
+}
+TEST_F(homa_prio, homa_prio_check__not_enough_messages)
+{
+	int version = self->homa.cutoff_version;
+
+	self->homa.prio_autotune_min_msgs = 2000;
+	homa_prio_check(&self->homa);
+	add_traffic();
+	self->homa.timer_ticks = 10;
+	homa_prio_check(&self->homa);
+	EXPECT_EQ(version, self->homa.cutoff_version);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.prio_autotune_updates);
+}
+TEST_F(homa_prio, homa_prio_check__install_cutoffs)
+{
+	int version = self->homa.cutoff_version;
+
+	homa_prio_check(&self->homa);
+	add_traffic();
+	self->homa.timer_ticks = 10;
+	homa_prio_check(&self->homa);
+	EXPECT_EQ(version + 1, self->homa.cutoff_version);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.prio_autotune_updates);
+	EXPECT_EQ(128, self->homa.unsched_cutoffs[7]);
+	EXPECT_EQ(1024, self->homa.unsched_cutoffs[6]);
+	EXPECT_EQ(5120, self->homa.unsched_cutoffs[5]);
+	EXPECT_EQ(HOMA_MAX_MESSAGE_LENGTH, self->homa.unsched_cutoffs[4]);
+	EXPECT_EQ(INT_MAX, self->homa.unsched_cutoffs[0]);
+	EXPECT_EQ(3, self->homa.max_sched_prio);
+	EXPECT_EQ(128, self->tuner->deciles[0]);
+	EXPECT_EQ(8, self->tuner->num_priorities);
+}
+TEST_F(homa_prio, homa_prio_check__drift_too_small)
+{
+	int version = self->homa.cutoff_version;
+
+	homa_prio_check(&self->homa);
+	add_traffic();
+	self->homa.timer_ticks = 10;
+	homa_prio_check(&self->homa);
+	EXPECT_EQ(version + 1, self->homa.cutoff_version);
+
+	/* Same traffic mix again: the deciles don't change. */
+	self->homa.unsched_cutoffs[7] = 300;
+	add_traffic();
+	self->homa.timer_ticks = 20;
+	homa_prio_check(&self->homa);
+	EXPECT_EQ(version + 1, self->homa.cutoff_version);
+	EXPECT_EQ(300, self->homa.unsched_cutoffs[7]);
+
+	/* num_priorities changed: must recompute even without drift. */
+	self->homa.num_priorities = 7;
+	add_traffic();
+	self->homa.timer_ticks = 30;
+	homa_prio_check(&self->homa);
+	EXPECT_EQ(version + 2, self->homa.cutoff_version);
+	EXPECT_EQ(128, self->homa.unsched_cutoffs[6]);
+}
+TEST_F(homa_prio, homa_prio_check__cutoffs_unchanged)
+{
+	int version;
+
+	homa_prio_check(&self->homa);
+	add_traffic();
+	self->homa.timer_ticks = 10;
+	homa_prio_check(&self->homa);
+	version = self->homa.cutoff_version;
+
+	/* Distribution drifts but cutoffs come out the same. */
+	memset(self->tuner->deciles, 0, sizeof(self->tuner->deciles));
+	add_traffic();
+	self->homa.timer_ticks = 20;
+	homa_prio_check(&self->homa);
+	EXPECT_EQ(version, self->homa.cutoff_version);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.prio_autotune_updates);
+}
+
+TEST_F(homa_prio, homa_prio_compute__basics)
+{
+	int cutoffs[HOMA_MAX_PRIORITIES];
+
+	set_histogram(self->tuner);
+	homa_prio_compute(&self->homa, cutoffs);
+	EXPECT_EQ(128, cutoffs[7]);
+	EXPECT_EQ(1024, cutoffs[6]);
+	EXPECT_EQ(5120, cutoffs[5]);
+	EXPECT_EQ(HOMA_MAX_MESSAGE_LENGTH, cutoffs[4]);
+	EXPECT_EQ(HOMA_MAX_MESSAGE_LENGTH, cutoffs[0]);
+}
+TEST_F(homa_prio, homa_prio_compute__partly_scheduled_bucket)
+{
+	int cutoffs[HOMA_MAX_PRIORITIES];
+
+	/* Only the first 1000 bytes of the 5000-byte messages are now
+	 * unscheduled, so they no longer get a priority of their own.
+	 */
+	self->homa.unsched_bytes = 1000;
+	set_histogram(self->tuner);
+	homa_prio_compute(&self->homa, cutoffs);
+	EXPECT_EQ(128, cutoffs[7]);
+	EXPECT_EQ(1024, cutoffs[6]);
+	EXPECT_EQ(HOMA_MAX_MESSAGE_LENGTH, cutoffs[5]);
+}
+TEST_F(homa_prio, homa_prio_compute__unused_priorities)
+{
+	int cutoffs[HOMA_MAX_PRIORITIES];
+
+	self->homa.num_priorities = 4;
+	set_histogram(self->tuner);
+	homa_prio_compute(&self->homa, cutoffs);
+	EXPECT_EQ(0, cutoffs[7]);
+	EXPECT_EQ(0, cutoffs[4]);
+	EXPECT_EQ(1024, cutoffs[3]);
+	EXPECT_EQ(HOMA_MAX_MESSAGE_LENGTH, cutoffs[2]);
+}
+TEST_F(homa_prio, homa_prio_compute__no_traffic)
+{
+	int cutoffs[HOMA_MAX_PRIORITIES];
+	int i;
+
+	memset(self->tuner->bytes, 0, sizeof(self->tuner->bytes));
+	memset(self->tuner->msgs, 0, sizeof(self->tuner->msgs));
+	homa_prio_compute(&self->homa, cutoffs);
+	for (i = 0; i < HOMA_MAX_PRIORITIES; i++)
+		EXPECT_EQ(HOMA_MAX_MESSAGE_LENGTH, cutoffs[i]);
+}
+
+TEST_F(homa_prio, homa_prio_deciles)
+{
+	int deciles[9];
+
+	set_histogram(self->tuner);
+	homa_prio_deciles(self->tuner, deciles);
+	EXPECT_EQ(128, deciles[0]);
+	EXPECT_EQ(128, deciles[7]);
+	EXPECT_EQ(1024, deciles[8]);
+}
+TEST_F(homa_prio, homa_prio_deciles__no_messages)
+{
+	int deciles[9];
+
+	memset(self->tuner->msgs, 0, sizeof(self->tuner->msgs));
+	homa_prio_deciles(self->tuner, deciles);
+	EXPECT_EQ(HOMA_MAX_MESSAGE_LENGTH, deciles[0]);
+	EXPECT_EQ(HOMA_MAX_MESSAGE_LENGTH, deciles[8]);
+}
+
+TEST_F(homa_prio, homa_prio_drift)
+{
+	int d1[9] = {100, 200, 300, 400, 500, 600, 700, 800, 1000};
+	int d2[9] = {100, 200, 300, 400, 500, 600, 700, 800, 500};
+	int d3[9] = {0, 0, 0, 0, 0, 0, 0, 0, 0};
+
+	EXPECT_EQ(0, homa_prio_drift(d1, d1));
+	EXPECT_EQ(500, homa_prio_drift(d1, d2));
+	EXPECT_EQ(500, homa_prio_drift(d2, d1));
+	EXPECT_EQ(9000, homa_prio_drift(d1, d3));
+	EXPECT_EQ(0, homa_prio_drift(d3, d3));
+}
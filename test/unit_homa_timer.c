@@ -44,6 +44,29 @@ FIXTURE_TEARDOWN(homa_timer)
 	unit_teardown();
 }
 
+TEST_F(homa_timer, homa_check_rpc__release_stale_pregrant)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 100, 100);
+	ASSERT_NE(NULL, crpc);
+	crpc->msgin.rec_incoming = 20000;
+	crpc->pregrant_timer_ticks = 100;
+	atomic_set(&self->homa.total_incoming, 25000);
+
+	/* First call: reservation is still recent. */
+	self->homa.timer_ticks = 101;
+	homa_check_rpc(crpc);
+	EXPECT_EQ(20000, crpc->msgin.rec_incoming);
+	EXPECT_EQ(25000, atomic_read(&self->homa.total_incoming));
+
+	/* Second call: release the reservation. */
+	self->homa.timer_ticks = 102;
+	homa_check_rpc(crpc);
+	EXPECT_EQ(0, crpc->msgin.rec_incoming);
+	EXPECT_EQ(5000, atomic_read(&self->homa.total_incoming));
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.resp_pregrant_expirations);
+}
 TEST_F(homa_timer, homa_check_rpc__request_ack)
 {
 	struct homa_rpc *srpc = unit_server_rpc(&self->hsk, UNIT_OUTGOING,
@@ -177,6 +200,29 @@ TEST_F(homa_timer, homa_check_rpc__check_for_resend)
 	homa_check_rpc(crpc);
 	EXPECT_STREQ("xmit RESEND 0-99@7", unit_log_get());
 }
+TEST_F(homa_timer, homa_check_rpc__resend_carries_acks)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 50000, 200);
+	ASSERT_NE(NULL, crpc);
+	self->homa.resend_ticks = 3;
+	self->homa.resend_interval = 2;
+	crpc->msgout.granted = 0;
+	crpc->peer->acks[0] = (struct homa_ack) {
+			.client_port = htons(self->client_port),
+			.server_port = htons(self->server_port),
+			.client_id = cpu_to_be64(self->client_id + 2)};
+	crpc->peer->num_acks = 1;
+
+	crpc->silent_ticks = 3;
+	unit_log_clear();
+	mock_xmit_log_verbose = 1;
+	homa_check_rpc(crpc);
+	EXPECT_SUBSTR("resend_prio 7, acks [cp 40000, sp 99, id 1236]",
+			unit_log_get());
+	EXPECT_EQ(0, crpc->peer->num_acks);
+}
 
 TEST_F(homa_timer, homa_timer__basics)
 {
@@ -149,6 +149,19 @@ TEST_F(homa_utils, homa_rpc_new_server__normal)
 	EXPECT_EQ(1, created);
 	homa_rpc_free(srpc);
 }
+TEST_F(homa_utils, homa_rpc_new_server__resp_incoming)
+{
+	int created;
+	struct homa_rpc *srpc;
+
+	self->data.resp_incoming = htonl(30000);
+	srpc = homa_rpc_new_server(&self->hsk, self->client_ip, &self->data,
+			&created);
+	ASSERT_FALSE(IS_ERR(srpc));
+	homa_rpc_unlock(srpc);
+	EXPECT_EQ(30000, srpc->resp_incoming);
+	homa_rpc_free(srpc);
+}
 TEST_F(homa_utils, homa_rpc_new_server__already_exists)
 {
 	int created;
@@ -221,7 +234,7 @@ TEST_F(homa_utils, homa_rpc_new_server__no_buffer_pool)
 	int created;
 	self->data.message_length = N(1400);
 	self->data.seg.segment_length = N(1400);
-	homa_pool_destroy(&self->hsk.buffer_pool);
+	homa_pool_detach(&self->hsk);
 	struct homa_rpc *srpc = homa_rpc_new_server(&self->hsk,
 			self->client_ip, &self->data, &created);
 	ASSERT_TRUE(IS_ERR(srpc));
@@ -246,7 +259,7 @@ TEST_F(homa_utils, homa_rpc_new_server__dont_handoff_no_buffers)
 	int created;
 	self->data.message_length = N(1400);
 	self->data.seg.segment_length = N(1400);
-	atomic_set(&self->hsk.buffer_pool.free_bpages,0 );
+	atomic_set(self->hsk.buffer_pool->free_bpages,0 );
 	struct homa_rpc *srpc = homa_rpc_new_server(&self->hsk,
 			self->client_ip, &self->data, &created);
 	ASSERT_FALSE(IS_ERR(srpc));
@@ -286,18 +299,79 @@ TEST_F(homa_utils, homa_bucket_lock_slow)
 
 	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.client_lock_misses);
 	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.client_lock_miss_cycles);
-	homa_bucket_lock_slow(crpc->bucket, crpc->id);
+	homa_bucket_lock_slow(crpc->bucket, crpc->id, "unit test");
 	homa_rpc_unlock(crpc);
 	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.client_lock_misses);
 	EXPECT_NE(0, homa_cores[cpu_number]->metrics.client_lock_miss_cycles);
 	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.server_lock_misses);
 	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.server_lock_miss_cycles);
-	homa_bucket_lock_slow(srpc->bucket, srpc->id);
+	homa_bucket_lock_slow(srpc->bucket, srpc->id, "unit test");
 	homa_rpc_unlock(srpc);
 	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.server_lock_misses);
 	EXPECT_NE(0, homa_cores[cpu_number]->metrics.server_lock_miss_cycles);
 }
 
+TEST_F(homa_utils, homa_lock_miss__basics)
+{
+	struct homa_core *core = homa_cores[cpu_number];
+	char *locker = "locker1";
+	int i, found = 0;
+
+	homa_lock_miss(HOMA_LOCK_SOCKET, locker, 100);
+	homa_lock_miss(HOMA_LOCK_SOCKET, locker, 5000);
+	homa_lock_miss(HOMA_LOCK_THROTTLE, locker, 600);
+	for (i = 0; i < HOMA_MAX_LOCK_SITES; i++) {
+		struct homa_lock_site *site = &core->lock_sites[i];
+
+		if (site->locker == NULL)
+			continue;
+		found++;
+		EXPECT_EQ(locker, site->locker);
+		if (site->lock_class == HOMA_LOCK_SOCKET) {
+			EXPECT_EQ(2, site->misses);
+			EXPECT_EQ(5100, site->miss_cycles);
+			EXPECT_EQ(1, site->histogram[0]);
+			EXPECT_EQ(1, site->histogram[4]);
+		} else {
+			EXPECT_EQ(HOMA_LOCK_THROTTLE, site->lock_class);
+			EXPECT_EQ(1, site->misses);
+			EXPECT_EQ(1, site->histogram[1]);
+		}
+	}
+	EXPECT_EQ(2, found);
+	EXPECT_EQ(0, core->metrics.lock_site_overflows);
+}
+TEST_F(homa_utils, homa_lock_miss__table_full)
+{
+	static char lockers[HOMA_MAX_LOCK_SITES + 1];
+	int i;
+
+	for (i = 0; i <= HOMA_MAX_LOCK_SITES; i++)
+		homa_lock_miss(HOMA_LOCK_BPAGE, &lockers[i], 1000);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.lock_site_overflows);
+}
+TEST_F(homa_utils, homa_lock_bucket)
+{
+	EXPECT_EQ(0, homa_lock_bucket(0));
+	EXPECT_EQ(0, homa_lock_bucket(511));
+	EXPECT_EQ(1, homa_lock_bucket(512));
+	EXPECT_EQ(1, homa_lock_bucket(1023));
+	EXPECT_EQ(2, homa_lock_bucket(1024));
+	EXPECT_EQ(HOMA_NUM_LOCK_BUCKETS-1, homa_lock_bucket(1ULL << 40));
+}
+TEST_F(homa_utils, homa_print_lock_sites)
+{
+	homa_lock_miss(HOMA_LOCK_SOCKET, "homa_socket_shutdown #2", 1000);
+	self->homa.metrics_length = 0;
+	homa_print_lock_sites(&self->homa, homa_cores[cpu_number]);
+	EXPECT_STREQ("lock_socket_homa_socket_shutdown__2_misses               1  "
+			"Misses for socket lock in homa_socket_shutdown #2\n"
+			"lock_socket_homa_socket_shutdown__2_cycles            1000  "
+			"Time waiting for socket lock in "
+			"homa_socket_shutdown #2\n"
+			"lock_socket_homa_socket_shutdown__2_wait_1                1  "
+			"Misses waiting >= 512 cycles\n", self->homa.metrics);
+}
 TEST_F(homa_utils, homa_rpc_acked__basics)
 {
 	struct homa_sock hsk;
@@ -378,6 +452,18 @@ TEST_F(homa_utils, homa_rpc_free__basics)
 	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
 	EXPECT_EQ(1, unit_list_length(&self->hsk.dead_rpcs));
 }
+TEST_F(homa_utils, homa_rpc_free__uncharge_peer)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_ONE_PKT, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 1000, 150000);
+	ASSERT_NE(NULL, crpc);
+	EXPECT_EQ(3, homa_pool_peer_bpages(self->hsk.buffer_pool,
+			crpc->peer));
+	homa_rpc_free(crpc);
+	EXPECT_EQ(0, homa_pool_peer_bpages(self->hsk.buffer_pool,
+			crpc->peer));
+}
 TEST_F(homa_utils, homa_rpc_free__already_dead)
 {
 	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
@@ -599,7 +685,7 @@ TEST_F(homa_utils, homa_rpc_reap__hit_limit_in_msgin_packets)
 }
 TEST_F(homa_utils, homa_rpc_reap__release_buffers)
 {
-	struct homa_pool *pool = &self->hsk.buffer_pool;
+	struct homa_pool *pool = self->hsk.buffer_pool;
 	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
 			UNIT_RCVD_ONE_PKT, self->client_ip, self->server_ip,
 			4000, 98, 1000,	150000);
@@ -608,10 +694,10 @@ TEST_F(homa_utils, homa_rpc_reap__release_buffers)
 	EXPECT_EQ(1, atomic_read(&pool->descriptors[1].refs));
 	homa_rpc_free(crpc);
 	EXPECT_EQ(1, atomic_read(&pool->descriptors[1].refs));
-	self->hsk.buffer_pool.check_waiting_invoked = 0;
+	self->hsk.buffer_pool->check_waiting_invoked = 0;
 	homa_rpc_reap(&self->hsk, 5);
 	EXPECT_EQ(0, atomic_read(&pool->descriptors[1].refs));
-	EXPECT_EQ(1, self->hsk.buffer_pool.check_waiting_invoked);
+	EXPECT_EQ(1, self->hsk.buffer_pool->check_waiting_invoked);
 }
 TEST_F(homa_utils, homa_rpc_reap__free_gaps)
 {
@@ -765,6 +851,134 @@ TEST_F(homa_utils, homa_append_metric)
 	EXPECT_EQ(120, self->homa.metrics_capacity);
 }
 
+TEST_F(homa_utils, homa_metric_descs__cover_all_fields)
+{
+	int i, next = 0;
+
+	for (i = 0; i < homa_num_metric_descs; i++) {
+		EXPECT_EQ(next, homa_metric_descs[i].offset);
+		next = homa_metric_descs[i].offset + homa_metric_descs[i].count;
+	}
+	EXPECT_EQ(sizeof(struct homa_metrics)/sizeof(__u64), next);
+}
+
+TEST_F(homa_utils, homa_metrics_snapshot__per_core)
+{
+	struct homa_metrics_raw_header *header;
+	__u64 *counters;
+	char *schema;
+
+	homa_cores[0]->metrics.small_msg_bytes[1] = 100;
+	homa_cores[2]->metrics.sent_msg_bytes = 200;
+	header = (struct homa_metrics_raw_header *) homa_metrics_snapshot(0);
+	ASSERT_NE(NULL, header);
+	EXPECT_EQ(HOMA_METRICS_MAGIC, header->magic);
+	EXPECT_EQ(HOMA_METRICS_VERSION, header->version);
+	EXPECT_EQ(8, header->num_cores);
+	EXPECT_EQ(sizeof(struct homa_metrics)/8, header->num_counters);
+	EXPECT_EQ(0, header->schema_length & 7);
+	EXPECT_EQ(0, header->flags);
+	schema = ((char *) header) + sizeof(*header);
+	EXPECT_EQ(0, strncmp("small_msg_bytes 0 64\nmedium_msg_bytes 64 128\n",
+			schema, 45));
+	EXPECT_SUBSTR("\nsent_msg_bytes 194 1\n", schema);
+	EXPECT_SUBSTR("\npackets_sent 195 ", schema);
+	counters = (__u64 *) (schema + header->schema_length);
+	EXPECT_EQ(100, counters[1]);
+	EXPECT_EQ(200, counters[2*header->num_counters + 194]);
+	vfree(header);
+}
+TEST_F(homa_utils, homa_metrics_snapshot__sum)
+{
+	struct homa_metrics_raw_header *header;
+	__u64 *counters;
+
+	homa_cores[0]->metrics.sent_msg_bytes = 200;
+	homa_cores[2]->metrics.sent_msg_bytes = 300;
+	homa_cores[7]->metrics.temp[3] = 5;
+	header = (struct homa_metrics_raw_header *) homa_metrics_snapshot(1);
+	ASSERT_NE(NULL, header);
+	EXPECT_EQ(1, header->num_cores);
+	EXPECT_EQ(HOMA_METRICS_SUMMED, header->flags);
+	counters = (__u64 *) (((char *) header) + sizeof(*header)
+			+ header->schema_length);
+	EXPECT_EQ(500, counters[194]);
+	EXPECT_EQ(5, counters[header->num_counters - NUM_TEMP_METRICS + 3]);
+	vfree(header);
+}
+TEST_F(homa_utils, homa_metrics_snapshot__vmalloc_fails)
+{
+	mock_vmalloc_errors = 1;
+	EXPECT_EQ(NULL, homa_metrics_snapshot(0));
+}
+
+TEST_F(homa_utils, homa_print_latency)
+{
+	__u64 histogram[HOMA_NUM_SIZE_CLASSES][HOMA_NUM_LATENCY_BUCKETS];
+
+	memset(histogram, 0, sizeof(histogram));
+	histogram[0][8] = 5;
+	histogram[3][1] = 7;
+	self->homa.metrics_length = 0;
+	homa_print_latency(&self->homa, "client", histogram);
+	EXPECT_STREQ("client_latency_0_8                     5  "
+			"client RPCs, request < 1000 bytes, latency >= 4096 "
+			"cycles\n"
+			"client_latency_3_1                     7  "
+			"client RPCs, request >= 100000 bytes, latency >= 1280 "
+			"cycles\n", self->homa.metrics);
+}
+
+TEST_F(homa_utils, homa_print_stage_latency)
+{
+	__u64 histogram[HOMA_NUM_LATENCY_BUCKETS];
+
+	memset(histogram, 0, sizeof(histogram));
+	histogram[1] = 3;
+	histogram[8] = 5;
+	self->homa.metrics_length = 0;
+	homa_print_stage_latency(&self->homa, "gro_softirq_latency",
+			"Packets from GRO to SoftIRQ", histogram);
+	EXPECT_STREQ("gro_softirq_latency_1                3  "
+			"Packets from GRO to SoftIRQ, delay >= 1280 cycles\n"
+			"gro_softirq_latency_8                5  "
+			"Packets from GRO to SoftIRQ, delay >= 4096 cycles\n",
+			self->homa.metrics);
+}
+
+TEST_F(homa_utils, homa_latency_bucket)
+{
+	EXPECT_EQ(0, homa_latency_bucket(0));
+	EXPECT_EQ(0, homa_latency_bucket(1023));
+	EXPECT_EQ(0, homa_latency_bucket(1024));
+	EXPECT_EQ(1, homa_latency_bucket(1280));
+	EXPECT_EQ(4, homa_latency_bucket(2048));
+	EXPECT_EQ(6, homa_latency_bucket(3072));
+	EXPECT_EQ(8, homa_latency_bucket(5000));
+	EXPECT_EQ(HOMA_NUM_LATENCY_BUCKETS-1, homa_latency_bucket(1ULL << 40));
+}
+TEST_F(homa_utils, homa_latency_bucket_min)
+{
+	int i;
+
+	EXPECT_EQ(0, homa_latency_bucket_min(0));
+	EXPECT_EQ(1280, homa_latency_bucket_min(1));
+	EXPECT_EQ(3072, homa_latency_bucket_min(6));
+	for (i = 1; i < HOMA_NUM_LATENCY_BUCKETS; i++) {
+		EXPECT_EQ(i, homa_latency_bucket(homa_latency_bucket_min(i)));
+		EXPECT_EQ(i-1, homa_latency_bucket(
+				homa_latency_bucket_min(i) - 1));
+	}
+}
+TEST_F(homa_utils, homa_latency_size_class)
+{
+	EXPECT_EQ(0, homa_latency_size_class(999));
+	EXPECT_EQ(1, homa_latency_size_class(1000));
+	EXPECT_EQ(2, homa_latency_size_class(99999));
+	EXPECT_EQ(3, homa_latency_size_class(100000));
+	EXPECT_EQ(3, homa_latency_size_class(5000000));
+}
+
 TEST_F(homa_utils, homa_prios_changed__basics)
 {
 	set_cutoffs(&self->homa, 90, 80, HOMA_MAX_MESSAGE_LENGTH*2, 60, 50,
@@ -9,6 +9,49 @@
 #include "mock.h"
 #include "utils.h"
 
+/* Decodes the records in a binary timetrace (starting just after the
+ * header) into a human-readable string, stored in a static buffer.
+ */
+static char *raw_records(char *data, int length)
+{
+	static char result[2000];
+	int used = 0;
+	char *p = data;
+
+	result[0] = 0;
+	while (p < (data + length)) {
+		struct tt_raw_record *record = (struct tt_raw_record *) p;
+		char msg[100];
+
+		if (used > 0)
+			used += snprintf(result + used, sizeof(result) - used,
+					"; ");
+		if (record->type == TT_RAW_FORMAT) {
+			used += snprintf(result + used, sizeof(result) - used,
+					"format C%d '%s'", record->core,
+					(char *) (record + 1));
+		} else if (record->type == TT_RAW_EVENT) {
+			snprintf(msg, sizeof(msg),
+					(char *) record->format_id,
+					record->arg0, record->arg1,
+					record->arg2, record->arg3);
+			used += snprintf(result + used, sizeof(result) - used,
+					"%llu C%d %s", record->timestamp,
+					record->core, msg);
+		} else if (record->type == TT_RAW_LOST) {
+			used += snprintf(result + used, sizeof(result) - used,
+					"lost C%d before %llu", record->core,
+					record->timestamp);
+		} else {
+			used += snprintf(result + used, sizeof(result) - used,
+					"bogus type %d", record->type);
+			break;
+		}
+		p += sizeof(*record) + record->length;
+	}
+	return result;
+}
+
 FIXTURE(timetrace) {
 	struct file file;
 };
@@ -286,4 +329,112 @@ TEST_F(timetrace, tt_proc_release__unfreeze)
 	EXPECT_FALSE(tt_frozen);
 	EXPECT_EQ(NULL, tt_buffers[1]->events[3].format);
 	EXPECT_EQ(0, tt_buffers[1]->next_index);
-}
\ No newline at end of file
+}
+TEST_F(timetrace, tt_raw_read__basics)
+{
+	char buffer[1000];
+	struct tt_raw_header *header = (struct tt_raw_header *) buffer;
+	int length;
+
+	tt_record_buf(tt_buffers[0], 1000, "Buf0 %d", 1, 0, 0, 0);
+	tt_record_buf(tt_buffers[0], 1100, "Buf0 %d", 2, 0, 0, 0);
+	tt_record_buf(tt_buffers[2], 1050, "Buf2 %d %d", 3, 4, 0, 0);
+	tt_raw_open(NULL, &self->file);
+	EXPECT_EQ(1, tt_freeze_count.counter);
+	length = tt_raw_read(&self->file, buffer, sizeof(buffer), 0);
+	EXPECT_EQ(TT_RAW_MAGIC, header->magic);
+	EXPECT_EQ(TT_RAW_VERSION, header->version);
+	EXPECT_EQ(8, header->num_cores);
+	EXPECT_STREQ("format C0 'Buf0 %d'; 1000 C0 Buf0 1; 1100 C0 Buf0 2; "
+			"format C2 'Buf2 %d %d'; 1050 C2 Buf2 3 4",
+			raw_records(buffer + sizeof(*header),
+			length - sizeof(*header)));
+	EXPECT_EQ(0, tt_raw_read(&self->file, buffer, sizeof(buffer), 0));
+	tt_raw_release(NULL, &self->file);
+	EXPECT_EQ(0, tt_freeze_count.counter);
+	EXPECT_EQ(0, tt_buffers[0]->next_index);
+}
+TEST_F(timetrace, tt_raw_read__small_reads)
+{
+	char buffer[1000];
+	int length, count;
+
+	tt_record_buf(tt_buffers[1], 1000, "First event", 0, 0, 0, 0);
+	tt_record_buf(tt_buffers[1], 1100, "Second event", 0, 0, 0, 0);
+	tt_raw_open(NULL, &self->file);
+	length = 0;
+	while (1) {
+		count = tt_raw_read(&self->file, buffer + length, 7, 0);
+		if (count <= 0)
+			break;
+		length += count;
+	}
+	EXPECT_EQ(0, count);
+	EXPECT_STREQ("format C1 'First event'; 1000 C1 First event; "
+			"format C1 'Second event'; 1100 C1 Second event",
+			raw_records(buffer + sizeof(struct tt_raw_header),
+			length - sizeof(struct tt_raw_header)));
+	tt_raw_release(NULL, &self->file);
+}
+TEST_F(timetrace, tt_raw_read__copy_to_user_error)
+{
+	char buffer[1000];
+
+	tt_raw_open(NULL, &self->file);
+	mock_copy_to_user_errors = 1;
+	EXPECT_EQ(EFAULT, -tt_raw_read(&self->file, buffer, sizeof(buffer),
+			0));
+	tt_raw_release(NULL, &self->file);
+}
+
+TEST_F(timetrace, tt_stream_read__basics)
+{
+	char buffer[1000];
+	int length;
+
+	tt_stream_open(NULL, &self->file);
+	EXPECT_EQ(0, tt_freeze_count.counter);
+	length = tt_raw_read(&self->file, buffer, sizeof(buffer), 0);
+	EXPECT_EQ(sizeof(struct tt_raw_header), length);
+
+	tt_record_buf(tt_buffers[0], 1000, "Event %d", 1, 0, 0, 0);
+	tt_record_buf(tt_buffers[0], 1001, "Event %d", 2, 0, 0, 0);
+	tt_record_buf(tt_buffers[0], 1002, "Event %d", 3, 0, 0, 0);
+	length = tt_raw_read(&self->file, buffer, sizeof(buffer), 0);
+	EXPECT_STREQ("format C0 'Event %d'; 1000 C0 Event 1; 1001 C0 Event 2",
+			raw_records(buffer, length));
+
+	tt_record_buf(tt_buffers[0], 1003, "Event %d", 4, 0, 0, 0);
+	length = tt_raw_read(&self->file, buffer, sizeof(buffer), 0);
+	EXPECT_STREQ("1002 C0 Event 3", raw_records(buffer, length));
+	EXPECT_EQ(0, tt_raw_read(&self->file, buffer, sizeof(buffer), 0));
+
+	tt_raw_release(NULL, &self->file);
+	EXPECT_EQ(0, tt_freeze_count.counter);
+	EXPECT_EQ(4, tt_buffers[0]->next_index);
+}
+TEST_F(timetrace, tt_stream_read__lost_events)
+{
+	char buffer[1000];
+	int length;
+
+	tt_buffer_size = 4;
+	tt_stream_open(NULL, &self->file);
+	tt_raw_read(&self->file, buffer, sizeof(buffer), 0);
+	tt_record_buf(tt_buffers[0], 1000, "Event %d", 1, 0, 0, 0);
+	tt_record_buf(tt_buffers[0], 1001, "Event %d", 2, 0, 0, 0);
+	tt_record_buf(tt_buffers[0], 1002, "Event %d", 3, 0, 0, 0);
+	length = tt_raw_read(&self->file, buffer, sizeof(buffer), 0);
+	EXPECT_STREQ("format C0 'Event %d'; 1000 C0 Event 1; 1001 C0 Event 2",
+			raw_records(buffer, length));
+
+	tt_record_buf(tt_buffers[0], 1003, "Event %d", 4, 0, 0, 0);
+	tt_record_buf(tt_buffers[0], 1004, "Event %d", 5, 0, 0, 0);
+	tt_record_buf(tt_buffers[0], 1005, "Event %d", 6, 0, 0, 0);
+	tt_record_buf(tt_buffers[0], 1006, "Event %d", 7, 0, 0, 0);
+	tt_record_buf(tt_buffers[0], 1007, "Event %d", 8, 0, 0, 0);
+	length = tt_raw_read(&self->file, buffer, sizeof(buffer), 0);
+	EXPECT_STREQ("lost C0 before 1005; 1005 C0 Event 6; 1006 C0 Event 7",
+			raw_records(buffer, length));
+	tt_raw_release(NULL, &self->file);
+}
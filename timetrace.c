@@ -47,8 +47,30 @@ static const struct proc_ops tt_pops = {
 	.proc_release           = tt_proc_release
 };
 
-/* Used to remove the /proc file during tt_destroy. */
+/* Describes file operations for reading binary timetraces (snapshot
+ * mode, like tt_pops).
+ */
+static const struct proc_ops tt_raw_pops = {
+	.proc_open              = tt_raw_open,
+	.proc_read              = tt_raw_read,
+	.proc_lseek             = tt_proc_lseek,
+	.proc_release           = tt_raw_release
+};
+
+/* Describes file operations for reading binary timetraces continuously,
+ * without freezing.
+ */
+static const struct proc_ops tt_stream_pops = {
+	.proc_open              = tt_stream_open,
+	.proc_read              = tt_raw_read,
+	.proc_lseek             = tt_proc_lseek,
+	.proc_release           = tt_raw_release
+};
+
+/* Used to remove the /proc files during tt_destroy. */
 static struct proc_dir_entry *tt_dir_entry;
+static struct proc_dir_entry *tt_raw_entry;
+static struct proc_dir_entry *tt_stream_entry;
 
 /* Synchronizes accesses to global state such as frozen and init.  A mutex
  * isn't safe here, because tt_freeze gets called at times when threads
@@ -115,14 +137,33 @@ int tt_init(char *proc_file, int *temp)
 	}
 
 	if (proc_file != NULL) {
+		char name[100];
+
 		tt_dir_entry = proc_create(proc_file, S_IRUGO, NULL, &tt_pops);
 		if (!tt_dir_entry) {
 			printk(KERN_ERR "couldn't create /proc/%s for timetrace "
 					"reading\n", proc_file);
 			goto error;
 		}
+		snprintf(name, sizeof(name), "%s_raw", proc_file);
+		tt_raw_entry = proc_create(name, S_IRUGO, NULL, &tt_raw_pops);
+		if (!tt_raw_entry) {
+			printk(KERN_ERR "couldn't create /proc/%s for timetrace "
+					"reading\n", name);
+			goto error;
+		}
+		snprintf(name, sizeof(name), "%s_stream", proc_file);
+		tt_stream_entry = proc_create(name, S_IRUGO, NULL,
+				&tt_stream_pops);
+		if (!tt_stream_entry) {
+			printk(KERN_ERR "couldn't create /proc/%s for timetrace "
+					"reading\n", name);
+			goto error;
+		}
 	} else {
 		tt_dir_entry = NULL;
+		tt_raw_entry = NULL;
+		tt_stream_entry = NULL;
 	}
 
 	spin_lock_init(&tt_lock);
@@ -148,6 +189,14 @@ int tt_init(char *proc_file, int *temp)
 	return 0;
 
 	error:
+	if (tt_dir_entry) {
+		proc_remove(tt_dir_entry);
+		tt_dir_entry = NULL;
+	}
+	if (tt_raw_entry) {
+		proc_remove(tt_raw_entry);
+		tt_raw_entry = NULL;
+	}
 	for (i = 0; i < nr_cpu_ids; i++) {
 		kfree(tt_buffers[i]);
 		tt_buffers[i] = NULL;
@@ -167,6 +216,13 @@ void tt_destroy(void)
 		init = false;
 		if (tt_dir_entry != NULL)
 			proc_remove(tt_dir_entry);
+		if (tt_raw_entry != NULL)
+			proc_remove(tt_raw_entry);
+		if (tt_stream_entry != NULL)
+			proc_remove(tt_stream_entry);
+		tt_dir_entry = NULL;
+		tt_raw_entry = NULL;
+		tt_stream_entry = NULL;
 	}
 	for (i = 0; i < nr_cpu_ids; i++) {
 		kfree(tt_buffers[i]);
@@ -482,6 +538,36 @@ loff_t tt_proc_lseek(struct file *file, loff_t offset, int whence)
 	return 0;
 }
 
+/**
+ * tt_unfreeze() - Invoked when a reader that froze the timetrace (by
+ * incrementing tt_freeze_count) is finished. If this is the last such
+ * reader, the buffers are reset and recording resumes. The caller must
+ * hold tt_lock.
+ */
+static void tt_unfreeze(void)
+{
+	int i;
+
+	if (!init)
+		return;
+	if (tt_frozen && (atomic_read(&tt_freeze_count) == 2)) {
+		atomic_dec(&tt_freeze_count);
+		tt_frozen = false;
+	}
+
+	if (atomic_read(&tt_freeze_count) == 1) {
+		/* We are the last active open of the file; reset all of
+		 * the buffers to "empty".
+		 */
+		for (i = 0; i < nr_cpu_ids; i++) {
+			struct tt_buffer *buffer = tt_buffers[i];
+			buffer->events[tt_buffer_size-1].format = NULL;
+			buffer->next_index = 0;
+		}
+	}
+	atomic_dec(&tt_freeze_count);
+}
+
 /**
  * tt_proc_release() - This function is invoked when the last reference to
  * an open /proc/timetrace is closed.  It performs cleanup.
@@ -492,8 +578,6 @@ loff_t tt_proc_lseek(struct file *file, loff_t offset, int whence)
  */
 int tt_proc_release(struct inode *inode, struct file *file)
 {
-	int i;
-
 	struct tt_proc_file *pf = file->private_data;
 	if ((pf == NULL) || (pf->file != file)) {
 		printk(KERN_ERR "tt_metrics_release found damaged "
@@ -505,27 +589,329 @@ int tt_proc_release(struct inode *inode, struct file *file)
 	file->private_data = NULL;
 
 	spin_lock(&tt_lock);
+	tt_unfreeze();
+	spin_unlock(&tt_lock);
+	return 0;
+}
 
-	if (init) {
-		if (tt_frozen && (atomic_read(&tt_freeze_count) == 2)) {
-			atomic_dec(&tt_freeze_count);
-			tt_frozen = false;
+/**
+ * tt_raw_open_common() - Does most of the work of opening
+ * /proc/timetrace_raw or /proc/timetrace_stream.
+ * @file:     Information about the open file.
+ * @stream:   True means the file is for streaming (don't freeze the
+ *            timetrace); false means return a snapshot.
+ *
+ * Return:    0 for success, else a negative errno.
+ */
+static int tt_raw_open_common(struct file *file, bool stream)
+{
+	struct tt_raw_file *pf = NULL;
+	struct tt_raw_header *header;
+	int result = 0;
+
+	spin_lock(&tt_lock);
+	if (!init) {
+		result = -EINVAL;
+		goto done;
+	}
+	pf = kmalloc(sizeof(*pf), GFP_KERNEL);
+	if (pf == NULL) {
+		result = -ENOMEM;
+		goto done;
+	}
+	memset(pf->last_time, 0, sizeof(pf->last_time));
+	memset(pf->formats, 0, sizeof(pf->formats));
+	pf->file = file;
+	pf->stream = stream;
+	pf->next_core = 0;
+
+	if (!stream)
+		atomic_inc(&tt_freeze_count);
+	tt_find_oldest(pf->pos);
+	file->private_data = pf;
+
+	header = (struct tt_raw_header *) pf->storage;
+	header->magic = TT_RAW_MAGIC;
+	header->version = TT_RAW_VERSION;
+	header->cpu_khz = cpu_khz;
+	header->num_cores = nr_cpu_ids;
+	pf->bytes_available = sizeof(*header);
+	pf->next_byte = pf->storage;
+
+	done:
+	spin_unlock(&tt_lock);
+	return result;
+}
+
+/**
+ * tt_raw_open() - This function is invoked when /proc/timetrace_raw is
+ * opened. Like /proc/timetrace, the trace is frozen while the file is open.
+ * @inode:    The inode corresponding to the file.
+ * @file:     Information about the open file.
+ *
+ * Return:    0 for success, else a negative errno.
+ */
+int tt_raw_open(struct inode *inode, struct file *file)
+{
+	return tt_raw_open_common(file, false);
+}
+
+/**
+ * tt_stream_open() - This function is invoked when /proc/timetrace_stream
+ * is opened. Recording continues while the file is open, and each read
+ * returns the events recorded since the previous read.
+ * @inode:    The inode corresponding to the file.
+ * @file:     Information about the open file.
+ *
+ * Return:    0 for success, else a negative errno.
+ */
+int tt_stream_open(struct inode *inode, struct file *file)
+{
+	return tt_raw_open_common(file, true);
+}
+
+/**
+ * tt_raw_add() - Append a record to the storage for a binary timetrace,
+ * preceded by a TT_RAW_FORMAT record if the event's format hasn't been
+ * output before.
+ * @pf:      Open file for which output is being generated.
+ * @used:    Number of bytes of @pf->storage already in use.
+ * @core:    Core from whose buffer @event came.
+ * @event:   Event to output.
+ *
+ * Return:   Number of bytes added to @pf->storage, or 0 if there wasn't
+ *           enough space left for the event.
+ */
+static int tt_raw_add(struct tt_raw_file *pf, int used, int core,
+		struct tt_event *event)
+{
+	struct tt_raw_record *record;
+	int i, length, slot, needed, hash;
+	const char *format = event->format;
+	bool known = false;
+
+	/* Look up the format in the hash table (linear probing, limited
+	 * to a few slots; if the table is full, formats will be output
+	 * redundantly).
+	 */
+	slot = -1;
+	hash = (((unsigned long) format) >> 3) & (TT_RAW_FORMATS-1);
+	for (i = 0; i < 16; i++) {
+		int index = (hash + i) & (TT_RAW_FORMATS-1);
+		if (pf->formats[index] == format) {
+			known = true;
+			break;
 		}
+		if (pf->formats[index] == NULL) {
+			slot = index;
+			break;
+		}
+	}
+
+	needed = sizeof(*record);
+	length = 0;
+	if (!known) {
+		length = (strnlen(format, 1000) + 8) & ~7;
+		needed += sizeof(*record) + length;
+	}
+	if ((used + needed) > TT_RAW_BUF_SIZE)
+		return 0;
+
+	record = (struct tt_raw_record *) (pf->storage + used);
+	if (!known) {
+		memset(record, 0, sizeof(*record) + length);
+		record->type = TT_RAW_FORMAT;
+		record->core = core;
+		record->length = length;
+		record->format_id = (__u64) format;
+		strncpy((char *) (record + 1), format, length - 1);
+		if (slot >= 0)
+			pf->formats[slot] = format;
+		record = (struct tt_raw_record *) (((char *) (record + 1))
+				+ length);
+	}
+	record->type = TT_RAW_EVENT;
+	record->core = core;
+	record->length = 0;
+	record->timestamp = event->timestamp;
+	record->format_id = (__u64) format;
+	record->arg0 = event->arg0;
+	record->arg1 = event->arg1;
+	record->arg2 = event->arg2;
+	record->arg3 = event->arg3;
+	return needed;
+}
+
+/**
+ * tt_raw_fill() - Fill the storage of a binary timetrace file with as
+ * many records as will fit. The caller must hold tt_lock, and
+ * @pf->storage must be empty.
+ * @pf:      Open file for which output is being generated.
+ *
+ * Return:   The number of bytes now available in @pf->storage (0 means
+ *           there are no more events to return).
+ */
+int tt_raw_fill(struct tt_raw_file *pf)
+{
+	int used = 0;
+	int mask = tt_buffer_size - 1;
+	int cores_done;
+
+	/* Each iteration through this loop returns all of the available
+	 * events from one core. Events are output in order for each core,
+	 * but aren't merged across cores (the reader must do that).
+	 */
+	for (cores_done = 0; cores_done < nr_cpu_ids; cores_done++) {
+		int core = pf->next_core;
+		struct tt_buffer *buffer = tt_buffers[core];
+		int end = READ_ONCE(buffer->next_index);
+
+		if (pf->stream) {
+			struct tt_event *prev;
 
-		if (atomic_read(&tt_freeze_count) == 1) {
-			/* We are the last active open of the file; reset all of
-			 * the buffers to "empty".
+			/* Tt_record_buf advances next_index before filling
+			 * in the event, so the most recent event may not
+			 * be complete; leave it for the next read.
 			 */
-			for (i = 0; i < nr_cpu_ids; i++) {
-				struct tt_buffer *buffer = tt_buffers[i];
-				buffer->events[tt_buffer_size-1].format = NULL;
-				buffer->next_index = 0;
+			if (pf->pos[core] == end)
+				goto next_core;
+			end = (end - 1) & mask;
+
+			/* If the event before pos has changed, then the
+			 * buffer wrapped around and we missed events; skip
+			 * to the oldest event still in the buffer.
+			 */
+			prev = &buffer->events[(pf->pos[core] - 1) & mask];
+			if ((pf->last_time[core] != 0)
+					&& (prev->timestamp
+					!= pf->last_time[core])) {
+				struct tt_raw_record *record;
+
+				if ((used + sizeof(*record)) > TT_RAW_BUF_SIZE)
+					return used;
+				pf->pos[core] = (end + 2) & mask;
+				record = (struct tt_raw_record *)
+						(pf->storage + used);
+				memset(record, 0, sizeof(*record));
+				record->type = TT_RAW_LOST;
+				record->core = core;
+				record->timestamp = buffer->events[
+						pf->pos[core]].timestamp;
+				used += sizeof(*record);
+				pf->last_time[core] = 0;
 			}
 		}
-		atomic_dec(&tt_freeze_count);
+
+		while (pf->pos[core] != end) {
+			struct tt_event *event = &buffer->events[pf->pos[core]];
+			int added;
+
+			/* A backwards step in time means the event was
+			 * overwritten while we were reading it.
+			 */
+			if (event->timestamp < pf->last_time[core])
+				break;
+			added = tt_raw_add(pf, used, core, event);
+			if (added == 0)
+				return used;
+			used += added;
+			pf->last_time[core] = event->timestamp;
+			pf->pos[core] = (pf->pos[core] + 1) & mask;
+		}
+
+		next_core:
+		pf->next_core = (core + 1) % nr_cpu_ids;
+	}
+	return used;
+}
+
+/**
+ * tt_raw_read() - This function is invoked to handle read kernel calls on
+ * /proc/timetrace_raw and /proc/timetrace_stream.
+ * @file:    Information about the file being read.
+ * @buffer:  Address in user space of the buffer in which data from the file
+ *           should be returned.
+ * @length:  Number of bytes available at @buffer.
+ * @offset:  Current read offset within the file. For now, we assume I/O
+ *           is done sequentially, so we ignore this.
+ *
+ * Return: the number of bytes returned at @buffer. 0 means the end of the
+ * file was reached (for streaming files this means only that there are
+ * no new events right now), and a negative number indicates an
+ * error (-errno).
+ */
+ssize_t tt_raw_read(struct file *file, char __user *user_buf,
+		size_t length, loff_t *offset)
+{
+	int copied_to_user = 0;
+	struct tt_raw_file *pf = file->private_data;
+
+	spin_lock(&tt_lock);
+	if ((pf == NULL) || (pf->file != file)) {
+		printk(KERN_ERR "tt_raw_read found damaged "
+				"private_data: 0x%p\n", file->private_data);
+		copied_to_user = -EINVAL;
+		goto done;
 	}
 
+	if (!init)
+		goto done;
+
+	while (copied_to_user < length) {
+		int chunk_size;
+
+		if (pf->bytes_available == 0) {
+			pf->next_byte = pf->storage;
+			pf->bytes_available = tt_raw_fill(pf);
+			if (pf->bytes_available == 0)
+				goto done;
+		}
+		chunk_size = pf->bytes_available;
+		if (chunk_size > (length - copied_to_user))
+			chunk_size = length - copied_to_user;
+		if (copy_to_user(user_buf + copied_to_user, pf->next_byte,
+				chunk_size) != 0) {
+			if (copied_to_user == 0)
+				copied_to_user = -EFAULT;
+			goto done;
+		}
+		pf->bytes_available -= chunk_size;
+		pf->next_byte += chunk_size;
+		copied_to_user += chunk_size;
+	}
+
+	done:
 	spin_unlock(&tt_lock);
+	return copied_to_user;
+}
+
+/**
+ * tt_raw_release() - This function is invoked when the last reference to
+ * an open /proc/timetrace_raw or /proc/timetrace_stream is closed.
+ * @inode:    The inode corresponding to the file.
+ * @file:     Information about the open file.
+ *
+ * Return: 0 for success, or a negative errno if there was an error.
+ */
+int tt_raw_release(struct inode *inode, struct file *file)
+{
+	struct tt_raw_file *pf = file->private_data;
+	bool stream;
+
+	if ((pf == NULL) || (pf->file != file)) {
+		printk(KERN_ERR "tt_raw_release found damaged "
+				"private_data: 0x%p\n", file->private_data);
+		return -EINVAL;
+	}
+	stream = pf->stream;
+	kfree(pf);
+	file->private_data = NULL;
+
+	if (!stream) {
+		spin_lock(&tt_lock);
+		tt_unfreeze();
+		spin_unlock(&tt_lock);
+	}
 	return 0;
 }
 
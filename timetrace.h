@@ -94,6 +94,121 @@ struct tt_proc_file {
 	char *next_byte;
 };
 
+/**
+ * The binary forms of the timetrace (/proc/timetrace_raw and
+ * /proc/timetrace_stream) consist of a tt_raw_header followed by
+ * any number of tt_raw_records. Records are not sorted by time across
+ * cores; readers must merge them (see util/ttraw.cc). These structures
+ * are duplicated in util/ttraw.cc, so changes here must be made there
+ * also.
+ */
+#define TT_RAW_MAGIC   0x77725454
+#define TT_RAW_VERSION 1
+
+struct tt_raw_header {
+	/** @magic: Always TT_RAW_MAGIC. */
+	__u32 magic;
+
+	/** @version: Format of the data that follows (TT_RAW_VERSION). */
+	__u32 version;
+
+	/** @cpu_khz: Clock rate for timestamps, in kHz. */
+	__u32 cpu_khz;
+
+	/** @num_cores: Number of per-core buffers in the trace. */
+	__u32 num_cores;
+};
+
+/* Legal values for the type field of tt_raw_record. */
+enum tt_raw_type {
+	/* A single timetrace event. */
+	TT_RAW_EVENT               = 1,
+
+	/* Defines a format string; @length bytes of string (NULL-terminated,
+	 * padded to a multiple of 8 bytes) follow the record. Each format
+	 * is defined once, before the first event that refers to it.
+	 */
+	TT_RAW_FORMAT              = 2,
+
+	/* In streaming mode, indicates that the reader fell behind and
+	 * the events on @core before @timestamp were overwritten before
+	 * they could be read.
+	 */
+	TT_RAW_LOST                = 3,
+};
+
+struct tt_raw_record {
+	/** @type: One of the values of enum tt_raw_type. */
+	__u16 type;
+
+	/** @core: Core whose buffer the record came from. */
+	__u16 core;
+
+	/** @length: Bytes of additional data following this record. */
+	__u32 length;
+
+	/** @timestamp: Time when the event occurred (tt_rdtsc units). */
+	__u64 timestamp;
+
+	/**
+	 * @format_id: Identifies the format string for the event (matches
+	 * a previous TT_RAW_FORMAT record).
+	 */
+	__u64 format_id;
+
+	/** @arg0: Arguments for the event (see tt_event). */
+	__u32 arg0;
+	__u32 arg1;
+	__u32 arg2;
+	__u32 arg3;
+};
+
+/**
+ * Holds information about an open of /proc/timetrace_raw or
+ * /proc/timetrace_stream.
+ */
+struct tt_raw_file {
+	/* Identifies a particular open file. */
+	struct file* file;
+
+	/* True means this is a streaming reader: the timetrace isn't
+	 * frozen, and reads return new events as they are recorded.
+	 */
+	bool stream;
+
+	/* Index of the next entry to return from each tt_buffer. */
+	int pos[NR_CPUS];
+
+	/* Timestamp of the last event returned from each tt_buffer (0 means
+	 * nothing returned yet); used in streaming mode to detect when the
+	 * reader has fallen behind.
+	 */
+	__u64 last_time[NR_CPUS];
+
+	/* Core whose events should be returned next. */
+	int next_core;
+
+	/* Format strings that have already been output (open hash table
+	 * indexed by address; NULL means empty slot).
+	 */
+#define TT_RAW_FORMATS 1024
+	const char *formats[TT_RAW_FORMATS];
+
+	/* Records are collected here, so they can be dumped out to
+	 * user space in bulk.
+	 */
+#define TT_RAW_BUF_SIZE 16384
+	char storage[TT_RAW_BUF_SIZE];
+
+	/* Number of bytes in storage currently available to copy to
+	 * application.
+	 */
+	int bytes_available;
+
+	/* Address of next byte in storage to copy to application. */
+	char *next_byte;
+};
+
 extern void   tt_destroy(void);
 extern void   tt_freeze(void);
 extern int    tt_init(char *proc_file, int *temp);
@@ -116,6 +231,12 @@ extern ssize_t   tt_proc_read(struct file *file, char __user *user_buf,
 			size_t length, loff_t *offset);
 extern int       tt_proc_release(struct inode *inode, struct file *file);
 extern loff_t    tt_proc_lseek(struct file *file, loff_t offset, int whence);
+extern int       tt_raw_fill(struct tt_raw_file *pf);
+extern int       tt_raw_open(struct inode *inode, struct file *file);
+extern ssize_t   tt_raw_read(struct file *file, char __user *user_buf,
+			size_t length, loff_t *offset);
+extern int       tt_raw_release(struct inode *inode, struct file *file);
+extern int       tt_stream_open(struct inode *inode, struct file *file);
 extern struct    tt_buffer *tt_buffers[];
 extern int       tt_buffer_size;
 extern atomic_t  tt_freeze_count;
@@ -52,6 +52,7 @@ def read_metrics(metrics_file, out):
 
     global symbols, docs
     symbols.clear()
+    docs.clear()
     metrics = []
     metrics.append({})
     core = 0
@@ -73,7 +74,9 @@ def read_metrics(metrics_file, out):
             while len(metrics) <= core:
                 metrics.append({})
             continue
-        if core == 0:
+        # Some metrics (such as histogram buckets and lock call sites)
+        # are only printed for cores where they are nonzero.
+        if symbol not in docs:
             symbols.append(symbol)
             docs[symbol] = doc
         metrics[core][symbol] = count
@@ -120,10 +123,10 @@ for symbol in symbols:
         continue
     total_cur = 0
     for core in cur:
-        total_cur += core[symbol]
+        total_cur += core.get(symbol, 0)
     total_prev = 0
     for core in prev:
-        total_prev += core[symbol]
+        total_prev += core.get(symbol, 0)
     delta = total_cur - total_prev
     deltas[symbol] = delta
 
@@ -369,6 +372,24 @@ if elapsed_secs != 0:
                 scale_number(misses/elapsed_secs),
                 cycles_per_miss/(cpu_khz/1e06), 100.0*cycles/time_delta))
 
+    # Per-call-site breakdown (metrics such as lock_socket_homa_data_pkt_misses),
+    # most expensive first.
+    sites = [symbol[:-7] for symbol in deltas if symbol.startswith("lock_")
+            and symbol.endswith("_misses") and deltas[symbol] != 0]
+    sites.sort(key=lambda site: deltas[site + "_cycles"], reverse=True)
+    if sites:
+        print("\nLock Misses by Call Site:")
+        print("-------------------------")
+        print("                                          Misses/sec.  "
+                "ns/Miss   %CPU")
+        for site in sites:
+            misses = float(deltas[site + "_misses"])
+            cycles = float(deltas[site + "_cycles"])
+            print("%-40s    %s    %6.1f   %5.1f" % (site[5:],
+                    scale_number(misses/elapsed_secs),
+                    (cycles/misses)/(cpu_khz/1e06),
+                    100.0*cycles/time_delta))
+
     total_messages = float(deltas["requests_received"]
             + deltas["responses_received"])
     if total_messages > 0.0:
@@ -0,0 +1,82 @@
+#!/usr/bin/python3
+
+# Copyright (c) 2024 Homa Developers
+# SPDX-License-Identifier: BSD-1-Clause
+
+"""
+Reads Homa metrics in binary form from /proc/net/homa_metrics_raw (or
+/proc/net/homa_metrics_sum, or a saved copy of either) and prints them, one
+metric per line. Histogram metrics are printed with one line per element,
+in the form name[index]. Much cheaper than reading /proc/net/homa_metrics.
+Usage: metrics_raw.py [--sum] [file]
+"""
+
+from __future__ import division, print_function
+import struct
+import sys
+
+# Must match struct homa_metrics_raw_header in homa.h.
+HEADER_FORMAT = "<IIIIIIQQ"
+HEADER_SIZE = struct.calcsize(HEADER_FORMAT)
+HOMA_METRICS_MAGIC = 0x616d6f68
+HOMA_METRICS_VERSION = 1
+
+def read_raw_metrics(metrics_file):
+    """
+    Read a binary metrics snapshot from the file whose name is "metrics_file".
+    Returns a tuple (info, schema, cores), where info is a dictionary with
+    header information (rdtsc_cycles, cpu_khz, summed), schema is a list
+    of (name, offset, count) tuples describing each metric, and cores is
+    a list with one element for each block of counters in the file; each
+    element is a list of counter values.
+    """
+
+    f = open(metrics_file, "rb")
+    data = f.read()
+    f.close()
+    (magic, version, num_cores, num_counters, schema_length, flags,
+            rdtsc_cycles, cpu_khz) = struct.unpack_from(HEADER_FORMAT, data)
+    if magic != HOMA_METRICS_MAGIC:
+        raise Exception("%s has bad magic number 0x%x" % (metrics_file,
+                magic))
+    if version != HOMA_METRICS_VERSION:
+        raise Exception("%s has unsupported version %d" % (metrics_file,
+                version))
+    info = {"rdtsc_cycles": rdtsc_cycles, "cpu_khz": cpu_khz,
+            "summed": (flags & 1) != 0}
+
+    schema = []
+    text = data[HEADER_SIZE:HEADER_SIZE + schema_length].split(b"\0")[0]
+    for line in text.decode().splitlines():
+        name, offset, count = line.split()
+        schema.append((name, int(offset), int(count)))
+
+    cores = []
+    offset = HEADER_SIZE + schema_length
+    for i in range(num_cores):
+        cores.append(list(struct.unpack_from("<%dQ" % (num_counters),
+                data, offset)))
+        offset += 8*num_counters
+    return (info, schema, cores)
+
+if __name__ == "__main__":
+    file_name = "/proc/net/homa_metrics_raw"
+    for arg in sys.argv[1:]:
+        if arg == "--sum":
+            file_name = "/proc/net/homa_metrics_sum"
+        else:
+            file_name = arg
+    info, schema, cores = read_raw_metrics(file_name)
+    print("%-30s %20d" % ("rdtsc_cycles", info["rdtsc_cycles"]))
+    print("%-30s %20d" % ("cpu_khz", info["cpu_khz"]))
+    for core in range(len(cores)):
+        if not info["summed"]:
+            print("%-30s %20d" % ("core", core))
+        counters = cores[core]
+        for name, offset, count in schema:
+            if count == 1:
+                print("%-30s %20d" % (name, counters[offset]))
+                continue
+            for i in range(count):
+                print("%-30s %20d" % ("%s[%d]" % (name, i),
+                        counters[offset + i]))
@@ -0,0 +1,119 @@
+#!/usr/bin/python3
+
+# Copyright (c) 2024 Homa Developers
+# SPDX-License-Identifier: BSD-1-Clause
+
+"""
+Reads the RPC latency histograms kept by Homa (client_rpc_latency and
+server_rpc_latency in /proc/net/homa_metrics_sum) and prints percentiles
+for each request size class, followed by percentiles for each stage of
+the receive pipeline (gro_softirq_latency, etc.). If an interval is given,
+only events that occurred during the interval are considered; otherwise
+all events since Homa was loaded are considered.
+Usage: rpc_latency.py [interval_secs]
+"""
+
+from __future__ import division, print_function
+import sys
+import time
+
+from metrics_raw import read_raw_metrics
+
+# The following values must match the definitions of HOMA_LATENCY_MIN_SHIFT,
+# HOMA_LATENCY_SUB_SHIFT, HOMA_LATENCY_SIZE_BASE, and HOMA_NUM_SIZE_CLASSES
+# in homa_impl.h.
+MIN_SHIFT = 10
+SUB_SHIFT = 2
+SIZE_BASE = 1000
+NUM_SIZE_CLASSES = 4
+
+def bucket_min(bucket):
+    """
+    Returns the smallest latency (in cycles) that falls in a given bucket
+    of a latency histogram (same as homa_latency_bucket_min).
+    """
+    if bucket == 0:
+        return 0
+    exp = MIN_SHIFT + (bucket >> SUB_SHIFT)
+    return (1 << exp) + ((bucket & ((1 << SUB_SHIFT) - 1))
+            << (exp - SUB_SHIFT))
+
+def get_histograms(metrics_file):
+    """
+    Returns a tuple (cpu_khz, histograms, stages), where histograms is a
+    dictionary with keys "client" and "server"; each value is a list with
+    one entry for each size class, which is a list of bucket counts. Stages
+    is a list of (name, buckets) tuples, one for each stage of the receive
+    pipeline, in pipeline order.
+    """
+    info, schema, cores = read_raw_metrics(metrics_file)
+    counters = cores[0]
+    histograms = {}
+    stages = []
+    for name, offset, count in schema:
+        if name.endswith("_rpc_latency"):
+            buckets = count // NUM_SIZE_CLASSES
+            histograms[name.split("_")[0]] = [
+                    counters[offset + i*buckets:offset + (i+1)*buckets]
+                    for i in range(NUM_SIZE_CLASSES)]
+        elif name.endswith("_latency"):
+            stages.append((name[:-len("_latency")],
+                    counters[offset:offset + count]))
+    return (info["cpu_khz"], histograms, stages)
+
+def percentile(buckets, fraction):
+    """
+    Returns an upper bound on the given percentile (expressed as a
+    fraction) of the latencies in a histogram, in cycles.
+    """
+    total = sum(buckets)
+    seen = 0
+    for i in range(len(buckets)):
+        seen += buckets[i]
+        if seen >= fraction*total:
+            return bucket_min(i+1)
+    return bucket_min(len(buckets))
+
+metrics_file = "/proc/net/homa_metrics_sum"
+cpu_khz, cur, stages = get_histograms(metrics_file)
+if len(sys.argv) > 1:
+    time.sleep(float(sys.argv[1]))
+    prev = cur
+    prev_stages = stages
+    cpu_khz, cur, stages = get_histograms(metrics_file)
+    for kind in cur:
+        for c in range(NUM_SIZE_CLASSES):
+            cur[kind][c] = [a - b for a, b in zip(cur[kind][c],
+                    prev[kind][c])]
+    stages = [(name, [a - b for a, b in zip(buckets, prev_buckets)])
+            for (name, buckets), (_, prev_buckets) in zip(stages,
+            prev_stages)]
+
+print("Kind    Request size         RPCs      P50 (us)  P99 (us) "
+        " P999 (us)")
+for kind in ["client", "server"]:
+    limit = SIZE_BASE
+    for c in range(NUM_SIZE_CLASSES):
+        if c < NUM_SIZE_CLASSES - 1:
+            size = "< %d" % (limit)
+        else:
+            size = ">= %d" % (limit // 10)
+        limit *= 10
+        buckets = cur[kind][c]
+        count = sum(buckets)
+        if count == 0:
+            continue
+        print("%-7s %-14s %12d %12.1f %9.1f %10.1f" % (kind, size, count,
+                percentile(buckets, 0.5)*1000/cpu_khz,
+                percentile(buckets, 0.99)*1000/cpu_khz,
+                percentile(buckets, 0.999)*1000/cpu_khz))
+
+print("\nStage                    Events      P50 (us)  P99 (us)  P999 (us)")
+for name, buckets in stages:
+    count = sum(buckets)
+    if count == 0:
+        continue
+    print("%-18s %12d %12.1f %9.1f %10.1f" % (name, count,
+            percentile(buckets, 0.5)*1000/cpu_khz,
+            percentile(buckets, 0.99)*1000/cpu_khz,
+            percentile(buckets, 0.999)*1000/cpu_khz))
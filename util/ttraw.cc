@@ -0,0 +1,361 @@
+/* Copyright (c) 2024 Homa Developers
+ * SPDX-License-Identifier: BSD-1-Clause
+ */
+
+/* This file contains a program that reads the binary form of Homa's kernel
+ * timetrace (/proc/timetrace_raw or /proc/timetrace_stream), optionally
+ * merges it with timetraces generated by the time_trace class in user
+ * space, and prints the result in the same form as ttprint.py. Type
+ * "ttraw --help" for information about command-line arguments.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "test_utils.h"
+
+/* The following definitions must match those in timetrace.h. */
+#define TT_RAW_MAGIC   0x77725454
+#define TT_RAW_VERSION 1
+
+struct tt_raw_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t cpu_khz;
+	uint32_t num_cores;
+};
+
+enum tt_raw_type {
+	TT_RAW_EVENT               = 1,
+	TT_RAW_FORMAT              = 2,
+	TT_RAW_LOST                = 3,
+};
+
+struct tt_raw_record {
+	uint16_t type;
+	uint16_t core;
+	uint32_t length;
+	uint64_t timestamp;
+	uint64_t format_id;
+	uint32_t arg0;
+	uint32_t arg1;
+	uint32_t arg2;
+	uint32_t arg3;
+};
+
+/* Values of command-line arguments (and their default values): */
+
+const char *input_name = NULL;
+const char *save_name = NULL;
+double stream_secs = 0.0;
+std::vector<const char *> user_traces;
+
+/**
+ * struct event - Holds one event from any of the input traces.
+ */
+struct event {
+	/** @timestamp: time of the event, in rdtsc units. */
+	uint64_t timestamp;
+
+	/** @source: identifies the core or thread that recorded the event. */
+	std::string source;
+
+	/** @message: human-readable description of the event. */
+	std::string message;
+};
+
+/** @events: all of the events that have been collected so far. */
+std::vector<event> events;
+
+/** @formats: format strings for kernel events, indexed by format_id. */
+std::unordered_map<uint64_t, std::string> formats;
+
+/** @cpu_ghz: clock rate for kernel timestamps (0 means not known yet). */
+double cpu_ghz = 0.0;
+
+/**
+ * print_help() - Print out usage information for this program.
+ * @name:   Name of the program (argv[0])
+ */
+void print_help(const char *name)
+{
+	printf("Usage: %s options\n\n"
+		"Read Homa's kernel timetrace in binary form, merge it with any\n"
+		"user-space timetraces, and print the result on standard output.\n"
+		"The following options are available:\n"
+		"--help            Print this message\n"
+		"--input           Name of a file containing a binary timetrace\n"
+		"                  (default: /proc/timetrace_raw, or\n"
+		"                  /proc/timetrace_stream if --stream is given)\n"
+		"--save            Also write the binary timetrace to this file,\n"
+		"                  so it can be decoded later with --input\n"
+		"--stream          Read continuously for this many seconds without\n"
+		"                  freezing the timetrace (default: read a snapshot)\n"
+		"--user            Name of a file created by time_trace::print_to_file;\n"
+		"                  its events are merged with the kernel's. May be\n"
+		"                  specified multiple times\n",
+		name);
+}
+
+/**
+ * decode() - Extract events from binary timetrace data.
+ * @data:     Binary timetrace data. Complete records are removed from
+ *            the front of this string; a partial record at the end is
+ *            left for the next call.
+ * Return:    True for success, false if the data was malformed (an error
+ *            message will have been printed).
+ */
+bool decode(std::string &data)
+{
+	static bool header_seen = false;
+	size_t used = 0;
+
+	if (!header_seen) {
+		struct tt_raw_header header;
+
+		if (data.size() < sizeof(header))
+			return true;
+		memcpy(&header, data.data(), sizeof(header));
+		if (header.magic != TT_RAW_MAGIC) {
+			fprintf(stderr, "Binary timetrace has bad magic number "
+					"0x%x\n", header.magic);
+			return false;
+		}
+		if (header.version != TT_RAW_VERSION) {
+			fprintf(stderr, "Binary timetrace has unsupported "
+					"version %u\n", header.version);
+			return false;
+		}
+		cpu_ghz = header.cpu_khz * 1e-06;
+		used = sizeof(header);
+		header_seen = true;
+	}
+
+	while ((data.size() - used) >= sizeof(tt_raw_record)) {
+		tt_raw_record record;
+		char source[20], message[1000];
+
+		memcpy(&record, data.data() + used, sizeof(record));
+		if ((data.size() - used) < (sizeof(record) + record.length))
+			break;
+		snprintf(source, sizeof(source), "[C%02d]", record.core);
+		if (record.type == TT_RAW_FORMAT) {
+			formats[record.format_id] = std::string(data.data()
+					+ used + sizeof(record));
+		} else if (record.type == TT_RAW_EVENT) {
+			std::unordered_map<uint64_t, std::string>::iterator it =
+					formats.find(record.format_id);
+			if (it == formats.end()) {
+				fprintf(stderr, "Binary timetrace contains "
+					"unknown format id 0x%lx\n",
+					record.format_id);
+				return false;
+			}
+			snprintf(message, sizeof(message), it->second.c_str(),
+					record.arg0, record.arg1, record.arg2,
+					record.arg3);
+			events.push_back({record.timestamp, source, message});
+		} else if (record.type == TT_RAW_LOST) {
+			events.push_back({record.timestamp, source,
+					"ttraw: events lost before this point"});
+		} else {
+			fprintf(stderr, "Binary timetrace contains bogus record "
+					"type %d\n", record.type);
+			return false;
+		}
+		used += sizeof(record) + record.length;
+	}
+	data.erase(0, used);
+	return true;
+}
+
+/**
+ * read_kernel() - Read a binary timetrace and add its events to @events.
+ * @name:     Name of the file containing the trace.
+ * @secs:     If nonzero, keep reading for this many seconds even if
+ *            reads return no data (for streaming files).
+ * Return:    True for success, false if an error occurred.
+ */
+bool read_kernel(const char *name, double secs)
+{
+	std::string data;
+	char buffer[100000];
+	FILE *save = NULL;
+	uint64_t end = rdtsc() + (uint64_t) (secs * get_cycles_per_sec());
+	bool result = true;
+
+	int fd = open(name, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Couldn't open %s: %s\n", name,
+				strerror(errno));
+		return false;
+	}
+	if (save_name) {
+		save = fopen(save_name, "w");
+		if (save == NULL) {
+			fprintf(stderr, "Couldn't open %s: %s\n", save_name,
+					strerror(errno));
+			close(fd);
+			return false;
+		}
+	}
+	while (1) {
+		ssize_t count = read(fd, buffer, sizeof(buffer));
+		if (count < 0) {
+			fprintf(stderr, "Error reading %s: %s\n", name,
+					strerror(errno));
+			result = false;
+			break;
+		}
+		if (count == 0) {
+			if (rdtsc() >= end)
+				break;
+			usleep(1000);
+			continue;
+		}
+		if (save)
+			fwrite(buffer, 1, count, save);
+		data.append(buffer, count);
+		if (!decode(data)) {
+			result = false;
+			break;
+		}
+	}
+	if (data.size() != 0)
+		fprintf(stderr, "Binary timetrace ends with %lu bytes of "
+				"partial record\n", data.size());
+	if (save)
+		fclose(save);
+	close(fd);
+	return result;
+}
+
+/**
+ * read_user() - Read a timetrace created by time_trace::print_to_file and
+ * add its events to @events.
+ * @name:     Name of the file containing the trace.
+ * Return:    True for success, false if an error occurred.
+ */
+bool read_user(const char *name)
+{
+	char line[2000];
+	uint64_t start;
+	double ghz;
+
+	FILE *f = fopen(name, "r");
+	if (f == NULL) {
+		fprintf(stderr, "Couldn't open %s: %s\n", name,
+				strerror(errno));
+		return false;
+	}
+
+	/* The first line gives the absolute time of the first event, which
+	 * allows the relative times on all the other lines to be converted
+	 * back to rdtsc units.
+	 */
+	if ((fgets(line, sizeof(line), f) == NULL)
+			|| (sscanf(strstr(line, "timestamp") ? : "",
+			"timestamp %lu (cpu_ghz %lf)", &start, &ghz) != 2)) {
+		fprintf(stderr, "%s doesn't start with a 'First event' line\n",
+				name);
+		fclose(f);
+		return false;
+	}
+	while (fgets(line, sizeof(line), f) != NULL) {
+		double micros;
+		char source[100];
+		int offset;
+
+		if (sscanf(line, "%lf us (+%*f us) %99s %n", &micros, source,
+				&offset) != 2)
+			continue;
+		line[strcspn(line, "\n")] = 0;
+		events.push_back({start + (uint64_t) (micros * 1000.0 * ghz),
+				source, line + offset});
+	}
+	fclose(f);
+	return true;
+}
+
+int main(int argc, const char** argv)
+{
+	/* Parse arguments. */
+	for (int i = 1; i < argc; i++) {
+		const char *option = argv[i];
+
+		if (strcmp(option, "--help") == 0) {
+			print_help(argv[0]);
+			exit(0);
+		} else if ((strcmp(option, "--input") == 0)
+				|| (strcmp(option, "--save") == 0)
+				|| (strcmp(option, "--stream") == 0)
+				|| (strcmp(option, "--user") == 0)) {
+			const char *value = argv[i+1];
+			if (value == NULL) {
+				printf("No value provided for %s\n", option);
+				exit(1);
+			}
+			if (strcmp(option, "--input") == 0)
+				input_name = value;
+			else if (strcmp(option, "--save") == 0)
+				save_name = value;
+			else if (strcmp(option, "--user") == 0)
+				user_traces.push_back(value);
+			else {
+				char *end;
+				stream_secs = strtod(value, &end);
+				if ((*end != 0) || (stream_secs <= 0)) {
+					printf("Bad value '%s' for %s; must be "
+						"a positive number\n", value,
+						option);
+					exit(1);
+				}
+			}
+			i++;
+		} else {
+			printf("Unknown option '%s'\n", argv[i]);
+			exit(1);
+		}
+	}
+
+	if (input_name == NULL)
+		input_name = (stream_secs > 0) ? "/proc/timetrace_stream"
+				: "/proc/timetrace_raw";
+	if (!read_kernel(input_name, stream_secs))
+		exit(1);
+	for (const char *name: user_traces) {
+		if (!read_user(name))
+			exit(1);
+	}
+	if (events.empty())
+		exit(0);
+
+	/* Kernel events are grouped by core, so they must be sorted (along
+	 * with the user events) to produce a single timeline.
+	 */
+	std::stable_sort(events.begin(), events.end(),
+			[](const event &a, const event &b) {
+				return a.timestamp < b.timestamp;
+			});
+	uint64_t first = events[0].timestamp;
+	uint64_t prev = first;
+	printf("%9.3f us (+%8.3f us) [C00] First event has timestamp %lu "
+			"(cpu_ghz %.15f)\n", 0.0, 0.0, first, cpu_ghz);
+	for (event &e: events) {
+		printf("%9.3f us (+%8.3f us) %-6s %s\n",
+				(e.timestamp - first)/(1000.0*cpu_ghz),
+				(e.timestamp - prev)/(1000.0*cpu_ghz),
+				e.source.c_str(), e.message.c_str());
+		prev = e.timestamp;
+	}
+	exit(0);
+}